@@ -6,9 +6,27 @@ namespace Parameters
   {
     AllParameters ();
     static void declare_parameters (ParameterHandler &prm);
+    static void set_parameter (ParameterHandler  &prm,
+			       const std::string &parameter_override);
     void parse_parameters (ParameterHandler &prm);
 
     unsigned int timestep_number_max;
+    std::string time_step_control;
+    double time_step_relative_tolerance;
+    double time_step_absolute_tolerance_flow;
+    double time_step_absolute_tolerance_transport;
+    double time_step_safety_factor;
+    double time_step_minimum_factor;
+    double time_step_maximum_factor;
+    double minimum_time_step_drying;
+    double maximum_time_step_drying;
+    double minimum_time_step_saturation;
+    double maximum_time_step_saturation;
+    double minimum_time_step_transport;
+    double maximum_time_step_transport;
+    bool freeze_steady_flow;
+    double flow_freeze_tolerance;
+    unsigned int flow_freeze_interval;
     double time_step;
     double theta_richards;
     double theta_transport;
@@ -16,6 +34,19 @@ namespace Parameters
     double insulation_thickness;
     double insulation_depth;
     unsigned int refinement_level;
+    std::string mesh_cache_directory;
+    bool adaptive_refinement;
+    double refine_threshold;
+    double coarsen_threshold;
+    unsigned int minimum_refinement_level;
+    unsigned int maximum_refinement_level;
+    unsigned int maximum_cells;
+    double front_cells_per_adaptation;
+    unsigned int maximum_adaptation_interval;
+    bool write_checkpoints;
+    std::string checkpoint_prefix;
+    bool restart_from_checkpoint;
+    std::string restart_file;
     int output_frequency_transport;
     unsigned int output_frequency_terminal;
 
@@ -61,6 +92,7 @@ namespace Parameters
     bool homogeneous_decay_rate;
     bool coupled_transport;
     double biomass_dry_density;
+    bool reaction_activity_mask;
 
     std::string mesh_filename;
     std::string moisture_transport_equation;
@@ -70,6 +102,14 @@ namespace Parameters
     std::string transport_mass_entry_point;
     std::string output_directory;
     bool output_data_in_terminal;
+    bool asynchronous_output;
+    bool compress_output;
+    std::string output_data_format;
+    unsigned int output_data_flush_interval;
+    bool output_data_every_time_step;
+    std::string timing_file;
+    std::string diagnostics_prefix;
+    bool log_to_file;
 
     // Hydraulic properties
     double saturated_hydraulic_conductivity;
@@ -98,6 +138,33 @@ namespace Parameters
     
     std::string relative_permeability_model;
     std::string sand_fraction;
+
+    // Linear solvers
+    std::string flow_solver;
+    std::string flow_preconditioner;
+    double flow_amg_rebuild_ratio;
+    std::string flow_operator;
+    unsigned int flow_chebyshev_degree;
+    double flow_chebyshev_smoothing_range;
+    std::string transport_solver;
+    unsigned int transport_gmres_restart;
+    std::string transport_preconditioner;
+    std::string transport_preconditioner_update;
+    std::string transport_operator;
+
+    // Nonlinear solver
+    std::string nonlinear_solver;
+    unsigned int anderson_depth;
+    std::string convergence_criterion;
+    double flow_residual_tolerance;
+    bool concurrent_flow_and_transport;
+
+    // Constitutive tables
+    bool use_constitutive_tables;
+    std::string constitutive_tables_interpolation;
+    unsigned int constitutive_tables_points;
+    double constitutive_tables_min_pressure_head;
+    double constitutive_tables_max_pressure_head;
 };
 
   template <int dim>
@@ -107,10 +174,35 @@ namespace Parameters
     time_step                 =0.;
     theta_richards            =0.;
     theta_transport           =0.;
+    time_step_relative_tolerance          =0.;
+    time_step_absolute_tolerance_flow     =0.;
+    time_step_absolute_tolerance_transport=0.;
+    time_step_safety_factor               =0.;
+    time_step_minimum_factor              =0.;
+    time_step_maximum_factor              =0.;
+    minimum_time_step_drying              =0.;
+    maximum_time_step_drying              =0.;
+    minimum_time_step_saturation          =0.;
+    maximum_time_step_saturation          =0.;
+    minimum_time_step_transport           =0.;
+    maximum_time_step_transport           =0.;
+    freeze_steady_flow                    =false;
+    flow_freeze_tolerance                 =0.;
+    flow_freeze_interval                  =0;
     domain_size               =0.;
     insulation_thickness      =0.;
     insulation_depth          =0.;
     refinement_level          =0.;
+    adaptive_refinement        =false;
+    refine_threshold           =0.;
+    coarsen_threshold          =0.;
+    minimum_refinement_level   =0;
+    maximum_refinement_level   =0;
+    maximum_cells              =0;
+    front_cells_per_adaptation =0.;
+    maximum_adaptation_interval=0;
+    write_checkpoints          =false;
+    restart_from_checkpoint    =false;
     output_frequency_transport=0;
     output_frequency_terminal =0;
 
@@ -153,6 +245,7 @@ namespace Parameters
     homogeneous_decay_rate =false;
     coupled_transport      =false;
     biomass_dry_density    =0.;
+    reaction_activity_mask =false;
 
     saturated_hydraulic_conductivity=0.;
     moisture_content_saturation     =0.;
@@ -163,10 +256,29 @@ namespace Parameters
     effective_diffusion_coefficient =0.;
 
     output_data_in_terminal=false;
+    asynchronous_output    =false;
+    compress_output        =false;
+    output_data_flush_interval =0;
+    output_data_every_time_step=false;
+    log_to_file                =false;
 
     initial_condition_homogeneous_bacteria_column_1=0.;
     initial_condition_homogeneous_bacteria_column_2=0.;
     initial_condition_homogeneous_bacteria_column_3=0.;
+
+    flow_amg_rebuild_ratio        =0.;
+    flow_chebyshev_degree         =0;
+    flow_chebyshev_smoothing_range=0.;
+    transport_gmres_restart=0;
+
+    anderson_depth         =0;
+    flow_residual_tolerance=0.;
+    concurrent_flow_and_transport=false;
+
+    use_constitutive_tables              =false;
+    constitutive_tables_points           =0;
+    constitutive_tables_min_pressure_head=0.;
+    constitutive_tables_max_pressure_head=0.;
 }
 
   template <int dim>
@@ -191,6 +303,67 @@ namespace Parameters
 			"value for theta that interpolated between explicit "
 			"Euler (theta=0), Crank-Nicolson (theta=0.5), and "
 			"implicit Euler (theta=1).");
+      prm.declare_entry("time step control", "heuristic",
+			Patterns::Selection("heuristic|error"),
+			"heuristic doubles the time step when the nonlinear "
+			"iteration converges fast. error estimates the local "
+			"error of pressure and substrate with respect to a "
+			"linear extrapolation of the previous time steps and "
+			"chooses the time step with a PI controller.");
+      prm.declare_entry("relative tolerance", "1E-3",
+			Patterns::Double(0),
+			"relative tolerance for the local error estimate");
+      prm.declare_entry("absolute tolerance flow", "1E-3",
+			Patterns::Double(0),
+			"absolute tolerance for the local error estimate of "
+			"the pressure head in m");
+      prm.declare_entry("absolute tolerance transport", "1E-3",
+			Patterns::Double(0),
+			"absolute tolerance for the local error estimate of "
+			"the substrate concentration");
+      prm.declare_entry("safety factor", "0.9",
+			Patterns::Double(0,1),
+			"safety factor of the time step controller");
+      prm.declare_entry("minimum time step factor", "0.2",
+			Patterns::Double(0,1),
+			"smallest allowed ratio between two consecutive time steps");
+      prm.declare_entry("maximum time step factor", "2",
+			Patterns::Double(1),
+			"largest allowed ratio between two consecutive time steps");
+      prm.declare_entry("minimum time step drying", "1",
+			Patterns::Double(0),
+			"smallest time step in s while the soil dries");
+      prm.declare_entry("maximum time step drying", "1",
+			Patterns::Double(0),
+			"largest time step in s while the soil dries");
+      prm.declare_entry("minimum time step saturation", "1",
+			Patterns::Double(0),
+			"smallest time step in s while the soil saturates");
+      prm.declare_entry("maximum time step saturation", "1",
+			Patterns::Double(0),
+			"largest time step in s while the soil saturates");
+      prm.declare_entry("minimum time step transport", "1",
+			Patterns::Double(0),
+			"smallest time step in s while transport is active");
+      prm.declare_entry("maximum time step transport", "30",
+			Patterns::Double(0),
+			"largest time step in s while transport is active");
+      prm.declare_entry("freeze steady flow", "false",
+			Patterns::Bool(),
+			"if true, the Richards equation is not solved while "
+			"transport is active and the flow is steady. The "
+			"pressure and the velocity field are kept from the last "
+			"time step where the flow was solved.");
+      prm.declare_entry("flow freeze tolerance", "1E-6",
+			Patterns::Double(0),
+			"the flow is considered steady when the relative "
+			"residual of the last solution in the next time step "
+			"is below this value");
+      prm.declare_entry("flow freeze interval", "100",
+			Patterns::Integer(1),
+			"the flow is solved again after this many time steps "
+			"even if the pump and the boundary conditions did not "
+			"change");
     }
     prm.leave_subsection();
 
@@ -214,6 +387,69 @@ namespace Parameters
       prm.declare_entry("refinement level", "5",
 			Patterns::Integer(),
 			"number of cells as in 2^n");
+      prm.declare_entry("mesh cache directory", "",
+			Patterns::Anything(),
+			"directory where the initial (refined) mesh is cached, "
+			"keyed by a hash of the grid options and the mesh file. "
+			"Leave empty to build the mesh at every run.");
+    }
+    prm.leave_subsection();
+
+    prm.enter_subsection("adaptive refinement");
+    {
+      prm.declare_entry("adaptive refinement", "false",
+			Patterns::Bool(),
+			"if true, the mesh follows the substrate and biomass "
+			"front while transport is active");
+      prm.declare_entry("refine threshold", "0.3",
+			Patterns::Double(0,1),
+			"cells whose indicator is above this fraction of the "
+			"largest indicator are refined");
+      prm.declare_entry("coarsen threshold", "0.05",
+			Patterns::Double(0,1),
+			"cells whose indicator is below this fraction of the "
+			"largest indicator are coarsened. Cells between both "
+			"thresholds keep their level.");
+      prm.declare_entry("minimum level", "0",
+			Patterns::Integer(0),
+			"cells are not coarsened below this level");
+      prm.declare_entry("maximum level", "9",
+			Patterns::Integer(0),
+			"cells are not refined above this level");
+      prm.declare_entry("maximum cells", "5000",
+			Patterns::Integer(1),
+			"no cell is refined while the mesh has more cells "
+			"than this, only coarsened");
+      prm.declare_entry("front cells per adaptation", "1",
+			Patterns::Double(0),
+			"the mesh is adapted again when the front may have "
+			"moved this many of the smallest cells");
+      prm.declare_entry("maximum interval", "100",
+			Patterns::Integer(1),
+			"largest number of time steps between two adaptations");
+    }
+    prm.leave_subsection();
+
+    prm.enter_subsection("checkpoint");
+    {
+      prm.declare_entry("write checkpoints", "false",
+			Patterns::Bool(),
+			"if true, the state is written when the dry and the "
+			"saturated conditions are reached and at the end of "
+			"the run, to <prefix>_dry.chk, <prefix>_saturated.chk "
+			"and <prefix>_final.chk");
+      prm.declare_entry("checkpoint prefix", "state",
+			Patterns::Anything(),
+			"prefix of the checkpoint files");
+      prm.declare_entry("restart from checkpoint", "false",
+			Patterns::Bool(),
+			"if true, the mesh, the solution and the phase of the "
+			"simulation are read from the restart file instead of "
+			"being set by the initial conditions. The mesh is built "
+			"from the same grid options it was written with.");
+      prm.declare_entry("restart file", "state_saturated.chk",
+			Patterns::Anything(),
+			"checkpoint to restart from");
     }
     prm.leave_subsection();
 
@@ -342,6 +578,74 @@ namespace Parameters
     }
     prm.leave_subsection();
 
+    prm.enter_subsection("linear solvers");
+    {
+      prm.declare_entry("flow solver","cg",
+			Patterns::Selection("cg|direct"),"solver used for "
+			"the Richards equation. direct uses UMFPACK, its "
+			"symbolic factorization is reused until the mesh "
+			"changes. Meant for small (e.g. 1D) problems.");
+      prm.declare_entry("flow preconditioner","ssor",
+			Patterns::Selection("ssor|amg"),"preconditioner "
+			"used with CG for the Richards equation. amg "
+			"requires deal.II configured with Trilinos.");
+      prm.declare_entry("flow amg rebuild ratio","2.",
+			Patterns::Double(1.),"the AMG hierarchy is kept "
+			"between Picard iterations and time steps while the "
+			"sparsity pattern does not change. It is rebuilt when "
+			"the number of CG iterations grows above this factor "
+			"times the number of iterations obtained right after "
+			"the last rebuild.");
+      prm.declare_entry("flow operator","automatic",
+			Patterns::Selection("automatic|matrix_based|matrix_free"),
+			"matrix_free applies the system matrix of the "
+			"Richards equation cell by cell (MatrixFree) instead "
+			"of assembling it, which saves the memory of the "
+			"flow matrices, e.g. in 3D. It is solved with CG and "
+			"a Chebyshev preconditioner, the flow solver must be "
+			"cg and the flow preconditioner is not used. "
+			"automatic is matrix_free in 3D, unless the direct "
+			"solver or amg are asked for, and matrix_based "
+			"otherwise.");
+      prm.declare_entry("flow chebyshev degree","4",
+			Patterns::Integer(1),"degree of the Chebyshev "
+			"preconditioner of the matrix_free flow operator.");
+      prm.declare_entry("flow chebyshev smoothing range","100.",
+			Patterns::Double(1.),"ratio between the largest "
+			"eigenvalue of the (Jacobi scaled) flow operator and "
+			"the smallest one the Chebyshev preconditioner acts "
+			"on. The largest eigenvalue is estimated with a few "
+			"CG iterations.");
+      prm.declare_entry("transport solver","bicgstab",
+			Patterns::Selection("bicgstab|gmres|direct"),"solver "
+			"used for the transport equation. direct uses UMFPACK, "
+			"as for the flow solver.");
+      prm.declare_entry("transport gmres restart","30",
+			Patterns::Integer(1),"number of temporary vectors "
+			"(restart length) of the GMRES solver.");
+      prm.declare_entry("transport preconditioner","jacobi",
+			Patterns::Selection("jacobi|ilu|mic"),"preconditioner "
+			"used for the transport equation. mic assumes a "
+			"symmetric matrix, so it only helps when diffusion "
+			"dominates.");
+      prm.declare_entry("transport preconditioner update","iteration",
+			Patterns::Selection("iteration|timestep"),"build the "
+			"ilu/mic preconditioner in every Picard iteration or "
+			"only once per time step (and after the time step "
+			"or the mesh changes).");
+      prm.declare_entry("transport operator","automatic",
+			Patterns::Selection("automatic|matrix_based|matrix_free"),
+			"matrix_free applies the SUPG system matrix of the "
+			"transport equation cell by cell (MatrixFree) "
+			"instead of assembling the transport matrices. It is "
+			"solved with the transport solver (bicgstab or "
+			"gmres) and a Jacobi preconditioner, so the "
+			"transport preconditioner must be jacobi. automatic "
+			"is matrix_free in 3D, unless the direct solver, ilu "
+			"or mic are asked for, and matrix_based otherwise.");
+    }
+    prm.leave_subsection();
+
     prm.enter_subsection("van genuchten parameters");
     {
       prm.declare_entry("van genuchten n","2",
@@ -403,6 +707,55 @@ namespace Parameters
     }
     prm.leave_subsection();
 
+    prm.enter_subsection("nonlinear solver");
+    {
+      prm.declare_entry("method","picard",
+			Patterns::Selection("picard|anderson"),"picard "
+			"uses each new solution of the Richards equation as "
+			"the next iterate. anderson combines the last "
+			"iterates to accelerate the Picard iteration.");
+      prm.declare_entry("anderson depth","3",
+			Patterns::Integer(1),"number of previous iterates "
+			"used by the Anderson acceleration.");
+      prm.declare_entry("convergence criterion","norm ratio",
+			Patterns::Selection("norm ratio|residual"),"norm ratio "
+			"compares the norms of two consecutive iterates. "
+			"residual uses the residual of the Richards equation, "
+			"relative to the norm of the right hand side.");
+      prm.declare_entry("flow residual tolerance","1E-8",
+			Patterns::Double(0.),"tolerance used with the residual "
+			"convergence criterion.");
+      prm.declare_entry("concurrent flow and transport","true",
+			Patterns::Bool(),"if true, the Richards equation is "
+			"assembled and solved in a separate task while the "
+			"transport equation is assembled. Both only use the "
+			"previous iterate, so the results do not change.");
+    }
+    prm.leave_subsection();
+
+    prm.enter_subsection("constitutive tables");
+    {
+      prm.declare_entry("use tables","false",
+			Patterns::Bool(),"if true, the van Genuchten "
+			"curves (effective saturation, specific moisture "
+			"capacity and relative permeability) are evaluated "
+			"from lookup tables built once per material instead "
+			"of the analytic expressions.");
+      prm.declare_entry("interpolation","monotone cubic",
+			Patterns::Selection("linear|monotone cubic"),
+			"interpolation used between table points.");
+      prm.declare_entry("number of points","400",
+			Patterns::Integer(2),"number of table points, "
+			"equally spaced in log(|h|).");
+      prm.declare_entry("minimum pressure head","1E-3",
+			Patterns::Double(0.),"smallest |h| in the tables (cm). "
+			"The analytic expressions are used below this value.");
+      prm.declare_entry("maximum pressure head","1E5",
+			Patterns::Double(0.),"largest |h| in the tables (cm). "
+			"The analytic expressions are used above this value.");
+    }
+    prm.leave_subsection();
+
     prm.enter_subsection("reaction properties");
     {
       prm.declare_entry("first order decay factor","0.",Patterns::Double(),"Declare first order "
@@ -412,6 +765,10 @@ namespace Parameters
       prm.declare_entry("half velocity constant","0.",Patterns::Double()," ");
       prm.declare_entry("decay rate","0.",Patterns::Double()," ");
       prm.declare_entry("biomass dry density","0.",Patterns::Double()," ");
+      prm.declare_entry("reaction activity mask","true",Patterns::Bool(),
+			"only evaluate the biomass reactions on cells with "
+			"biomass and reuse the properties of the other cells "
+			"while their pressures do not change");
     }
     prm.leave_subsection();
 
@@ -444,10 +801,71 @@ namespace Parameters
 			Patterns::Bool(),"if true, the program will generate output "
 			"in the terminal. Set to false to avoid cluttering "
 			"and speed up a bit the program.");
+      prm.declare_entry("asynchronous output", "true",
+			Patterns::Bool(),"if true, the output files are "
+			"written in the background while the time stepping "
+			"goes on");
+      prm.declare_entry("compress output", "true",
+			Patterns::Bool(),"if true, the data of the .vtu "
+			"files is zlib compressed (if deal.II was configured "
+			"with zlib)");
+      prm.declare_entry("output data format", "text",
+			Patterns::Selection("text|binary"),"format of the "
+			"output_data file with the fluxes and the mass balance");
+      prm.declare_entry("output data flush interval", "100",
+			Patterns::Integer(1),"number of rows of the "
+			"output_data file kept in memory before they are "
+			"written");
+      prm.declare_entry("output data every time step", "false",
+			Patterns::Bool(),"if true, a row is added to the "
+			"output_data file at every time step, otherwise only "
+			"when the data is printed in the terminal");
+      prm.declare_entry("timing file", "timing.json",
+			Patterns::Anything(),"JSON file with the wall time "
+			"of the main parts of the program and the solver "
+			"and time step counters, per period of the "
+			"simulation. Leave empty to skip it.");
+      prm.declare_entry("diagnostics prefix", "",
+			Patterns::Anything(),"prefix of the names of the "
+			"output, output_data, timing and checkpoint files. "
+			"Each member of an ensemble gets its own.");
+      prm.declare_entry("log to file", "false",
+			Patterns::Bool(),"if true, the terminal output "
+			"of the run is written to the file log.txt, with "
+			"the diagnostics prefix. The members of an "
+			"ensemble always log to file.");
     }
     prm.leave_subsection();
   }
 
+  /*
+   * Sets one entry given as "subsection/.../entry = value", e.g.
+   * "van genuchten parameters/van genuchten n = 3"
+   */
+  template <int dim>
+  void
+  AllParameters<dim>::set_parameter (ParameterHandler  &prm,
+				     const std::string &parameter_override)
+  {
+    const std::string::size_type equal_sign=parameter_override.find('=');
+    if (equal_sign==std::string::npos)
+      {
+	std::cout << "Error. Parameter override \"" << parameter_override
+		  << "\" is not of the form subsection/entry=value.\n";
+	throw -1;
+      }
+    std::vector<std::string> path=
+      Utilities::split_string_list(parameter_override.substr(0,equal_sign),'/');
+    const std::string value=
+      Utilities::trim(parameter_override.substr(equal_sign+1));
+
+    for (unsigned int i=0; i+1<path.size(); ++i)
+      prm.enter_subsection(path[i]);
+    prm.set(path.back(),value);
+    for (unsigned int i=0; i+1<path.size(); ++i)
+      prm.leave_subsection();
+  }
+
   template <int dim>
   void AllParameters<dim>::parse_parameters (ParameterHandler &prm)
   {
@@ -457,6 +875,22 @@ namespace Parameters
       timestep_number_max=prm.get_integer("timestep number max");
       theta_richards     =prm.get_double ("richards theta scheme value");
       theta_transport    =prm.get_double ("transport theta scheme value");
+      time_step_control  =prm.get        ("time step control");
+      time_step_relative_tolerance          =prm.get_double("relative tolerance");
+      time_step_absolute_tolerance_flow     =prm.get_double("absolute tolerance flow");
+      time_step_absolute_tolerance_transport=prm.get_double("absolute tolerance transport");
+      time_step_safety_factor               =prm.get_double("safety factor");
+      time_step_minimum_factor              =prm.get_double("minimum time step factor");
+      time_step_maximum_factor              =prm.get_double("maximum time step factor");
+      minimum_time_step_drying              =prm.get_double("minimum time step drying");
+      maximum_time_step_drying              =prm.get_double("maximum time step drying");
+      minimum_time_step_saturation          =prm.get_double("minimum time step saturation");
+      maximum_time_step_saturation          =prm.get_double("maximum time step saturation");
+      minimum_time_step_transport           =prm.get_double("minimum time step transport");
+      maximum_time_step_transport           =prm.get_double("maximum time step transport");
+      freeze_steady_flow                    =prm.get_bool  ("freeze steady flow");
+      flow_freeze_tolerance                 =prm.get_double("flow freeze tolerance");
+      flow_freeze_interval                  =prm.get_integer("flow freeze interval");
     }
     prm.leave_subsection();
 
@@ -469,6 +903,29 @@ namespace Parameters
       insulation_thickness=prm.get_double ("insulation thickness");
       insulation_depth    =prm.get_double ("insulation depth");
       refinement_level    =prm.get_integer("refinement level");
+      mesh_cache_directory=prm.get        ("mesh cache directory");
+    }
+    prm.leave_subsection();
+
+    prm.enter_subsection("adaptive refinement");
+    {
+      adaptive_refinement        =prm.get_bool   ("adaptive refinement");
+      refine_threshold           =prm.get_double ("refine threshold");
+      coarsen_threshold          =prm.get_double ("coarsen threshold");
+      minimum_refinement_level   =prm.get_integer("minimum level");
+      maximum_refinement_level   =prm.get_integer("maximum level");
+      maximum_cells              =prm.get_integer("maximum cells");
+      front_cells_per_adaptation =prm.get_double ("front cells per adaptation");
+      maximum_adaptation_interval=prm.get_integer("maximum interval");
+    }
+    prm.leave_subsection();
+
+    prm.enter_subsection("checkpoint");
+    {
+      write_checkpoints      =prm.get_bool("write checkpoints");
+      checkpoint_prefix      =prm.get     ("checkpoint prefix");
+      restart_from_checkpoint=prm.get_bool("restart from checkpoint");
+      restart_file           =prm.get     ("restart file");
     }
     prm.leave_subsection();
 
@@ -530,6 +987,22 @@ namespace Parameters
     }
     prm.leave_subsection();
 
+    prm.enter_subsection("linear solvers");
+    {
+      flow_solver                   =prm.get        ("flow solver");
+      flow_preconditioner           =prm.get        ("flow preconditioner");
+      flow_amg_rebuild_ratio        =prm.get_double ("flow amg rebuild ratio");
+      flow_operator                 =prm.get        ("flow operator");
+      flow_chebyshev_degree         =prm.get_integer("flow chebyshev degree");
+      flow_chebyshev_smoothing_range=prm.get_double ("flow chebyshev smoothing range");
+      transport_solver               =prm.get        ("transport solver");
+      transport_gmres_restart        =prm.get_integer("transport gmres restart");
+      transport_preconditioner       =prm.get        ("transport preconditioner");
+      transport_preconditioner_update=prm.get        ("transport preconditioner update");
+      transport_operator             =prm.get        ("transport operator");
+    }
+    prm.leave_subsection();
+
     prm.enter_subsection("van genuchten parameters");
     {
       van_genuchten_n=prm.get_double("van genuchten n");
@@ -572,6 +1045,27 @@ namespace Parameters
     }
     prm.leave_subsection();
 
+    prm.enter_subsection("nonlinear solver");
+    {
+      nonlinear_solver       =prm.get        ("method");
+      anderson_depth         =prm.get_integer("anderson depth");
+      convergence_criterion  =prm.get        ("convergence criterion");
+      flow_residual_tolerance=prm.get_double ("flow residual tolerance");
+      concurrent_flow_and_transport=
+	prm.get_bool("concurrent flow and transport");
+    }
+    prm.leave_subsection();
+
+    prm.enter_subsection("constitutive tables");
+    {
+      use_constitutive_tables              =prm.get_bool   ("use tables");
+      constitutive_tables_interpolation    =prm.get        ("interpolation");
+      constitutive_tables_points           =prm.get_integer("number of points");
+      constitutive_tables_min_pressure_head=prm.get_double ("minimum pressure head");
+      constitutive_tables_max_pressure_head=prm.get_double ("maximum pressure head");
+    }
+    prm.leave_subsection();
+
     prm.enter_subsection("reaction properties");
     {
       first_order_decay_factor  =prm.get_double("first order decay factor");
@@ -580,6 +1074,7 @@ namespace Parameters
       half_velocity_constant    =prm.get_double("half velocity constant");
       decay_rate                =prm.get_double("decay rate");
       biomass_dry_density       =prm.get_double("biomass dry density");
+      reaction_activity_mask    =prm.get_bool  ("reaction activity mask");
     }
     prm.leave_subsection();
 
@@ -596,6 +1091,14 @@ namespace Parameters
       output_frequency_terminal =prm.get_integer("output frequency terminal");
       output_directory	        =prm.get("output directory");
       output_data_in_terminal   =prm.get_bool("output data in terminal");
+      asynchronous_output       =prm.get_bool("asynchronous output");
+      compress_output           =prm.get_bool("compress output");
+      output_data_format        =prm.get("output data format");
+      output_data_flush_interval=prm.get_integer("output data flush interval");
+      output_data_every_time_step=prm.get_bool("output data every time step");
+      timing_file               =prm.get("timing file");
+      diagnostics_prefix        =prm.get("diagnostics prefix");
+      log_to_file               =prm.get_bool("log to file");
     }
     prm.leave_subsection();
   }
@@ -0,0 +1,175 @@
+#!/bin/bash
+#
+# Benchmark cases of soleimani_et_al_2009. Every case is input.prm with a
+# few parameters changed, run in its own directory under results/. The
+# program writes its wall times and counters to timing.json (see
+# Timing_Monitor), which are collected in results/summary.csv:
+#
+#   case,threads,cells,wall_time,time_steps,time_per_step,
+#   picard_iterations,flow_solver_iterations,transport_solver_iterations,
+#   rejected_time_steps,peak_memory_kB
+#
+# Usage:
+#   run_benchmarks.sh [-b binary] [-t "1 2 4 8"] [-w "1 4 16"]
+#                     [-s baseline] [-c baseline] [cases]
+#
+#   -b  program to run (default ../soleimani_et_al_2009)
+#   -t  thread counts of the strong scaling runs (default "1")
+#   -w  thread counts of the weak scaling runs of the synthetic case, one
+#       refinement level more for every factor 4 (default: none)
+#   -s  save the summary as baselines/<baseline>.csv
+#   -c  compare the wall times with baselines/<baseline>.csv
+#
+# Cases (default: all):
+#   1d_saturation          saturation of the column, no transport
+#   1d_transport_pump      coupled transport over two days of pump cycles
+#   2d_three_columns       the three sand columns with adaptive refinement,
+#                          needs joined_columns.msh in this directory
+#   2d_synthetic           uniformly refined square, no mesh file needed
+
+BENCHMARK_DIR=$(cd $(dirname $0) && pwd)
+BINARY=$BENCHMARK_DIR/../soleimani_et_al_2009
+THREADS="1"
+WEAK_THREADS=""
+SAVE_BASELINE=""
+COMPARE_BASELINE=""
+SYNTHETIC_LEVEL=7
+
+while getopts "b:t:w:s:c:" option; do
+    case $option in
+	b) BINARY=$(readlink -f $OPTARG) ;;
+	t) THREADS=$OPTARG ;;
+	w) WEAK_THREADS=$OPTARG ;;
+	s) SAVE_BASELINE=$OPTARG ;;
+	c) COMPARE_BASELINE=$OPTARG ;;
+	*) exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+CASES=${@:-"1d_saturation 1d_transport_pump 2d_three_columns 2d_synthetic"}
+
+if [ ! -x $BINARY ]; then
+    echo "Error. $BINARY is not an executable, use -b."
+    exit 1
+fi
+
+RESULTS=$BENCHMARK_DIR/results
+SUMMARY=$RESULTS/summary.csv
+mkdir -p $RESULTS
+echo "case,threads,cells,wall_time,time_steps,time_per_step,picard_iterations,flow_solver_iterations,transport_solver_iterations,rejected_time_steps,peak_memory_kB" > $SUMMARY
+
+# set_parameter file name value
+set_parameter () {
+    if ! grep -q "^ *set $2 *=" $1; then
+	echo "Error. Parameter \"$2\" not found in $1." >&2
+	exit 1
+    fi
+    sed -i "s|^\( *set $2 *=\).*|\1 $3|" $1
+}
+
+# case_parameters case file, prints the dimension
+case_parameters () {
+    set_parameter $2 "output data in terminal" false
+    set_parameter $2 "output frequency terminal" 100
+    set_parameter $2 "output frequency transport" 0
+    set_parameter $2 "timing file" timing.json
+    case $1 in
+	1d_saturation)
+	    set_parameter $2 "initial state" no_drying
+	    set_parameter $2 "coupled transport" false
+	    set_parameter $2 "timestep number max" 2000
+	    echo 1 ;;
+	1d_transport_pump)
+	    set_parameter $2 "initial state" no_drying
+	    set_parameter $2 "coupled transport" true
+	    set_parameter $2 "timestep number max" 8000
+	    set_parameter $2 "maximum time step transport" 30
+	    echo 1 ;;
+	2d_three_columns)
+	    set_parameter $2 "use mesh file" true
+	    set_parameter $2 "mesh filename" $BENCHMARK_DIR/joined_columns.msh
+	    set_parameter $2 "adaptive refinement" true
+	    set_parameter $2 "timestep number max" 3000
+	    echo 2 ;;
+	2d_synthetic*)
+	    set_parameter $2 "use mesh file" false
+	    set_parameter $2 "refinement level" ${3:-$SYNTHETIC_LEVEL}
+	    set_parameter $2 "timestep number max" 200
+	    echo 2 ;;
+	*)
+	    echo "Error. Unknown case $1." >&2
+	    exit 1 ;;
+    esac
+}
+
+# sum_counter timing.json counter, sums the counter over all periods
+sum_counter () {
+    awk -F': ' -v key="/$2\"" 'index($0,key) {gsub(/,/,"",$2); sum+=$2} END {printf "%d", sum}' $1
+}
+
+# run_case name case threads [refinement level]
+run_case () {
+    local directory=$RESULTS/$1_t$3
+    rm -rf $directory
+    mkdir -p $directory/output
+    cp $BENCHMARK_DIR/../input.prm $directory/input.prm
+    local dim
+    dim=$(case_parameters $2 $directory/input.prm $4) || exit 1
+
+    echo "Running $1 with $3 thread(s)"
+    (cd $directory && DEAL_II_NUM_THREADS=$3 $BINARY input.prm $dim > log.txt 2>&1)
+    if [ ! -f $directory/timing.json ]; then
+	echo "Error. $1 failed, see $directory/log.txt"
+	return
+    fi
+    local timing=$directory/timing.json
+    local wall_time=$(awk -F': ' '/"wall_time": [0-9]/ && !/calls/ {gsub(/,/,"",$2); print $2; exit}' $timing)
+    local time_steps=$(sum_counter $timing "time steps")
+    local time_per_step=$(awk "BEGIN {if ($time_steps>0) printf \"%e\", $wall_time/$time_steps; else print 0}")
+    echo "$1,$3,$(sum_counter $timing "active cells"),$wall_time,$time_steps,$time_per_step,$(sum_counter $timing "picard iterations"),$(sum_counter $timing "flow solver iterations"),$(sum_counter $timing "transport solver iterations"),$(sum_counter $timing "rejected time steps"),$(sum_counter $timing "peak memory (kB)")" >> $SUMMARY
+}
+
+for case in $CASES; do
+    if [ $case == 2d_three_columns ] && [ ! -f $BENCHMARK_DIR/joined_columns.msh ]; then
+	echo "Skipping $case, joined_columns.msh not found in $BENCHMARK_DIR"
+	continue
+    fi
+    for threads in $THREADS; do
+	run_case $case $case $threads
+    done
+done
+
+# Weak scaling: the 2D cells grow by 4 with every refinement level, the
+# level is the synthetic level plus floor(log4(threads/first thread count))
+first=""
+for threads in $WEAK_THREADS; do
+    if [ -z "$first" ]; then
+	first=$threads
+    fi
+    if [ $((threads%first)) -ne 0 ]; then
+	echo "Error. The weak scaling thread count $threads is not a multiple of $first." >&2
+	exit 1
+    fi
+    level=$SYNTHETIC_LEVEL
+    ratio=$((threads/first))
+    while [ $ratio -ge 4 ]; do
+	level=$((level+1))
+	ratio=$((ratio/4))
+    done
+    run_case 2d_synthetic_weak 2d_synthetic $threads $level
+done
+
+cat $SUMMARY
+
+if [ -n "$SAVE_BASELINE" ]; then
+    mkdir -p $BENCHMARK_DIR/baselines
+    cp $SUMMARY $BENCHMARK_DIR/baselines/$SAVE_BASELINE.csv
+    echo "Baseline saved to baselines/$SAVE_BASELINE.csv"
+fi
+
+if [ -n "$COMPARE_BASELINE" ]; then
+    echo "case,threads,baseline_wall_time,wall_time,ratio"
+    awk -F',' 'NR==FNR {if (FNR>1) baseline[$1","$2]=$4; next}
+	       FNR>1 && ($1","$2) in baseline {printf "%s,%s,%s,%s,%.3f\n", $1, $2, baseline[$1","$2], $4, $4/baseline[$1","$2]}' \
+	$BENCHMARK_DIR/baselines/$COMPARE_BASELINE.csv $SUMMARY
+fi
@@ -16,6 +16,10 @@
 #include <deal.II/base/multithread_info.h>  
 #include <deal.II/base/tensor_function.h>
 #include <deal.II/base/parameter_handler.h>
+#include <deal.II/base/work_stream.h>
+#include <deal.II/base/mpi.h>
+#include <deal.II/base/timer.h>
+#include <deal.II/base/vectorization.h>
 
 #include <deal.II/lac/vector.h>
 #include <deal.II/lac/full_matrix.h>
@@ -27,6 +31,13 @@
 #include <deal.II/lac/solver_cg.h>
 #include <deal.II/lac/solver_gmres.h>
 #include <deal.II/lac/precondition.h>
+#include <deal.II/lac/sparse_ilu.h>
+#include <deal.II/lac/sparse_mic.h>
+#include <deal.II/lac/sparse_direct.h>
+#ifdef DEAL_II_WITH_TRILINOS
+#include <deal.II/lac/trilinos_sparse_matrix.h>
+#include <deal.II/lac/trilinos_precondition.h>
+#endif
 
 #include <deal.II/grid/tria.h>
 #include <deal.II/grid/grid_generator.h>
@@ -51,6 +62,9 @@
 #include <deal.II/numerics/error_estimator.h>
 #include <deal.II/numerics/solution_transfer.h>
 
+#include <deal.II/matrix_free/matrix_free.h>
+#include <deal.II/matrix_free/fe_evaluation.h>
+
 #include <fstream>
 #include <iostream>
 #include <math.h>
@@ -59,14 +73,194 @@
 #include <string>
 #include <algorithm>
 #include <time.h>
+#include <unistd.h>
+#include <cstdio>
 #include <map>
+#include <deque>
+#include <array>
+#include <memory>
 
-#include <DataTools.h>
 #include "Parameters.h"
 
+class Interpolation_Table {
+public:
+  /*
+   * Table of a scalar function sampled at equally spaced points in
+   * [x_min,x_max]. Because the spacing is uniform the interval that
+   * contains a given x is found without searching. The interpolation
+   * is either piecewise linear or a monotone (Fritsch-Carlson) cubic
+   * Hermite spline, that keeps the monotonicity of the sampled data.
+   */
+  Interpolation_Table ();
+
+  void reinit(const double x_min_,
+	      const double x_max_,
+	      const std::vector<double> &y_,
+	      const bool monotone_cubic_);
+  double value(const double x) const;
+  bool empty() const;
+private:
+  double x_min;
+  double dx;
+  double inverse_dx;
+  bool monotone_cubic;
+  std::vector<double> y;
+  std::vector<double> slopes;
+};
+
+Interpolation_Table::Interpolation_Table()
+{
+  x_min=0.;
+  dx=0.;
+  inverse_dx=0.;
+  monotone_cubic=false;
+}
+
+void Interpolation_Table::reinit(const double x_min_,
+				 const double x_max_,
+				 const std::vector<double> &y_,
+				 const bool monotone_cubic_)
+{
+  if (y_.size()<2 || x_max_<=x_min_)
+    {
+      std::cout << "Error. Interpolation table needs at least two points "
+		<< "and x_max>x_min.\n";
+      throw -1;
+    }
+
+  y=y_;
+  x_min=x_min_;
+  dx=(x_max_-x_min_)/(y.size()-1);
+  inverse_dx=1./dx;
+  monotone_cubic=monotone_cubic_;
+
+  slopes.clear();
+  if (monotone_cubic==false)
+    return;
+  /*
+   * Fritsch and Carlson (1980), "Monotone piecewise cubic interpolation".
+   * Start with the average of the secants and limit the slopes so the
+   * cubic does not overshoot on any interval.
+   */
+  const unsigned int n_points=y.size();
+  std::vector<double> secants(n_points-1,0.);
+  for (unsigned int k=0; k<n_points-1; k++)
+    secants[k]=(y[k+1]-y[k])*inverse_dx;
+
+  slopes.resize(n_points,0.);
+  slopes[0]=secants[0];
+  slopes[n_points-1]=secants[n_points-2];
+  for (unsigned int k=1; k<n_points-1; k++)
+    if (secants[k-1]*secants[k]>0.)
+      slopes[k]=0.5*(secants[k-1]+secants[k]);
+
+  for (unsigned int k=0; k<n_points-1; k++)
+    {
+      if (secants[k]==0.)
+	{
+	  slopes[k]=0.;
+	  slopes[k+1]=0.;
+	  continue;
+	}
+      double a=slopes[k]/secants[k];
+      double b=slopes[k+1]/secants[k];
+      if (a<0.)
+	slopes[k]=0.;
+      if (b<0.)
+	slopes[k+1]=0.;
+      if (a*a+b*b>9.)
+	{
+	  double tau=3./sqrt(a*a+b*b);
+	  slopes[k]  =tau*a*secants[k];
+	  slopes[k+1]=tau*b*secants[k];
+	}
+    }
+}
+
+double Interpolation_Table::value(const double x) const
+{
+  const unsigned int n_intervals=y.size()-1;
+  double position=(x-x_min)*inverse_dx;
+  unsigned int k=0;
+  if (position>0.)
+    k=(unsigned int)position;
+  if (k>=n_intervals)
+    k=n_intervals-1;
+  double t=position-k;
+
+  if (monotone_cubic==false)
+    return (y[k]+t*(y[k+1]-y[k]));
+
+  double t2=t*t;
+  double t3=t2*t;
+  return ((2.*t3-3.*t2+1.)*y[k]+
+	  (t3-2.*t2+t)*dx*slopes[k]+
+	  (-2.*t3+3.*t2)*y[k+1]+
+	  (t3-t2)*dx*slopes[k+1]);
+}
+
+bool Interpolation_Table::empty() const
+{
+  return (y.size()==0);
+}
+
 class Hydraulic_Properties {
 public:
-  
+  /*
+   * The names of the models are only parsed in the constructor. Objects
+   * of this class are meant to be built once per material (see
+   * Heat_Pipe::setup_hydraulic_properties) and evaluated many times.
+   */
+  enum Constitutive_Model
+    {
+      haverkamp_et_al_1977,
+      van_genuchten_1980
+    };
+  enum Relative_Permeability_Model
+    {
+      soleimani,
+      clement,
+      okubo_and_matsumoto,
+      vandevivere
+    };
+  static Constitutive_Model
+  constitutive_model_from_name(const std::string &name);
+  static Relative_Permeability_Model
+  relative_permeability_model_from_name(const std::string &name);
+  /*
+   * Policy with the models as compile-time constants. The member
+   * templates below evaluate the curves of the models of their ModelType
+   * argument, the tests on the models are constants and the compiler
+   * removes them. Heat_Pipe instantiates its properties kernel once per
+   * combination (see Heat_Pipe::calculate_mass_balance_ratio). The
+   * relative permeability model is only used by van_genuchten_1980.
+   */
+  template <Constitutive_Model constitutive_model_,
+	    Relative_Permeability_Model relative_permeability_model_=soleimani>
+  struct Model
+  {
+    static const Constitutive_Model          constitutive_model         =constitutive_model_;
+    static const Relative_Permeability_Model relative_permeability_model=relative_permeability_model_;
+  };
+
+  template <class ModelType>
+  double specific_moisture_capacity(double pressure_head_) const;
+  template <class ModelType>
+  double hydraulic_conductivity(double pressure_head_,
+				double biomass_concentration_,
+				double biomass_dry_density_) const;
+  template <class ModelType>
+  double effective_total_saturation(double pressure_head_) const;
+  template <class ModelType>
+  double effective_free_saturation(double pressure_head_,
+				   double biomass_concentration_,
+				   double biomass_dry_density_) const;
+  template <class ModelType>
+  double moisture_content_total(double pressure_head_) const;
+  template <class ModelType>
+  double moisture_content_free(double pressure_head_,
+			       double biomass_concentration_,
+			       double biomass_dry_density_) const;
 
   Hydraulic_Properties (
 			std::string type_of_hydraulic_properties_,
@@ -74,37 +268,63 @@ public:
 			double moisture_content_residual_,
 			double hydraulic_conductivity_saturated_,
 			double van_genuchten_alpha_,
-			double van_genuchten_n_);
-
+			double van_genuchten_n_,
+			std::string relative_permeability_model_);
+  /*
+   * The same curves for the models given to the constructor, selected
+   * at run time. Meant for the setup code.
+   */
   double get_specific_moisture_capacity(
-					double pressure_head_);
+					double pressure_head_) const;
   double get_hydraulic_conductivity(
 				    double pressure_head_,
 				    double biomass_concentration_,
-				    double biomass_dry_density_,
-				    std::string relative_permeability_model_);
+				    double biomass_dry_density_) const;
   double get_effective_total_saturation(
-					double pressure_head_);
+					double pressure_head_) const;
   double get_actual_total_saturation(
-				     double pressure_head_);
+				     double pressure_head_) const;
   double get_effective_biomass_saturation(
 					  double biomass_concentration_,
-					  double biomass_dry_density_);
+					  double biomass_dry_density_) const;
   double get_actual_biomass_saturation(
 				       double biomass_concentration_,
-				       double biomass_dry_density_);
+				       double biomass_dry_density_) const;
   double get_effective_free_saturation(
 				       double pressure_head_,
 				       double biomass_concentration_,
-				       double biomass_dry_density_);
+				       double biomass_dry_density_) const;
   double get_moisture_content_total(
-				    double pressure_head_);
+				    double pressure_head_) const;
   double get_moisture_content_free(
 				   double pressure_head_,
 				   double biomass_concentration_,
-				   double biomass_dry_density_);
+				   double biomass_dry_density_) const;
+  /*
+   * Optional lookup-table mode for the van Genuchten curves. The tables
+   * are sampled in log(|h|) for min_pressure_head<=|h|<=max_pressure_head,
+   * outside this range (and for other constitutive models) the analytic
+   * expressions are used. The max interpolation error of each table,
+   * relative to the max of the curve over the tabulated range, is
+   * returned in the error arguments.
+   */
+  void build_tables(
+		    double min_pressure_head_,
+		    double max_pressure_head_,
+		    unsigned int n_points_,
+		    bool monotone_cubic_,
+		    double &saturation_error_,
+		    double &moisture_capacity_error_,
+		    double &permeability_error_);
 private:
+  bool use_tables(double pressure_head_) const;
+  double get_clogging_term_total(
+				 double pressure_head_,
+				 double effective_total_saturation_) const;
+
   std::string type_of_hydraulic_properties;
+  Constitutive_Model          constitutive_model;
+  Relative_Permeability_Model relative_permeability_model;
   double moisture_content_saturation;
   double moisture_content_residual;
   double hydraulic_conductivity_saturated;
@@ -112,6 +332,20 @@ private:
   double van_genuchten_alpha;
   double van_genuchten_n;
   double van_genuchten_m;
+  /*
+   * Constants derived from the parameters above
+   */
+  double inverse_van_genuchten_m;
+  double residual_saturation;//moisture_content_residual/moisture_content_saturation
+  double moisture_content_range;//moisture_content_saturation-moisture_content_residual
+  /*
+   * Tables of Se(h), C(h) and (1-Se^(1/m))^m as functions of log(|h|)
+   */
+  double min_pressure_head;
+  double max_pressure_head;
+  Interpolation_Table effective_saturation_table;
+  Interpolation_Table moisture_capacity_table;
+  Interpolation_Table clogging_term_table;
 };
 
 Hydraulic_Properties::Hydraulic_Properties(std::string type_of_hydraulic_properties_,
@@ -119,9 +353,12 @@ Hydraulic_Properties::Hydraulic_Properties(std::string type_of_hydraulic_propert
 					   double moisture_content_residual_,
 					   double hydraulic_conductivity_saturated_,
 					   double van_genuchten_alpha_,
-					   double van_genuchten_n_)
+					   double van_genuchten_n_,
+					   std::string relative_permeability_model_)
 {
   type_of_hydraulic_properties=type_of_hydraulic_properties_;
+  constitutive_model         =constitutive_model_from_name(type_of_hydraulic_properties_);
+  relative_permeability_model=relative_permeability_model_from_name(relative_permeability_model_);
   moisture_content_saturation=moisture_content_saturation_;
   moisture_content_residual=moisture_content_residual_;
   hydraulic_conductivity_saturated=hydraulic_conductivity_saturated_;
@@ -129,31 +366,89 @@ Hydraulic_Properties::Hydraulic_Properties(std::string type_of_hydraulic_propert
   van_genuchten_alpha=van_genuchten_alpha_;
   van_genuchten_n=van_genuchten_n_;
   van_genuchten_m=1.-1./van_genuchten_n_;
+
+  inverse_van_genuchten_m=1./van_genuchten_m;
+  residual_saturation    =moisture_content_residual/moisture_content_saturation;
+  moisture_content_range =moisture_content_saturation-moisture_content_residual;
+
+  min_pressure_head=0.;
+  max_pressure_head=0.;
+}
+
+Hydraulic_Properties::Constitutive_Model
+Hydraulic_Properties::constitutive_model_from_name(const std::string &name)
+{
+  if (name.compare("haverkamp_et_al_1977")==0)
+    return (haverkamp_et_al_1977);
+  else if (name.compare("van_genuchten_1980")==0)
+    return (van_genuchten_1980);
+  std::cout << "Equations for \"" << name
+	    << "\" are not implemented. Error.\n";
+  throw -1;
 }
 
-double Hydraulic_Properties::get_specific_moisture_capacity(double pressure_head)
+Hydraulic_Properties::Relative_Permeability_Model
+Hydraulic_Properties::relative_permeability_model_from_name(const std::string &name)
 {
+  if (name.compare("soleimani")==0)
+    return (soleimani);
+  else if (name.compare("clement")==0)
+    return (clement);
+  else if (name.compare("okubo_and_matsumoto")==0)
+    return (okubo_and_matsumoto);
+  else if (name.compare("vandevivere")==0)
+    return (vandevivere);
+  std::cout << "Relative permeability model not implemented: "
+	    << name << ".\n"
+	    << "Available models are: soleimani, clement, okubo_and_matsumoto, vandevivere";
+  throw -1;
+}
 
-  if (type_of_hydraulic_properties.compare("haverkamp_et_al_1977")==0)
+template <class ModelType>
+inline
+double Hydraulic_Properties::specific_moisture_capacity(double pressure_head) const
+{
+  if (ModelType::constitutive_model==haverkamp_et_al_1977)
     {
       double alpha=1.611E6;
       double beta =3.96;
 
-      return(-1.*alpha*(moisture_content_saturation-moisture_content_residual)
+      return(-1.*alpha*moisture_content_range
 	     *beta*pressure_head*pow(fabs(pressure_head),beta-2)
 	     /pow(alpha+pow(fabs(pressure_head),beta),2));
     }
-  else if (type_of_hydraulic_properties.compare("van_genuchten_1980")==0)
+  else
     {
       if (pressure_head>=0.)
 	pressure_head=-0.01;
+      if (use_tables(pressure_head))
+	return (moisture_capacity_table.value(log(fabs(pressure_head))));
+      /*
+       * pressure_head is negative here, so pressure_head/fabs(pressure_head)=-1
+       * and (alpha|h|)^n is obtained from (alpha|h|)^(n-1) without another pow
+       */
+      double alpha_head=van_genuchten_alpha*fabs(pressure_head);
+      double alpha_head_n_minus_1=pow(alpha_head,van_genuchten_n-1.);
+
+      return (van_genuchten_alpha*van_genuchten_m*van_genuchten_n*
+	      moisture_content_range*
+	      alpha_head_n_minus_1*
+	      pow(1.+alpha_head_n_minus_1*alpha_head,-1.*van_genuchten_m-1.));
+    }
+}
 
-      return (-1.*van_genuchten_alpha*van_genuchten_m*van_genuchten_n*
-	      (moisture_content_saturation-moisture_content_residual)*
-	      pow(van_genuchten_alpha*fabs(pressure_head),van_genuchten_n-1.)*
-	      pow(1.+pow(van_genuchten_alpha*fabs(pressure_head),van_genuchten_n),
-		  -1.*van_genuchten_m-1.)*
-	      pressure_head/fabs(pressure_head));
+template <class ModelType>
+inline
+double Hydraulic_Properties::effective_total_saturation(double pressure_head) const
+{
+  if (ModelType::constitutive_model==van_genuchten_1980)
+    {
+      if (pressure_head>=0.)
+	return (1.);
+      else if (use_tables(pressure_head))
+	return (effective_saturation_table.value(log(fabs(pressure_head))));
+      else
+	return (1./pow(1.+pow(van_genuchten_alpha*fabs(pressure_head),van_genuchten_n),van_genuchten_m));
     }
   else
     {
@@ -163,42 +458,150 @@ double Hydraulic_Properties::get_specific_moisture_capacity(double pressure_head
     }
 }
 
-double Hydraulic_Properties::get_effective_total_saturation(double pressure_head)
+template <class ModelType>
+inline
+double Hydraulic_Properties::effective_free_saturation(double pressure_head,
+						       double biomass_concentration,
+						       double biomass_dry_density) const
+{
+  double effective_free_saturation=
+    effective_total_saturation<ModelType>(pressure_head)-
+    get_effective_biomass_saturation(biomass_concentration,biomass_dry_density);
+
+  if (effective_free_saturation<=0.)
+    effective_free_saturation=0.;
+
+  return (effective_free_saturation);
+}
+
+template <class ModelType>
+inline
+double Hydraulic_Properties::moisture_content_total(double pressure_head) const
+{
+  return(moisture_content_range*
+	 effective_total_saturation<ModelType>(pressure_head)
+	 +moisture_content_residual);
+}
+
+template <class ModelType>
+inline
+double Hydraulic_Properties::moisture_content_free(double pressure_head,
+						   double biomass_concentration,
+						   double biomass_dry_density) const
+{
+  return(moisture_content_range*
+	 effective_free_saturation<ModelType>(pressure_head,biomass_concentration,biomass_dry_density)
+	 +moisture_content_residual);
+}
+
+template <class ModelType>
+inline
+double Hydraulic_Properties::hydraulic_conductivity(double pressure_head,
+						    double biomass_concentration,//mg_biomass/cm3_void
+						    double biomass_dry_density) const
 {
-  if (type_of_hydraulic_properties.compare("van_genuchten_1980")==0)
+  if (ModelType::constitutive_model==haverkamp_et_al_1977)
     {
-      double effective_total_saturation=-1000.;
-      if (pressure_head>=0.)
-	effective_total_saturation=
-	  1.;
+      double gamma=4.74;
+      double A=1.175E6;
+
+      return (hydraulic_conductivity_saturated*A/(A+pow(fabs(pressure_head),gamma)));
+    }
+  double relative_permeability=0.;
+  double biovolume_fraction=biomass_concentration/biomass_dry_density;//cm3_biomass/cm3_void
+  if (ModelType::relative_permeability_model==soleimani)
+    {
+      double effective_total_saturation_=
+	effective_total_saturation<ModelType>(pressure_head);
+
+      double effective_biomass_saturation=
+	get_effective_biomass_saturation(biomass_concentration,biomass_dry_density);
+
+      double clogging_term=0.;
+      if (effective_biomass_saturation>effective_total_saturation_)
+	effective_total_saturation_=effective_biomass_saturation;
       else
-	effective_total_saturation=
-	  1./pow(1.+pow(van_genuchten_alpha*fabs(pressure_head),van_genuchten_n),van_genuchten_m);
-      return (effective_total_saturation);
+	clogging_term=
+	  pow(1.-pow(effective_biomass_saturation,inverse_van_genuchten_m),van_genuchten_m)-
+	  get_clogging_term_total(pressure_head,effective_total_saturation_);
+
+      relative_permeability=
+	sqrt(effective_total_saturation_)*
+	clogging_term*clogging_term;
     }
-  else
+  else if (ModelType::relative_permeability_model==clement)
     {
-      std::cout << "Equations for \"" << type_of_hydraulic_properties
-		<< "\" are not implemented. Error.\n";
-      throw -1;
+      if (biovolume_fraction<1.)
+	relative_permeability=
+	  pow(1.-biovolume_fraction,19/6);
+      else
+	relative_permeability=0.;
+    }
+  else if (ModelType::relative_permeability_model==okubo_and_matsumoto)
+    {
+      if (biovolume_fraction<1.)
+	relative_permeability=
+	  (1.-biovolume_fraction)*(1.-biovolume_fraction);
+      else
+	relative_permeability=0.;
+    }
+  else if (ModelType::relative_permeability_model==vandevivere)
+    {
+      /*
+       * By Philippe Vandevivere,"Bacterial clogging of porous media:
+       * a new modelling approach", 1995
+       * */
+      if (biovolume_fraction<1.)
+	{
+	  double plug_hydraulic_conductivity=0.00025;
+	  double critical_biovolume_fraction=0.1;
+	  //double critical_porosity=0.9;
+	  //double relative_porosity=1.-biomass_concentration/biomass_dry_density;
+	  double relative_biovolume_fraction=biovolume_fraction/critical_biovolume_fraction;
+	  double phi=exp(-0.5*relative_biovolume_fraction*relative_biovolume_fraction);
+
+	  relative_permeability
+	    =phi*(1.-biovolume_fraction)*(1.-biovolume_fraction)
+	    +
+	    (1.-phi)*plug_hydraulic_conductivity
+	    /(plug_hydraulic_conductivity+biovolume_fraction*(1.-plug_hydraulic_conductivity));
+	}
+      else
+	relative_permeability=0.;
     }
+
+  return(hydraulic_conductivity_saturated*relative_permeability);
+}
+
+double Hydraulic_Properties::get_specific_moisture_capacity(double pressure_head) const
+{
+  if (constitutive_model==haverkamp_et_al_1977)
+    return (specific_moisture_capacity<Model<haverkamp_et_al_1977> >(pressure_head));
+  return (specific_moisture_capacity<Model<van_genuchten_1980> >(pressure_head));
+}
+
+double Hydraulic_Properties::get_effective_total_saturation(double pressure_head) const
+{
+  if (constitutive_model==haverkamp_et_al_1977)
+    return (effective_total_saturation<Model<haverkamp_et_al_1977> >(pressure_head));
+  return (effective_total_saturation<Model<van_genuchten_1980> >(pressure_head));
 }
 
-double Hydraulic_Properties::get_actual_total_saturation(double pressure_head)
+double Hydraulic_Properties::get_actual_total_saturation(double pressure_head) const
 {
-  return ((moisture_content_residual/moisture_content_saturation)+
-	  (1.-moisture_content_residual/moisture_content_saturation)*
+  return (residual_saturation+
+	  (1.-residual_saturation)*
 	  get_effective_total_saturation(pressure_head));
 }
 
 double Hydraulic_Properties::get_effective_biomass_saturation(double biomass_concentration,
-							      double biomass_dry_density)
+							      double biomass_dry_density) const
 {
   double actual_biomass_saturation=
     biomass_concentration/biomass_dry_density;
 
   double effective_biomass_saturation=
-    actual_biomass_saturation/(1.-(moisture_content_residual/moisture_content_saturation));
+    actual_biomass_saturation/(1.-residual_saturation);
 
   if (effective_biomass_saturation>1.)
     effective_biomass_saturation=1.;
@@ -207,153 +610,287 @@ double Hydraulic_Properties::get_effective_biomass_saturation(double biomass_con
 }
 
 double Hydraulic_Properties::get_actual_biomass_saturation(double biomass_concentration,
-							   double biomass_dry_density)
+							   double biomass_dry_density) const
 {
   return (get_effective_biomass_saturation(biomass_concentration,biomass_dry_density)*
-	  (1.-(moisture_content_residual/moisture_content_saturation)));
+	  (1.-residual_saturation));
 }
 
 double Hydraulic_Properties::get_effective_free_saturation(double pressure_head,
 							   double biomass_concentration,
-							   double biomass_dry_density)
+							   double biomass_dry_density) const
 {
-  double effective_free_saturation=
-    get_effective_total_saturation(pressure_head)-
-    get_effective_biomass_saturation(biomass_concentration,biomass_dry_density);
-
-  if (effective_free_saturation<=0.)
-    effective_free_saturation=0.;
-
-  return (effective_free_saturation);
+  if (constitutive_model==haverkamp_et_al_1977)
+    return (effective_free_saturation<Model<haverkamp_et_al_1977> >
+	    (pressure_head,biomass_concentration,biomass_dry_density));
+  return (effective_free_saturation<Model<van_genuchten_1980> >
+	  (pressure_head,biomass_concentration,biomass_dry_density));
 }
 
 double Hydraulic_Properties::get_hydraulic_conductivity(double pressure_head,
 							double biomass_concentration,//mg_biomass/cm3_void
-							double biomass_dry_density,
-							std::string relative_permeability_model)
+							double biomass_dry_density) const
 {
-  if (type_of_hydraulic_properties.compare("haverkamp_et_al_1977")==0)
-    {
-      double gamma=4.74;
-      double A=1.175E6;
+  if (constitutive_model==haverkamp_et_al_1977)
+    return (hydraulic_conductivity<Model<haverkamp_et_al_1977> >
+	    (pressure_head,biomass_concentration,biomass_dry_density));
+  else if (relative_permeability_model==clement)
+    return (hydraulic_conductivity<Model<van_genuchten_1980,clement> >
+	    (pressure_head,biomass_concentration,biomass_dry_density));
+  else if (relative_permeability_model==okubo_and_matsumoto)
+    return (hydraulic_conductivity<Model<van_genuchten_1980,okubo_and_matsumoto> >
+	    (pressure_head,biomass_concentration,biomass_dry_density));
+  else if (relative_permeability_model==vandevivere)
+    return (hydraulic_conductivity<Model<van_genuchten_1980,vandevivere> >
+	    (pressure_head,biomass_concentration,biomass_dry_density));
+  return (hydraulic_conductivity<Model<van_genuchten_1980,soleimani> >
+	  (pressure_head,biomass_concentration,biomass_dry_density));
+}
 
-      return (hydraulic_conductivity_saturated*A/(A+pow(fabs(pressure_head),gamma)));
-    }
-  else if (type_of_hydraulic_properties.compare("van_genuchten_1980")==0)
-    {
-      double effective_total_saturation=
-	get_effective_total_saturation(pressure_head);
+double Hydraulic_Properties::get_moisture_content_total(double pressure_head) const
+{
+  if (constitutive_model==haverkamp_et_al_1977)
+    return (moisture_content_total<Model<haverkamp_et_al_1977> >(pressure_head));
+  return (moisture_content_total<Model<van_genuchten_1980> >(pressure_head));
+}
 
-      double effective_biomass_saturation=
-	get_effective_biomass_saturation(biomass_concentration,biomass_dry_density);
+double Hydraulic_Properties::get_moisture_content_free(double pressure_head,
+						       double biomass_concentration,
+						       double biomass_dry_density) const
+{
+  if (constitutive_model==haverkamp_et_al_1977)
+    return (moisture_content_free<Model<haverkamp_et_al_1977> >
+	    (pressure_head,biomass_concentration,biomass_dry_density));
+  return (moisture_content_free<Model<van_genuchten_1980> >
+	  (pressure_head,biomass_concentration,biomass_dry_density));
+}
 
-      if (effective_biomass_saturation>effective_total_saturation)
-	effective_total_saturation=effective_biomass_saturation;
+bool Hydraulic_Properties::use_tables(double pressure_head) const
+{
+  return (pressure_head<0. &&
+	  fabs(pressure_head)>=min_pressure_head &&
+	  fabs(pressure_head)<=max_pressure_head &&
+	  !effective_saturation_table.empty());
+}
 
-      double relative_permeability=0.;
-      if (relative_permeability_model.compare("soleimani")==0)
-	{
-	  relative_permeability=
-	    pow(effective_total_saturation,0.5)*
-	    pow(pow(1.-pow(effective_biomass_saturation,1./van_genuchten_m),van_genuchten_m)-
-		pow(1.-pow(effective_total_saturation,1./van_genuchten_m),van_genuchten_m),2.);
-	}
-      else if (relative_permeability_model.compare("clement")==0)
-	{
-	  if (biomass_concentration/biomass_dry_density<1.)//cm3_biomass/cm3_void
-	    relative_permeability=
-	      pow(1.-biomass_concentration/biomass_dry_density,19/6);
-	  else
-	    relative_permeability=0.;
+double Hydraulic_Properties::get_clogging_term_total(double pressure_head,
+						     double effective_total_saturation) const
+{
+  if (use_tables(pressure_head))
+    return (clogging_term_table.value(log(fabs(pressure_head))));
+  else
+    return (pow(1.-pow(effective_total_saturation,inverse_van_genuchten_m),van_genuchten_m));
+}
 
-	}
-      else if (relative_permeability_model.compare("okubo_and_matsumoto")==0)
-	{
-	  if (biomass_concentration/biomass_dry_density<1.)//cm3_biomass/cm3_void
-	    relative_permeability=
-	      pow(1.-biomass_concentration/biomass_dry_density,2);
-	  else
-	    relative_permeability=0.;
+void Hydraulic_Properties::build_tables(double min_pressure_head_,
+					double max_pressure_head_,
+					unsigned int n_points,
+					bool monotone_cubic,
+					double &saturation_error,
+					double &moisture_capacity_error,
+					double &permeability_error)
+{
+  saturation_error=0.;
+  moisture_capacity_error=0.;
+  permeability_error=0.;
+  /*
+   * Only the van Genuchten curves are tabulated, other models keep
+   * using the analytic expressions.
+   */
+  if (constitutive_model!=van_genuchten_1980)
+    return;
+
+  if (min_pressure_head_<=0. || max_pressure_head_<=min_pressure_head_ || n_points<2)
+    {
+      std::cout << "Error. Constitutive tables need 0<min pressure head<"
+		<< "max pressure head and at least two points.\n";
+      throw -1;
+    }
+  /*
+   * Sample the analytic curves. The tables are cleared first so all the
+   * get_* functions below use the analytic expressions.
+   */
+  min_pressure_head=0.;
+  max_pressure_head=0.;
+  effective_saturation_table=Interpolation_Table();
+  moisture_capacity_table=Interpolation_Table();
+  clogging_term_table=Interpolation_Table();
+
+  const double log_min=log(min_pressure_head_);
+  const double log_max=log(max_pressure_head_);
+  const double dx=(log_max-log_min)/(n_points-1);
+
+  std::vector<double> saturation(n_points,0.);
+  std::vector<double> moisture_capacity(n_points,0.);
+  std::vector<double> clogging_term(n_points,0.);
+  for (unsigned int k=0; k<n_points; k++)
+    {
+      double pressure_head=-1.*exp(log_min+k*dx);
+      saturation[k]=get_effective_total_saturation(pressure_head);
+      moisture_capacity[k]=get_specific_moisture_capacity(pressure_head);
+      clogging_term[k]=get_clogging_term_total(pressure_head,saturation[k]);
+    }
+  /*
+   * The error is checked at points between the table nodes, where it
+   * is largest
+   */
+  const unsigned int subdivisions=4;
+  std::vector<double> check_points;
+  std::vector<double> check_saturation;
+  std::vector<double> check_moisture_capacity;
+  std::vector<double> check_clogging_term;
+  for (unsigned int k=0; k<n_points-1; k++)
+    for (unsigned int j=1; j<subdivisions; j++)
+      {
+	double x=log_min+(k+(1.*j)/subdivisions)*dx;
+	double pressure_head=-1.*exp(x);
+	double effective_saturation=get_effective_total_saturation(pressure_head);
+	check_points.push_back(x);
+	check_saturation.push_back(effective_saturation);
+	check_moisture_capacity.push_back(get_specific_moisture_capacity(pressure_head));
+	check_clogging_term.push_back(get_clogging_term_total(pressure_head,effective_saturation));
+      }
 
-	}
-      else if (relative_permeability_model.compare("vandevivere")==0)
-	{
-	  /*
-	   * By Philippe Vandevivere,"Bacterial clogging of porous media:
-	   * a new modelling approach", 1995
-	   * */
-	  if (biomass_concentration/biomass_dry_density<1.)//cm3_biomass/cm3_void
-	    {
-	      double plug_hydraulic_conductivity=0.00025;
-	      double critical_biovolume_fraction=0.1;
-	      //double critical_porosity=0.9;
-	      //double relative_porosity=1.-biomass_concentration/biomass_dry_density;
-	      double biovolume_fraction=biomass_concentration/biomass_dry_density;
-	      double phi=exp(-0.5*pow(biovolume_fraction/critical_biovolume_fraction,2));
-
-	      relative_permeability
-		=phi*pow(1-biovolume_fraction,2.)
-		+
-		(1.-phi)*plug_hydraulic_conductivity
-		/(plug_hydraulic_conductivity+biovolume_fraction*(1.-plug_hydraulic_conductivity));
-	    }
-	  else
-	    relative_permeability=0.;
-	}
-      else
-	{
-	  std::cout << "Relative permeability model not implemented: "
-		    << relative_permeability_model << ".\n"
-		    << "Available models are: soleimani, clement, okubo_and_matsumoto";
-	  throw -1;
-	}
+  effective_saturation_table.reinit(log_min,log_max,saturation,monotone_cubic);
+  moisture_capacity_table.reinit(log_min,log_max,moisture_capacity,monotone_cubic);
+  clogging_term_table.reinit(log_min,log_max,clogging_term,monotone_cubic);
 
-      return(hydraulic_conductivity_saturated*relative_permeability);
-    }
-  else
+  double max_saturation=0.;
+  double max_moisture_capacity=0.;
+  double max_clogging_term=0.;
+  for (unsigned int i=0; i<check_points.size(); i++)
     {
-      std::cout << "Equations for \"" << type_of_hydraulic_properties
-		<< "\" are not implemented. Error.\n";
-      throw -1;
+      saturation_error=
+	std::max(saturation_error,
+		 fabs(effective_saturation_table.value(check_points[i])-check_saturation[i]));
+      moisture_capacity_error=
+	std::max(moisture_capacity_error,
+		 fabs(moisture_capacity_table.value(check_points[i])-check_moisture_capacity[i]));
+      permeability_error=
+	std::max(permeability_error,
+		 fabs(clogging_term_table.value(check_points[i])-check_clogging_term[i]));
+      max_saturation=std::max(max_saturation,fabs(check_saturation[i]));
+      max_moisture_capacity=std::max(max_moisture_capacity,fabs(check_moisture_capacity[i]));
+      max_clogging_term=std::max(max_clogging_term,fabs(check_clogging_term[i]));
     }
+  if (max_saturation>0.)
+    saturation_error/=max_saturation;
+  if (max_moisture_capacity>0.)
+    moisture_capacity_error/=max_moisture_capacity;
+  if (max_clogging_term>0.)
+    permeability_error/=max_clogging_term;
+
+  min_pressure_head=min_pressure_head_;
+  max_pressure_head=max_pressure_head_;
 }
 
-double Hydraulic_Properties::get_moisture_content_total(double pressure_head)
+
+using namespace dealii;
+#include <InitialValue.h>
+//--------------------------------------------------------------------------------------------
+class Monod_Kinetics
 {
-  return((moisture_content_saturation-moisture_content_residual)*
-	 get_effective_total_saturation(pressure_head)
-	 +moisture_content_residual);
-}
+public:
+  /*
+   * Biomass growth with Monod kinetics, one set of constants per
+   * biomass species, each growing on its own substrate. Over a time
+   * step the biomass is multiplied by exp(mu*dt) with
+   *   mu=Y*q_max*Se*S/(Se*S+K_s/1000)-b
+   * The growth factors are computed for contiguous arrays of nodal
+   * values, VectorizedArray<double>::n_array_elements nodes at a time.
+   */
+  struct Species
+  {
+    double yield_coefficient;
+    double maximum_substrate_use_rate;
+    double half_velocity_constant;
+    double decay_rate;
+  };
 
-double Hydraulic_Properties::get_moisture_content_free(double pressure_head,
-						       double biomass_concentration,
-						       double biomass_dry_density)
+  void add_species(const Species &species_);
+  unsigned int n_species() const;
+  void growth_factors(const unsigned int species_index,
+		      const double       time_step,
+		      const unsigned int n_points,
+		      const double       *free_saturation,
+		      const double       *substrate,
+		      double             *factors) const;
+private:
+  std::vector<Species> species;
+};
+
+void Monod_Kinetics::add_species(const Species &species_)
 {
-  return((moisture_content_saturation-moisture_content_residual)*
-	 get_effective_free_saturation(pressure_head,biomass_concentration,biomass_dry_density)
-	 +moisture_content_residual);
+  species.push_back(species_);
 }
 
+unsigned int Monod_Kinetics::n_species() const
+{
+  return (species.size());
+}
 
-using namespace dealii;
-#include <InitialValue.h>
+void Monod_Kinetics::growth_factors(const unsigned int species_index,
+				    const double       time_step,
+				    const unsigned int n_points,
+				    const double       *free_saturation,
+				    const double       *substrate,
+				    double             *factors) const
+{
+  if (species_index>=species.size())
+    {
+      std::cout << "Error. Biomass species " << species_index
+		<< " is not defined.\n";
+      throw -1;
+    }
+  const Species &kinetics=species[species_index];
+  const unsigned int n_lanes=VectorizedArray<double>::n_array_elements;
+  const VectorizedArray<double> growth_coefficient=
+    make_vectorized_array(kinetics.yield_coefficient*kinetics.maximum_substrate_use_rate);
+  const VectorizedArray<double> half_velocity_constant=
+    make_vectorized_array(kinetics.half_velocity_constant/1000.);
+  const VectorizedArray<double> decay_rate=
+    make_vectorized_array(kinetics.decay_rate);
+  const VectorizedArray<double> dt=
+    make_vectorized_array(time_step);
+  /*
+   * The lanes past the end of the arrays are filled with a zero
+   * substrate, their results are discarded
+   */
+  for (unsigned int i=0; i<n_points; i+=n_lanes)
+    {
+      const unsigned int n_filled=std::min(n_lanes,n_points-i);
+      VectorizedArray<double> saturation=make_vectorized_array(0.);
+      VectorizedArray<double> concentration=make_vectorized_array(0.);
+      for (unsigned int v=0; v<n_filled; ++v)
+	{
+	  saturation[v]   =free_saturation[i+v];
+	  concentration[v]=substrate[i+v];
+	}
+      const VectorizedArray<double> uptake=saturation*concentration;
+      const VectorizedArray<double> factor=
+	std::exp((growth_coefficient*uptake/(uptake+half_velocity_constant)
+		  -decay_rate)*dt);
+      for (unsigned int v=0; v<n_filled; ++v)
+	factors[i+v]=factor[v];
+    }
+}
 //--------------------------------------------------------------------------------------------
 template <int dim>
 class Saturated_Properties
 {
 public:
-  Saturated_Properties(Parameters::AllParameters<dim>& parameters_);
+  Saturated_Properties(const Parameters::AllParameters<dim>& parameters_);
   double hydraulic_conductivity(const unsigned int material_id=0) const;
   double moisture_content      (const unsigned int material_id=0) const;
 private:
-  Parameters::AllParameters<dim> parameters;
+  const Parameters::AllParameters<dim> &parameters;
 };
 
 template <int dim>
-Saturated_Properties<dim>::Saturated_Properties(Parameters::AllParameters<dim>& parameters_)
-{
-  parameters=parameters_;
-}
+Saturated_Properties<dim>::Saturated_Properties(const Parameters::AllParameters<dim>& parameters_)
+  :
+  parameters(parameters_)
+{}
 
 template <int dim>
 double Saturated_Properties<dim>::hydraulic_conductivity(const unsigned int material_id) const
@@ -372,7 +909,7 @@ double Saturated_Properties<dim>::hydraulic_conductivity(const unsigned int mate
 	    parameters.saturated_hydraulic_conductivity;
 	}
     }
-  else if (dim==2)
+  else if (dim==2 || dim==3)
     {
       if (material_id==50)//left - 212um
 	{
@@ -422,7 +959,7 @@ double Saturated_Properties<dim>::moisture_content(const unsigned int material_i
 	    parameters.moisture_content_saturation;
 	}
     }
-  else if (dim==2)
+  else if (dim==2 || dim==3)
     {
       if (material_id==50)//left - 212um
 	{
@@ -459,69 +996,2044 @@ double Saturated_Properties<dim>::moisture_content(const unsigned int material_i
 
 namespace TRL
 {
-  template <int dim>
-  class Heat_Pipe
+  /*
+   * Data structures used by the multithreaded assembly loops. The
+   * Scratch objects hold everything a thread needs to compute the
+   * contributions of one cell (FEFaceValues objects and local vectors)
+   * and the CopyData objects hold the results that need to be added
+   * to the global matrices, vectors and to the flow, nutrient and
+   * biomass tallies.
+   */
+  namespace Assembly
   {
-  public:
-    Heat_Pipe(int argc, char *argv[]);
-    ~Heat_Pipe();
-    void run();
+    /*
+     * Geometry-only quantities of every active cell (JxW values, shape
+     * function gradients, cell volume and diameter) for a given
+     * quadrature. They are independent of the solution and of the time
+     * step, so they are computed once per mesh and reused in every
+     * Picard iteration. The shape function values are the same for all
+     * cells and are stored only once. The object is emptied with clear()
+     * whenever the mesh changes (see Heat_Pipe::distribute_dofs()) and
+     * rebuilt the next time it is needed.
+     */
+    template <int dim>
+    struct Geometry
+    {
+      Geometry ();
+
+      void reinit (const DoFHandler<dim> &dof_handler,
+		   const Quadrature<dim>  &quadrature);
+      void clear ();
+      bool empty () const;
+
+      double shape_value (const unsigned int i,
+			  const unsigned int q_point) const;
+      const Tensor<1,dim> &shape_grad (const unsigned int cell_index,
+				       const unsigned int i,
+				       const unsigned int q_point) const;
+      double JxW (const unsigned int cell_index,
+		  const unsigned int q_point) const;
+
+      unsigned int dofs_per_cell;
+      unsigned int n_q_points;
+      std::vector<double>        shape_values;
+      std::vector<double>        JxW_values;
+      std::vector<Tensor<1,dim> > shape_gradients;
+      std::vector<double>        cell_volume;
+      std::vector<double>        cell_diameter;
+    };
+
+    template <int dim>
+    Geometry<dim>::Geometry ()
+      :
+      dofs_per_cell (0),
+      n_q_points    (0)
+    {}
+
+    template <int dim>
+    void Geometry<dim>::reinit (const DoFHandler<dim> &dof_handler,
+				const Quadrature<dim>  &quadrature)
+    {
+      const FiniteElement<dim> &fe=dof_handler.get_fe();
+      FEValues<dim> fe_values (fe, quadrature,
+			       update_values|update_gradients|
+			       update_JxW_values);
+      dofs_per_cell=fe.dofs_per_cell;
+      n_q_points   =quadrature.size();
+
+      const unsigned int n_cells=dof_handler.get_triangulation().n_active_cells();
+      shape_values.resize   (n_q_points*dofs_per_cell);
+      JxW_values.resize     (n_cells*n_q_points);
+      shape_gradients.resize(n_cells*n_q_points*dofs_per_cell);
+      cell_volume.resize    (n_cells);
+      cell_diameter.resize  (n_cells);
+
+      bool first_cell=true;
+      typename DoFHandler<dim>::active_cell_iterator
+	cell = dof_handler.begin_active(),
+	endc = dof_handler.end();
+      for (; cell!=endc; ++cell)
+	{
+	  fe_values.reinit (cell);
+	  const unsigned int cell_index=cell->active_cell_index();
+	  if (first_cell)
+	    {
+	      for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+		for (unsigned int i=0; i<dofs_per_cell; ++i)
+		  shape_values[q_point*dofs_per_cell+i]=
+		    fe_values.shape_value(i,q_point);
+	      first_cell=false;
+	    }
+	  double dV=0.;
+	  for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+	    {
+	      JxW_values[cell_index*n_q_points+q_point]=fe_values.JxW(q_point);
+	      for (unsigned int i=0; i<dofs_per_cell; ++i)
+		{
+		  shape_gradients[(cell_index*n_q_points+q_point)*dofs_per_cell+i]=
+		    fe_values.shape_grad(i,q_point);
+		  dV+=//cm3_soil
+		    fe_values.shape_value(i,q_point)*
+		    fe_values.JxW(q_point);
+		}
+	    }
+	  cell_volume[cell_index]  =dV;
+	  cell_diameter[cell_index]=cell->diameter();
+	}
+    }
 
-  private:
-    void read_grid();
-    void refine_grid(const unsigned int refinement_mode);
-    void setup_system();
-    void initial_condition();
-    void initial_condition_biomass();
-    void assemble_system_flow();
-    void assemble_system_transport();
-    void solve_system_flow();
-    void solve_system_transport();
-    void output_results();
-    void print_info(unsigned int iteration,
-		    double rel_err_flow,
-		    double rel_err_tran) const;
-    void calculate_mass_balance_ratio();
-    void hydraulic_properties(double pressure_head,
-			      double &specific_moisture_capacity,
-			      double &hydraulic_conductivity,
-			      double &actual_total_moisture_content,
-			      double &actual_free_water_moisture_content,
-			      std::string hydraulic_properties,
-			      double biomass_concentration=0,
-			      bool stop_bacterial_growth=false);
-    void repeated_vertices();
+    template <int dim>
+    void Geometry<dim>::clear ()
+    {
+      dofs_per_cell=0;
+      n_q_points   =0;
+      shape_values.clear();
+      JxW_values.clear();
+      shape_gradients.clear();
+      cell_volume.clear();
+      cell_diameter.clear();
+    }
 
-    Triangulation<dim> triangulation;
-    DoFHandler<dim>    dof_handler;
-    FE_Q<dim>          fe;
-    ConstraintMatrix   hanging_node_constraints;
-    SparsityPattern    sparsity_pattern;
+    template <int dim>
+    bool Geometry<dim>::empty () const
+    {
+      return (cell_volume.size()==0);
+    }
 
-    // Richards' equation variables
-    SparseMatrix<double> system_matrix_flow;
-    SparseMatrix<double> mass_matrix_richards;
-    SparseMatrix<double> laplace_matrix_new_richards;
-    SparseMatrix<double> laplace_matrix_old_richards;
-    Vector<double>       system_rhs_flow;
-    Vector<double>       solution_flow_new_iteration;
-    Vector<double>       solution_flow_old_iteration;
-    Vector<double>       old_solution_flow;
-    // Substrate variables
-    SparseMatrix<double> system_matrix_transport;
-    SparseMatrix<double> mass_matrix_transport_new;
-    SparseMatrix<double> mass_matrix_transport_old;
-    SparseMatrix<double> laplace_matrix_new_transport;
-    SparseMatrix<double> laplace_matrix_old_transport;
-    Vector<double>       system_rhs_transport;
-    Vector<double>       solution_transport;
-    Vector<double>       old_solution_transport;
-    
+    template <int dim>
+    inline
+    double Geometry<dim>::shape_value (const unsigned int i,
+				       const unsigned int q_point) const
+    {
+      return shape_values[q_point*dofs_per_cell+i];
+    }
+
+    template <int dim>
+    inline
+    const Tensor<1,dim> &Geometry<dim>::shape_grad (const unsigned int cell_index,
+						    const unsigned int i,
+						    const unsigned int q_point) const
+    {
+      return shape_gradients[(cell_index*n_q_points+q_point)*dofs_per_cell+i];
+    }
+
+    template <int dim>
+    inline
+    double Geometry<dim>::JxW (const unsigned int cell_index,
+			       const unsigned int q_point) const
+    {
+      return JxW_values[cell_index*n_q_points+q_point];
+    }
+
+    /*
+     * Velocities, SUPG parameter and dispersion coefficients of a cell
+     * in the last transport assembly (see calculate_boundary_flows()
+     * and Transport_Operator). sink_weight multiplies the nodal sink
+     * factors of the matrix-free transport: minus the porosity of the
+     * cell for the Monod kinetics, one for the homogeneous decay.
+     */
+    template <int dim>
+    struct Transport_Cell_Coefficients
+    {
+      Transport_Cell_Coefficients ();
+
+      Tensor<1,dim> new_velocity;
+      Tensor<1,dim> old_velocity;
+      double        tau;
+      double        new_diffusion;
+      double        old_diffusion;
+      double        sink_weight;
+    };
+
+    template <int dim>
+    Transport_Cell_Coefficients<dim>::Transport_Cell_Coefficients ()
+      :
+      tau           (0.),
+      new_diffusion (0.),
+      old_diffusion (0.),
+      sink_weight   (0.)
+    {}
+
+    namespace Scratch
+    {
+      template <int dim>
+      struct Flow
+      {
+	Flow (const FiniteElement<dim> &fe,
+	      const Quadrature<dim-1>  &face_quadrature);
+	Flow (const Flow &scratch);
+
+	FEFaceValues<dim> fe_face_values;
+      };
+
+      template <int dim>
+      Flow<dim>::Flow (const FiniteElement<dim> &fe,
+		       const Quadrature<dim-1>  &face_quadrature)
+	:
+	fe_face_values (fe, face_quadrature,
+			update_values|update_gradients|
+			update_normal_vectors|
+			update_quadrature_points|update_JxW_values)
+      {}
+
+      template <int dim>
+      Flow<dim>::Flow (const Flow &scratch)
+	:
+	fe_face_values (scratch.fe_face_values.get_fe(),
+			scratch.fe_face_values.get_quadrature(),
+			scratch.fe_face_values.get_update_flags())
+      {}
+
+      template <int dim>
+      struct Transport
+      {
+	Transport (const FiniteElement<dim> &fe,
+		   const Quadrature<dim-1>  &face_quadrature);
+	Transport (const Transport &scratch);
+
+	FEFaceValues<dim> fe_face_values;
+	std::vector<double> new_test_values;
+	std::vector<double> old_test_values;
+      };
+
+      template <int dim>
+      Transport<dim>::Transport (const FiniteElement<dim> &fe,
+				 const Quadrature<dim-1>  &face_quadrature)
+	:
+	fe_face_values (fe, face_quadrature,
+			update_values|update_gradients|
+			update_normal_vectors|
+			update_quadrature_points|update_JxW_values),
+	new_test_values (fe.dofs_per_cell),
+	old_test_values (fe.dofs_per_cell)
+      {}
+
+      template <int dim>
+      Transport<dim>::Transport (const Transport &scratch)
+	:
+	fe_face_values (scratch.fe_face_values.get_fe(),
+			scratch.fe_face_values.get_quadrature(),
+			scratch.fe_face_values.get_update_flags()),
+	new_test_values (scratch.new_test_values),
+	old_test_values (scratch.old_test_values)
+      {}
+    }
+
+    namespace CopyData
+    {
+      template <int dim>
+      struct Flow
+      {
+	Flow (const FiniteElement<dim> &fe);
+
+	FullMatrix<double>        cell_mass_matrix;
+	FullMatrix<double>        cell_laplace_matrix_new;
+	FullMatrix<double>        cell_laplace_matrix_old;
+	Vector<double>            cell_rhs;
+	std::vector<unsigned int> local_dof_indices;
+      };
+
+      template <int dim>
+      Flow<dim>::Flow (const FiniteElement<dim> &fe)
+	:
+	cell_mass_matrix        (fe.dofs_per_cell,fe.dofs_per_cell),
+	cell_laplace_matrix_new (fe.dofs_per_cell,fe.dofs_per_cell),
+	cell_laplace_matrix_old (fe.dofs_per_cell,fe.dofs_per_cell),
+	cell_rhs                (fe.dofs_per_cell),
+	local_dof_indices       (fe.dofs_per_cell)
+      {}
+
+      template <int dim>
+      struct Transport
+      {
+	Transport (const FiniteElement<dim> &fe);
+
+	FullMatrix<double>        cell_mass_matrix_new;
+	FullMatrix<double>        cell_mass_matrix_old;
+	FullMatrix<double>        cell_laplace_matrix_new;
+	FullMatrix<double>        cell_laplace_matrix_old;
+	Vector<double>            cell_rhs;
+	std::vector<unsigned int> local_dof_indices;
+
+	unsigned int cell_index;
+	double       nutrients_in_domain;
+	Transport_Cell_Coefficients<dim> coefficients;
+      };
+
+      template <int dim>
+      Transport<dim>::Transport (const FiniteElement<dim> &fe)
+	:
+	cell_mass_matrix_new    (fe.dofs_per_cell,fe.dofs_per_cell),
+	cell_mass_matrix_old    (fe.dofs_per_cell,fe.dofs_per_cell),
+	cell_laplace_matrix_new (fe.dofs_per_cell,fe.dofs_per_cell),
+	cell_laplace_matrix_old (fe.dofs_per_cell,fe.dofs_per_cell),
+	cell_rhs                (fe.dofs_per_cell),
+	local_dof_indices       (fe.dofs_per_cell),
+	cell_index              (0),
+	nutrients_in_domain     (0.)
+      {}
+    }
+  }
+
+#ifdef DEAL_II_WITH_UMFPACK
+  /*
+   * Direct solver based on UMFPACK. Unlike SparseDirectUMFPACK, the
+   * symbolic factorization is kept between calls to factorize() and
+   * only the numeric factorization is redone, as long as clear() is
+   * not called. clear() must be called whenever the sparsity pattern of
+   * the matrix changes (see setup_system()).
+   *
+   * The rows of the deal.II matrix are passed to UMFPACK as if they
+   * were columns, i.e. UMFPACK factorizes the transpose of the matrix,
+   * and solve() asks UMFPACK for the solution of the transposed system.
+   * This way the matrix does not need to be converted to column format.
+   */
+  class Direct_Solver
+  {
+  public:
+    Direct_Solver ();
+    ~Direct_Solver ();
+
+    void clear ();
+    void factorize (const SparseMatrix<double> &matrix);
+    void solve (const Vector<double> &rhs,
+		Vector<double>       &solution) const;
+    unsigned int n_symbolic_factorizations () const;
+  private:
+    Direct_Solver (const Direct_Solver &);
+    Direct_Solver &operator= (const Direct_Solver &);
+
+    void *symbolic_decomposition;
+    void *numeric_decomposition;
+
+    std::vector<types::suitesparse_index> row_start;
+    std::vector<types::suitesparse_index> column_indices;
+    std::vector<types::suitesparse_index> sorted_position;
+    std::vector<double>                   values;
+    std::vector<double>                   control;
+    unsigned int                          symbolic_factorizations;
+  };
+
+  Direct_Solver::Direct_Solver ()
+    :
+    symbolic_decomposition (0),
+    numeric_decomposition  (0),
+    control                (UMFPACK_CONTROL),
+    symbolic_factorizations(0)
+  {
+    umfpack_dl_defaults (&control[0]);
+  }
+
+  Direct_Solver::~Direct_Solver ()
+  {
+    clear ();
+  }
+
+  void Direct_Solver::clear ()
+  {
+    if (symbolic_decomposition!=0)
+      umfpack_dl_free_symbolic (&symbolic_decomposition);
+    if (numeric_decomposition!=0)
+      umfpack_dl_free_numeric (&numeric_decomposition);
+    symbolic_decomposition=0;
+    numeric_decomposition=0;
+
+    row_start.clear();
+    column_indices.clear();
+    sorted_position.clear();
+    values.clear();
+  }
+
+  void Direct_Solver::factorize (const SparseMatrix<double> &matrix)
+  {
+    const unsigned int n=matrix.m();
+    if (symbolic_decomposition==0)
+      {
+	/*
+	 * UMFPACK wants the indices of each column (here, each row) sorted,
+	 * deal.II stores the diagonal entry first. sorted_position maps the
+	 * n-th entry of the deal.II matrix (in iteration order) to its
+	 * position in the arrays passed to UMFPACK.
+	 */
+	row_start.resize(n+1);
+	column_indices.resize(matrix.n_nonzero_elements());
+	sorted_position.resize(matrix.n_nonzero_elements());
+	values.resize(matrix.n_nonzero_elements());
+
+	std::vector<std::pair<types::suitesparse_index,types::suitesparse_index> > row_entries;
+	types::suitesparse_index entry_index=0;
+	row_start[0]=0;
+	for (unsigned int row=0; row<n; ++row)
+	  {
+	    row_entries.clear();
+	    for (SparseMatrix<double>::const_iterator entry=matrix.begin(row);
+		 entry!=matrix.end(row); ++entry, ++entry_index)
+	      row_entries.push_back(std::make_pair(entry->column(),entry_index));
+	    std::sort(row_entries.begin(),row_entries.end());
+
+	    row_start[row+1]=row_start[row]+row_entries.size();
+	    for (unsigned int i=0; i<row_entries.size(); ++i)
+	      {
+		column_indices[row_start[row]+i]=row_entries[i].first;
+		sorted_position[row_entries[i].second]=row_start[row]+i;
+	      }
+	  }
+      }
+
+    types::suitesparse_index entry_index=0;
+    for (unsigned int row=0; row<n; ++row)
+      for (SparseMatrix<double>::const_iterator entry=matrix.begin(row);
+	   entry!=matrix.end(row); ++entry, ++entry_index)
+	values[sorted_position[entry_index]]=entry->value();
+
+    int status=UMFPACK_OK;
+    if (symbolic_decomposition==0)
+      {
+	status=umfpack_dl_symbolic (n, n,
+				    &row_start[0], &column_indices[0], &values[0],
+				    &symbolic_decomposition,
+				    &control[0], 0);
+	if (status!=UMFPACK_OK)
+	  {
+	    std::cout << "Error in the UMFPACK symbolic factorization. Status: "
+		      << status << "\n";
+	    throw -1;
+	  }
+	symbolic_factorizations++;
+      }
+
+    if (numeric_decomposition!=0)
+      umfpack_dl_free_numeric (&numeric_decomposition);
+    status=umfpack_dl_numeric (&row_start[0], &column_indices[0], &values[0],
+			       symbolic_decomposition,
+			       &numeric_decomposition,
+			       &control[0], 0);
+    if (status!=UMFPACK_OK)
+      {
+	std::cout << "Error in the UMFPACK numeric factorization. Status: "
+		  << status << "\n";
+	throw -1;
+      }
+  }
+
+  void Direct_Solver::solve (const Vector<double> &rhs,
+			     Vector<double>       &solution) const
+  {
+    int status=umfpack_dl_solve (UMFPACK_At,
+				 &row_start[0], &column_indices[0], &values[0],
+				 solution.begin(), rhs.begin(),
+				 numeric_decomposition,
+				 &control[0], 0);
+    if (status!=UMFPACK_OK)
+      {
+	std::cout << "Error in the UMFPACK solve. Status: "
+		  << status << "\n";
+	throw -1;
+      }
+  }
+
+  unsigned int Direct_Solver::n_symbolic_factorizations () const
+  {
+    return symbolic_factorizations;
+  }
+#endif
+
+  /*
+   * Anderson acceleration of a fixed point iteration x=G(x). apply()
+   * receives the last input x_k of the iteration and g=G(x_k), and
+   * replaces g by the next input x_{k+1}. This is the combination of
+   * the last depth+1 values of G that minimizes the linearized
+   * residual G(x)-x (Walker and Ni, 2011). The history must be cleared
+   * whenever the fixed point problem changes, e.g. at a new time step.
+   */
+  class Anderson_Acceleration
+  {
+  public:
+    Anderson_Acceleration ();
+
+    void reinit (const unsigned int depth_);
+    void clear ();
+    void apply (const Vector<double> &x,
+		Vector<double>       &g);
+  private:
+    unsigned int               depth;
+    bool                       has_previous;
+    Vector<double>             previous_residual;
+    Vector<double>             previous_g;
+    std::deque<Vector<double> > residual_differences;
+    std::deque<Vector<double> > g_differences;
+  };
+
+  Anderson_Acceleration::Anderson_Acceleration ()
+    :
+    depth        (0),
+    has_previous (false)
+  {}
+
+  void Anderson_Acceleration::reinit (const unsigned int depth_)
+  {
+    depth=depth_;
+    clear ();
+  }
+
+  void Anderson_Acceleration::clear ()
+  {
+    has_previous=false;
+    residual_differences.clear();
+    g_differences.clear();
+  }
+
+  void Anderson_Acceleration::apply (const Vector<double> &x,
+				     Vector<double>       &g)
+  {
+    Vector<double> residual(g);
+    residual-=x;
+
+    if (has_previous)
+      {
+	residual_differences.push_back(residual);
+	residual_differences.back()-=previous_residual;
+	g_differences.push_back(g);
+	g_differences.back()-=previous_g;
+	if (residual_differences.size()>depth)
+	  {
+	    residual_differences.pop_front();
+	    g_differences.pop_front();
+	  }
+      }
+    previous_residual=residual;
+    previous_g=g;
+    has_previous=true;
+
+    const unsigned int m=residual_differences.size();
+    if (m==0)
+      return;
+    /*
+     * Least squares problem min|residual-sum_i gamma_i*residual_differences_i|
+     * solved with the normal equations. m is small, a tiny
+     * regularization keeps them solvable when the differences become
+     * (almost) linearly dependent close to convergence.
+     */
+    FullMatrix<double> normal_matrix(m,m);
+    Vector<double>     normal_rhs(m);
+    Vector<double>     gamma(m);
+    double max_diagonal=0.;
+    for (unsigned int i=0; i<m; ++i)
+      {
+	for (unsigned int j=0; j<=i; ++j)
+	  {
+	    normal_matrix(i,j)=residual_differences[i]*residual_differences[j];
+	    normal_matrix(j,i)=normal_matrix(i,j);
+	  }
+	normal_rhs(i)=residual_differences[i]*residual;
+	max_diagonal=std::max(max_diagonal,normal_matrix(i,i));
+      }
+    if (max_diagonal==0.)
+      return;
+    for (unsigned int i=0; i<m; ++i)
+      normal_matrix(i,i)+=1.E-10*max_diagonal;
+
+    normal_matrix.gauss_jordan();
+    normal_matrix.vmult(gamma,normal_rhs);
+
+    for (unsigned int i=0; i<m; ++i)
+      g.add(-1.*gamma(i),g_differences[i]);
+  }
+
+  /*
+   * Matrix-free form of the system matrix of the Richards equation,
+   *   (c*phi_i,phi_j)+theta*dt*(K*grad phi_i,grad phi_j)
+   * with c the (theta weighted) specific moisture capacity and K the
+   * hydraulic conductivity, interpolated at the quadrature points from
+   * their nodal values in set_coefficients(). Only the coefficients at
+   * the quadrature points are stored, the shape functions are applied
+   * on the fly, VectorizedArray<double>::n_array_elements cells at a
+   * time. Q1 elements and two quadrature points per direction: Gauss,
+   * or Gauss-Lobatto (the trapezoidal rule) for the lumped mass matrix.
+   *
+   * The constrained rows (hanging nodes and first kind boundaries) act
+   * as the identity, so the operator can be used with CG, and with
+   * PreconditionChebyshev on its diagonal, to solve for corrections
+   * that are zero on the constrained dofs.
+   */
+  template <int dim>
+  class Richards_Operator : public Subscriptor
+  {
+  public:
+    typedef FEEvaluation<dim,1,2,1,double> Evaluation;
+
+    void reinit (const DoFHandler<dim>  &dof_handler,
+		 const ConstraintMatrix &constraints,
+		 const bool             lumped_matrix);
+    void clear ();
+    void set_coefficients (const Vector<double> &new_moisture_capacity,
+			   const Vector<double> &old_moisture_capacity,
+			   const double         new_capacity_weight,
+			   const Vector<double> &hydraulic_conductivity,
+			   const double         conductivity_weight);
+
+    unsigned int m () const;
+    unsigned int n () const;
+    double el (const unsigned int row,
+	       const unsigned int col) const;
+    void vmult (Vector<double>       &dst,
+		const Vector<double> &src) const;
+    void apply_plain (Vector<double>       &dst,
+		      const Vector<double> &src) const;
+
+    const MatrixFree<dim,double> &get_matrix_free () const;
+    const Vector<double> &get_inverse_diagonal () const;
+    VectorizedArray<double> mass_coefficient (const unsigned int cell,
+					      const unsigned int q_point) const;
+  private:
+    void apply_cell (Evaluation         &phi,
+		     const unsigned int cell) const;
+    void local_apply (const MatrixFree<dim,double>               &data,
+		      Vector<double>                             &dst,
+		      const Vector<double>                       &src,
+		      const std::pair<unsigned int,unsigned int> &cell_range) const;
+    void local_apply_plain (const MatrixFree<dim,double>               &data,
+			    Vector<double>                             &dst,
+			    const Vector<double>                       &src,
+			    const std::pair<unsigned int,unsigned int> &cell_range) const;
+    void local_compute_diagonal (const MatrixFree<dim,double>               &data,
+				 Vector<double>                             &dst,
+				 const unsigned int                         &dummy,
+				 const std::pair<unsigned int,unsigned int> &cell_range) const;
+
+    MatrixFree<dim,double>               data;
+    std::vector<unsigned int>            constrained_dofs;
+    Table<2,VectorizedArray<double> >    mass_coefficients;
+    Table<2,VectorizedArray<double> >    conductivity_coefficients;
+    Vector<double>                       diagonal;
+    Vector<double>                       inverse_diagonal;
+  };
+
+  template <int dim>
+  void Richards_Operator<dim>::reinit (const DoFHandler<dim>  &dof_handler,
+				       const ConstraintMatrix &constraints,
+				       const bool             lumped_matrix)
+  {
+    /*
+     * The cells of a batch are colored so that the threads of the
+     * cell loops never write to the same dof at the same time
+     */
+    typename MatrixFree<dim,double>::AdditionalData additional_data;
+    additional_data.tasks_parallel_scheme=
+      MatrixFree<dim,double>::AdditionalData::partition_color;
+    if (lumped_matrix)
+      data.reinit(dof_handler,constraints,QGaussLobatto<1>(2),additional_data);
+    else
+      data.reinit(dof_handler,constraints,QGauss<1>(2),additional_data);
+
+    constrained_dofs.clear();
+    for (unsigned int i=0; i<dof_handler.n_dofs(); ++i)
+      if (constraints.is_constrained(i))
+	constrained_dofs.push_back(i);
+
+    diagonal.reinit(dof_handler.n_dofs());
+    inverse_diagonal.reinit(dof_handler.n_dofs());
+    mass_coefficients.reinit(0,0);
+    conductivity_coefficients.reinit(0,0);
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::clear ()
+  {
+    data.clear();
+    constrained_dofs.clear();
+    mass_coefficients.reinit(0,0);
+    conductivity_coefficients.reinit(0,0);
+    diagonal.reinit(0);
+    inverse_diagonal.reinit(0);
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::set_coefficients (const Vector<double> &new_moisture_capacity,
+						 const Vector<double> &old_moisture_capacity,
+						 const double         new_capacity_weight,
+						 const Vector<double> &hydraulic_conductivity,
+						 const double         conductivity_weight)
+  {
+    /*
+     * c=w*c_new+(1-w)*c_old and theta*dt*K, interpolated with the shape
+     * functions from the nodal values as in local_assemble_system_flow().
+     * The diagonal, for the preconditioner, changes with them.
+     */
+    Evaluation phi(data);
+    const unsigned int n_cells=data.n_macro_cells();
+    mass_coefficients.reinit(n_cells,phi.n_q_points);
+    conductivity_coefficients.reinit(n_cells,phi.n_q_points);
+    for (unsigned int cell=0; cell<n_cells; ++cell)
+      {
+	phi.reinit(cell);
+	phi.read_dof_values_plain(new_moisture_capacity);
+	phi.evaluate(true,false);
+	for (unsigned int q=0; q<phi.n_q_points; ++q)
+	  mass_coefficients(cell,q)=new_capacity_weight*phi.get_value(q);
+	if (new_capacity_weight!=1.)
+	  {
+	    phi.read_dof_values_plain(old_moisture_capacity);
+	    phi.evaluate(true,false);
+	    for (unsigned int q=0; q<phi.n_q_points; ++q)
+	      mass_coefficients(cell,q)+=(1.-new_capacity_weight)*phi.get_value(q);
+	  }
+	phi.read_dof_values_plain(hydraulic_conductivity);
+	phi.evaluate(true,false);
+	for (unsigned int q=0; q<phi.n_q_points; ++q)
+	  conductivity_coefficients(cell,q)=conductivity_weight*phi.get_value(q);
+      }
+
+    diagonal=0;
+    unsigned int dummy=0;
+    data.cell_loop(&Richards_Operator<dim>::local_compute_diagonal,
+		   this,diagonal,dummy);
+    for (unsigned int i=0; i<constrained_dofs.size(); ++i)
+      diagonal(constrained_dofs[i])=1.;
+    for (unsigned int i=0; i<diagonal.size(); ++i)
+      inverse_diagonal(i)=(diagonal(i)!=0. ? 1./diagonal(i) : 1.);
+  }
+
+  template <int dim>
+  unsigned int Richards_Operator<dim>::m () const
+  {
+    return (diagonal.size());
+  }
+
+  template <int dim>
+  unsigned int Richards_Operator<dim>::n () const
+  {
+    return (diagonal.size());
+  }
+
+  template <int dim>
+  double Richards_Operator<dim>::el (const unsigned int row,
+				     const unsigned int col) const
+  {
+    /*
+     * Only the diagonal is known. It is what PreconditionChebyshev asks
+     * for if it is not given the inverse diagonal.
+     */
+    return (row==col ? diagonal(row) : 0.);
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::vmult (Vector<double>       &dst,
+				      const Vector<double> &src) const
+  {
+    dst=0;
+    data.cell_loop(&Richards_Operator<dim>::local_apply,this,dst,src);
+    for (unsigned int i=0; i<constrained_dofs.size(); ++i)
+      dst(constrained_dofs[i])=src(constrained_dofs[i]);
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::apply_plain (Vector<double>       &dst,
+					    const Vector<double> &src) const
+  {
+    /*
+     * The operator applied to src as it is, i.e. with its (first kind
+     * boundary) values on the constrained dofs, e.g. to compute the
+     * residual of an iterate. The constrained rows of dst are zero.
+     */
+    dst=0;
+    data.cell_loop(&Richards_Operator<dim>::local_apply_plain,this,dst,src);
+  }
+
+  template <int dim>
+  const MatrixFree<dim,double> &Richards_Operator<dim>::get_matrix_free () const
+  {
+    return (data);
+  }
+
+  template <int dim>
+  const Vector<double> &Richards_Operator<dim>::get_inverse_diagonal () const
+  {
+    return (inverse_diagonal);
+  }
+
+  template <int dim>
+  VectorizedArray<double> Richards_Operator<dim>::mass_coefficient (const unsigned int cell,
+								    const unsigned int q_point) const
+  {
+    return (mass_coefficients(cell,q_point));
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::apply_cell (Evaluation         &phi,
+					   const unsigned int cell) const
+  {
+    phi.evaluate(true,true);
+    for (unsigned int q=0; q<phi.n_q_points; ++q)
+      {
+	phi.submit_value(mass_coefficients(cell,q)*phi.get_value(q),q);
+	phi.submit_gradient(conductivity_coefficients(cell,q)*phi.get_gradient(q),q);
+      }
+    phi.integrate(true,true);
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::local_apply (const MatrixFree<dim,double>               &data,
+					    Vector<double>                             &dst,
+					    const Vector<double>                       &src,
+					    const std::pair<unsigned int,unsigned int> &cell_range) const
+  {
+    Evaluation phi(data);
+    for (unsigned int cell=cell_range.first; cell<cell_range.second; ++cell)
+      {
+	phi.reinit(cell);
+	phi.read_dof_values(src);
+	apply_cell(phi,cell);
+	phi.distribute_local_to_global(dst);
+      }
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::local_apply_plain (const MatrixFree<dim,double>               &data,
+						  Vector<double>                             &dst,
+						  const Vector<double>                       &src,
+						  const std::pair<unsigned int,unsigned int> &cell_range) const
+  {
+    Evaluation phi(data);
+    for (unsigned int cell=cell_range.first; cell<cell_range.second; ++cell)
+      {
+	phi.reinit(cell);
+	phi.read_dof_values_plain(src);
+	apply_cell(phi,cell);
+	phi.distribute_local_to_global(dst);
+      }
+  }
+
+  template <int dim>
+  void Richards_Operator<dim>::local_compute_diagonal (const MatrixFree<dim,double>               &data,
+						       Vector<double>                             &dst,
+						       const unsigned int                         &,
+						       const std::pair<unsigned int,unsigned int> &cell_range) const
+  {
+    /*
+     * The operator is applied to each unit vector of the cell, the i-th
+     * entry of the result is the i-th diagonal entry of the cell matrix
+     */
+    Evaluation phi(data);
+    VectorizedArray<double> cell_diagonal[Evaluation::dofs_per_cell];
+    for (unsigned int cell=cell_range.first; cell<cell_range.second; ++cell)
+      {
+	phi.reinit(cell);
+	for (unsigned int i=0; i<phi.dofs_per_cell; ++i)
+	  {
+	    for (unsigned int j=0; j<phi.dofs_per_cell; ++j)
+	      phi.submit_dof_value(make_vectorized_array(0.),j);
+	    phi.submit_dof_value(make_vectorized_array(1.),i);
+	    apply_cell(phi,cell);
+	    cell_diagonal[i]=phi.get_dof_value(i);
+	  }
+	for (unsigned int i=0; i<phi.dofs_per_cell; ++i)
+	  phi.submit_dof_value(cell_diagonal[i],i);
+	phi.distribute_local_to_global(dst);
+      }
+  }
+
+  /*
+   * Matrix-free form of the SUPG system matrix of the transport
+   * equation,
+   *   (theta_f*c,w_i)+weight*[(D*theta_f*grad c,grad phi_i)
+   *   +(v*grad c-s*c,w_i)-<v*n*c,w_i>_inflow]
+   * with the test functions w_i=phi_i+tau*v*grad(phi_i), theta_f the
+   * free moisture content, D the dispersion coefficient and s the sink
+   * factor, as in local_assemble_system_transport(). v, tau and D are
+   * constant on a cell, theta_f and s are interpolated from their nodal
+   * values. The operator is kept for both time levels: vmult() applies
+   * the one of the new time step (weight theta*dt), the system matrix,
+   * and apply_old() the one of the old time step (weight
+   * -(1-theta)*dt), which gives the right hand side. The cells with an
+   * inflow face are few, they keep the local matrices of their faces.
+   *
+   * As in Richards_Operator, Q1 elements and two Gauss points per
+   * direction. The rows of the hanging nodes act as the identity in
+   * vmult(); the operator is not symmetric, it is solved with BiCGStab
+   * or GMRES and PreconditionJacobi on its diagonal.
+   */
+  template <int dim>
+  class Transport_Operator : public Subscriptor
+  {
+  public:
+    typedef FEEvaluation<dim,1,2,1,double> Evaluation;
+
+    void reinit (const DoFHandler<dim>                 &dof_handler,
+		 const ConstraintMatrix                &constraints_,
+		 const std::vector<types::boundary_id> &inflow_boundaries_);
+    void clear ();
+    void set_coefficients (const std::vector<Assembly::Transport_Cell_Coefficients<dim> > &cell_coefficients,
+			   const Vector<double> &new_free_moisture_content,
+			   const Vector<double> &old_free_moisture_content,
+			   const Vector<double> &new_sink_factor,
+			   const Vector<double> &old_sink_factor,
+			   const double         new_weight,
+			   const double         old_weight);
+
+    unsigned int m () const;
+    unsigned int n () const;
+    void vmult (Vector<double>       &dst,
+		const Vector<double> &src) const;
+    void apply_old (Vector<double>       &dst,
+		    const Vector<double> &src) const;
+    void add_inflow (Vector<double> &dst,
+		     const double   new_flux_weight,
+		     const double   old_flux_weight) const;
+    void precondition_Jacobi (Vector<double>       &dst,
+			      const Vector<double> &src,
+			      const double         omega) const;
+
+    const MatrixFree<dim,double> &get_matrix_free () const;
+  private:
+    /*
+     * Coefficients of one time level: at the quadrature points the free
+     * moisture content and the weighted dispersion and sink terms, per
+     * cell batch the velocity and tau, and the local matrices of the
+     * inflow faces (already weighted)
+     */
+    struct Coefficients
+    {
+      Table<2,VectorizedArray<double> >                   moisture;
+      Table<2,VectorizedArray<double> >                   diffusion;
+      Table<2,VectorizedArray<double> >                   sink;
+      AlignedVector<Tensor<1,dim,VectorizedArray<double> > > velocity;
+      AlignedVector<VectorizedArray<double> >             tau;
+      std::vector<FullMatrix<double> >                    inflow_matrices;
+      double                                              weight;
+    };
+
+    void set_level (Coefficients                                            &coefficients,
+		    const std::vector<Assembly::Transport_Cell_Coefficients<dim> > &cell_coefficients,
+		    const bool                                              new_level,
+		    const Vector<double>                                    &free_moisture_content,
+		    const Vector<double>                                    &sink_factor,
+		    const double                                            weight);
+    bool inflow_face (const typename DoFHandler<dim>::active_cell_iterator &cell,
+		      const unsigned int                                   face) const;
+    void apply_cell (Evaluation         &phi,
+		     const unsigned int cell,
+		     const Coefficients &coefficients) const;
+    void apply_inflow (Vector<double>       &dst,
+		       const Vector<double> &src,
+		       const Coefficients   &coefficients) const;
+    void local_apply (const MatrixFree<dim,double>               &data,
+		      Vector<double>                             &dst,
+		      const Vector<double>                       &src,
+		      const std::pair<unsigned int,unsigned int> &cell_range) const;
+    void local_apply_old (const MatrixFree<dim,double>               &data,
+			  Vector<double>                             &dst,
+			  const Vector<double>                       &src,
+			  const std::pair<unsigned int,unsigned int> &cell_range) const;
+    void local_compute_diagonal (const MatrixFree<dim,double>               &data,
+				 Vector<double>                             &dst,
+				 const unsigned int                         &dummy,
+				 const std::pair<unsigned int,unsigned int> &cell_range) const;
+
+    MatrixFree<dim,double>                                      data;
+    SmartPointer<const ConstraintMatrix>                        constraints;
+    std::vector<unsigned int>                                   constrained_dofs;
+    std::vector<types::boundary_id>                             inflow_boundaries;
+    std::vector<typename DoFHandler<dim>::active_cell_iterator> inflow_cells;
+    std::vector<std::vector<unsigned int> >                     inflow_dof_indices;
+    /*
+     * -<v*n,w_i> on the inflow faces with the new and the old velocity,
+     * both with the test functions of the new time step
+     */
+    std::vector<Vector<double> >                                new_inflow_fluxes;
+    std::vector<Vector<double> >                                old_inflow_fluxes;
+    Coefficients                                                new_coefficients;
+    Coefficients                                                old_coefficients;
+    Vector<double>                                              diagonal;
+    Vector<double>                                              inverse_diagonal;
+  };
+
+  template <int dim>
+  void Transport_Operator<dim>::reinit (const DoFHandler<dim>                 &dof_handler,
+					const ConstraintMatrix                &constraints_,
+					const std::vector<types::boundary_id> &inflow_boundaries_)
+  {
+    typename MatrixFree<dim,double>::AdditionalData additional_data;
+    additional_data.tasks_parallel_scheme=
+      MatrixFree<dim,double>::AdditionalData::partition_color;
+    data.reinit(dof_handler,constraints_,QGauss<1>(2),additional_data);
+    constraints=&constraints_;
+
+    constrained_dofs.clear();
+    for (unsigned int i=0; i<dof_handler.n_dofs(); ++i)
+      if (constraints_.is_constrained(i))
+	constrained_dofs.push_back(i);
+
+    inflow_boundaries=inflow_boundaries_;
+    inflow_cells.clear();
+    inflow_dof_indices.clear();
+    typename DoFHandler<dim>::active_cell_iterator
+      cell = dof_handler.begin_active(),
+      endc = dof_handler.end();
+    for (; cell!=endc; ++cell)
+      {
+	if (cell->at_boundary()==false)
+	  continue;
+	bool inflow=false;
+	for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
+	  if (inflow_face(cell,face))
+	    inflow=true;
+	if (inflow==false)
+	  continue;
+	inflow_cells.push_back(cell);
+	inflow_dof_indices.push_back(std::vector<unsigned int>(cell->get_fe().dofs_per_cell));
+	cell->get_dof_indices(inflow_dof_indices.back());
+      }
+
+    const unsigned int dofs_per_cell=dof_handler.get_fe().dofs_per_cell;
+    new_inflow_fluxes.assign(inflow_cells.size(),Vector<double>(dofs_per_cell));
+    old_inflow_fluxes.assign(inflow_cells.size(),Vector<double>(dofs_per_cell));
+    new_coefficients.inflow_matrices.assign(inflow_cells.size(),
+					    FullMatrix<double>(dofs_per_cell,dofs_per_cell));
+    old_coefficients.inflow_matrices.assign(inflow_cells.size(),
+					    FullMatrix<double>(dofs_per_cell,dofs_per_cell));
+    diagonal.reinit(dof_handler.n_dofs());
+    inverse_diagonal.reinit(dof_handler.n_dofs());
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::clear ()
+  {
+    data.clear();
+    constraints=0;
+    constrained_dofs.clear();
+    inflow_cells.clear();
+    inflow_dof_indices.clear();
+    new_inflow_fluxes.clear();
+    old_inflow_fluxes.clear();
+    new_coefficients=Coefficients();
+    old_coefficients=Coefficients();
+    diagonal.reinit(0);
+    inverse_diagonal.reinit(0);
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::set_coefficients (const std::vector<Assembly::Transport_Cell_Coefficients<dim> > &cell_coefficients,
+						  const Vector<double> &new_free_moisture_content,
+						  const Vector<double> &old_free_moisture_content,
+						  const Vector<double> &new_sink_factor,
+						  const Vector<double> &old_sink_factor,
+						  const double         new_weight,
+						  const double         old_weight)
+  {
+    set_level(new_coefficients,cell_coefficients,true,
+	      new_free_moisture_content,new_sink_factor,new_weight);
+    set_level(old_coefficients,cell_coefficients,false,
+	      old_free_moisture_content,old_sink_factor,old_weight);
+    /*
+     * The face terms, cell by cell as in local_assemble_system_transport()
+     */
+    FEFaceValues<dim> fe_face_values(data.get_dof_handler().get_fe(),QGauss<dim-1>(2),
+				     update_values|update_gradients|
+				     update_normal_vectors|update_JxW_values);
+    const unsigned int dofs_per_cell  =fe_face_values.get_fe().dofs_per_cell;
+    const unsigned int n_face_q_points=fe_face_values.get_quadrature().size();
+    for (unsigned int c=0; c<inflow_cells.size(); ++c)
+      {
+	const typename DoFHandler<dim>::active_cell_iterator &cell=inflow_cells[c];
+	const Assembly::Transport_Cell_Coefficients<dim> &cell_data=
+	  cell_coefficients[cell->active_cell_index()];
+	FullMatrix<double> &new_matrix=new_coefficients.inflow_matrices[c];
+	FullMatrix<double> &old_matrix=old_coefficients.inflow_matrices[c];
+	new_matrix=0;
+	old_matrix=0;
+	new_inflow_fluxes[c]=0;
+	old_inflow_fluxes[c]=0;
+	for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
+	  {
+	    if (inflow_face(cell,face)==false)
+	      continue;
+	    fe_face_values.reinit(cell,face);
+	    for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
+	      {
+		const double new_flux=
+		  cell_data.new_velocity*
+		  fe_face_values.normal_vector(q_face_point)*
+		  fe_face_values.JxW(q_face_point);
+		const double old_flux=
+		  cell_data.old_velocity*
+		  fe_face_values.normal_vector(q_face_point)*
+		  fe_face_values.JxW(q_face_point);
+		for (unsigned int i=0; i<dofs_per_cell; ++i)
+		  {
+		    const double new_test_value=
+		      fe_face_values.shape_value(i,q_face_point)+
+		      cell_data.tau*cell_data.new_velocity*fe_face_values.shape_grad(i,q_face_point);
+		    const double old_test_value=
+		      fe_face_values.shape_value(i,q_face_point)+
+		      cell_data.tau*cell_data.old_velocity*fe_face_values.shape_grad(i,q_face_point);
+		    for (unsigned int j=0; j<dofs_per_cell; ++j)
+		      {
+			new_matrix(i,j)-=
+			  new_weight*new_test_value*
+			  fe_face_values.shape_value(j,q_face_point)*new_flux;
+			old_matrix(i,j)-=
+			  old_weight*old_test_value*
+			  fe_face_values.shape_value(j,q_face_point)*old_flux;
+		      }
+		    new_inflow_fluxes[c](i)-=new_test_value*new_flux;
+		    old_inflow_fluxes[c](i)-=new_test_value*old_flux;
+		  }
+	      }
+	  }
+      }
+
+    diagonal=0;
+    unsigned int dummy=0;
+    data.cell_loop(&Transport_Operator<dim>::local_compute_diagonal,
+		   this,diagonal,dummy);
+    for (unsigned int c=0; c<inflow_cells.size(); ++c)
+      for (unsigned int i=0; i<dofs_per_cell; ++i)
+	if (constraints->is_constrained(inflow_dof_indices[c][i])==false)
+	  diagonal(inflow_dof_indices[c][i])+=new_coefficients.inflow_matrices[c](i,i);
+    for (unsigned int i=0; i<constrained_dofs.size(); ++i)
+      diagonal(constrained_dofs[i])=1.;
+    for (unsigned int i=0; i<diagonal.size(); ++i)
+      inverse_diagonal(i)=(diagonal(i)!=0. ? 1./diagonal(i) : 1.);
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::set_level (Coefficients                                            &coefficients,
+					   const std::vector<Assembly::Transport_Cell_Coefficients<dim> > &cell_coefficients,
+					   const bool                                              new_level,
+					   const Vector<double>                                    &free_moisture_content,
+					   const Vector<double>                                    &sink_factor,
+					   const double                                            weight)
+  {
+    Evaluation phi(data);
+    const unsigned int n_cells=data.n_macro_cells();
+    coefficients.moisture.reinit(n_cells,phi.n_q_points);
+    coefficients.diffusion.reinit(n_cells,phi.n_q_points);
+    coefficients.sink.reinit(n_cells,phi.n_q_points);
+    coefficients.velocity.resize(n_cells);
+    coefficients.tau.resize(n_cells);
+    coefficients.weight=weight;
+    for (unsigned int cell=0; cell<n_cells; ++cell)
+      {
+	/*
+	 * The cells of the batch, their unused lanes stay zero
+	 */
+	VectorizedArray<double> diffusion  =make_vectorized_array(0.);
+	VectorizedArray<double> sink_weight=make_vectorized_array(0.);
+	coefficients.velocity[cell]=Tensor<1,dim,VectorizedArray<double> >();
+	coefficients.tau[cell]     =make_vectorized_array(0.);
+	for (unsigned int v=0; v<data.n_components_filled(cell); ++v)
+	  {
+	    const Assembly::Transport_Cell_Coefficients<dim> &cell_data=
+	      cell_coefficients[data.get_cell_iterator(cell,v)->active_cell_index()];
+	    const Tensor<1,dim> &velocity=
+	      (new_level ? cell_data.new_velocity : cell_data.old_velocity);
+	    for (unsigned int d=0; d<dim; ++d)
+	      coefficients.velocity[cell][d][v]=velocity[d];
+	    coefficients.tau[cell][v]=cell_data.tau;
+	    diffusion[v]  =(new_level ? cell_data.new_diffusion : cell_data.old_diffusion);
+	    sink_weight[v]=cell_data.sink_weight;
+	  }
+	phi.reinit(cell);
+	phi.read_dof_values_plain(free_moisture_content);
+	phi.evaluate(true,false);
+	for (unsigned int q=0; q<phi.n_q_points; ++q)
+	  {
+	    coefficients.moisture(cell,q) =phi.get_value(q);
+	    coefficients.diffusion(cell,q)=weight*diffusion*phi.get_value(q);
+	  }
+	phi.read_dof_values_plain(sink_factor);
+	phi.evaluate(true,false);
+	for (unsigned int q=0; q<phi.n_q_points; ++q)
+	  coefficients.sink(cell,q)=weight*sink_weight*phi.get_value(q);
+      }
+  }
+
+  template <int dim>
+  bool Transport_Operator<dim>::inflow_face (const typename DoFHandler<dim>::active_cell_iterator &cell,
+					     const unsigned int                                   face) const
+  {
+    return (cell->face(face)->at_boundary() &&
+	    std::find(inflow_boundaries.begin(),inflow_boundaries.end(),
+		      cell->face(face)->boundary_id())!=inflow_boundaries.end());
+  }
+
+  template <int dim>
+  unsigned int Transport_Operator<dim>::m () const
+  {
+    return (diagonal.size());
+  }
+
+  template <int dim>
+  unsigned int Transport_Operator<dim>::n () const
+  {
+    return (diagonal.size());
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::vmult (Vector<double>       &dst,
+				       const Vector<double> &src) const
+  {
+    dst=0;
+    data.cell_loop(&Transport_Operator<dim>::local_apply,this,dst,src);
+    apply_inflow(dst,src,new_coefficients);
+    for (unsigned int i=0; i<constrained_dofs.size(); ++i)
+      dst(constrained_dofs[i])=src(constrained_dofs[i]);
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::apply_old (Vector<double>       &dst,
+					   const Vector<double> &src) const
+  {
+    /*
+     * The operator of the old time step applied to the old solution is
+     * the right hand side without the inflow (see add_inflow()). The
+     * constrained rows of dst are zero.
+     */
+    dst=0;
+    data.cell_loop(&Transport_Operator<dim>::local_apply_old,this,dst,src);
+    apply_inflow(dst,src,old_coefficients);
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::add_inflow (Vector<double> &dst,
+					    const double   new_flux_weight,
+					    const double   old_flux_weight) const
+  {
+    /*
+     * The mass that enters through the inflow faces, i.e. the
+     * concentration at the boundary times the time step and theta
+     * or (1-theta) in the weights
+     */
+    Vector<double> cell_dst;
+    for (unsigned int c=0; c<inflow_cells.size(); ++c)
+      {
+	cell_dst =new_inflow_fluxes[c];
+	cell_dst*=new_flux_weight;
+	cell_dst.add(old_flux_weight,old_inflow_fluxes[c]);
+	constraints->distribute_local_to_global(cell_dst,inflow_dof_indices[c],dst);
+      }
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::precondition_Jacobi (Vector<double>       &dst,
+						     const Vector<double> &src,
+						     const double         omega) const
+  {
+    /*
+     * What PreconditionJacobi calls, the diagonal is the one of the
+     * new time step
+     */
+    dst.equ(omega,src);
+    dst.scale(inverse_diagonal);
+  }
+
+  template <int dim>
+  const MatrixFree<dim,double> &Transport_Operator<dim>::get_matrix_free () const
+  {
+    return (data);
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::apply_cell (Evaluation         &phi,
+					    const unsigned int cell,
+					    const Coefficients &coefficients) const
+  {
+    /*
+     * The terms tested with phi_i are also tested with tau*v*grad(phi_i),
+     * the streamline part of the SUPG test functions
+     */
+    const Tensor<1,dim,VectorizedArray<double> > &velocity=coefficients.velocity[cell];
+    const VectorizedArray<double> weight=make_vectorized_array(coefficients.weight);
+    phi.evaluate(true,true);
+    for (unsigned int q=0; q<phi.n_q_points; ++q)
+      {
+	const VectorizedArray<double>                value   =phi.get_value(q);
+	const Tensor<1,dim,VectorizedArray<double> > gradient=phi.get_gradient(q);
+	const VectorizedArray<double> residual=
+	  coefficients.moisture(cell,q)*value
+	  +weight*(velocity*gradient)
+	  -coefficients.sink(cell,q)*value;
+	phi.submit_value(residual,q);
+	phi.submit_gradient(coefficients.tau[cell]*residual*velocity+
+			    coefficients.diffusion(cell,q)*gradient,q);
+      }
+    phi.integrate(true,true);
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::apply_inflow (Vector<double>       &dst,
+					      const Vector<double> &src,
+					      const Coefficients   &coefficients) const
+  {
+    /*
+     * The values of src on the hanging nodes of the cell are the ones
+     * given by the constraints, as in read_dof_values()
+     */
+    if (inflow_cells.size()==0)
+      return;
+    const unsigned int dofs_per_cell=inflow_dof_indices[0].size();
+    Vector<double> cell_src(dofs_per_cell);
+    Vector<double> cell_dst(dofs_per_cell);
+    for (unsigned int c=0; c<inflow_cells.size(); ++c)
+      {
+	for (unsigned int i=0; i<dofs_per_cell; ++i)
+	  {
+	    const unsigned int dof=inflow_dof_indices[c][i];
+	    if (constraints->is_constrained(dof)==false)
+	      {
+		cell_src(i)=src(dof);
+		continue;
+	      }
+	    const std::vector<std::pair<types::global_dof_index,double> > &entries=
+	      *constraints->get_constraint_entries(dof);
+	    cell_src(i)=0.;
+	    for (unsigned int k=0; k<entries.size(); ++k)
+	      cell_src(i)+=entries[k].second*src(entries[k].first);
+	  }
+	coefficients.inflow_matrices[c].vmult(cell_dst,cell_src);
+	constraints->distribute_local_to_global(cell_dst,inflow_dof_indices[c],dst);
+      }
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::local_apply (const MatrixFree<dim,double>               &data,
+					     Vector<double>                             &dst,
+					     const Vector<double>                       &src,
+					     const std::pair<unsigned int,unsigned int> &cell_range) const
+  {
+    Evaluation phi(data);
+    for (unsigned int cell=cell_range.first; cell<cell_range.second; ++cell)
+      {
+	phi.reinit(cell);
+	phi.read_dof_values(src);
+	apply_cell(phi,cell,new_coefficients);
+	phi.distribute_local_to_global(dst);
+      }
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::local_apply_old (const MatrixFree<dim,double>               &data,
+						 Vector<double>                             &dst,
+						 const Vector<double>                       &src,
+						 const std::pair<unsigned int,unsigned int> &cell_range) const
+  {
+    Evaluation phi(data);
+    for (unsigned int cell=cell_range.first; cell<cell_range.second; ++cell)
+      {
+	phi.reinit(cell);
+	phi.read_dof_values(src);
+	apply_cell(phi,cell,old_coefficients);
+	phi.distribute_local_to_global(dst);
+      }
+  }
+
+  template <int dim>
+  void Transport_Operator<dim>::local_compute_diagonal (const MatrixFree<dim,double>               &data,
+							Vector<double>                             &dst,
+							const unsigned int                         &,
+							const std::pair<unsigned int,unsigned int> &cell_range) const
+  {
+    /*
+     * As in Richards_Operator: the operator applied to each unit vector
+     * of the cell
+     */
+    Evaluation phi(data);
+    VectorizedArray<double> cell_diagonal[Evaluation::dofs_per_cell];
+    for (unsigned int cell=cell_range.first; cell<cell_range.second; ++cell)
+      {
+	phi.reinit(cell);
+	for (unsigned int i=0; i<phi.dofs_per_cell; ++i)
+	  {
+	    for (unsigned int j=0; j<phi.dofs_per_cell; ++j)
+	      phi.submit_dof_value(make_vectorized_array(0.),j);
+	    phi.submit_dof_value(make_vectorized_array(1.),i);
+	    apply_cell(phi,cell,new_coefficients);
+	    cell_diagonal[i]=phi.get_dof_value(i);
+	  }
+	for (unsigned int i=0; i<phi.dofs_per_cell; ++i)
+	  phi.submit_dof_value(cell_diagonal[i],i);
+	phi.distribute_local_to_global(dst);
+      }
+  }
+
+  /*
+   * Integral over each cell of a batch of the values submitted to the
+   * quadrature points of phi. The shape functions add up to one, so it
+   * is the sum of the integrated dof values.
+   */
+  template <class EvaluationType>
+  VectorizedArray<double> cell_integral (EvaluationType &phi)
+  {
+    phi.integrate(true,false);
+    VectorizedArray<double> integral=make_vectorized_array(0.);
+    for (unsigned int i=0; i<phi.dofs_per_cell; ++i)
+      integral+=phi.get_dof_value(i);
+    return (integral);
+  }
+
+  /*
+   * The properties computed at the nodes in
+   * calculate_mass_balance_ratio(), one vector per property. DataOut,
+   * SolutionTransfer and the vector operations work on whole
+   * properties; the cell loops read all of them in one pass over the
+   * dof indices of the cell. Heat_Pipe keeps the values at the old
+   * and at the new time step in two objects, which are swapped at
+   * the end of each time step.
+   */
+  class Nodal_Properties
+  {
+  public:
+    void reinit (const unsigned int n_dofs);
+    void swap (Nodal_Properties &other);
+
+    Vector<double> biomass_concentration;
+    Vector<double> biomass_fraction;
+    Vector<double> total_moisture_content;
+    Vector<double> free_moisture_content;
+    Vector<double> hydraulic_conductivity;
+    Vector<double> specific_moisture_capacity;
+    Vector<double> free_saturation;
+  };
+
+  void Nodal_Properties::reinit (const unsigned int n_dofs)
+  {
+    biomass_concentration.reinit     (n_dofs);
+    biomass_fraction.reinit          (n_dofs);
+    total_moisture_content.reinit    (n_dofs);
+    free_moisture_content.reinit     (n_dofs);
+    hydraulic_conductivity.reinit    (n_dofs);
+    specific_moisture_capacity.reinit(n_dofs);
+    free_saturation.reinit           (n_dofs);
+  }
+
+  void Nodal_Properties::swap (Nodal_Properties &other)
+  {
+    biomass_concentration.swap     (other.biomass_concentration);
+    biomass_fraction.swap          (other.biomass_fraction);
+    total_moisture_content.swap    (other.total_moisture_content);
+    free_moisture_content.swap     (other.free_moisture_content);
+    hydraulic_conductivity.swap    (other.hydraulic_conductivity);
+    specific_moisture_capacity.swap(other.specific_moisture_capacity);
+    free_saturation.swap           (other.free_saturation);
+  }
+
+  /*
+   * Time series of scalar values (fluxes, mass balance) written to a
+   * file that stays open for the whole run. Rows are kept in memory and
+   * written every flush_interval rows, and when the writer is closed or
+   * destroyed. The text format has a header line with the column names
+   * and one tab separated row per line. The binary format starts with
+   * the number of columns (unsigned int) and the column names (null
+   * terminated), followed by the rows as doubles.
+   */
+  class Time_Series_Writer
+  {
+  public:
+    Time_Series_Writer ();
+    ~Time_Series_Writer ();
+
+    void open (const std::string              &filename,
+	       const std::vector<std::string> &column_names,
+	       const bool                      binary_,
+	       const unsigned int              flush_interval_);
+    void add_row (const std::vector<double> &row);
+    void flush ();
+    void close ();
+  private:
+    std::ofstream       file;
+    bool                binary;
+    unsigned int        flush_interval;
+    unsigned int        n_columns;
+    std::vector<double> rows;
+  };
+
+  Time_Series_Writer::Time_Series_Writer ()
+    :
+    binary         (false),
+    flush_interval (1),
+    n_columns      (0)
+  {}
+
+  Time_Series_Writer::~Time_Series_Writer ()
+  {
+    close ();
+  }
+
+  void Time_Series_Writer::open (const std::string              &filename,
+				 const std::vector<std::string> &column_names,
+				 const bool                      binary_,
+				 const unsigned int              flush_interval_)
+  {
+    close ();
+    binary        =binary_;
+    flush_interval=std::max(flush_interval_,1U);
+    n_columns     =column_names.size();
+
+    if (binary)
+      file.open(filename.c_str(),std::ios_base::out|std::ios_base::binary);
+    else
+      file.open(filename.c_str(),std::ios_base::out);
+    if (!file.is_open())
+      {
+	std::cout << "Error. The time series file " << filename
+		  << " could not be opened.\n";
+	throw -1;
+      }
+    if (binary)
+      {
+	file.write(reinterpret_cast<const char *>(&n_columns),sizeof(n_columns));
+	for (unsigned int i=0; i<n_columns; ++i)
+	  file.write(column_names[i].c_str(),column_names[i].size()+1);
+      }
+    else
+      {
+	for (unsigned int i=0; i<n_columns; ++i)
+	  file << column_names[i] << (i+1<n_columns ? "\t" : "\n");
+	file << std::scientific << std::setprecision(10);
+      }
+    rows.reserve(flush_interval*n_columns);
+  }
+
+  void Time_Series_Writer::add_row (const std::vector<double> &row)
+  {
+    if (row.size()!=n_columns)
+      {
+	std::cout << "Error. Time series row with " << row.size()
+		  << " values, expected " << n_columns << ".\n";
+	throw -1;
+      }
+    rows.insert(rows.end(),row.begin(),row.end());
+    if (rows.size()>=flush_interval*n_columns)
+      flush ();
+  }
+
+  void Time_Series_Writer::flush ()
+  {
+    if (!file.is_open())
+      return;
+    if (binary)
+      {
+	if (rows.size()>0)
+	  file.write(reinterpret_cast<const char *>(&rows[0]),
+		     rows.size()*sizeof(double));
+      }
+    else
+      {
+	for (unsigned int i=0; i<rows.size(); ++i)
+	  file << rows[i] << ((i+1)%n_columns==0 ? "\n" : "\t");
+      }
+    file.flush();
+    rows.clear();
+  }
+
+  void Time_Series_Writer::close ()
+  {
+    if (!file.is_open())
+      return;
+    flush ();
+    file.close();
+  }
+
+  /*
+   * Wall time and number of calls of named sections of the program,
+   * and named counters (solver iterations, rejected time steps, ...).
+   * Both may be added to from several threads, e.g. by the flow task.
+   * write_json() writes them, with the total wall time since
+   * construction, as one JSON object.
+   */
+  class Timing_Monitor
+  {
+  public:
+    /*
+     * Adds the wall time between construction and destruction to a
+     * section
+     */
+    class Scope
+    {
+    public:
+      Scope (Timing_Monitor    &monitor_,
+	     const std::string &section_);
+      ~Scope ();
+    private:
+      Timing_Monitor    &monitor;
+      const std::string section;
+      Timer             timer;
+    };
+
+    void add_time (const std::string &section,
+		   const double       wall_time);
+    void add_count (const std::string  &counter,
+		    const unsigned int  n=1);
+    void write_json (const std::string &filename) const;
+  private:
+    Timer                  total_timer;
+    mutable Threads::Mutex mutex;
+    std::map<std::string,std::pair<unsigned int,double> > sections;
+    std::map<std::string,unsigned long>                 counters;
+  };
+
+  Timing_Monitor::Scope::Scope (Timing_Monitor    &monitor_,
+				const std::string &section_)
+    :
+    monitor (monitor_),
+    section (section_)
+  {}
+
+  Timing_Monitor::Scope::~Scope ()
+  {
+    monitor.add_time(section,timer.wall_time());
+  }
+
+  void Timing_Monitor::add_time (const std::string &section,
+				 const double       wall_time)
+  {
+    Threads::Mutex::ScopedLock lock(mutex);
+    sections[section].first++;
+    sections[section].second+=wall_time;
+  }
+
+  void Timing_Monitor::add_count (const std::string  &counter,
+				  const unsigned int  n)
+  {
+    Threads::Mutex::ScopedLock lock(mutex);
+    counters[counter]+=n;
+  }
+
+  void Timing_Monitor::write_json (const std::string &filename) const
+  {
+    Threads::Mutex::ScopedLock lock(mutex);
+    std::ofstream file(filename.c_str());
+    if (!file.is_open())
+      {
+	std::cout << "Error. The timing file " << filename
+		  << " could not be opened.\n";
+	throw -1;
+      }
+    file << std::scientific << std::setprecision(6)
+	 << "{\n"
+	 << "  \"wall_time\": " << total_timer.wall_time() << ",\n"
+	 << "  \"sections\": {";
+    for (std::map<std::string,std::pair<unsigned int,double> >::const_iterator
+	   section=sections.begin(); section!=sections.end(); ++section)
+      file << (section==sections.begin() ? "\n" : ",\n")
+	   << "    \"" << section->first << "\": {\"calls\": "
+	   << section->second.first << ", \"wall_time\": "
+	   << section->second.second << "}";
+    file << "\n  },\n"
+	 << "  \"counters\": {";
+    for (std::map<std::string,unsigned long>::const_iterator
+	   counter=counters.begin(); counter!=counters.end(); ++counter)
+      file << (counter==counters.begin() ? "\n" : ",\n")
+	   << "    \"" << counter->first << "\": " << counter->second;
+    file << "\n  }\n"
+	 << "}\n";
+  }
+
+  /*
+   * Checkpoint files. The refinement history of the mesh is stored as
+   * the refinement tree of the coarse cells in depth-first order, one
+   * entry per cell telling if it has children. Unlike the cell and dof
+   * numbering, this order only depends on the geometry of the mesh, so
+   * the nodal values are stored per active cell in the same order.
+   */
+  namespace Checkpoint
+  {
+    const unsigned int version=2;
+
+    template <typename T>
+    void write_value (std::ostream &out, const T &value)
+    {
+      out.write(reinterpret_cast<const char *>(&value),sizeof(T));
+    }
+
+    template <typename T>
+    void read_value (std::istream &in, T &value)
+    {
+      in.read(reinterpret_cast<char *>(&value),sizeof(T));
+    }
+
+    template <class Iterator>
+    void add_to_refinement_tree (const Iterator        &cell,
+				 std::vector<char>     &refinement_tree,
+				 std::vector<Iterator> &active_cells)
+    {
+      refinement_tree.push_back(cell->has_children());
+      if (cell->has_children())
+	for (unsigned int c=0; c<cell->n_children(); ++c)
+	  add_to_refinement_tree(cell->child(c),refinement_tree,active_cells);
+      else
+	active_cells.push_back(cell);
+    }
+
+    bool next_has_children (const std::vector<char> &refinement_tree,
+			    unsigned int            &position)
+    {
+      if (position>=refinement_tree.size())
+	{
+	  std::cout << "Error. The refinement tree of the checkpoint "
+		    << "does not match the mesh.\n";
+	  throw -1;
+	}
+      return (refinement_tree[position++]!=0);
+    }
+
+    void skip_refinement_tree (const std::vector<char> &refinement_tree,
+			       const unsigned int       children_per_cell,
+			       unsigned int            &position)
+    {
+      if (next_has_children(refinement_tree,position))
+	for (unsigned int c=0; c<children_per_cell; ++c)
+	  skip_refinement_tree(refinement_tree,children_per_cell,position);
+    }
+    /*
+     * Flags the active cells that have children in the refinement
+     * tree. Returns false when the mesh already matches the tree.
+     */
+    template <class Iterator>
+    bool flag_refinement_tree (const Iterator          &cell,
+			       const std::vector<char> &refinement_tree,
+			       const unsigned int       children_per_cell,
+			       unsigned int            &position)
+    {
+      if (next_has_children(refinement_tree,position)==false)
+	return false;
+      if (cell->has_children()==false)
+	{
+	  cell->set_refine_flag();
+	  for (unsigned int c=0; c<children_per_cell; ++c)
+	    skip_refinement_tree(refinement_tree,children_per_cell,position);
+	  return true;
+	}
+      bool flagged=false;
+      for (unsigned int c=0; c<cell->n_children(); ++c)
+	flagged=flag_refinement_tree(cell->child(c),refinement_tree,
+				     children_per_cell,position)||flagged;
+      return flagged;
+    }
+    /*
+     * Refines the coarse mesh until it matches the refinement tree,
+     * one level per pass
+     */
+    template <int dim>
+    void apply_refinement_tree (Triangulation<dim>      &triangulation,
+				const std::vector<char> &refinement_tree)
+    {
+      bool flagged=true;
+      while (flagged)
+	{
+	  flagged=false;
+	  unsigned int position=0;
+	  for (typename Triangulation<dim>::cell_iterator cell=triangulation.begin(0);
+	       cell!=triangulation.end(0); ++cell)
+	    flagged=flag_refinement_tree(cell,refinement_tree,
+					 GeometryInfo<dim>::max_children_per_cell,
+					 position)||flagged;
+	  if (flagged)
+	    triangulation.execute_coarsening_and_refinement();
+	}
+    }
+    /*
+     * 64 bit FNV-1a hash, the key of the mesh cache
+     */
+    unsigned long long hash_string (const std::string &text)
+    {
+      unsigned long long hash=14695981039346656037ULL;
+      for (unsigned int i=0; i<text.size(); ++i)
+	{
+	  hash^=(unsigned char)text[i];
+	  hash*=1099511628211ULL;
+	}
+      return (hash);
+    }
+  }
+
+  /*
+   * The mesh of a run and what only depends on it: the dofs, the
+   * hanging node constraints, the sparsity pattern, the results of
+   * Heat_Pipe::repeated_vertices() and the cached cell geometry. A run
+   * builds its own, except the members of an ensemble without adaptive
+   * refinement, which read the one of the first member with the same
+   * mesh (see Shared_Meshes).
+   */
+  template <int dim>
+  struct Mesh_Data
+  {
+    Mesh_Data ();
+    ~Mesh_Data ();
+
+    Triangulation<dim> triangulation;
+    /*
+     * The element of dof_handler, it lives as long as the dofs do
+     */
+    FE_Q<dim>          fe;
+    DoFHandler<dim>    dof_handler;
+    ConstraintMatrix   hanging_node_constraints;
+    SparsityPattern    sparsity_pattern;
+    Vector<double>     boundary_ids;
+    Vector<double>     dof_valence;//number of cells sharing each dof
+    // Cached cell geometry for the flow and transport quadratures
+    Assembly::Geometry<dim> flow_geometry;
+    Assembly::Geometry<dim> transport_geometry;
+  };
+
+  template <int dim>
+  Mesh_Data<dim>::Mesh_Data ()
+    :
+    fe(1),
+    dof_handler(triangulation)
+  {}
+
+  template <int dim>
+  Mesh_Data<dim>::~Mesh_Data ()
+  {
+    dof_handler.clear ();
+  }
+  /*
+   * The meshes shared by the members of an ensemble, one per key (see
+   * Heat_Pipe::shared_mesh_key()). The first member that asks for a
+   * mesh builds it while it holds the mutex of the entry, the others
+   * wait for it and only read the result. If the first member fails
+   * the entry stays empty and the next one builds it.
+   */
+  template <int dim>
+  class Shared_Meshes
+  {
+  public:
+    struct Entry
+    {
+      Threads::Mutex                         mutex;
+      std::shared_ptr<const Mesh_Data<dim> > mesh_data;
+    };
+    Entry &entry (const unsigned long long key);
+
+  private:
+    Threads::Mutex                      mutex;
+    std::map<unsigned long long,Entry> entries;
+  };
+
+  template <int dim>
+  typename Shared_Meshes<dim>::Entry &
+  Shared_Meshes<dim>::entry (const unsigned long long key)
+  {
+    Threads::Mutex::ScopedLock lock(mutex);
+    return (entries[key]);
+  }
+
+  template <int dim>
+  class Heat_Pipe
+  {
+  public:
+    Heat_Pipe(int argc, char *argv[],
+	      const std::vector<std::string> &parameter_overrides=
+	      std::vector<std::string>(),
+	      Shared_Meshes<dim> *shared_meshes_=0);
+    ~Heat_Pipe();
+    void run();
+
+  private:
+    /*
+     * Nodal values of a field on one cell. The element is FE_Q(1), so
+     * there is exactly one dof per vertex and the cell kernels can keep
+     * these on the stack instead of reallocating a Vector per cell
+     */
+    typedef std::array<double,GeometryInfo<dim>::vertices_per_cell> Cell_Values;
+    /*
+     * Contributions of a cell without biomass to the nodal properties,
+     * together with the pressures they were computed from. See
+     * calculate_mass_balance_ratio()
+     */
+    struct Cell_Property_Cache
+    {
+      Cell_Property_Cache () : valid (false) {}
+
+      bool        valid;
+      Cell_Values old_pressure;
+      Cell_Values new_pressure;
+      Cell_Values free_saturation;
+      Cell_Values hydraulic_conductivity;
+      Cell_Values total_moisture_content;
+      Cell_Values free_moisture_content;
+      Cell_Values moisture_capacity;
+    };
+
+    void read_grid();
+    void refine_grid(const unsigned int refinement_mode);
+    void create_initial_mesh();
+    bool share_mesh() const;
+    unsigned long long shared_mesh_key() const;
+    Quadrature<dim> flow_quadrature() const;
+    void distribute_dofs();
+    void setup_system();
+    void initial_condition();
+    void initial_condition_biomass();
+    void assemble_system_flow();
+    void local_assemble_system_flow(const typename DoFHandler<dim>::active_cell_iterator &cell,
+				    Assembly::Scratch::Flow<dim> &scratch,
+				    Assembly::CopyData::Flow<dim> &data);
+    void copy_local_to_global_flow(const Assembly::CopyData::Flow<dim> &data);
+    void assemble_system_flow_matrix_free();
+    void local_assemble_rhs_flow_matrix_free(const MatrixFree<dim,double>               &data,
+					     Vector<double>                             &dst,
+					     const Vector<double>                       &src,
+					     const std::pair<unsigned int,unsigned int> &cell_range) const;
+    void solve_system_flow_matrix_free();
+    void assemble_system_transport();
+    void local_assemble_system_transport(const typename DoFHandler<dim>::active_cell_iterator &cell,
+					 Assembly::Scratch::Transport<dim> &scratch,
+					 Assembly::CopyData::Transport<dim> &data);
+    void copy_local_to_global_transport(const Assembly::CopyData::Transport<dim> &data);
+    Assembly::Transport_Cell_Coefficients<dim>
+    transport_cell_coefficients(const unsigned int cell_index,
+				const double       cell_diameter,
+				const double       porosity,
+				Tensor<1,dim>      new_velocity,
+				Tensor<1,dim>      old_velocity) const;
+    void set_transport_cell_coefficients(const unsigned int                               cell_index,
+					 const Assembly::Transport_Cell_Coefficients<dim> &coefficients);
+    void assemble_system_transport_matrix_free();
+    void solve_system_flow();
+    double compute_flow_residual();
+    double assemble_and_solve_system_flow();
+    void solve_system_transport();
+    template <class MatrixType, class PreconditionerType>
+    void solve_system_transport(SolverControl            &solver_control,
+				const MatrixType         &system_matrix,
+				const PreconditionerType &preconditioner);
+    void output_results();
+    void write_output(const std::string filename,
+		      const std::string pvd_filename,
+		      const double      output_time);
+    void wait_for_output();
+    std::string timing_section(const std::string &name) const;
+    void write_checkpoint(const std::string &filename) const;
+    void read_checkpoint(const std::string &filename);
+    unsigned long long mesh_cache_key() const;
+    std::string mesh_cache_filename() const;
+    void write_mesh(std::ostream &file) const;
+    bool read_mesh(std::istream &file);
+    bool read_mesh_cache();
+    void write_mesh_cache() const;
+    void print_info(unsigned int iteration,
+		    double rel_err_flow,
+		    double rel_err_tran) const;
+    void calculate_mass_balance_ratio();
+    template <class ModelType>
+    void calculate_mass_balance_ratio_kernel();
+    void calculate_boundary_flows(const bool water_flows,
+				  const bool nutrient_flows);
+    void calculate_biomass_in_domain();
+    double estimate_time_step_error() const;
+    void time_step_bounds(double &minimum_time_step,
+			  double &maximum_time_step) const;
+    void hydraulic_properties(double pressure_head,
+			      double &specific_moisture_capacity,
+			      double &hydraulic_conductivity,
+			      double &actual_total_moisture_content,
+			      double &actual_free_water_moisture_content,
+			      std::string hydraulic_properties,
+			      double biomass_concentration=0,
+			      bool stop_bacterial_growth=false);
+    void repeated_vertices();
+    void setup_hydraulic_properties();
+
+    /*
+     * mesh is what the run reads. own_mesh is the same object, through
+     * which the run builds and changes it, unless the run reads the
+     * mesh of an ensemble member (see share_mesh()), then it is empty
+     */
+    std::shared_ptr<Mesh_Data<dim> >       own_mesh;
+    std::shared_ptr<const Mesh_Data<dim> > mesh;
+    Shared_Meshes<dim>                    *shared_meshes;
+    FE_Q<dim>                              fe;
+
+    // Richards' equation variables
+    SparseMatrix<double> system_matrix_flow;
+    SparseMatrix<double> mass_matrix_richards;
+    SparseMatrix<double> laplace_matrix_new_richards;
+    SparseMatrix<double> laplace_matrix_old_richards;
+    Vector<double>       system_rhs_flow;
+    Vector<double>       solution_flow_new_iteration;
+    Vector<double>       solution_flow_old_iteration;
+    Vector<double>       old_solution_flow;
+#ifdef DEAL_II_WITH_TRILINOS
+    TrilinosWrappers::SparseMatrix    system_matrix_flow_trilinos;
+    TrilinosWrappers::PreconditionAMG flow_amg_preconditioner;
+#endif
+#ifdef DEAL_II_WITH_UMFPACK
+    Direct_Solver flow_direct_solver;
+    Direct_Solver transport_direct_solver;
+#endif
+    /*
+     * flow operator=matrix_free: the system matrix is the operator, the
+     * flow matrices above are not allocated. The first kind boundaries
+     * and the hanging nodes are in flow_constraints, which only changes
+     * with the mesh and when the top is fixed or released.
+     */
+    bool                   matrix_free_flow;
+    Richards_Operator<dim> richards_operator;
+    ConstraintMatrix       flow_constraints;
+    Vector<double>         system_residual_flow;
+    bool                   rebuild_richards_operator;
+    bool                   richards_operator_top_fixed;
+    Anderson_Acceleration flow_anderson_acceleration;
+    bool         rebuild_flow_preconditioner;
+    unsigned int flow_preconditioner_reference_iterations;
+    unsigned int flow_solver_iterations;
+    // Substrate variables
+    SparseMatrix<double> system_matrix_transport;
+    SparseMatrix<double> mass_matrix_transport_new;
+    SparseMatrix<double> mass_matrix_transport_old;
+    SparseMatrix<double> laplace_matrix_new_transport;
+    SparseMatrix<double> laplace_matrix_old_transport;
+    Vector<double>       system_rhs_transport;
+    Vector<double>       solution_transport;
+    Vector<double>       old_solution_transport;
+    Vector<double>       older_solution_flow;
+    Vector<double>       older_solution_transport;
+    SparseILU<double>    transport_ilu_preconditioner;
+    SparseMIC<double>    transport_mic_preconditioner;
+    bool                 rebuild_transport_preconditioner;
+    unsigned int         transport_solver_iterations;
+    double               transport_solver_residual;
+    /*
+     * transport operator=matrix_free: the system matrix is the
+     * operator, the transport matrices above and the transport geometry
+     * cache are not allocated
+     */
+    bool                    matrix_free_transport;
+    Transport_Operator<dim> transport_operator;
+    bool                    rebuild_transport_operator;
+    
     unsigned int timestep_number_max;
     unsigned int timestep_number;
     unsigned int refinement_level;
     double       time;
     double       time_step;
+    double       old_time_step;
+    double       time_step_error;
+    double       old_time_step_error;
+    bool         time_step_history;
     double       time_max;
     double       theta_richards;
     double       theta_transport;
@@ -529,6 +3041,10 @@ namespace TRL
     std::string  parameters_filename;
     bool use_mesh_file;
     bool solve_flow;
+    bool frozen_stop_flow;
+    unsigned int flow_frozen_timestep;
+    std::vector<Tensor<1,dim> > frozen_velocity;
+    std::vector<Assembly::Transport_Cell_Coefficients<dim> > transport_coefficients;
 
     double milestone_time;
     double time_for_dry_conditions;
@@ -537,27 +3053,22 @@ namespace TRL
     bool transient_saturation;
     bool transient_transport;
     bool activate_transport;
+    /*
+     * Options of the input file that are used inside the cell loops,
+     * resolved once in the constructor
+     */
+    bool head_equation;
+    bool transport_mass_entry_at_top;
+    bool transport_mass_entry_at_bottom;
     bool test_transport;
     bool coupled_transport;
     
-    Vector<double> old_nodal_biomass_concentration;
-    Vector<double> new_nodal_biomass_concentration;
-    Vector<double> old_nodal_biomass_fraction;
-    Vector<double> new_nodal_biomass_fraction;    
-    Vector<double> old_nodal_total_moisture_content;
-    Vector<double> new_nodal_total_moisture_content;
-    Vector<double> old_nodal_free_moisture_content;
-    Vector<double> new_nodal_free_moisture_content;
-    Vector<double> old_nodal_hydraulic_conductivity;
-    Vector<double> new_nodal_hydraulic_conductivity;
-    Vector<double> old_nodal_specific_moisture_capacity;
-    Vector<double> new_nodal_specific_moisture_capacity;
-    Vector<double> old_nodal_free_saturation;
-    Vector<double> new_nodal_free_saturation;
-    Vector<double> boundary_ids;
+    Nodal_Properties old_nodal;
+    Nodal_Properties new_nodal;
     Vector<double> velocity_x;
     Vector<double> velocity_y;
-    std::vector<std::vector<double> > average_hydraulic_conductivity_vector;
+    Vector<double> velocity_z;
+    Time_Series_Writer output_data;
     Parameters::AllParameters<dim>  parameters;
 
     unsigned int figure_count;
@@ -579,56 +3090,139 @@ namespace TRL
     double cumulative_flow_at_bottom;
     double biomass_in_domain_previous;
     double biomass_in_domain_current;
-    std::map<unsigned int,double> repeated_points;
+    std::vector<Hydraulic_Properties> material_hydraulic_properties;
+    /*
+     * calculate_mass_balance_ratio_kernel() instantiated for the models
+     * of the input file, selected in the constructor
+     */
+    void (Heat_Pipe<dim>::*mass_balance_kernel)();
+    Monod_Kinetics biomass_kinetics;
+    std::vector<unsigned char>       reaction_active_cells;
+    std::vector<Cell_Property_Cache> cell_property_cache;
     std::vector<typename DoFHandler<dim>::active_cell_iterator> prerefinement_cells;
+    double       last_adaptation_time;
+    unsigned int last_adaptation_timestep;
+    /*
+     * Copies of the output vectors, written by write_output() while
+     * the time stepping goes on. The first n_output_dof_vectors are
+     * nodal, the rest cell data.
+     */
+    std::vector<Vector<double> > output_vectors;
+    std::vector<std::string>     output_names;
+    unsigned int                 n_output_dof_vectors;
+    std::vector<std::pair<double,std::string> > output_records;
+    Threads::Task<>              output_task;
+    bool                         output_in_task;
+    /*
+     * Sections and counters are named after the period of the
+     * simulation, see timing_section()
+     */
+    Timing_Monitor timing_monitor;
+    /*
+     * The terminal output of the run, std::cout unless it is sent to
+     * the log file (see the "log to file" parameter). Mutable, the
+     * const members print too
+     */
+    std::ofstream        log_file;
+    mutable std::ostream terminal;
   };
 
   template<int dim>
-  Heat_Pipe<dim>::Heat_Pipe(int argc, char *argv[])
+  Heat_Pipe<dim>::Heat_Pipe(int argc, char *argv[],
+			    const std::vector<std::string> &parameter_overrides,
+			    Shared_Meshes<dim>             *shared_meshes_)
     :
-    dof_handler(triangulation),
-    fe(1)
+    own_mesh(new Mesh_Data<dim>()),
+    mesh(own_mesh),
+    shared_meshes(shared_meshes_),
+    fe(1),
+    terminal(std::cout.rdbuf())
   {
-    std::cout << "Program run with the following arguments:\n";
-    if (argc!=3)
+    /*
+     * The dimensions are optional, main() uses 2 if they are not given
+     */
+    if (argc<2 || argc>5)
       {
+	std::cout << "Program run with the following arguments:\n";
 	for (int i=0; i<argc; i++)
 	  std::cout << "arg " << i << " : " << argv[i] << "\n";
 	std::cout << "Error, wrong number of arguments passed to the program.\n"
-		  << "Expected input: 'program name' 'input parameter file'\n";
-
-      }
-    else
-      {
-	std::cout << "Program name        : " << argv[0] << "\n";
-	std::cout << "Input parameter file: " << argv[1] << "\n";
-	std::cout << "Dimensions          : " << argv[2] << "\n\n";
+		  << "Expected input: 'program name' 'input parameter file' "
+		  << "['dimensions' ['ensemble file' ['members in parallel']]]\n";
+	throw -1;
       }
 
     parameters_filename = argv[1];
-    std::cout << "parameter file: " << parameters_filename << "\n";
     std::ifstream inFile;
     inFile.open(parameters_filename.c_str());
     
     ParameterHandler prm;
     Parameters::AllParameters<dim>::declare_parameters (prm);
     prm.parse_input(inFile,parameters_filename);
+    for (unsigned int i=0; i<parameter_overrides.size(); ++i)
+      Parameters::AllParameters<dim>::set_parameter(prm,parameter_overrides[i]);
     parameters.parse_parameters(prm);
+    /*
+     * From here on the output of the run goes to its own log file if
+     * asked for, e.g. for the members of an ensemble, which run at the
+     * same time
+     */
+    if (parameters.log_to_file==true)
+      {
+	const std::string log_filename=parameters.diagnostics_prefix+"log.txt";
+	log_file.open(log_filename.c_str());
+	if (!log_file.is_open())
+	  {
+	    std::cout << "Error. The log file " << log_filename
+		      << " could not be opened.\n";
+	    throw -1;
+	  }
+	terminal.rdbuf(log_file.rdbuf());
+      }
+
+    terminal << "Program run with the following arguments:\n";
+    terminal << "Program name        : " << argv[0] << "\n";
+    terminal << "Input parameter file: " << argv[1] << "\n";
+    if (argc>2)
+      terminal << "Dimensions          : " << argv[2] << "\n";
+    if (argc>3)
+      terminal << "Ensemble file       : " << argv[3] << "\n";
+    for (unsigned int i=0; i<parameter_overrides.size(); ++i)
+      terminal << "Parameter override  : " << parameter_overrides[i] << "\n";
+    terminal << "\n";
+    terminal << "parameter file: " << parameters_filename << "\n";
 
     theta_richards      = parameters.theta_richards;
     theta_transport     = parameters.theta_transport;
     timestep_number_max = parameters.timestep_number_max;
     time_step           = parameters.time_step;
+    old_time_step       = time_step;
+    time_step_error     = 0.;
+    old_time_step_error = 0.;
+    time_step_history   = false;
     time_max            = time_step*timestep_number_max;
     refinement_level    = parameters.refinement_level;
     use_mesh_file       = parameters.use_mesh_file;
     mesh_filename       = parameters.mesh_filename;
     test_transport      = parameters.test_function_transport;
     coupled_transport   = parameters.coupled_transport;
+
+    Monod_Kinetics::Species biomass_species;
+    biomass_species.yield_coefficient         =parameters.yield_coefficient;
+    biomass_species.maximum_substrate_use_rate=parameters.maximum_substrate_use_rate;
+    biomass_species.half_velocity_constant    =parameters.half_velocity_constant;
+    biomass_species.decay_rate                =parameters.decay_rate;
+    biomass_kinetics.add_species(biomass_species);
     
     timestep_number=0;
     time=0;
     solve_flow                   =true;
+    last_adaptation_time         =0.;
+    last_adaptation_timestep     =0;
+    n_output_dof_vectors         =0;
+    output_in_task               =false;
+    frozen_stop_flow             =true;
+    flow_frozen_timestep         =0;
     milestone_time               =0;
     time_for_dry_conditions      =0;
     time_for_saturated_conditions=0;
@@ -654,6 +3248,116 @@ namespace TRL
     biomass_in_domain_previous=0.;
     biomass_in_domain_current=0.;
 
+    flow_anderson_acceleration.reinit(parameters.anderson_depth);
+    /*
+     * automatic: matrix-free in 3D, where the assembled matrices take
+     * most of the memory, unless the solver or the preconditioner asked
+     * for needs them
+     */
+    matrix_free_flow                        =
+      (parameters.flow_operator.compare("matrix_free")==0 ||
+       (parameters.flow_operator.compare("automatic")==0 && dim==3 &&
+	parameters.flow_solver.compare("cg")==0 &&
+	parameters.flow_preconditioner.compare("amg")!=0));
+    matrix_free_transport                   =
+      (parameters.transport_operator.compare("matrix_free")==0 ||
+       (parameters.transport_operator.compare("automatic")==0 && dim==3 &&
+	parameters.transport_solver.compare("direct")!=0 &&
+	parameters.transport_preconditioner.compare("jacobi")==0));
+    rebuild_transport_operator              =true;
+    rebuild_richards_operator               =true;
+    richards_operator_top_fixed             =false;
+    rebuild_flow_preconditioner             =true;
+    flow_preconditioner_reference_iterations=0;
+    flow_solver_iterations                  =0;
+    rebuild_transport_preconditioner        =true;
+    transport_solver_iterations             =0;
+    transport_solver_residual               =0.;
+    /*
+     * The distributed mode is not implemented yet: the mesh, the
+     * matrices and the vectors are not distributed, so every process
+     * would run the whole (identical) problem and write the same files.
+     */
+    if (Utilities::MPI::n_mpi_processes(MPI_COMM_WORLD)>1)
+      {
+	terminal << "Error. Heat_Pipe runs on a single process, "
+		 << "use threads instead of MPI processes.\n";
+	throw -1;
+      }
+#ifndef DEAL_II_WITH_UMFPACK
+    if (parameters.flow_solver.compare("direct")==0 ||
+	parameters.transport_solver.compare("direct")==0)
+      {
+	terminal << "Error. The direct solver requires "
+		 << "deal.II configured with UMFPACK.\n";
+	throw -1;
+      }
+#endif
+    if (matrix_free_flow && parameters.flow_solver.compare("direct")==0)
+      {
+	terminal << "Error. The direct flow solver needs the assembled "
+		 << "matrix, use cg with the matrix_free flow operator.\n";
+	throw -1;
+      }
+    if (matrix_free_transport &&
+	(parameters.transport_solver.compare("direct")==0 ||
+	 parameters.transport_preconditioner.compare("jacobi")!=0))
+      {
+	terminal << "Error. The direct transport solver and the ilu and mic "
+		 << "preconditioners need the assembled matrix, use bicgstab "
+		 << "or gmres and jacobi with the matrix_free transport operator.\n";
+	throw -1;
+      }
+#ifndef DEAL_II_WITH_TRILINOS
+    if (parameters.flow_preconditioner.compare("amg")==0 &&
+	matrix_free_flow==false)
+      {
+	terminal << "Error. The amg flow preconditioner requires "
+		 << "deal.II configured with Trilinos.\n";
+	throw -1;
+      }
+#endif
+
+    if (parameters.moisture_transport_equation.compare("head")!=0 &&
+	parameters.moisture_transport_equation.compare("mixed")!=0)
+      {
+	terminal << "Moisture transport equation \""
+		 << parameters.moisture_transport_equation
+		 << "\" is not implemented. Error.\n";
+	throw -1;
+      }
+    head_equation=
+      (parameters.moisture_transport_equation.compare("head")==0);
+    /*
+     * All the materials use the same constitutive and relative
+     * permeability models, so the hydraulic properties kernel is chosen
+     * once here instead of testing the models at every vertex
+     */
+    typedef Hydraulic_Properties HP;
+    const HP::Constitutive_Model constitutive_model=
+      HP::constitutive_model_from_name(parameters.hydraulic_properties);
+    const HP::Relative_Permeability_Model relative_permeability_model=
+      HP::relative_permeability_model_from_name(parameters.relative_permeability_model);
+    if (constitutive_model==HP::haverkamp_et_al_1977)
+      mass_balance_kernel=&Heat_Pipe<dim>::template
+	calculate_mass_balance_ratio_kernel<HP::Model<HP::haverkamp_et_al_1977> >;
+    else if (relative_permeability_model==HP::clement)
+      mass_balance_kernel=&Heat_Pipe<dim>::template
+	calculate_mass_balance_ratio_kernel<HP::Model<HP::van_genuchten_1980,HP::clement> >;
+    else if (relative_permeability_model==HP::okubo_and_matsumoto)
+      mass_balance_kernel=&Heat_Pipe<dim>::template
+	calculate_mass_balance_ratio_kernel<HP::Model<HP::van_genuchten_1980,HP::okubo_and_matsumoto> >;
+    else if (relative_permeability_model==HP::vandevivere)
+      mass_balance_kernel=&Heat_Pipe<dim>::template
+	calculate_mass_balance_ratio_kernel<HP::Model<HP::van_genuchten_1980,HP::vandevivere> >;
+    else
+      mass_balance_kernel=&Heat_Pipe<dim>::template
+	calculate_mass_balance_ratio_kernel<HP::Model<HP::van_genuchten_1980,HP::soleimani> >;
+    transport_mass_entry_at_top=
+      (parameters.transport_mass_entry_point.compare("top")==0);
+    transport_mass_entry_at_bottom=
+      (parameters.transport_mass_entry_point.compare("bottom")==0);
+
     if (parameters.initial_state.compare("default")==0 ||
 	parameters.initial_state.compare("final")==0)
       {
@@ -681,9 +3385,9 @@ namespace TRL
       }
     else
       {
-	std::cout << "Wrong initial state specified in input file."
-		  << "\"" << parameters.initial_state << "\" is not a valid "
-		  << "parameter.";
+	terminal << "Wrong initial state specified in input file."
+		 << "\"" << parameters.initial_state << "\" is not a valid "
+		 << "parameter.";
 	throw 1;
       }
   }
@@ -691,19 +3395,22 @@ namespace TRL
   template<int dim>
   Heat_Pipe<dim>::~Heat_Pipe()
   {
-    dof_handler.clear ();
+    wait_for_output();
   }
 
   template <int dim>
   void Heat_Pipe<dim>::calculate_mass_balance_ratio()
   {
-    new_nodal_biomass_concentration.reinit (dof_handler.n_dofs());
-    new_nodal_biomass_fraction.reinit      (dof_handler.n_dofs());
-    new_nodal_hydraulic_conductivity.reinit(dof_handler.n_dofs());
-    new_nodal_total_moisture_content.reinit(dof_handler.n_dofs());
-    new_nodal_free_moisture_content.reinit (dof_handler.n_dofs());
-    new_nodal_specific_moisture_capacity.reinit(dof_handler.n_dofs());
-    new_nodal_free_saturation.reinit       (dof_handler.n_dofs());
+    (this->*mass_balance_kernel)();
+  }
+
+  template <int dim>
+  template <class ModelType>
+  void Heat_Pipe<dim>::calculate_mass_balance_ratio_kernel()
+  {
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("mass balance"));
+    new_nodal.reinit(mesh->dof_handler.n_dofs());
     
     QGauss<dim>quadrature_formula(2);
     FEValues<dim>fe_values(fe, quadrature_formula,
@@ -714,146 +3421,189 @@ namespace TRL
     const unsigned int n_q_points   =quadrature_formula.size();
     std::vector<unsigned int> local_dof_indices(fe.dofs_per_cell);
     
-    Vector<double> cell_biomass_concentration(dofs_per_cell);
-    Vector<double> cell_biomass_fraction     (dofs_per_cell);
-    Vector<double> cell_hydraulic_conductivity(dofs_per_cell);
-    Vector<double> cell_total_moisture_content(dofs_per_cell);
-    Vector<double> cell_free_moisture_content(dofs_per_cell);
-    Vector<double> cell_moisture_capacity(dofs_per_cell);
-    Vector<double> cell_free_saturation(dofs_per_cell);
-    Vector<double> cell_factors(dofs_per_cell);
-
-    Vector<double> old_biomass_concentration;
-    
-    Vector<double> old_transport_values;
-    Vector<double> new_transport_values;
-    Vector<double> new_pressure_values_old_iteration;
-    Vector<double> old_pressure_values;
-    
+    Cell_Values cell_biomass_concentration;
+    Cell_Values cell_biomass_fraction;
+    Cell_Values cell_hydraulic_conductivity;
+    Cell_Values cell_total_moisture_content;
+    Cell_Values cell_free_moisture_content;
+    Cell_Values cell_moisture_capacity;
+    Cell_Values cell_free_saturation;
+    Cell_Values cell_factors;
+
+    Cell_Values old_biomass_concentration;
+    Cell_Values new_pressure_values_old_iteration;
+    /*
+     * The free saturation and the substrate at the vertices of every
+     * cell are gathered first, so the reaction kernel computes all the
+     * biomass growth factors in one pass over contiguous arrays. The
+     * saturation depends on the material of the cell, so there is one
+     * entry per cell vertex and not per dof.
+     *
+     * The biomass only grows where there is biomass already, so with
+     * the activity mask the kernel only runs on the vertices of the
+     * cells with biomass (reaction_active_cells). The properties of
+     * the other cells only depend on their pressures. They are cached
+     * and reused while these pressures do not change, e.g. while the
+     * flow is frozen in the transport phase.
+     */
+    const unsigned int n_cells=mesh->triangulation.n_active_cells();
+    const unsigned int vertices_per_cell=GeometryInfo<dim>::vertices_per_cell;
+    const unsigned int n_cell_vertices=n_cells*vertices_per_cell;
+    std::vector<double> free_saturation(n_cell_vertices);
+    std::vector<double> growth_factor(n_cell_vertices,1.);
+    std::vector<double> reaction_saturation;
+    std::vector<double> reaction_substrate;
+    std::vector<double> reaction_growth_factor;
+    std::vector<unsigned int> reaction_cells;
+    std::vector<unsigned char> use_cache(n_cells,0);
+    if (reaction_active_cells.size()!=n_cells)
+      reaction_active_cells.assign(n_cells,1);
+    if (cell_property_cache.size()!=n_cells)
+      cell_property_cache.assign(n_cells,Cell_Property_Cache());
+
     typename DoFHandler<dim>::active_cell_iterator
-      cell = dof_handler.begin_active(),
-      endc = dof_handler.end();
-    for (; cell!=endc; ++cell)
+      cell = mesh->dof_handler.begin_active(),
+      endc = mesh->dof_handler.end();
+    for (unsigned int cell_index=0; cell!=endc; ++cell, ++cell_index)
       {
-	fe_values.reinit (cell);
 	cell->get_dof_indices(local_dof_indices);
+	bool active=(parameters.reaction_activity_mask==false);
+	for (unsigned int i=0; i<vertices_per_cell; ++i)
+	  if (old_nodal.biomass_concentration(local_dof_indices[i])!=0.)
+	    active=true;
+	reaction_active_cells[cell_index]=active;
+
+	const Cell_Property_Cache &cache=cell_property_cache[cell_index];
+	if (active==false && cache.valid==true)
+	  {
+	    bool same_pressures=true;
+	    for (unsigned int i=0; i<vertices_per_cell; ++i)
+	      if (cache.old_pressure[i]!=old_solution_flow(local_dof_indices[i]) ||
+		  cache.new_pressure[i]!=solution_flow_old_iteration(local_dof_indices[i]))
+		same_pressures=false;
+	    if (same_pressures==true)
+	      {
+		use_cache[cell_index]=1;
+		continue;
+	      }
+	  }
 
-	cell_biomass_concentration=0.;
-	cell_biomass_fraction=0.;
-	cell_hydraulic_conductivity=0.;
-	cell_total_moisture_content=0.;
-	cell_free_moisture_content=0.;
-	cell_moisture_capacity=0.;
-	cell_free_saturation=0.;
-	cell_factors=0.;
-	
-	old_biomass_concentration
-	  .reinit(cell->get_fe().dofs_per_cell);
-	new_pressure_values_old_iteration
-	  .reinit(cell->get_fe().dofs_per_cell);
-	old_pressure_values
-	  .reinit(cell->get_fe().dofs_per_cell);
-	old_transport_values
-	  .reinit(cell->get_fe().dofs_per_cell);
-	new_transport_values
-	  .reinit(cell->get_fe().dofs_per_cell);
+	const Hydraulic_Properties &hydraulic_properties=
+	  material_hydraulic_properties[cell->material_id()];
+	for (unsigned int i=0; i<vertices_per_cell; ++i)
+	  {
+	    const unsigned int dof=local_dof_indices[i];
+	    free_saturation[cell_index*vertices_per_cell+i]=
+	      hydraulic_properties
+	      .effective_free_saturation<ModelType>(old_solution_flow(dof),
+						    old_nodal.biomass_concentration(dof),
+						    parameters.biomass_dry_density);
+	  }
+	if (active==true)
+	  {
+	    reaction_cells.push_back(cell_index);
+	    for (unsigned int i=0; i<vertices_per_cell; ++i)
+	      {
+		const unsigned int dof=local_dof_indices[i];
+		reaction_saturation.push_back(free_saturation[cell_index*vertices_per_cell+i]);
+		if (old_solution_transport(dof)>1.E-1)
+		  reaction_substrate.push_back(old_solution_transport(dof));
+		else
+		  reaction_substrate.push_back(0.);
+	      }
+	  }
+      }
+    if (transient_drying==false && transient_transport==true && reaction_cells.size()>0)
+      {
+	reaction_growth_factor.resize(reaction_saturation.size());
+	biomass_kinetics.growth_factors(0,time_step,reaction_saturation.size(),
+					&reaction_saturation[0],&reaction_substrate[0],
+					&reaction_growth_factor[0]);
+	for (unsigned int c=0; c<reaction_cells.size(); ++c)
+	  for (unsigned int i=0; i<vertices_per_cell; ++i)
+	    growth_factor[reaction_cells[c]*vertices_per_cell+i]=
+	      reaction_growth_factor[c*vertices_per_cell+i];
+      }
+    timing_monitor.add_count(timing_section("reaction active cells"),reaction_cells.size());
+    
+    unsigned int n_cached_cells=0;
+    cell = mesh->dof_handler.begin_active();
+    for (unsigned int cell_index=0; cell!=endc; ++cell, ++cell_index)
+      {
+	cell->get_dof_indices(local_dof_indices);
+	if (use_cache[cell_index]==1)
+	  {
+	    const Cell_Property_Cache &cache=cell_property_cache[cell_index];
+	    for (unsigned int i=0; i<dofs_per_cell; ++i)
+	      {
+		new_nodal.hydraulic_conductivity(local_dof_indices[i])+=cache.hydraulic_conductivity[i];
+		new_nodal.total_moisture_content(local_dof_indices[i])+=cache.total_moisture_content[i];
+		new_nodal.free_moisture_content(local_dof_indices[i])+=cache.free_moisture_content[i];
+		new_nodal.specific_moisture_capacity(local_dof_indices[i])+=cache.moisture_capacity[i];
+		new_nodal.free_saturation(local_dof_indices[i])+=cache.free_saturation[i];
+	      }
+	    n_cached_cells++;
+	    continue;
+	  }
+	fe_values.reinit (cell);
+
+	cell_biomass_concentration.fill(0.);
+	cell_biomass_fraction.fill(0.);
+	cell_hydraulic_conductivity.fill(0.);
+	cell_total_moisture_content.fill(0.);
+	cell_free_moisture_content.fill(0.);
+	cell_moisture_capacity.fill(0.);
+	cell_free_saturation.fill(0.);
+	cell_factors.fill(0.);
 	
-	cell->get_dof_values(solution_flow_old_iteration,
-			     new_pressure_values_old_iteration);
-	cell->get_dof_values(old_solution_flow          ,old_pressure_values);
-	cell->get_dof_values(old_solution_transport     ,old_transport_values);
-	cell->get_dof_values(solution_transport         ,new_transport_values);
-	cell->get_dof_values(old_nodal_biomass_concentration,
-			     old_biomass_concentration);
+	for (unsigned int i=0; i<dofs_per_cell; ++i)
+	  {
+	    const unsigned int dof=local_dof_indices[i];
+	    new_pressure_values_old_iteration[i]=solution_flow_old_iteration(dof);
+	    old_biomass_concentration[i]        =old_nodal.biomass_concentration(dof);
+	  }
 	/*
 	 * We are calculating the contribution of each cell to a vertex
 	 * for this, we need to know how many cells share the same vertex.
-	 * This is done in another function, but here we retrieve this
-	 * information for the current cell's vertices.
+	 * This is counted once per mesh in repeated_vertices(), here we
+	 * retrieve this information for the current cell's vertices.
 	 */
 	for (unsigned int i=0; i<dofs_per_cell; ++i)
-	  {
-	    std::map<unsigned int,double>::iterator it;
-	    it=repeated_points.find(local_dof_indices[i]);
-	    if (it==repeated_points.end())//the point is not in the map
-	      {
-	    	std::cout << "error, point " << std::endl;
-		for (unsigned int p=0; p<dim; p++)
-	    	  std::cout << cell->vertex(i)[p] << " ";
-	    	std::cout << " not in the map" << std::endl;
-	    	throw -1;
-	      }
-	    cell_factors[i]=it->second;
-	  }
+	  cell_factors[i]=mesh->dof_valence(local_dof_indices[i]);
 	
-	Saturated_Properties<dim>
-	  saturated_properties(parameters);
+	const Hydraulic_Properties &hydraulic_properties=
+	  material_hydraulic_properties[cell->material_id()];
 	/*
 	 * In this first loop I calculate biomass content
 	 * and variables that don't depend on biomass
 	 */
 	for (unsigned int i=0; i<dofs_per_cell; ++i)
 	  {
-	    //Point<dim> vertex_point=cell->vertex(i);
-	    Hydraulic_Properties
-	      hydraulic_properties(parameters.hydraulic_properties,
-				   saturated_properties.moisture_content(/*vertex_point,*/
-									 cell->material_id()),
-				   parameters.moisture_content_residual,
-				   saturated_properties.hydraulic_conductivity(/*vertex_point,*/
-									       cell->material_id()),
-				   parameters.van_genuchten_alpha,
-				   parameters.van_genuchten_n);
-	    
-	    double effective_saturation_free=
-	      hydraulic_properties
-	      .get_effective_free_saturation(old_pressure_values[i],
-	    				     old_biomass_concentration[i],
-	    				     parameters.biomass_dry_density);
-	    cell_free_saturation(i)+=
+	    cell_free_saturation[i]+=
 	      (1./cell_factors[i])*
-	      effective_saturation_free;
+	      free_saturation[cell_index*vertices_per_cell+i];
 	    
 	    if (transient_drying==false)//biomass growth calculation
 	      {
-	    	double old_substrate=0;
-	    	if (old_transport_values[i]>1.E-1)
-	    	  old_substrate=
-		    old_transport_values[i];
-		
-		if (transient_transport==true)
-		  {
-		    cell_biomass_concentration(i)+=
-		      (1./cell_factors[i])*
-		      old_biomass_concentration(i)
-		      *
-		      exp((parameters.yield_coefficient*parameters.maximum_substrate_use_rate*
-			   effective_saturation_free*old_substrate/
-			   (effective_saturation_free*old_substrate
-			    +parameters.half_velocity_constant/1000.)
-			   -parameters.decay_rate)*time_step);
-		  }
-		else
-		  {
-		    cell_biomass_concentration(i)+=
-		      (1./cell_factors[i])*
-		      old_biomass_concentration(i);
-		  }
+		cell_biomass_concentration[i]+=
+		  (1./cell_factors[i])*
+		  old_biomass_concentration[i]*
+		  growth_factor[cell_index*vertices_per_cell+i];
 		
-	    	cell_biomass_fraction(i)+=
-	    	  cell_biomass_concentration(i)/
+	    	cell_biomass_fraction[i]+=
+	    	  cell_biomass_concentration[i]/
 	    	  parameters.biomass_dry_density;
 	      }
 	    
-	    cell_total_moisture_content(i)+=
+	    cell_total_moisture_content[i]+=
 	      (1./cell_factors[i])*
 	      hydraulic_properties
-	      .get_moisture_content_total(new_pressure_values_old_iteration[i]);
+	      .moisture_content_total<ModelType>(new_pressure_values_old_iteration[i]);
 	    
-	    cell_moisture_capacity(i)+=
+	    cell_moisture_capacity[i]+=
 	      (1./cell_factors[i])*
 	      hydraulic_properties
-	      .get_specific_moisture_capacity(new_pressure_values_old_iteration[i]);
+	      .specific_moisture_capacity<ModelType>(new_pressure_values_old_iteration[i]);
 	  }
 	/*
 	 * The next loop calculates the amount of biomass present in
@@ -884,56 +3634,376 @@ namespace TRL
 	 */
 	for (unsigned int i=0; i<GeometryInfo<dim>::vertices_per_cell; i++)
 	  {
-	    //Point<dim> vertex_point=cell->vertex(i);
-	    Hydraulic_Properties
-	      hydraulic_properties(parameters.hydraulic_properties,
-				   saturated_properties.moisture_content(/*vertex_point,*/
-									 cell->material_id()),
-				   parameters.moisture_content_residual,
-				   saturated_properties.hydraulic_conductivity(/*vertex_point,*/
-									       cell->material_id()),
-				   parameters.van_genuchten_alpha,
-				   parameters.van_genuchten_n);
-	    cell_hydraulic_conductivity(i)+=
+	    cell_hydraulic_conductivity[i]+=
 	      (1./cell_factors[i])*
 	      hydraulic_properties
-	      .get_hydraulic_conductivity(new_pressure_values_old_iteration[i],
-	    				  new_biomass_in_cell,
-	    				  parameters.biomass_dry_density,
-	    				  parameters.relative_permeability_model);
-	    cell_free_moisture_content(i)+=
+	      .hydraulic_conductivity<ModelType>(new_pressure_values_old_iteration[i],
+						 new_biomass_in_cell,
+						 parameters.biomass_dry_density);
+	    cell_free_moisture_content[i]+=
 	      (1./cell_factors[i])*
 	      hydraulic_properties
-	      .get_moisture_content_free(new_pressure_values_old_iteration[i],
-					 new_biomass_in_cell,
-					 parameters.biomass_dry_density);
+	      .moisture_content_free<ModelType>(new_pressure_values_old_iteration[i],
+						new_biomass_in_cell,
+						parameters.biomass_dry_density);
+	  }
+	if (reaction_active_cells[cell_index]==0)
+	  {
+	    Cell_Property_Cache &cache=cell_property_cache[cell_index];
+	    cache.valid=true;
+	    for (unsigned int i=0; i<dofs_per_cell; ++i)
+	      {
+		cache.old_pressure[i]=old_solution_flow(local_dof_indices[i]);
+		cache.new_pressure[i]=new_pressure_values_old_iteration[i];
+	      }
+	    cache.free_saturation       =cell_free_saturation;
+	    cache.hydraulic_conductivity=cell_hydraulic_conductivity;
+	    cache.total_moisture_content=cell_total_moisture_content;
+	    cache.free_moisture_content =cell_free_moisture_content;
+	    cache.moisture_capacity     =cell_moisture_capacity;
+	  }
+	for (unsigned int i=0; i<dofs_per_cell; ++i)
+	  {
+	    new_nodal.biomass_concentration(local_dof_indices[i])+=cell_biomass_concentration[i];
+	    new_nodal.biomass_fraction(local_dof_indices[i])+=cell_biomass_fraction[i];
+	    new_nodal.hydraulic_conductivity(local_dof_indices[i])+=cell_hydraulic_conductivity[i];
+	    new_nodal.total_moisture_content(local_dof_indices[i])+=cell_total_moisture_content[i];
+	    new_nodal.free_moisture_content(local_dof_indices[i])+=cell_free_moisture_content[i];
+	    new_nodal.specific_moisture_capacity(local_dof_indices[i])+=cell_moisture_capacity[i];
+	    new_nodal.free_saturation(local_dof_indices[i])+=cell_free_saturation[i];
 	  }
+      }
+    timing_monitor.add_count(timing_section("cached cells"),n_cached_cells);
+    // hanging_node_constraints.condense(new_nodal.biomass_concentration);
+    // hanging_node_constraints.condense(new_nodal.biomass_fraction);
+    // hanging_node_constraints.condense(new_nodal.hydraulic_conductivity);
+    // hanging_node_constraints.condense(new_nodal.total_moisture_content);
+    // hanging_node_constraints.condense(new_nodal.free_moisture_content);
+    // hanging_node_constraints.condense(new_nodal.specific_moisture_capacity);
+    // hanging_node_constraints.condense(new_nodal.free_saturation);
+
+    // hanging_node_constraints.distribute(new_nodal.biomass_concentration);
+    // hanging_node_constraints.distribute(new_nodal.biomass_fraction);
+    // hanging_node_constraints.distribute(new_nodal.hydraulic_conductivity);
+    // hanging_node_constraints.distribute(new_nodal.total_moisture_content);
+    // hanging_node_constraints.distribute(new_nodal.free_moisture_content);
+    // hanging_node_constraints.distribute(new_nodal.specific_moisture_capacity);
+    // hanging_node_constraints.distribute(new_nodal.free_saturation);
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::calculate_boundary_flows(const bool water_flows,
+						const bool nutrient_flows)
+  {
+    /*
+     * The water and nutrient flows through the top and bottom
+     * boundaries of the accepted time step. They used to be summed up
+     * in every assembly, i.e. in every Picard iteration. The SUPG
+     * coefficients of the transport terms are the ones of the last
+     * transport assembly (transport_coefficients)
+     */
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("boundary flows"));
+    const unsigned int dofs_per_cell=fe.dofs_per_cell;
+    QGauss<dim-1> flow_face_quadrature_formula(1);
+    QGauss<dim-1> transport_face_quadrature_formula(2);
+    FEFaceValues<dim> flow_face_values(fe,flow_face_quadrature_formula,
+				       update_values|update_gradients|
+				       update_normal_vectors|
+				       update_quadrature_points|update_JxW_values);
+    FEFaceValues<dim> transport_face_values(fe,transport_face_quadrature_formula,
+					    update_values|update_gradients|
+					    update_normal_vectors|
+					    update_quadrature_points|update_JxW_values);
+    const unsigned int n_flow_face_q_points     =flow_face_quadrature_formula.size();
+    const unsigned int n_transport_face_q_points=transport_face_quadrature_formula.size();
+    std::vector<unsigned int> local_dof_indices(dofs_per_cell);
+
+    Cell_Values old_pressure_values;
+    Cell_Values new_pressure_values;
+    Cell_Values old_hydraulic_conductivity_values;
+    Cell_Values new_hydraulic_conductivity_values;
+    Cell_Values old_substrate_values;
+    Cell_Values new_substrate_values;
+    Cell_Values old_free_moisture_content_values;
+    Cell_Values new_free_moisture_content_values;
+
+    if (water_flows==true)
+      {
+	flow_at_top=0.;
+	flow_at_bottom=0.;
+	flow_column_1=0.;
+	flow_column_2=0.;
+	flow_column_3=0.;
+      }
+    if (nutrient_flows==true)
+      {
+	nutrient_flow_at_bottom=0.;
+	nutrient_flow_at_top=0.;
+      }
+    if (water_flows==false && nutrient_flows==false)
+      return;
+
+    typename DoFHandler<dim>::active_cell_iterator
+      cell = mesh->dof_handler.begin_active(),
+      endc = mesh->dof_handler.end();
+    for (; cell!=endc; ++cell)
+      {
+	if (cell->at_boundary()==false)
+	  continue;
+	cell->get_dof_indices(local_dof_indices);
 	for (unsigned int i=0; i<dofs_per_cell; ++i)
 	  {
-	    new_nodal_biomass_concentration(local_dof_indices[i])+=cell_biomass_concentration(i);
-	    new_nodal_biomass_fraction(local_dof_indices[i])+=cell_biomass_fraction(i);
-	    new_nodal_hydraulic_conductivity(local_dof_indices[i])+=cell_hydraulic_conductivity(i);
-	    new_nodal_total_moisture_content(local_dof_indices[i])+=cell_total_moisture_content(i);
-	    new_nodal_free_moisture_content(local_dof_indices[i])+=cell_free_moisture_content(i);
-	    new_nodal_specific_moisture_capacity(local_dof_indices[i])+=cell_moisture_capacity(i);
-	    new_nodal_free_saturation(local_dof_indices[i])+=cell_free_saturation(i);
+	    const unsigned int dof=local_dof_indices[i];
+	    old_pressure_values[i]              =old_solution_flow(dof);
+	    new_pressure_values[i]              =solution_flow_old_iteration(dof);
+	    old_hydraulic_conductivity_values[i]=old_nodal.hydraulic_conductivity(dof);
+	    new_hydraulic_conductivity_values[i]=new_nodal.hydraulic_conductivity(dof);
+	    old_substrate_values[i]             =old_solution_transport(dof);
+	    new_substrate_values[i]             =solution_transport(dof);
+	    old_free_moisture_content_values[i] =old_nodal.free_moisture_content(dof);
+	    new_free_moisture_content_values[i] =new_nodal.free_moisture_content(dof);
+	  }
+	const Assembly::Transport_Cell_Coefficients<dim> &coefficients=
+	  transport_coefficients[cell->active_cell_index()];
+	const Tensor<1,dim> &new_velocity=coefficients.new_velocity;
+	const Tensor<1,dim> &old_velocity=coefficients.old_velocity;
+	const double tau=coefficients.tau;
+	const double new_diffusion_value=
+	  parameters.dispersivity_longitudinal*new_velocity.norm()+
+	  parameters.effective_diffusion_coefficient;
+	const double old_diffusion_value=
+	  parameters.dispersivity_longitudinal*old_velocity.norm()+
+	  parameters.effective_diffusion_coefficient;
+
+	for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
+	  {
+	    if (cell->face(face)->at_boundary()==false)
+	      continue;
+	    const unsigned int face_boundary_indicator=cell->face(face)->boundary_id();
+	    if (face_boundary_indicator!=11 &&// top right
+		face_boundary_indicator!=12 &&// top centre
+		face_boundary_indicator!=13 &&// top left
+		face_boundary_indicator!=2)// bottom
+	      continue;
+	    /*
+	     * Water flow through the top and bottom boundaries
+	     */
+	    if (water_flows==true)
+	      {
+		flow_face_values.reinit(cell,face);
+		double flow=0.;
+		for (unsigned int q_face_point=0; q_face_point<n_flow_face_q_points; ++q_face_point)
+		  for (unsigned int k=0; k<dofs_per_cell; ++k)
+		    {
+		      for (unsigned int i=0; i<dofs_per_cell; ++i)
+			{
+			  for (unsigned int j=0; j<dofs_per_cell; ++j)
+			    {
+			      flow-=
+				(theta_richards)*
+				new_hydraulic_conductivity_values[k]*
+				flow_face_values.shape_value(k,q_face_point)*
+				flow_face_values.normal_vector(q_face_point)*
+				flow_face_values.shape_grad(j,q_face_point)*
+				(
+				 new_pressure_values[j]
+				 +
+				 cell->vertex(j)[dim-1]
+				 )*
+				flow_face_values.shape_value(i,q_face_point)*
+				flow_face_values.JxW(q_face_point)
+				+
+				(1.-theta_richards)*
+				old_hydraulic_conductivity_values[k]*
+				flow_face_values.shape_value(k,q_face_point)*
+				flow_face_values.normal_vector(q_face_point)*
+				flow_face_values.shape_grad(j,q_face_point)*
+				(
+				 old_pressure_values[j]
+				 +
+				 cell->vertex(j)[dim-1]
+				 )*
+				flow_face_values.shape_value(i,q_face_point)*
+				flow_face_values.JxW(q_face_point);
+			    }
+			}
+		    }
+		if (face_boundary_indicator==11 ||
+		    face_boundary_indicator==12 ||
+		    face_boundary_indicator==13)//top
+		  {
+		    flow_at_top+=flow;
+		    if (face_boundary_indicator==11)// top right
+		      flow_column_1+=flow;
+		    if (face_boundary_indicator==12)// top centre
+		      flow_column_2+=flow;
+		    if (face_boundary_indicator==13)// top left
+		      flow_column_3+=flow;
+		  }
+		if (face_boundary_indicator==2)//bottom
+		  flow_at_bottom+=flow;
+	      }
+	    /*
+	     * Nutrient flow through the boundary
+	     */
+	    if (nutrient_flows==true)
+	      {
+		transport_face_values.reinit(cell,face);
+		double flow=0.;
+		for (unsigned int q_face_point=0; q_face_point<n_transport_face_q_points; ++q_face_point)
+		  {
+		    for (unsigned int i=0; i<dofs_per_cell; ++i)
+		      {
+			for (unsigned int k=0; k<dofs_per_cell; ++k)
+			  {
+			    flow+=
+			      -(theta_transport)*
+			      (
+			       transport_face_values.shape_value(i,q_face_point)
+			       +
+			       tau*
+			       new_velocity*                     
+			       transport_face_values.shape_grad(i,q_face_point)
+			       )*
+			      new_diffusion_value*
+			      new_substrate_values[k]*
+			      new_free_moisture_content_values[k]*
+			      transport_face_values.shape_grad(k,q_face_point)*
+			      transport_face_values.normal_vector(q_face_point)*
+			      transport_face_values.JxW(q_face_point)
+			      +
+			      (theta_transport)*
+			      (
+			       transport_face_values.shape_value(i,q_face_point)
+			       +
+			       tau*
+			       new_velocity*                     
+			       transport_face_values.shape_grad(i,q_face_point)
+			       )*
+			      new_substrate_values[k]*
+			      new_velocity*
+			      transport_face_values.shape_value(k,q_face_point)*
+			      transport_face_values.normal_vector(q_face_point)*
+			      transport_face_values.JxW(q_face_point)
+			      -
+			      (1.-theta_transport)*
+			      (
+			       transport_face_values.shape_value(i,q_face_point)
+			       +
+			       tau*
+			       old_velocity*                     
+			       transport_face_values.shape_grad(i,q_face_point)
+			       )*
+			      old_diffusion_value*
+			      old_substrate_values[k]*
+			      old_free_moisture_content_values[k]*
+			      transport_face_values.normal_vector(q_face_point)*
+			      transport_face_values.shape_grad(k,q_face_point)*
+			      transport_face_values.JxW(q_face_point)
+			      +
+			      (1.-theta_transport)*
+			      (
+			       transport_face_values.shape_value(i,q_face_point)
+			       +
+			       tau*
+			       old_velocity*                     
+			       transport_face_values.shape_grad(i,q_face_point)
+			       )*
+			      old_substrate_values[k]*
+			      old_velocity*
+			      transport_face_values.shape_value(k,q_face_point)*
+			      transport_face_values.normal_vector(q_face_point)*
+			      transport_face_values.JxW(q_face_point);
+			  }
+		      }
+		  }
+
+		if (face_boundary_indicator==2)
+		  {
+		    nutrient_flow_at_bottom+=flow;
+		  }
+		else if (face_boundary_indicator==11 ||
+			 face_boundary_indicator==12 ||
+			 face_boundary_indicator==13 )
+		  {
+		    nutrient_flow_at_top+=flow;
+		  }
+	      }
 	  }
       }
-    // hanging_node_constraints.condense(new_nodal_biomass_concentration);
-    // hanging_node_constraints.condense(new_nodal_biomass_fraction);
-    // hanging_node_constraints.condense(new_nodal_hydraulic_conductivity);
-    // hanging_node_constraints.condense(new_nodal_total_moisture_content);
-    // hanging_node_constraints.condense(new_nodal_free_moisture_content);
-    // hanging_node_constraints.condense(new_nodal_specific_moisture_capacity);
-    // hanging_node_constraints.condense(new_nodal_free_saturation);
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::calculate_biomass_in_domain()
+  {
+    /*
+     * The biomass in the domain and in each column, only evaluated on
+     * the time steps that are logged. The porosity of a cell is its
+     * average total moisture content, as in the transport assembly
+     */
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("biomass in domain"));
+    QGauss<dim> quadrature_formula(2);
+    /*
+     * The matrix-free transport does not keep the geometry cache, it is
+     * built only for this evaluation unless the mesh is shared
+     */
+    Assembly::Geometry<dim> evaluation_geometry;
+    if (matrix_free_transport==false && mesh->transport_geometry.empty())
+      own_mesh->transport_geometry.reinit(mesh->dof_handler,quadrature_formula);
+    if (mesh->transport_geometry.empty())
+      evaluation_geometry.reinit(mesh->dof_handler,quadrature_formula);
+    const Assembly::Geometry<dim> &geometry=
+      (mesh->transport_geometry.empty() ? evaluation_geometry : mesh->transport_geometry);
+    const unsigned int dofs_per_cell=fe.dofs_per_cell;
+    const unsigned int n_q_points   =geometry.n_q_points;
+    std::vector<unsigned int> local_dof_indices(dofs_per_cell);
+
+    biomass_in_domain_current=0.;
+    biomass_column_1=0.;
+    biomass_column_2=0.;
+    biomass_column_3=0.;
 
-    // hanging_node_constraints.distribute(new_nodal_biomass_concentration);
-    // hanging_node_constraints.distribute(new_nodal_biomass_fraction);
-    // hanging_node_constraints.distribute(new_nodal_hydraulic_conductivity);
-    // hanging_node_constraints.distribute(new_nodal_total_moisture_content);
-    // hanging_node_constraints.distribute(new_nodal_free_moisture_content);
-    // hanging_node_constraints.distribute(new_nodal_specific_moisture_capacity);
-    // hanging_node_constraints.distribute(new_nodal_free_saturation);
+    typename DoFHandler<dim>::active_cell_iterator
+      cell = mesh->dof_handler.begin_active(),
+      endc = mesh->dof_handler.end();
+    for (; cell!=endc; ++cell)
+      {
+	cell->get_dof_indices(local_dof_indices);
+	const unsigned int cell_index=cell->active_cell_index();
+	double porosity=0.;
+	if (test_transport==false)
+	  {
+	    for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+	      for (unsigned int k=0; k<dofs_per_cell; ++k)
+		porosity+=
+		  new_nodal.total_moisture_content(local_dof_indices[k])*
+		  geometry.shape_value(k,q_point)*
+		  geometry.JxW(cell_index,q_point);
+	    porosity/=geometry.cell_volume[cell_index];
+	  }
+	double biomass_in_current_cell=0.;
+	for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+	  {
+	    double new_biomass_concentration=0.;
+	    for (unsigned int k=0; k<dofs_per_cell; ++k)
+	      new_biomass_concentration+=
+		new_nodal.biomass_concentration(local_dof_indices[k])*
+		geometry.shape_value(k,q_point);
+	    biomass_in_current_cell+=//mg_biomass
+	      porosity*
+	      new_biomass_concentration*
+	      geometry.JxW(cell_index,q_point);
+	  }
+	if (cell->material_id()==50)
+	  biomass_column_1+=biomass_in_current_cell;
+	if (cell->material_id()==51)
+	  biomass_column_2+=biomass_in_current_cell;
+	if (cell->material_id()==52)
+	  biomass_column_3+=biomass_in_current_cell;
+	biomass_in_domain_current+=biomass_in_current_cell;
+      }
   }
 
   template <int dim>
@@ -945,47 +4015,40 @@ namespace TRL
 			   update_quadrature_points|
 			   update_JxW_values);
     const unsigned int dofs_per_cell=fe.dofs_per_cell;
-    boundary_ids.reinit(triangulation.n_active_cells());
+    own_mesh->boundary_ids.reinit(own_mesh->triangulation.n_active_cells());
     std::vector<unsigned int> dof_indices(dofs_per_cell);
     unsigned int vector_index=0;
-    repeated_points.clear();
+    own_mesh->dof_valence.reinit(own_mesh->dof_handler.n_dofs());
       
     typename DoFHandler<dim>::active_cell_iterator
-      cell = dof_handler.begin_active(),
-      endc = dof_handler.end();
+      cell = own_mesh->dof_handler.begin_active(),
+      endc = own_mesh->dof_handler.end();
     for (; cell!=endc; ++cell)
       {
 	fe_values.reinit (cell);
 	cell->get_dof_indices(dof_indices);
 	for (unsigned int i=0; i<GeometryInfo<dim>::vertices_per_cell; i++)
-	  {
-	    std::map<unsigned int,double>::iterator it2;
-	    it2=repeated_points.find(dof_indices[i]);
-	    if (it2!=repeated_points.end())//the dof index is already in the map
-	      it2->second=it2->second+1.;
-	    else // the point is not yet in the map
-	      repeated_points[dof_indices[i]]=1;
-	  }
+	  own_mesh->dof_valence(dof_indices[i])+=1.;
 	
 	for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
 	  {
 	    if (cell->face(face)->at_boundary())
 	      {
-		if (dim==2 && use_mesh_file && cell->face(face)->boundary_id()!=0)
-		  {//2D
-		    boundary_ids[vector_index]=cell->face(face)->boundary_id();
+		if (dim>1 && use_mesh_file && cell->face(face)->boundary_id()!=0)
+		  {//2D and 3D
+		    own_mesh->boundary_ids[vector_index]=cell->face(face)->boundary_id();
 		  }
 		else if (dim==1)
 		  {//1D
 		    if (fabs(cell->face(face)->center()[dim-1]-0.)<1E-4)//top
 		      {
 			cell->face(face)->set_boundary_id(11);
-			boundary_ids[vector_index]=11;
+			own_mesh->boundary_ids[vector_index]=11;
 		      }
 		    else if (fabs(cell->face(face)->center()[dim-1]+parameters.domain_size)<1E-4)//bottom
 		      {
 			cell->face(face)->set_boundary_id(2);
-			boundary_ids[vector_index]=2;
+			own_mesh->boundary_ids[vector_index]=2;
 		      }
 		  }
 		// else
@@ -1003,34 +4066,103 @@ namespace TRL
 	vector_index++;
       }
   }
+
+  template <int dim>
+  void Heat_Pipe<dim>::setup_hydraulic_properties()
+  {
+    /*
+     * The hydraulic properties only depend on the material of the
+     * cell, so they are built once per material id and looked up by
+     * material_id() during the assembly. This must be called after
+     * repeated_vertices() because the material ids are set there in 1D.
+     */
+    types::material_id max_material_id=0;
+    typename DoFHandler<dim>::active_cell_iterator
+      cell = mesh->dof_handler.begin_active(),
+      endc = mesh->dof_handler.end();
+    for (; cell!=endc; ++cell)
+      if (cell->material_id()>max_material_id)
+	max_material_id=cell->material_id();
+
+    Saturated_Properties<dim>
+      saturated_properties(parameters);
+    material_hydraulic_properties.clear();
+    for (unsigned int material_id=0; material_id<=max_material_id; material_id++)
+      material_hydraulic_properties
+	.push_back(Hydraulic_Properties(parameters.hydraulic_properties,
+					saturated_properties.moisture_content(material_id),
+					parameters.moisture_content_residual,
+					saturated_properties.hydraulic_conductivity(material_id),
+					parameters.van_genuchten_alpha,
+					parameters.van_genuchten_n,
+					parameters.relative_permeability_model));
+
+    if (parameters.use_constitutive_tables)
+      {
+	std::vector<bool> material_in_use(max_material_id+1,false);
+	for (cell=mesh->dof_handler.begin_active(); cell!=endc; ++cell)
+	  material_in_use[cell->material_id()]=true;
+
+	for (unsigned int material_id=0; material_id<=max_material_id; material_id++)
+	  {
+	    if (material_in_use[material_id]==false)
+	      continue;
+	    double saturation_error=0.;
+	    double moisture_capacity_error=0.;
+	    double permeability_error=0.;
+	    material_hydraulic_properties[material_id]
+	      .build_tables(parameters.constitutive_tables_min_pressure_head,
+			    parameters.constitutive_tables_max_pressure_head,
+			    parameters.constitutive_tables_points,
+			    parameters.constitutive_tables_interpolation.compare("monotone cubic")==0,
+			    saturation_error,
+			    moisture_capacity_error,
+			    permeability_error);
+	    terminal << "Constitutive tables for material " << material_id
+		     << " (" << parameters.constitutive_tables_interpolation
+		     << ", " << parameters.constitutive_tables_points << " points)"
+		     << "\n\tmax interpolation error, relative to the max of each curve:"
+		     << "\n\teffective saturation    : " << saturation_error
+		     << "\n\tmoisture capacity       : " << moisture_capacity_error
+		     << "\n\t(1-Se^(1/m))^m          : " << permeability_error
+		     << std::endl;
+	  }
+      }
+  }
   
   template <int dim>
   void Heat_Pipe<dim>::read_grid()
   {
-    if(use_mesh_file && dim==2)
+    if(use_mesh_file && dim>1)
       {
 	GridIn<dim> grid_in;
-	grid_in.attach_triangulation(triangulation);
+	grid_in.attach_triangulation(own_mesh->triangulation);
 	std::ifstream input_file(mesh_filename);
 	grid_in.read_msh(input_file);
 	//triangulation.refine_global(1);
       }
     else
       {
-	GridGenerator::hyper_cube(triangulation,
+	GridGenerator::hyper_cube(own_mesh->triangulation,
 				  -1.*parameters.domain_size/*(cm)*/,0);
-	triangulation.refine_global(refinement_level);	
+	own_mesh->triangulation.refine_global(refinement_level);	
       }
   }
 
   template <int dim>
   void Heat_Pipe<dim>::refine_grid(const unsigned int refinement_mode)
   {
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("refine grid"));
+    /*
+     * A pending output still reads the current mesh
+     */
+    wait_for_output();
     if (refinement_mode==1) //Refine mesh at selected regions
       {
 	if (timestep_number!=0)
 	  {
-	    std::cout << "Error, wrong timestep number for refinement mode\n";
+	    terminal << "Error, wrong timestep number for refinement mode\n";
 	    throw -1;
 	  }
 	/*
@@ -1038,8 +4170,8 @@ namespace TRL
 	 */
 	int cell_index=0;
 	typename DoFHandler<dim>::active_cell_iterator
-	  cell = dof_handler.begin_active(),
-	  endc = dof_handler.end();
+	  cell = own_mesh->dof_handler.begin_active(),
+	  endc = own_mesh->dof_handler.end();
 	for (; cell!=endc; ++cell)
 	  {
 	    if ((cell->center()[dim-1]<-78. && cell->center()[dim-1]> -82.) ||
@@ -1057,88 +4189,80 @@ namespace TRL
 	/*
 	 * Coarse and Refine following the substrate front
 	 */
-	Vector<float> estimated_error_per_cell_1(triangulation.n_active_cells());
-	KellyErrorEstimator<dim>::estimate(dof_handler,
+	Vector<float> estimated_error_per_cell_1(own_mesh->triangulation.n_active_cells());
+	KellyErrorEstimator<dim>::estimate(own_mesh->dof_handler,
 					   QGauss<dim-1>(2),
 					   typename FunctionMap<dim>::type(),
 					   old_solution_transport,
 					   estimated_error_per_cell_1);
-	GridRefinement::refine_and_coarsen_fixed_fraction(triangulation,
+	GridRefinement::refine_and_coarsen_fixed_fraction(own_mesh->triangulation,
 							  estimated_error_per_cell_1,
 							  0.3, 0.3,2000);
       }
-    else if (refinement_mode==3) //Coarse and Refine using two solution vectors (experimental)
+    else if (refinement_mode==3) //Coarse and Refine following the substrate and biomass fronts
       {
-	// Vector<float> estimated_error_per_cell_1(triangulation.n_active_cells());
-	// //Vector<float> estimated_error_per_cell_2(triangulation.n_active_cells());
-	// // std::vector<Vector<float>* > estimated_error_per_cell;
-	// // estimated_error_per_cell.push_back(&estimated_error_per_cell_1);
-	// // estimated_error_per_cell.push_back(&estimated_error_per_cell_2);
-	
-	// // std::vector<const Vector<double>* > input_solutions;
-	// // input_solutions.push_back(&solution_transport);
-	// // input_solutions.push_back(&new_nodal_biomass_concentration);
-    
-	// // KellyErrorEstimator<dim>::estimate(dof_handler,
-	// // 				   QGauss<dim-1>(2),
-	// // 				   typename FunctionMap<dim>::type(),
-	// // 				   input_solutions,
-	// // 				   estimated_error_per_cell);
-
-	// // estimated_error_per_cell_1.print(std::cout);
-	// // estimated_error_per_cell_2.print(std::cout);
-	
-	// if (timestep_number%5==0)
-	//   KellyErrorEstimator<dim>::estimate(dof_handler,
-	// 				     QGauss<dim-1>(2),
-	// 				     typename FunctionMap<dim>::type(),
-	// 				     old_nodal_biomass_concentration,
-	// 				     estimated_error_per_cell_1);
-	// else
-	//   KellyErrorEstimator<dim>::estimate(dof_handler,
-	// 				     QGauss<dim-1>(2),
-	// 				     typename FunctionMap<dim>::type(),
-	// 				     old_solution_transport,
-	// 				     estimated_error_per_cell_1);
-	
-	// GridRefinement::refine_and_coarsen_fixed_fraction(triangulation,
-	// 						  estimated_error_per_cell_1,
-	// 						  0.5, 0.4,4000);
-	// for (unsigned int i=0; i<prerefinement_cells.size(); i++)
-	//   {
-	//     for (unsigned int j=0; j<prerefinement_cells[i]->n_children(); j++)
-	//       {
-	// 	if (prerefinement_cells[i]->child(j)->active()==true)
-	// 	  {
-	// 	    prerefinement_cells[i]->child(j)->clear_refine_flag();
-	// 	    prerefinement_cells[i]->child(j)->clear_coarsen_flag();
-	// 	  }
-	// 	else
-	// 	  {
-	// 	    for (unsigned int k=0; k<prerefinement_cells[i]->child(j)->n_children(); k++)
-	// 	      {
-	// 		if (prerefinement_cells[i]->child(j)->child(k)->active()==true)
-	// 		  {
-	// 		    prerefinement_cells[i]->child(j)->child(k)->clear_refine_flag();
-	// 		    prerefinement_cells[i]->child(j)->child(k)->set_coarsen_flag();
-	// 		  }
-	// 		else
-	// 		  {
-	// 		    std::cout << triangulation.n_levels() << "\n";
-	// 		    std::cout << "error, cell is not active in mesh refinement function\n";
-	// 		  }
-	// 	      }
-		    
-	// 	  }
-	//       }
-	//   }
+	/*
+	 * Kelly indicators of substrate and biomass, each scaled by its
+	 * largest value so that both fronts count the same. Cells are
+	 * refined above the refine threshold and coarsened below the
+	 * coarsen threshold. Cells in between keep their level, so a
+	 * cell does not flip between two adaptations when its indicator
+	 * changes a little. No cell is refined once the mesh has
+	 * maximum cells.
+	 *
+	 * refine_grid(3) is called from run() after old_nodal and
+	 * new_nodal have been swapped, so the biomass of the accepted
+	 * time step is old_nodal.biomass_concentration, as the substrate
+	 * in solution_transport. new_nodal holds the one of the time
+	 * step before.
+	 */
+	Vector<float> substrate_indicator(own_mesh->triangulation.n_active_cells());
+	Vector<float> biomass_indicator  (own_mesh->triangulation.n_active_cells());
+	std::vector<const Vector<double>* > indicator_solutions;
+	indicator_solutions.push_back(&solution_transport);
+	indicator_solutions.push_back(&old_nodal.biomass_concentration);
+	std::vector<Vector<float>* > indicators;
+	indicators.push_back(&substrate_indicator);
+	indicators.push_back(&biomass_indicator);
+	KellyErrorEstimator<dim>::estimate(own_mesh->dof_handler,
+					   QGauss<dim-1>(2),
+					   typename FunctionMap<dim>::type(),
+					   indicator_solutions,
+					   indicators);
+	const float max_substrate_indicator=substrate_indicator.linfty_norm();
+	const float max_biomass_indicator  =biomass_indicator.linfty_norm();
+	if (max_substrate_indicator>0.)
+	  substrate_indicator/=max_substrate_indicator;
+	if (max_biomass_indicator>0.)
+	  biomass_indicator/=max_biomass_indicator;
+
+	const bool refinement_allowed=
+	  own_mesh->triangulation.n_active_cells()<parameters.maximum_cells;
+	typename DoFHandler<dim>::active_cell_iterator
+	  cell = own_mesh->dof_handler.begin_active(),
+	  endc = own_mesh->dof_handler.end();
+	for (; cell!=endc; ++cell)
+	  {
+	    const unsigned int cell_index=cell->active_cell_index();
+	    const double indicator=
+	      std::max(substrate_indicator(cell_index),
+		       biomass_indicator(cell_index));
+	    const unsigned int level=cell->level();
+	    if (indicator>parameters.refine_threshold &&
+		refinement_allowed &&
+		level<parameters.maximum_refinement_level)
+	      cell->set_refine_flag();
+	    else if (indicator<parameters.coarsen_threshold &&
+		     level>parameters.minimum_refinement_level)
+	      cell->set_coarsen_flag();
+	  }
       }
     else if (refinement_mode==4)
       {
 	int cell_index=0;
 	typename DoFHandler<dim>::active_cell_iterator
-	  cell = dof_handler.begin_active(),
-	  endc = dof_handler.end();
+	  cell = own_mesh->dof_handler.begin_active(),
+	  endc = own_mesh->dof_handler.end();
 	for (; cell!=endc; ++cell)
 	  {
 	    if (/*(cell->center()[dim-1]<-78. && cell->center()[dim-1]> -82.) ||*/
@@ -1155,8 +4279,8 @@ namespace TRL
       {
 	int cell_index=0;
 	typename DoFHandler<dim>::active_cell_iterator
-	  cell = dof_handler.begin_active(),
-	  endc = dof_handler.end();
+	  cell = own_mesh->dof_handler.begin_active(),
+	  endc = own_mesh->dof_handler.end();
 	for (; cell!=endc; ++cell)
 	  {
 	    cell->set_refine_flag();
@@ -1167,821 +4291,268 @@ namespace TRL
      * Make sure that the cells are not too refined. This is important
      * since there are a few points in the domain with high velocity
      * gradients that drive the refinement algorihm crazy...
+     * Mode 3 has its own level bounds.
      */
-    if (triangulation.n_levels()>3)
-      for (auto cell = triangulation.begin_active(3);
-	   cell != triangulation.end_active(3); ++cell)
+    if (refinement_mode!=3 && own_mesh->triangulation.n_levels()>3)
+      for (auto cell = own_mesh->triangulation.begin_active(3);
+	   cell != own_mesh->triangulation.end_active(3); ++cell)
 	{
 	  cell->clear_refine_flag();
 	  cell->clear_coarsen_flag();
 	  cell->set_coarsen_flag();
 	}
     
-    std::vector<Vector<double> > transfer_in;
-    transfer_in.push_back(old_solution_flow);
-    transfer_in.push_back(solution_flow_new_iteration);
-    transfer_in.push_back(solution_flow_old_iteration);
-    transfer_in.push_back(old_solution_transport);
-    transfer_in.push_back(solution_transport);
-    transfer_in.push_back(old_nodal_biomass_concentration);
-    transfer_in.push_back(new_nodal_biomass_concentration);
-    transfer_in.push_back(old_nodal_biomass_fraction);
-    transfer_in.push_back(new_nodal_biomass_fraction);
-    transfer_in.push_back(old_nodal_free_moisture_content);
-    transfer_in.push_back(new_nodal_free_moisture_content);
-    transfer_in.push_back(old_nodal_total_moisture_content);
-    transfer_in.push_back(new_nodal_total_moisture_content);
-    transfer_in.push_back(old_nodal_hydraulic_conductivity);
-    transfer_in.push_back(new_nodal_hydraulic_conductivity);
-    transfer_in.push_back(old_nodal_specific_moisture_capacity);
-    transfer_in.push_back(new_nodal_specific_moisture_capacity);
-    transfer_in.push_back(old_nodal_free_saturation);
-    transfer_in.push_back(new_nodal_free_saturation);
+    /*
+     * Only the state that is not recomputed is transferred. The
+     * new_nodal properties are computed again from these vectors by
+     * calculate_mass_balance_ratio() at the beginning of the next
+     * nonlinear iteration. The vectors are swapped in and out of the
+     * transfer instead of being copied, setup_system() sizes the
+     * members for the new mesh in between anyway.
+     */
+    std::vector<Vector<double>*> transferred_vectors;
+    transferred_vectors.push_back(&old_solution_flow);
+    transferred_vectors.push_back(&solution_flow_new_iteration);
+    transferred_vectors.push_back(&solution_flow_old_iteration);
+    transferred_vectors.push_back(&old_solution_transport);
+    transferred_vectors.push_back(&solution_transport);
+    transferred_vectors.push_back(&old_nodal.biomass_concentration);
+    transferred_vectors.push_back(&old_nodal.biomass_fraction);
+    transferred_vectors.push_back(&old_nodal.free_moisture_content);
+    transferred_vectors.push_back(&old_nodal.total_moisture_content);
+    transferred_vectors.push_back(&old_nodal.hydraulic_conductivity);
+    transferred_vectors.push_back(&old_nodal.specific_moisture_capacity);
+    transferred_vectors.push_back(&old_nodal.free_saturation);
+
+    std::vector<Vector<double> > transfer_in(transferred_vectors.size());
+    for (unsigned int i=0; i<transferred_vectors.size(); i++)
+      transfer_in[i].swap(*transferred_vectors[i]);
     
-    SolutionTransfer<dim> solution_transfer(dof_handler);
+    SolutionTransfer<dim> solution_transfer(own_mesh->dof_handler);
     
-    triangulation
+    own_mesh->triangulation
       .prepare_coarsening_and_refinement();
     solution_transfer
       .prepare_for_coarsening_and_refinement(transfer_in);
-    triangulation
+    own_mesh->triangulation
       .execute_coarsening_and_refinement();
     
     setup_system();
     
     std::vector<Vector<double> > transfer_out(transfer_in.size());
     for (unsigned int i=0; i<transfer_in.size(); i++)
-      transfer_out[i].reinit(dof_handler.n_dofs());
+      transfer_out[i].reinit(own_mesh->dof_handler.n_dofs());
     
     solution_transfer.interpolate(transfer_in,transfer_out);
-    old_solution_flow                   =transfer_out[0];
-    solution_flow_new_iteration         =transfer_out[1];
-    solution_flow_old_iteration         =transfer_out[2];
-    old_solution_transport              =transfer_out[3];
-    solution_transport                  =transfer_out[4];
-    old_nodal_biomass_concentration     =transfer_out[5];
-    new_nodal_biomass_concentration     =transfer_out[6];
-    old_nodal_biomass_fraction          =transfer_out[7];
-    new_nodal_biomass_fraction          =transfer_out[8];
-    old_nodal_free_moisture_content     =transfer_out[9];
-    new_nodal_free_moisture_content     =transfer_out[10];
-    old_nodal_total_moisture_content    =transfer_out[11];
-    new_nodal_total_moisture_content    =transfer_out[12];
-    old_nodal_hydraulic_conductivity    =transfer_out[13];
-    new_nodal_hydraulic_conductivity    =transfer_out[14];
-    old_nodal_specific_moisture_capacity=transfer_out[15];
-    new_nodal_specific_moisture_capacity=transfer_out[16];
-    old_nodal_free_saturation           =transfer_out[17];
-    new_nodal_free_saturation           =transfer_out[18];
+    for (unsigned int i=0; i<transferred_vectors.size(); i++)
+      transferred_vectors[i]->swap(transfer_out[i]);
     
     // hanging_node_constraints.condense(old_solution_flow);
     // hanging_node_constraints.condense(solution_flow_new_iteration);
     // hanging_node_constraints.condense(solution_flow_old_iteration);
     // hanging_node_constraints.condense(old_solution_transport);
     // hanging_node_constraints.condense(solution_transport);
-    // hanging_node_constraints.condense(old_nodal_biomass_concentration);
-    // hanging_node_constraints.condense(new_nodal_biomass_concentration);
-    // hanging_node_constraints.condense(old_nodal_biomass_fraction);
-    // hanging_node_constraints.condense(new_nodal_biomass_fraction);
-    // hanging_node_constraints.condense(old_nodal_free_moisture_content);
-    // hanging_node_constraints.condense(new_nodal_free_moisture_content);
-    // hanging_node_constraints.condense(old_nodal_total_moisture_content);
-    // hanging_node_constraints.condense(new_nodal_total_moisture_content);
-    // hanging_node_constraints.condense(old_nodal_hydraulic_conductivity);
-    // hanging_node_constraints.condense(new_nodal_hydraulic_conductivity);
-    // hanging_node_constraints.condense(old_nodal_specific_moisture_capacity);
-    // hanging_node_constraints.condense(new_nodal_specific_moisture_capacity);
-    // hanging_node_constraints.condense(old_nodal_free_saturation);
-    // hanging_node_constraints.condense(new_nodal_free_saturation);
+    // hanging_node_constraints.condense(old_nodal.biomass_concentration);
+    // hanging_node_constraints.condense(new_nodal.biomass_concentration);
+    // hanging_node_constraints.condense(old_nodal.biomass_fraction);
+    // hanging_node_constraints.condense(new_nodal.biomass_fraction);
+    // hanging_node_constraints.condense(old_nodal.free_moisture_content);
+    // hanging_node_constraints.condense(new_nodal.free_moisture_content);
+    // hanging_node_constraints.condense(old_nodal.total_moisture_content);
+    // hanging_node_constraints.condense(new_nodal.total_moisture_content);
+    // hanging_node_constraints.condense(old_nodal.hydraulic_conductivity);
+    // hanging_node_constraints.condense(new_nodal.hydraulic_conductivity);
+    // hanging_node_constraints.condense(old_nodal.specific_moisture_capacity);
+    // hanging_node_constraints.condense(new_nodal.specific_moisture_capacity);
+    // hanging_node_constraints.condense(old_nodal.free_saturation);
+    // hanging_node_constraints.condense(new_nodal.free_saturation);
     
     // hanging_node_constraints.distribute(old_solution_flow);
     // hanging_node_constraints.distribute(solution_flow_new_iteration);
     // hanging_node_constraints.distribute(solution_flow_old_iteration);
     // hanging_node_constraints.distribute(old_solution_transport);
     // hanging_node_constraints.distribute(solution_transport);
-    // hanging_node_constraints.distribute(old_nodal_biomass_concentration);
-    // hanging_node_constraints.distribute(new_nodal_biomass_concentration);
-    // hanging_node_constraints.distribute(old_nodal_biomass_fraction);
-    // hanging_node_constraints.distribute(new_nodal_biomass_fraction);
-    // hanging_node_constraints.distribute(old_nodal_free_moisture_content);
-    // hanging_node_constraints.distribute(new_nodal_free_moisture_content);
-    // hanging_node_constraints.distribute(old_nodal_total_moisture_content);
-    // hanging_node_constraints.distribute(new_nodal_total_moisture_content);
-    // hanging_node_constraints.distribute(old_nodal_hydraulic_conductivity);
-    // hanging_node_constraints.distribute(new_nodal_hydraulic_conductivity);
-    // hanging_node_constraints.distribute(old_nodal_specific_moisture_capacity);
-    // hanging_node_constraints.distribute(new_nodal_specific_moisture_capacity);
-    // hanging_node_constraints.distribute(old_nodal_free_saturation);
-    // hanging_node_constraints.distribute(new_nodal_free_saturation);
+    // hanging_node_constraints.distribute(old_nodal.biomass_concentration);
+    // hanging_node_constraints.distribute(new_nodal.biomass_concentration);
+    // hanging_node_constraints.distribute(old_nodal.biomass_fraction);
+    // hanging_node_constraints.distribute(new_nodal.biomass_fraction);
+    // hanging_node_constraints.distribute(old_nodal.free_moisture_content);
+    // hanging_node_constraints.distribute(new_nodal.free_moisture_content);
+    // hanging_node_constraints.distribute(old_nodal.total_moisture_content);
+    // hanging_node_constraints.distribute(new_nodal.total_moisture_content);
+    // hanging_node_constraints.distribute(old_nodal.hydraulic_conductivity);
+    // hanging_node_constraints.distribute(new_nodal.hydraulic_conductivity);
+    // hanging_node_constraints.distribute(old_nodal.specific_moisture_capacity);
+    // hanging_node_constraints.distribute(new_nodal.specific_moisture_capacity);
+    // hanging_node_constraints.distribute(old_nodal.free_saturation);
+    // hanging_node_constraints.distribute(new_nodal.free_saturation);
     
 
     repeated_vertices();
   }
   
   template <int dim>
-  void Heat_Pipe<dim>::setup_system()
+  void Heat_Pipe<dim>::distribute_dofs()
   {
-    dof_handler.distribute_dofs(fe);
+    own_mesh->dof_handler.distribute_dofs(own_mesh->fe);
     
-    hanging_node_constraints.clear();
-    DoFTools::make_hanging_node_constraints(dof_handler,
-  					    hanging_node_constraints);
-    hanging_node_constraints.close();
+    own_mesh->hanging_node_constraints.clear();
+    DoFTools::make_hanging_node_constraints(own_mesh->dof_handler,
+					    own_mesh->hanging_node_constraints);
+    own_mesh->hanging_node_constraints.close();
         
-    DynamicSparsityPattern csp(dof_handler.n_dofs(),
-    			       dof_handler.n_dofs());
+    /*
+     * Only the assembled matrices need the sparsity pattern. A shared
+     * mesh has it for the members that assemble them
+     */
+    if (matrix_free_flow==false || matrix_free_transport==false ||
+	share_mesh())
+      {
+	DynamicSparsityPattern csp(own_mesh->dof_handler.n_dofs(),
+				   own_mesh->dof_handler.n_dofs());
+
+	DoFTools::make_sparsity_pattern(own_mesh->dof_handler,csp);
+
+	own_mesh->hanging_node_constraints.condense(csp);
+	//SparsityPattern sparsity_pattern;
+	own_mesh->sparsity_pattern.copy_from(csp);
+      }
+    /*
+     * The cached cell geometry is rebuilt the next time the system is
+     * assembled
+     */
+    own_mesh->flow_geometry.clear();
+    own_mesh->transport_geometry.clear();
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::setup_system()
+  {
+    /*
+     * A shared mesh already has its dofs, only the vectors and the
+     * matrices of the run are sized
+     */
+    if (own_mesh)
+      distribute_dofs();
 
-    DoFTools::make_sparsity_pattern(dof_handler,csp);
+    solution_flow_new_iteration.reinit(mesh->dof_handler.n_dofs());
+    solution_flow_old_iteration.reinit(mesh->dof_handler.n_dofs());
+    old_solution_flow.reinit(mesh->dof_handler.n_dofs());
 
-    hanging_node_constraints.condense(csp);
-    //SparsityPattern sparsity_pattern;
-    sparsity_pattern.copy_from(csp);
+    solution_transport.reinit(mesh->dof_handler.n_dofs());
+    old_solution_transport.reinit(mesh->dof_handler.n_dofs());
 
-    solution_flow_new_iteration.reinit(dof_handler.n_dofs());
-    solution_flow_old_iteration.reinit(dof_handler.n_dofs());
-    old_solution_flow.reinit(dof_handler.n_dofs());
+    old_nodal.reinit(mesh->dof_handler.n_dofs());
+    new_nodal.reinit(mesh->dof_handler.n_dofs());
 
-    solution_transport.reinit(dof_handler.n_dofs());
-    old_solution_transport.reinit(dof_handler.n_dofs());
+    velocity_x.reinit(mesh->triangulation.n_active_cells());
+    velocity_y.reinit(mesh->triangulation.n_active_cells());
+    velocity_z.reinit(mesh->triangulation.n_active_cells());
+    frozen_velocity.resize(mesh->triangulation.n_active_cells());
+    transport_coefficients.resize(mesh->triangulation.n_active_cells());
+    solve_flow=true;
+    /*
+     * The matrices only need to be sized again when the sparsity
+     * pattern changes, i.e. here.
+     */
+    system_rhs_flow.reinit            (mesh->dof_handler.n_dofs());
+    if (matrix_free_flow==false)
+      {
+	system_matrix_flow.reinit         (mesh->sparsity_pattern);
+	mass_matrix_richards.reinit       (mesh->sparsity_pattern);
+	laplace_matrix_new_richards.reinit(mesh->sparsity_pattern);
+	laplace_matrix_old_richards.reinit(mesh->sparsity_pattern);
+      }
+    else
+      {
+	system_residual_flow.reinit(mesh->dof_handler.n_dofs());
+	richards_operator.clear();
+	rebuild_richards_operator=true;
+      }
 
-    old_nodal_biomass_concentration.reinit(dof_handler.n_dofs());
-    new_nodal_biomass_concentration.reinit(dof_handler.n_dofs());
-    old_nodal_biomass_fraction.reinit(dof_handler.n_dofs());
-    new_nodal_biomass_fraction.reinit(dof_handler.n_dofs());
-    old_nodal_total_moisture_content.reinit(dof_handler.n_dofs());
-    new_nodal_total_moisture_content.reinit(dof_handler.n_dofs());
-    old_nodal_free_moisture_content.reinit(dof_handler.n_dofs());
-    new_nodal_free_moisture_content.reinit(dof_handler.n_dofs());
-    old_nodal_hydraulic_conductivity.reinit(dof_handler.n_dofs());
-    new_nodal_hydraulic_conductivity.reinit(dof_handler.n_dofs());
-    old_nodal_specific_moisture_capacity.reinit(dof_handler.n_dofs());
-    new_nodal_specific_moisture_capacity.reinit(dof_handler.n_dofs());
-    old_nodal_free_saturation.reinit(dof_handler.n_dofs());
-    new_nodal_free_saturation.reinit(dof_handler.n_dofs());
+    system_rhs_transport.reinit        (mesh->dof_handler.n_dofs());
+    if (matrix_free_transport==false)
+      {
+	system_matrix_transport.reinit     (mesh->sparsity_pattern);
+	mass_matrix_transport_new.reinit   (mesh->sparsity_pattern);
+	mass_matrix_transport_old.reinit   (mesh->sparsity_pattern);
+	laplace_matrix_new_transport.reinit(mesh->sparsity_pattern);
+	laplace_matrix_old_transport.reinit(mesh->sparsity_pattern);
+      }
+    else
+      {
+	transport_operator.clear();
+	rebuild_transport_operator=true;
+      }
 
-    velocity_x.reinit(triangulation.n_active_cells());
-    velocity_y.reinit(triangulation.n_active_cells());
+    reaction_active_cells.clear();
+    cell_property_cache.clear();
+
+#ifdef DEAL_II_WITH_TRILINOS
+    if (parameters.flow_preconditioner.compare("amg")==0 &&
+	matrix_free_flow==false)
+      system_matrix_flow_trilinos.reinit(mesh->sparsity_pattern);
+#endif
+    rebuild_flow_preconditioner=true;
+    rebuild_transport_preconditioner=true;
+    flow_anderson_acceleration.clear();
+    time_step_history=false;
+#ifdef DEAL_II_WITH_UMFPACK
+    flow_direct_solver.clear();
+    transport_direct_solver.clear();
+#endif
   }
-
   template <int dim>
   void Heat_Pipe<dim>::assemble_system_transport()
   {
-    system_rhs_transport.reinit        (dof_handler.n_dofs());
-    system_matrix_transport.reinit     (sparsity_pattern);
-    mass_matrix_transport_new.reinit   (sparsity_pattern);
-    mass_matrix_transport_old.reinit   (sparsity_pattern);
-    laplace_matrix_new_transport.reinit(sparsity_pattern);
-    laplace_matrix_old_transport.reinit(sparsity_pattern);
+    if (matrix_free_transport)
+      {
+	assemble_system_transport_matrix_free();
+	return;
+      }
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("assemble transport"));
+    /*
+     * The matrices are sized in setup_system(), here they are only
+     * set to zero
+     */
+    system_rhs_transport        =0;
+    system_matrix_transport     =0;
+    mass_matrix_transport_new   =0;
+    mass_matrix_transport_old   =0;
+    laplace_matrix_new_transport=0;
+    laplace_matrix_old_transport=0;
 
     QGauss<dim>   quadrature_formula(2);
     QGauss<dim-1> face_quadrature_formula(2);
-    FEValues<dim> fe_values(fe,quadrature_formula,
-  			    update_values | update_gradients | update_hessians |
-  			    update_JxW_values);
-    FEFaceValues<dim> fe_face_values(fe, face_quadrature_formula,
-  				     update_values|update_gradients|
-  				     update_normal_vectors|
-  				     update_quadrature_points|update_JxW_values);
-    
-    const unsigned int dofs_per_cell  =fe.dofs_per_cell;
-    const unsigned int n_q_points     =quadrature_formula.size();
-    const unsigned int n_face_q_points=face_quadrature_formula.size();
-
-    FullMatrix<double> cell_mass_matrix_new   (dofs_per_cell,dofs_per_cell);
-    FullMatrix<double> cell_mass_matrix_old   (dofs_per_cell,dofs_per_cell);
-    FullMatrix<double> cell_laplace_matrix_new(dofs_per_cell,dofs_per_cell);
-    FullMatrix<double> cell_laplace_matrix_old(dofs_per_cell,dofs_per_cell);
-    Vector<double>     cell_rhs(dofs_per_cell);
-
-    std::vector<unsigned int> local_dof_indices (fe.dofs_per_cell);
-    Vector<double> old_substrate_values;
-    Vector<double> new_substrate_values;
-    Vector<double> old_pressure_values;
-    Vector<double> new_pressure_values;
-    Vector<double> old_biomass_concentration_values;
-    Vector<double> new_biomass_concentration_values;
-    Vector<double> old_free_moisture_content_values;
-    Vector<double> new_free_moisture_content_values;
-    Vector<double> old_hydraulic_conductivity_values;
-    Vector<double> new_hydraulic_conductivity_values;    
-    Vector<double> old_moisture_capacity_values;
-    Vector<double> new_moisture_capacity_values;
-    Vector<double> cell_old_free_saturation;
-    Vector<double> cell_new_free_saturation;
-    Vector<double> cell_new_total_moisture_content;
-    
-    double face_boundary_indicator;
-    nutrient_flow_at_bottom=0.;
-    nutrient_flow_at_top=0.;
+
+    if (mesh->transport_geometry.empty())
+      own_mesh->transport_geometry.reinit(mesh->dof_handler,quadrature_formula);
+
     nutrients_in_domain_current=0.;
-    biomass_in_domain_current=0.;
-    biomass_column_1=0.;
-    biomass_column_2=0.;
-    biomass_column_3=0.;
 
-    velocity_x.reinit(triangulation.n_active_cells());
-    velocity_y.reinit(triangulation.n_active_cells());
-    unsigned int cell_index=0;
-    
-    typename DoFHandler<dim>::active_cell_iterator
-      cell = dof_handler.begin_active(),
-      endc = dof_handler.end();
-    for (; cell!=endc; ++cell)
-      {
-    	fe_values.reinit (cell);
-    	cell_mass_matrix_new=0;
-    	cell_mass_matrix_old=0;
-    	cell_laplace_matrix_new=0;
-    	cell_laplace_matrix_old=0;
-  	cell_rhs=0;
-
-  	old_substrate_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_substrate_values.reinit(cell->get_fe().dofs_per_cell);
-  	old_pressure_values.reinit(cell->get_fe().dofs_per_cell);
-    	new_pressure_values.reinit(cell->get_fe().dofs_per_cell);
-  	old_biomass_concentration_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_biomass_concentration_values.reinit(cell->get_fe().dofs_per_cell);
-  	old_free_moisture_content_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_free_moisture_content_values.reinit(cell->get_fe().dofs_per_cell);
-  	old_hydraulic_conductivity_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_hydraulic_conductivity_values.reinit(cell->get_fe().dofs_per_cell);
-	cell_old_free_saturation.reinit(cell->get_fe().dofs_per_cell);
-	cell_new_free_saturation.reinit(cell->get_fe().dofs_per_cell);
-	cell_new_total_moisture_content.reinit(cell->get_fe().dofs_per_cell);
-	
-    	cell->get_dof_values(old_solution_transport,old_substrate_values);
-  	cell->get_dof_values(    solution_transport,new_substrate_values);
-    	cell->get_dof_values(old_solution_flow              ,old_pressure_values);
-    	cell->get_dof_values(    solution_flow_old_iteration,new_pressure_values);
-  	cell->get_dof_values(old_nodal_biomass_concentration,
-			     old_biomass_concentration_values);
-  	cell->get_dof_values(new_nodal_biomass_concentration,
-			     new_biomass_concentration_values);
-  	cell->get_dof_values(old_nodal_free_moisture_content,
-			     old_free_moisture_content_values);
-  	cell->get_dof_values(new_nodal_free_moisture_content,
-			     new_free_moisture_content_values);
-  	cell->get_dof_values(old_nodal_hydraulic_conductivity,
-			     old_hydraulic_conductivity_values);
-  	cell->get_dof_values(new_nodal_hydraulic_conductivity,
-			     new_hydraulic_conductivity_values);
-  	cell->get_dof_values(old_nodal_free_saturation,
-			     cell_old_free_saturation);
-  	cell->get_dof_values(new_nodal_free_saturation,
-			     cell_new_free_saturation);
-	cell->get_dof_values(new_nodal_total_moisture_content,
-			     cell_new_total_moisture_content);
-	/*
-  	 * Calculate local velocities, diffusivities
-	 * The velocities calculated here are Darcy velocities
-	 * not seepage velocities. Remember:
-	 * Seepage velocity = Darcy velocity / (porosity*Saturation)
-	 * Seepage velocity = Darcy velocity / moisture content
-	 *
-	 * Nutrients calculated in the domain (cell by cell are also
-	 * calculated here.
-  	 */
-  	Tensor<1,dim> new_velocity;
-  	Tensor<1,dim> old_velocity;
-	double total_moisture=0.;
-  	double dV=0;
-	if (test_transport==false)
-	  {
-	    for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
-	      {
-		for (unsigned int k=0; k<dofs_per_cell; ++k)
-		  {
-		    for (unsigned int i=0; i<dofs_per_cell; ++i)
-		      {
-			new_velocity-=//Darcy velocity - cm/s
-			  new_hydraulic_conductivity_values[i]*
-			  fe_values.shape_value(i,q_point)*
-			  (new_pressure_values(k)+
-			   cell->vertex(k)[dim-1])*
-			  fe_values.shape_grad(k,q_point)*
-			  fe_values.JxW(q_point);
-
-			old_velocity-=//Darcy velocity - cm/s
-			  old_hydraulic_conductivity_values[i]*
-			  fe_values.shape_value(i,q_point)*
-			  (old_pressure_values(k)+
-			   cell->vertex(k)[dim-1])*
-			  fe_values.shape_grad(k,q_point)*
-			  fe_values.JxW(q_point);
-
-			nutrients_in_domain_current+=//mg_nutrients
-			  fe_values.shape_value(i,q_point)*
-			  new_free_moisture_content_values[k]*
-			  new_substrate_values[k]*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point);
-		    
-			total_moisture+=
-			  fe_values.shape_value(i,q_point)*
-			  cell_new_total_moisture_content[k]*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point);
-		      }
-		    dV+=//cm3_soil
-		      fe_values.shape_value(k,q_point)*
-		      fe_values.JxW(q_point);
-		  }
-	      }
-	    new_velocity/=dV;
-	    old_velocity/=dV;
-	    total_moisture/=dV;
-	  }
-	else if (test_transport==true && dim==1)
-	  {
-	    if (parameters.transport_mass_entry_point=="bottom")
-	      {
-		new_velocity[dim-1]=parameters.richards_bottom_flow_value;
-		old_velocity[dim-1]=parameters.richards_bottom_flow_value;
-	      }
-	    else if (parameters.transport_mass_entry_point=="top")
-	      {
-		new_velocity[dim-1]=parameters.richards_top_flow_value;
-		old_velocity[dim-1]=parameters.richards_top_flow_value;
-	      }
-	    else
-	      {
-		std::cout << "Error. Case not implemented in transport assemble function.\n"
-			  << "Error assigning velocity field.";
-		  throw -1;
-	      }
-	  }
-	else
-	  {
-	    std::cout << "Error. Case not implemented in transport assemble function.\n"
-		      << "Error in combination of test_transport and dimension.";
-	      throw -1;
-	  }
-	
-	double porosity=total_moisture;
-	double biomass_in_current_cell=0.;
-	for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
-	  for (unsigned int k=0; k<dofs_per_cell; ++k)
-	    for (unsigned int i=0; i<dofs_per_cell; ++i)
-	      {
-		biomass_in_current_cell+=//mg_biomass
-		  fe_values.shape_value(i,q_point)*
-		  porosity*
-		  new_biomass_concentration_values[k]*
-		  fe_values.shape_value(k,q_point)*
-		  fe_values.JxW(q_point);
-		
-		// biomass_in_domain_current+=//mg_biomass
-		//   fe_values.shape_value(i,q_point)*
-		//   porosity*
-		//   new_biomass_concentration_values[k]*
-		//   fe_values.shape_value(k,q_point)*
-		//   fe_values.JxW(q_point);
-	      }
-	if (cell->material_id()==50)
-	  biomass_column_1+=biomass_in_current_cell;
-	if (cell->material_id()==51)
-	  biomass_column_2+=biomass_in_current_cell;
-	if (cell->material_id()==52)
-	  biomass_column_3+=biomass_in_current_cell;
-	biomass_in_domain_current+=biomass_in_current_cell;
-	
-  	if (new_velocity.norm()<1.E-7 || stop_flow==true)
-  	  {
-  	    new_velocity=0.;
-  	    old_velocity=0.;
-  	  }
-  	if (new_velocity.norm()>=1.E-5 && old_velocity.norm()<1.E-5 && stop_flow==false)
-  	  {//when the flow inlet is opened again, there is a discontinuity in the velocity
-	   //field. This tries to solve it.
-  	    old_velocity=new_velocity;
-  	  }
-  	if (numbers::is_nan(new_velocity.norm()) || numbers::is_nan(old_velocity.norm()))
-  	  {
-  	    std::cout << "NaN error in velocities calulation.\n";
-	    std::cout << new_velocity[dim-1] << "\t" << old_velocity[dim-1] << "\n";
-  	    throw -1;
-  	  }
-  	if (!numbers::is_finite(new_velocity.norm()) || !numbers::is_finite(old_velocity.norm()))
-  	  {
-  	    std::cout << "Infinite error in velocities calulation\n";
-	    std::cout << new_velocity[dim-1] << "\t" << old_velocity[dim-1] << "\n";
-  	    throw -1;
-  	  }
-
-	velocity_x[cell_index]=new_velocity[0];
-	if (dim==2)
-	  velocity_y[cell_index]=new_velocity[1];
-	cell_index++;
-	
-  	double new_diffusion_value=
-  	  parameters.dispersivity_longitudinal*new_velocity.norm()+
-  	  parameters.effective_diffusion_coefficient;
-  	double old_diffusion_value=
-  	  parameters.dispersivity_longitudinal*old_velocity.norm()+
-  	  parameters.effective_diffusion_coefficient;
-
-  	double Peclet=0.;
-  	double beta=0.;
-  	double tau=0.;
-  	if (new_velocity.norm()>=1.E-6 && new_diffusion_value>1.E-10 && old_diffusion_value>1.E-10)
-  	  {
-  	    Peclet=
-  	      0.5*cell->diameter()*(0.5*new_velocity.norm()+0.5*old_velocity.norm())/
-  	      (0.5*new_diffusion_value+0.5*old_diffusion_value);
-	    if (Peclet<1.E-6)
-	      {
-		beta=0.0;
-		tau=0.0;
-	      }
-	    else
-	      {
-		beta=
-		  (1./tanh(Peclet)-1./Peclet);
-		tau=	  
-		  0.5*beta*cell->diameter()/(0.5*new_velocity.norm()+0.5*old_velocity.norm());
-	      }
-  	  }
-	
-  	if (Peclet<0 || beta<0 || tau<0)
-  	  {
-  	    std::cout << "error in Peclet number calulation is less than 0\n"
-		      << "\tPe= " << std::scientific << std::setprecision(10) << Peclet
-		      << "\tb= "  << std::scientific << std::setprecision(10) << beta
-		      << "\tt= " << std::scientific << std::setprecision(10) << tau << "\n"
-		      << "\tVo= " << std::scientific << std::setprecision(10) << old_velocity.norm()
-		      << "\tVn= " << std::scientific << std::setprecision(10) << new_velocity.norm()
-		      << "\nDo= " << std::scientific << std::setprecision(10) << old_diffusion_value
-		      << "\tDn= " << std::scientific << std::setprecision(10) << new_diffusion_value
-		      << "\n";
-  	    throw -1;
-  	  }
-  	if (numbers::is_nan(Peclet) || numbers::is_nan(beta) || numbers::is_nan(tau))
-  	  {
-  	    std::cout << "error in Peclet number calulation is nan\n"
-		      << "\tPe= " << std::scientific << std::setprecision(10) << Peclet
-		      << "\tb= "  << std::scientific << std::setprecision(10) << beta
-		      << "\tt= " << std::scientific << std::setprecision(10) << tau << "\n"
-		      << "\tVo= " << std::scientific << std::setprecision(10) << old_velocity.norm()
-		      << "\tVn= " << std::scientific << std::setprecision(10) << new_velocity.norm()
-		      << "\nDo= " << std::scientific << std::setprecision(10) << old_diffusion_value
-		      << "\tDn= " << std::scientific << std::setprecision(10) << new_diffusion_value
-		      << "\n";
-	    throw -1;
-  	  }
-  	if (!numbers::is_finite(Peclet) || !numbers::is_finite(beta) || !numbers::is_finite(tau))
-  	  {
-  	    std::cout << "error in Peclet number calulation is not finite\n"
-		      << "\tPe= " << std::scientific << std::setprecision(10) << Peclet
-		      << "\tb= "  << std::scientific << std::setprecision(10) << beta
-		      << "\tt= " << std::scientific << std::setprecision(10) << tau << "\n"
-		      << "\tVo= " << std::scientific << std::setprecision(10) << old_velocity.norm()
-		      << "\tVn= " << std::scientific << std::setprecision(10) << new_velocity.norm()
-		      << "\nDo= " << std::scientific << std::setprecision(10) << old_diffusion_value
-		      << "\tDn= " << std::scientific << std::setprecision(10) << new_diffusion_value
-		      << "\n";
-  	    throw -1;
-  	  }
-	
-  	for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
-  	  {
-	    for (unsigned int k=0; k<dofs_per_cell; ++k)
-	      {
-		double new_sink_factor=0;
-		double old_sink_factor=0;
-		if (parameters.homogeneous_decay_rate==true)
-		  {
-		    new_sink_factor=parameters.first_order_decay_factor;//1/s
-		    old_sink_factor=parameters.first_order_decay_factor;
-		  }
-		else if (test_transport==false)
-		  {
-		    /* *
-		     * Some of the variables for the transport equation defined in the input file
-		     * are provided in [mg_substrate/L_total_water]. They need to be transformed
-		     * to [mg_substrate/cm3_total_water] to be consistent with the primary variable
-		     * in the transport equation and to [mg_biomass/cm3_total_water] in case of the
-		     * biomass concentration variable defined in the program as
-		     * [mg_biomass/cm3_total_water]. This is done in this way:
-		     *
-		     * half_velocity_constant[mg_substrate/L_total_water]
-		     * =half_velocity_constant[mg_substrate/L_total_water]*
-		     * total_water_volume_ratio [L_total_water/1000 cm3_total_water]
-		     * =(1./1000.)*half_velocity_constant[mg_substrate/cm3_total_water]
-		     * */
-		    if (new_substrate_values[k]>1.E-1)
-		      new_sink_factor=
-			-1.*porosity*
-			new_biomass_concentration_values[k]*
-			parameters.maximum_substrate_use_rate*cell_new_free_saturation[k]/
-			(cell_new_free_saturation[k]*new_substrate_values[k]
-			 +parameters.half_velocity_constant/1000.);
-		    if (old_substrate_values[k]>1.E-4)
-		      old_sink_factor=
-			-1.*porosity*
-			old_biomass_concentration_values[k]*
-			parameters.maximum_substrate_use_rate*cell_old_free_saturation[k]/
-			(cell_old_free_saturation[k]*old_substrate_values[k]
-			 +parameters.half_velocity_constant/1000.);
-		  }
-		
-		for (unsigned int i=0; i<dofs_per_cell; ++i)
-		  {
-		    for (unsigned int j=0; j<dofs_per_cell; ++j)
-		      {
-			/*i=test function, j=concentration IMPORTANT!!*/
-			cell_mass_matrix_new(i,j)+=
-			  (
-			   fe_values.shape_value(i,q_point)
-			   +
-			   tau*
-			   new_velocity*
-			   fe_values.shape_grad(i,q_point)
-			   )*
-			  fe_values.shape_value(j,q_point)*
-			  new_free_moisture_content_values[k]*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point);
-			
-			cell_mass_matrix_old(i,j)+=
-			  (
-			   fe_values.shape_value(i,q_point)
-			   +
-			   tau*
-			   old_velocity*
-			   fe_values.shape_grad(i,q_point)
-			   )*
-			  fe_values.shape_value(j,q_point)*
-			  old_free_moisture_content_values[k]*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point);
-			
-			cell_laplace_matrix_new(i,j)+=
-			  /*Diffusive term*/
-			  fe_values.shape_grad(i,q_point)*
-			  fe_values.shape_grad(j,q_point)*
-			  new_diffusion_value*
-			  new_free_moisture_content_values[k]*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point)
-			  +
-			  /*Convective term*/
-			  (
-			   fe_values.shape_value(i,q_point)
-			   +
-			   tau*
-			   new_velocity*
-			   fe_values.shape_grad(i,q_point)
-			   )*
-			  fe_values.shape_grad(j,q_point)*
-			  new_velocity*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point)
-			  /*Reaction term*/
-			  -
-			  (
-			   fe_values.shape_value(i,q_point)
-			   +
-			   tau*
-			   new_velocity*			   
-			   fe_values.shape_grad(i,q_point)
-			   )*
-			  fe_values.shape_value(j,q_point)*
-			  new_sink_factor*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point);
-
-			cell_laplace_matrix_old(i,j)+=
-			  /*Diffusive term*/
-			  fe_values.shape_grad(i,q_point)*
-			  fe_values.shape_grad(j,q_point)*
-			  old_diffusion_value*
-			  old_free_moisture_content_values[k]*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point)
-			  +
-			  /*Convective term*/
-			  (
-			   fe_values.shape_value(i,q_point)
-			   +
-			   tau*
-			   old_velocity*			   
-			   fe_values.shape_grad(i,q_point)
-			   )*
-			  fe_values.shape_grad(j,q_point)*
-			  old_velocity*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point)
-			  /*Reaction term*/
-			  -
-			  (
-			   fe_values.shape_value(i,q_point)
-			   +
-			   tau*
-			   old_velocity*			   
-			   fe_values.shape_grad(i,q_point)
-			   )*
-			  fe_values.shape_value(j,q_point)*
-			  old_sink_factor*
-			  fe_values.shape_value(k,q_point)*
-			  fe_values.JxW(q_point);
-		      }
-		  }
-	      }
-	  }
-	
-  	for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
-  	  {
-  	    if (cell->face(face)->at_boundary())
-  	      {
-  		fe_face_values.reinit(cell,face);
-  		face_boundary_indicator=cell->face(face)->boundary_id();
-  		//inlet
-  		if ((parameters.transport_fixed_at_top==false) &&
-  		    ((face_boundary_indicator==11 && // top right
-		      parameters.transport_mass_entry_point.compare("top")==0) ||
-		     (face_boundary_indicator==12 && // top centre
-		      parameters.transport_mass_entry_point.compare("top")==0) ||
-		     (face_boundary_indicator==13 && // top left
-		      parameters.transport_mass_entry_point.compare("top")==0) ||
-  		     (face_boundary_indicator==2 &&
-		      parameters.transport_mass_entry_point.compare("bottom")==0)))
-  		  {
-  		    for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
-  		      {
-  			for (unsigned int k=0; k<dofs_per_cell; ++k)
-  			  {
-  			    double concentration_at_boundary=//mg_substrate/cm3_total_water
-  			      parameters.transport_top_fixed_value/1000.;
-			    
-  			    for (unsigned int i=0; i<dofs_per_cell; ++i)
-  			      {
-  				for (unsigned int j=0; j<dofs_per_cell; ++j)
-  				  {/*i=test function, j=concentration IMPORTANT!!*/
-  				    cell_laplace_matrix_new(i,j)-=
-  				      (
-  				       fe_face_values.shape_value(i,q_face_point)
-  				       +
-  				       tau*
-  				       new_velocity*			   
-  				       fe_face_values.shape_grad(i,q_face_point)
-  				       )*
-  				      fe_face_values.shape_value(j,q_face_point)*
-  				      new_velocity*
-  				      fe_face_values.normal_vector(q_face_point)*
-  				      fe_face_values.shape_value(k,q_face_point)*
-  				      fe_face_values.JxW(q_face_point);
-
-  				    cell_laplace_matrix_old(i,j)-=
-  				      (
-  				       fe_face_values.shape_value(i,q_face_point)
-  				       +
-  				       tau*
-  				       old_velocity*			   
-  				       fe_face_values.shape_grad(i,q_face_point)
-  				       )*
-  				      fe_face_values.shape_value(j,q_face_point)*
-  				      old_velocity*
-  				      fe_face_values.normal_vector(q_face_point)*
-  				      fe_face_values.shape_value(k,q_face_point)*
-  				      fe_face_values.JxW(q_face_point);
-  				  }
-  				cell_rhs(i)-=
-  				  (
-  				   fe_face_values.shape_value(i,q_face_point)
-  				   +
-  				   tau*
-  				   new_velocity*			   
-  				   fe_face_values.shape_grad(i,q_face_point)
-  				   )*
-  				  time_step*
-  				  (theta_transport)*
-  				  concentration_at_boundary*
-  				  new_velocity*
-  				  fe_face_values.normal_vector(q_face_point)*
-  				  fe_face_values.shape_value(k,q_face_point)*
-  				  fe_face_values.JxW(q_face_point)
-  				  +
-  				  (
-  				   fe_face_values.shape_value(i,q_face_point)
-  				   +
-  				   tau*
-  				   new_velocity*			   
-  				   fe_face_values.shape_grad(i,q_face_point)
-  				   )*
-  				  time_step*
-  				  (1.-theta_transport)*
-  				  concentration_at_boundary*
-  				  old_velocity*
-  				  fe_face_values.normal_vector(q_face_point)*
-  				  fe_face_values.shape_value(k,q_face_point)*
-  				  fe_face_values.JxW(q_face_point);
-  			      }
-  			  }
-  		      }
-  		  }
-  		/*
-  		 * Calculate nutrient flow through the boundary
-  		 */
-  		{
-  		  double flow=0.;
-  		  for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
-  		    {
-  		      for (unsigned int i=0; i<dofs_per_cell; ++i)
-  		        {
-  			  for (unsigned int k=0; k<dofs_per_cell; ++k)
-  			    {
-  			      flow+=
-  				-(theta_transport)*
-  				(
-  				 fe_face_values.shape_value(i,q_face_point)
-  				 +
-  				 tau*
-  				 new_velocity*			   
-  				 fe_face_values.shape_grad(i,q_face_point)
-  				 )*
-  				new_diffusion_value*
-  				new_substrate_values[k]*
-				new_free_moisture_content_values[k]*
-				fe_face_values.shape_grad(k,q_face_point)*
-  				fe_face_values.normal_vector(q_face_point)*
-  				fe_face_values.JxW(q_face_point)
-  				+
-  				(theta_transport)*
-  				(
-  				 fe_face_values.shape_value(i,q_face_point)
-  				 +
-  				 tau*
-  				 new_velocity*			   
-  				 fe_face_values.shape_grad(i,q_face_point)
-  				 )*
-				new_substrate_values[k]*
-  				new_velocity*
-  				fe_face_values.shape_value(k,q_face_point)*
-  				fe_face_values.normal_vector(q_face_point)*
-  				fe_face_values.JxW(q_face_point)
-  				-
-  				(1.-theta_transport)*
-  				(
-  				 fe_face_values.shape_value(i,q_face_point)
-  				 +
-  				 tau*
-  				 old_velocity*			   
-  				 fe_face_values.shape_grad(i,q_face_point)
-  				 )*
-  				old_diffusion_value*
-				old_substrate_values[k]*
-				old_free_moisture_content_values[k]*
-				fe_face_values.normal_vector(q_face_point)*
-  				fe_face_values.shape_grad(k,q_face_point)*
-  				fe_face_values.JxW(q_face_point)
-  				+
-  				(1.-theta_transport)*
-  				(
-  				 fe_face_values.shape_value(i,q_face_point)
-  				 +
-  				 tau*
-  				 old_velocity*			   
-  				 fe_face_values.shape_grad(i,q_face_point)
-  				 )*
-				old_substrate_values[k]*
-  				old_velocity*
-  				fe_face_values.shape_value(k,q_face_point)*
-  				fe_face_values.normal_vector(q_face_point)*
-  				fe_face_values.JxW(q_face_point);
-  			    }
-  			}
-  		    }
-
-  		  if (face_boundary_indicator==2)
-  		    {
-  		      nutrient_flow_at_bottom+=flow;
-  		    }
-  		  else if (face_boundary_indicator==11 ||
-			   face_boundary_indicator==12 ||
-			   face_boundary_indicator==13 )
-  		    {
-  		      nutrient_flow_at_top+=flow;
-		    }
-  		}
-  	      }
-  	  }
-  	cell->get_dof_indices(local_dof_indices);
-    	for (unsigned int i=0; i<dofs_per_cell; ++i)
-  	  {
-  	    for (unsigned int j=0; j<dofs_per_cell; ++j)
-  	      {
-  		laplace_matrix_new_transport
-  		  .add(local_dof_indices[i],local_dof_indices[j],cell_laplace_matrix_new(i,j));
-  		laplace_matrix_old_transport
-  		  .add(local_dof_indices[i],local_dof_indices[j],cell_laplace_matrix_old(i,j));
-  		mass_matrix_transport_new
-  		  .add(local_dof_indices[i],local_dof_indices[j],cell_mass_matrix_new(i,j));
-  		mass_matrix_transport_old
-  		  .add(local_dof_indices[i],local_dof_indices[j],cell_mass_matrix_old(i,j));
-  	      }
-  	    system_rhs_transport(local_dof_indices[i])+=cell_rhs(i);
-  	  }
-      }
+    velocity_x.reinit(mesh->triangulation.n_active_cells());
+    velocity_y.reinit(mesh->triangulation.n_active_cells());
+    velocity_z.reinit(mesh->triangulation.n_active_cells());
+    /*
+     * As in assemble_system_flow(), the cells are assembled in parallel.
+     * The nutrients in the domain (needed by the convergence criterion
+     * in run()) and the cell velocities are accumulated per cell in
+     * CopyData::Transport and summed up in copy_local_to_global_transport().
+     * The copier is called in the order of the cells, so the sums (and
+     * therefore the output_data_* files) do not depend on the number of
+     * threads nor on the scheduling. The boundary flows and the biomass
+     * are only needed once per time step, see calculate_boundary_flows()
+     * and calculate_biomass_in_domain().
+     */
+    WorkStream::run(mesh->dof_handler.begin_active(),
+		    mesh->dof_handler.end(),
+		    *this,
+		    &Heat_Pipe<dim>::local_assemble_system_transport,
+		    &Heat_Pipe<dim>::copy_local_to_global_transport,
+		    Assembly::Scratch::Transport<dim>(fe,face_quadrature_formula),
+		    Assembly::CopyData::Transport<dim>(fe));
+
     Vector<double> tmp(solution_transport.size ());
     
     mass_matrix_transport_old.vmult   ( tmp,old_solution_transport);
@@ -1992,8 +4563,8 @@ namespace TRL
     system_matrix_transport.copy_from (mass_matrix_transport_new);
     system_matrix_transport.add       (theta_transport*time_step,laplace_matrix_new_transport);
     
-    hanging_node_constraints.condense(system_matrix_transport);
-    hanging_node_constraints.condense(system_rhs_transport);
+    mesh->hanging_node_constraints.condense(system_matrix_transport);
+    mesh->hanging_node_constraints.condense(system_rhs_transport);
     
     /* *
      * The boundary condition for the transport equation defined in the input file
@@ -2047,319 +4618,804 @@ namespace TRL
   }
 
   template <int dim>
-  void Heat_Pipe<dim>::assemble_system_flow()
+  void Heat_Pipe<dim>::local_assemble_system_transport(const typename DoFHandler<dim>::active_cell_iterator &cell,
+						       Assembly::Scratch::Transport<dim> &scratch,
+						       Assembly::CopyData::Transport<dim> &data)
+  {
+    const Assembly::Geometry<dim> &geometry=mesh->transport_geometry;
+    FEFaceValues<dim> &fe_face_values=scratch.fe_face_values;
+
+    const unsigned int dofs_per_cell  =fe.dofs_per_cell;
+    const unsigned int n_q_points     =geometry.n_q_points;
+    const unsigned int n_face_q_points=fe_face_values.get_quadrature().size();
+
+    FullMatrix<double> &cell_mass_matrix_new   =data.cell_mass_matrix_new;
+    FullMatrix<double> &cell_mass_matrix_old   =data.cell_mass_matrix_old;
+    FullMatrix<double> &cell_laplace_matrix_new=data.cell_laplace_matrix_new;
+    FullMatrix<double> &cell_laplace_matrix_old=data.cell_laplace_matrix_old;
+    Vector<double>     &cell_rhs               =data.cell_rhs;
+
+    Cell_Values old_substrate_values;
+    Cell_Values new_substrate_values;
+    Cell_Values old_pressure_values;
+    Cell_Values new_pressure_values;
+    Cell_Values old_biomass_concentration_values;
+    Cell_Values new_biomass_concentration_values;
+    Cell_Values old_free_moisture_content_values;
+    Cell_Values new_free_moisture_content_values;
+    Cell_Values old_hydraulic_conductivity_values;
+    Cell_Values new_hydraulic_conductivity_values;
+    Cell_Values cell_old_free_saturation;
+    Cell_Values cell_new_free_saturation;
+    Cell_Values cell_new_total_moisture_content;
+    std::vector<double> &new_test_values             =scratch.new_test_values;
+    std::vector<double> &old_test_values             =scratch.old_test_values;
+
+    double face_boundary_indicator;
+    data.nutrients_in_domain=0.;
+    cell_mass_matrix_new=0;
+    cell_mass_matrix_old=0;
+    cell_laplace_matrix_new=0;
+    cell_laplace_matrix_old=0;
+    cell_rhs=0;
+
+
+    /*
+     * All nodal values of the cell are gathered in one pass over its
+     * dof indices
+     */
+    cell->get_dof_indices(data.local_dof_indices);
+    for (unsigned int i=0; i<dofs_per_cell; ++i)
+      {
+	const unsigned int dof=data.local_dof_indices[i];
+	old_substrate_values[i]             =old_solution_transport(dof);
+	new_substrate_values[i]             =solution_transport(dof);
+	old_pressure_values[i]              =old_solution_flow(dof);
+	new_pressure_values[i]              =solution_flow_old_iteration(dof);
+	old_biomass_concentration_values[i] =old_nodal.biomass_concentration(dof);
+	new_biomass_concentration_values[i] =new_nodal.biomass_concentration(dof);
+	old_free_moisture_content_values[i] =old_nodal.free_moisture_content(dof);
+	new_free_moisture_content_values[i] =new_nodal.free_moisture_content(dof);
+	old_hydraulic_conductivity_values[i]=old_nodal.hydraulic_conductivity(dof);
+	new_hydraulic_conductivity_values[i]=new_nodal.hydraulic_conductivity(dof);
+	cell_old_free_saturation[i]         =old_nodal.free_saturation(dof);
+	cell_new_free_saturation[i]         =new_nodal.free_saturation(dof);
+	cell_new_total_moisture_content[i]  =new_nodal.total_moisture_content(dof);
+      }
+    /*
+     * The Monod sink vanishes without biomass at the vertices, so as
+     * in calculate_mass_balance_ratio() it is only evaluated on cells
+     * with biomass when the activity mask is set
+     */
+    bool reaction_active=(parameters.reaction_activity_mask==false);
+    for (unsigned int i=0; i<dofs_per_cell; ++i)
+      if (old_biomass_concentration_values[i]!=0. ||
+	  new_biomass_concentration_values[i]!=0.)
+	reaction_active=true;
+    /*
+     * Calculate local velocities, diffusivities
+     * The velocities calculated here are Darcy velocities
+     * not seepage velocities. Remember:
+     * Seepage velocity = Darcy velocity / (porosity*Saturation)
+     * Seepage velocity = Darcy velocity / moisture content
+     *
+     * Nutrients calculated in the domain (cell by cell are also
+     * calculated here.
+     */
+    const unsigned int cell_index=cell->active_cell_index();
+    Tensor<1,dim> new_velocity;
+    Tensor<1,dim> old_velocity;
+    double total_moisture=0.;
+    double dV=geometry.cell_volume[cell_index];
+    if (test_transport==false)
+      {
+	for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+	  {
+	    const double JxW=geometry.JxW(cell_index,q_point);
+	    double new_hydraulic_conductivity=0.;
+	    double old_hydraulic_conductivity=0.;
+	    double new_nutrients=0.;
+	    double new_total_moisture_content=0.;
+	    Tensor<1,dim> new_total_head_gradient;
+	    Tensor<1,dim> old_total_head_gradient;
+	    for (unsigned int k=0; k<dofs_per_cell; ++k)
+	      {
+		const double         shape_value_k=geometry.shape_value(k,q_point);
+		const Tensor<1,dim> &shape_grad_k =geometry.shape_grad(cell_index,k,q_point);
+		new_hydraulic_conductivity+=new_hydraulic_conductivity_values[k]*shape_value_k;
+		old_hydraulic_conductivity+=old_hydraulic_conductivity_values[k]*shape_value_k;
+		new_total_head_gradient+=
+		  (new_pressure_values[k]+cell->vertex(k)[dim-1])*shape_grad_k;
+		old_total_head_gradient+=
+		  (old_pressure_values[k]+cell->vertex(k)[dim-1])*shape_grad_k;
+		new_nutrients+=
+		  new_free_moisture_content_values[k]*
+		  new_substrate_values[k]*
+		  shape_value_k;
+		new_total_moisture_content+=
+		  cell_new_total_moisture_content[k]*
+		  shape_value_k;
+	      }
+	    new_velocity-=//Darcy velocity - cm/s
+	      new_hydraulic_conductivity*new_total_head_gradient*JxW;
+	    old_velocity-=//Darcy velocity - cm/s
+	      old_hydraulic_conductivity*old_total_head_gradient*JxW;
+	    data.nutrients_in_domain+=//mg_nutrients
+	      new_nutrients*JxW;
+	    total_moisture+=
+	      new_total_moisture_content*JxW;
+	  }
+	new_velocity/=dV;
+	old_velocity/=dV;
+	total_moisture/=dV;
+      }
+
+    data.cell_index  =cell_index;
+    data.coefficients=
+      transport_cell_coefficients(cell_index,geometry.cell_diameter[cell_index],
+				  total_moisture,new_velocity,old_velocity);
+
+    double porosity=total_moisture;
+    new_velocity=data.coefficients.new_velocity;
+    old_velocity=data.coefficients.old_velocity;
+    const double tau                =data.coefficients.tau;
+    const double new_diffusion_value=data.coefficients.new_diffusion;
+    const double old_diffusion_value=data.coefficients.old_diffusion;
+
+    for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+      {
+	double new_sink_factor=0.;
+	double old_sink_factor=0.;
+	double new_free_moisture_content=0.;
+	double old_free_moisture_content=0.;
+	for (unsigned int k=0; k<dofs_per_cell; ++k)
+	  {
+	    const double shape_value_k=geometry.shape_value(k,q_point);
+	    new_free_moisture_content+=new_free_moisture_content_values[k]*shape_value_k;
+	    old_free_moisture_content+=old_free_moisture_content_values[k]*shape_value_k;
+	    if (parameters.homogeneous_decay_rate==true)
+	      {
+		new_sink_factor+=parameters.first_order_decay_factor*shape_value_k;//1/s
+		old_sink_factor+=parameters.first_order_decay_factor*shape_value_k;
+	      }
+	    else if (test_transport==false && reaction_active==true)
+	      {
+		/* *
+		 * Some of the variables for the transport equation defined in the input file
+		 * are provided in [mg_substrate/L_total_water]. They need to be transformed
+		 * to [mg_substrate/cm3_total_water] to be consistent with the primary variable
+		 * in the transport equation and to [mg_biomass/cm3_total_water] in case of the
+		 * biomass concentration variable defined in the program as
+		 * [mg_biomass/cm3_total_water]. This is done in this way:
+		 *
+		 * half_velocity_constant[mg_substrate/L_total_water]
+		 * =half_velocity_constant[mg_substrate/L_total_water]*
+		 * total_water_volume_ratio [L_total_water/1000 cm3_total_water]
+		 * =(1./1000.)*half_velocity_constant[mg_substrate/cm3_total_water]
+		 * */
+		if (new_substrate_values[k]>1.E-1)
+		  new_sink_factor+=
+		    -1.*porosity*
+		    new_biomass_concentration_values[k]*
+		    parameters.maximum_substrate_use_rate*cell_new_free_saturation[k]/
+		    (cell_new_free_saturation[k]*new_substrate_values[k]
+		     +parameters.half_velocity_constant/1000.)*
+		    shape_value_k;
+		if (old_substrate_values[k]>1.E-4)
+		  old_sink_factor+=
+		    -1.*porosity*
+		    old_biomass_concentration_values[k]*
+		    parameters.maximum_substrate_use_rate*cell_old_free_saturation[k]/
+		    (cell_old_free_saturation[k]*old_substrate_values[k]
+		     +parameters.half_velocity_constant/1000.)*
+		    shape_value_k;
+	      }
+	  }
+	const double JxW=geometry.JxW(cell_index,q_point);
+	/*
+	 * Streamline upwind test functions: phi_i+tau*v*grad(phi_i)
+	 */
+	for (unsigned int i=0; i<dofs_per_cell; ++i)
+	  {
+	    const Tensor<1,dim> &shape_grad_i=geometry.shape_grad(cell_index,i,q_point);
+	    new_test_values[i]=
+	      geometry.shape_value(i,q_point)+tau*new_velocity*shape_grad_i;
+	    old_test_values[i]=
+	      geometry.shape_value(i,q_point)+tau*old_velocity*shape_grad_i;
+	  }
+
+	for (unsigned int i=0; i<dofs_per_cell; ++i)
+	  {
+	    const Tensor<1,dim> &shape_grad_i=geometry.shape_grad(cell_index,i,q_point);
+	    for (unsigned int j=0; j<dofs_per_cell; ++j)
+	      {
+		/*i=test function, j=concentration IMPORTANT!!*/
+		const double         shape_value_j=geometry.shape_value(j,q_point);
+		const Tensor<1,dim> &shape_grad_j =geometry.shape_grad(cell_index,j,q_point);
+		const double grad_i_grad_j=shape_grad_i*shape_grad_j;
+
+		cell_mass_matrix_new(i,j)+=
+		  new_test_values[i]*
+		  shape_value_j*
+		  new_free_moisture_content*
+		  JxW;
+
+		cell_mass_matrix_old(i,j)+=
+		  old_test_values[i]*
+		  shape_value_j*
+		  old_free_moisture_content*
+		  JxW;
+
+		cell_laplace_matrix_new(i,j)+=
+		  /*Diffusive term*/
+		  grad_i_grad_j*
+		  new_diffusion_value*
+		  new_free_moisture_content*
+		  JxW
+		  +
+		  /*Convective term*/
+		  new_test_values[i]*
+		  (shape_grad_j*new_velocity)*
+		  JxW
+		  /*Reaction term*/
+		  -
+		  new_test_values[i]*
+		  shape_value_j*
+		  new_sink_factor*
+		  JxW;
+
+		cell_laplace_matrix_old(i,j)+=
+		  /*Diffusive term*/
+		  grad_i_grad_j*
+		  old_diffusion_value*
+		  old_free_moisture_content*
+		  JxW
+		  +
+		  /*Convective term*/
+		  old_test_values[i]*
+		  (shape_grad_j*old_velocity)*
+		  JxW
+		  /*Reaction term*/
+		  -
+		  old_test_values[i]*
+		  shape_value_j*
+		  old_sink_factor*
+		  JxW;
+	      }
+	  }
+      }
+
+    for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
+      {
+	if (cell->face(face)->at_boundary())
+	  {
+	    fe_face_values.reinit(cell,face);
+	    face_boundary_indicator=cell->face(face)->boundary_id();
+	    //inlet
+	    if ((parameters.transport_fixed_at_top==false) &&
+		((face_boundary_indicator==11 && // top right
+		  transport_mass_entry_at_top) ||
+		 (face_boundary_indicator==12 && // top centre
+		  transport_mass_entry_at_top) ||
+		 (face_boundary_indicator==13 && // top left
+		  transport_mass_entry_at_top) ||
+		 (face_boundary_indicator==2 &&
+		  transport_mass_entry_at_bottom)))
+	      {
+		for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
+		  {
+		    for (unsigned int k=0; k<dofs_per_cell; ++k)
+		      {
+			double concentration_at_boundary=//mg_substrate/cm3_total_water
+			  parameters.transport_top_fixed_value/1000.;
+
+			for (unsigned int i=0; i<dofs_per_cell; ++i)
+			  {
+			    for (unsigned int j=0; j<dofs_per_cell; ++j)
+			      {/*i=test function, j=concentration IMPORTANT!!*/
+				cell_laplace_matrix_new(i,j)-=
+				  (
+				   fe_face_values.shape_value(i,q_face_point)
+				   +
+				   tau*
+				   new_velocity*                       
+				   fe_face_values.shape_grad(i,q_face_point)
+				   )*
+				  fe_face_values.shape_value(j,q_face_point)*
+				  new_velocity*
+				  fe_face_values.normal_vector(q_face_point)*
+				  fe_face_values.shape_value(k,q_face_point)*
+				  fe_face_values.JxW(q_face_point);
+
+				cell_laplace_matrix_old(i,j)-=
+				  (
+				   fe_face_values.shape_value(i,q_face_point)
+				   +
+				   tau*
+				   old_velocity*                       
+				   fe_face_values.shape_grad(i,q_face_point)
+				   )*
+				  fe_face_values.shape_value(j,q_face_point)*
+				  old_velocity*
+				  fe_face_values.normal_vector(q_face_point)*
+				  fe_face_values.shape_value(k,q_face_point)*
+				  fe_face_values.JxW(q_face_point);
+			      }
+			    cell_rhs(i)-=
+			      (
+			       fe_face_values.shape_value(i,q_face_point)
+			       +
+			       tau*
+			       new_velocity*                           
+			       fe_face_values.shape_grad(i,q_face_point)
+			       )*
+			      time_step*
+			      (theta_transport)*
+			      concentration_at_boundary*
+			      new_velocity*
+			      fe_face_values.normal_vector(q_face_point)*
+			      fe_face_values.shape_value(k,q_face_point)*
+			      fe_face_values.JxW(q_face_point)
+			      +
+			      (
+			       fe_face_values.shape_value(i,q_face_point)
+			       +
+			       tau*
+			       new_velocity*                           
+			       fe_face_values.shape_grad(i,q_face_point)
+			       )*
+			      time_step*
+			      (1.-theta_transport)*
+			      concentration_at_boundary*
+			      old_velocity*
+			      fe_face_values.normal_vector(q_face_point)*
+			      fe_face_values.shape_value(k,q_face_point)*
+			      fe_face_values.JxW(q_face_point);
+			  }
+		      }
+		  }
+	      }
+	  }
+      }
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::copy_local_to_global_transport(const Assembly::CopyData::Transport<dim> &data)
+  {
+    const unsigned int dofs_per_cell=fe.dofs_per_cell;
+    for (unsigned int i=0; i<dofs_per_cell; ++i)
+      {
+	for (unsigned int j=0; j<dofs_per_cell; ++j)
+	  {
+	    laplace_matrix_new_transport
+	      .add(data.local_dof_indices[i],data.local_dof_indices[j],data.cell_laplace_matrix_new(i,j));
+	    laplace_matrix_old_transport
+	      .add(data.local_dof_indices[i],data.local_dof_indices[j],data.cell_laplace_matrix_old(i,j));
+	    mass_matrix_transport_new
+	      .add(data.local_dof_indices[i],data.local_dof_indices[j],data.cell_mass_matrix_new(i,j));
+	    mass_matrix_transport_old
+	      .add(data.local_dof_indices[i],data.local_dof_indices[j],data.cell_mass_matrix_old(i,j));
+	  }
+	system_rhs_transport(data.local_dof_indices[i])+=data.cell_rhs(i);
+      }
+    nutrients_in_domain_current+=data.nutrients_in_domain;
+    set_transport_cell_coefficients(data.cell_index,data.coefficients);
+  }
+
+  template <int dim>
+  Assembly::Transport_Cell_Coefficients<dim>
+  Heat_Pipe<dim>::transport_cell_coefficients(const unsigned int cell_index,
+					      const double       cell_diameter,
+					      const double       porosity,
+					      Tensor<1,dim>      new_velocity,
+					      Tensor<1,dim>      old_velocity) const
+  {
+    /*
+     * The velocities of the cell (the cell averages of the Darcy
+     * velocities of the flow, given in new_velocity and old_velocity),
+     * its dispersion coefficients and its SUPG parameter, the same for
+     * the assembled and for the matrix-free transport
+     */
+    if (test_transport==true && dim==1)
+      {
+	if (transport_mass_entry_at_bottom)
+	  {
+	    new_velocity[dim-1]=parameters.richards_bottom_flow_value;
+	    old_velocity[dim-1]=parameters.richards_bottom_flow_value;
+	  }
+	else if (transport_mass_entry_at_top)
+	  {
+	    new_velocity[dim-1]=parameters.richards_top_flow_value;
+	    old_velocity[dim-1]=parameters.richards_top_flow_value;
+	  }
+	else
+	  {
+	    terminal << "Error. Case not implemented in transport assemble function.\n"
+		     << "Error assigning velocity field.";
+	      throw -1;
+	  }
+      }
+    else if (test_transport==true)
+      {
+	terminal << "Error. Case not implemented in transport assemble function.\n"
+		 << "Error in combination of test_transport and dimension.";
+	  throw -1;
+      }
+
+    /*
+     * While the flow is frozen (see run()), the velocity field is the
+     * one of the last time step where the flow was solved. It must not
+     * change with the clogging of the pores in the meantime, otherwise
+     * it would no longer be consistent with the pressure field.
+     */
+    if (solve_flow==false && test_transport==false)
+      {
+	new_velocity=frozen_velocity[cell_index];
+	old_velocity=new_velocity;
+      }
+
+    if (new_velocity.norm()<1.E-7 || stop_flow==true)
+      {
+	new_velocity=0.;
+	old_velocity=0.;
+      }
+    if (new_velocity.norm()>=1.E-5 && old_velocity.norm()<1.E-5 && stop_flow==false)
+      {//when the flow inlet is opened again, there is a discontinuity in the velocity
+       //field. This tries to solve it.
+	old_velocity=new_velocity;
+      }
+    if (numbers::is_nan(new_velocity.norm()) || numbers::is_nan(old_velocity.norm()))
+      {
+	terminal << "NaN error in velocities calulation.\n";
+	terminal << new_velocity[dim-1] << "\t" << old_velocity[dim-1] << "\n";
+	throw -1;
+      }
+    if (!numbers::is_finite(new_velocity.norm()) || !numbers::is_finite(old_velocity.norm()))
+      {
+	terminal << "Infinite error in velocities calulation\n";
+	terminal << new_velocity[dim-1] << "\t" << old_velocity[dim-1] << "\n";
+	throw -1;
+      }
+
+    double new_diffusion_value=
+      parameters.dispersivity_longitudinal*new_velocity.norm()+
+      parameters.effective_diffusion_coefficient;
+    double old_diffusion_value=
+      parameters.dispersivity_longitudinal*old_velocity.norm()+
+      parameters.effective_diffusion_coefficient;
+
+    double Peclet=0.;
+    double beta=0.;
+    double tau=0.;
+    if (new_velocity.norm()>=1.E-6 && new_diffusion_value>1.E-10 && old_diffusion_value>1.E-10)
+      {
+	Peclet=
+	  0.5*cell_diameter*(0.5*new_velocity.norm()+0.5*old_velocity.norm())/
+	  (0.5*new_diffusion_value+0.5*old_diffusion_value);
+	if (Peclet<1.E-6)
+	  {
+	    beta=0.0;
+	    tau=0.0;
+	  }
+	else
+	  {
+	    beta=
+	      (1./tanh(Peclet)-1./Peclet);
+	    tau=      
+	      0.5*beta*cell_diameter/(0.5*new_velocity.norm()+0.5*old_velocity.norm());
+	  }
+      }
+
+    if (Peclet<0 || beta<0 || tau<0)
+      {
+	terminal << "error in Peclet number calulation is less than 0\n"
+		 << "\tPe= " << std::scientific << std::setprecision(10) << Peclet
+		 << "\tb= "  << std::scientific << std::setprecision(10) << beta
+		 << "\tt= " << std::scientific << std::setprecision(10) << tau << "\n"
+		 << "\tVo= " << std::scientific << std::setprecision(10) << old_velocity.norm()
+		 << "\tVn= " << std::scientific << std::setprecision(10) << new_velocity.norm()
+		 << "\nDo= " << std::scientific << std::setprecision(10) << old_diffusion_value
+		 << "\tDn= " << std::scientific << std::setprecision(10) << new_diffusion_value
+		 << "\n";
+	throw -1;
+      }
+    if (numbers::is_nan(Peclet) || numbers::is_nan(beta) || numbers::is_nan(tau))
+      {
+	terminal << "error in Peclet number calulation is nan\n"
+		 << "\tPe= " << std::scientific << std::setprecision(10) << Peclet
+		 << "\tb= "  << std::scientific << std::setprecision(10) << beta
+		 << "\tt= " << std::scientific << std::setprecision(10) << tau << "\n"
+		 << "\tVo= " << std::scientific << std::setprecision(10) << old_velocity.norm()
+		 << "\tVn= " << std::scientific << std::setprecision(10) << new_velocity.norm()
+		 << "\nDo= " << std::scientific << std::setprecision(10) << old_diffusion_value
+		 << "\tDn= " << std::scientific << std::setprecision(10) << new_diffusion_value
+		 << "\n";
+	throw -1;
+      }
+    if (!numbers::is_finite(Peclet) || !numbers::is_finite(beta) || !numbers::is_finite(tau))
+      {
+	terminal << "error in Peclet number calulation is not finite\n"
+		 << "\tPe= " << std::scientific << std::setprecision(10) << Peclet
+		 << "\tb= "  << std::scientific << std::setprecision(10) << beta
+		 << "\tt= " << std::scientific << std::setprecision(10) << tau << "\n"
+		 << "\tVo= " << std::scientific << std::setprecision(10) << old_velocity.norm()
+		 << "\tVn= " << std::scientific << std::setprecision(10) << new_velocity.norm()
+		 << "\nDo= " << std::scientific << std::setprecision(10) << old_diffusion_value
+		 << "\tDn= " << std::scientific << std::setprecision(10) << new_diffusion_value
+		 << "\n";
+	throw -1;
+      }
+
+    Assembly::Transport_Cell_Coefficients<dim> coefficients;
+    coefficients.new_velocity =new_velocity;
+    coefficients.old_velocity =old_velocity;
+    coefficients.tau          =tau;
+    coefficients.new_diffusion=new_diffusion_value;
+    coefficients.old_diffusion=old_diffusion_value;
+    if (parameters.homogeneous_decay_rate==true)
+      coefficients.sink_weight=1.;
+    else if (test_transport==false)
+      coefficients.sink_weight=-1.*porosity;
+    return (coefficients);
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::set_transport_cell_coefficients(const unsigned int                               cell_index,
+						       const Assembly::Transport_Cell_Coefficients<dim> &coefficients)
+  {
+    velocity_x[cell_index]=coefficients.new_velocity[0];
+    if (dim>1)
+      velocity_y[cell_index]=coefficients.new_velocity[1];
+    if (dim>2)
+      velocity_z[cell_index]=coefficients.new_velocity[2];
+    if (solve_flow==true)
+      frozen_velocity[cell_index]=coefficients.new_velocity;
+    transport_coefficients[cell_index]=coefficients;
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::assemble_system_transport_matrix_free()
+  {
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("assemble transport"));
+    /*
+     * The operator is built again after the mesh changes (see
+     * setup_system()). The inflow faces are the ones with the face
+     * terms in local_assemble_system_transport().
+     */
+    if (rebuild_transport_operator)
+      {
+	std::vector<types::boundary_id> inflow_boundaries;
+	if (parameters.transport_fixed_at_top==false)
+	  {
+	    if (transport_mass_entry_at_top)
+	      {
+		inflow_boundaries.push_back(11);// top right
+		inflow_boundaries.push_back(12);// top centre
+		inflow_boundaries.push_back(13);// top left
+	      }
+	    if (transport_mass_entry_at_bottom)
+	      inflow_boundaries.push_back(2);
+	  }
+	transport_operator.reinit(mesh->dof_handler,mesh->hanging_node_constraints,inflow_boundaries);
+	rebuild_transport_operator=false;
+      }
+
+    nutrients_in_domain_current=0.;
+
+    velocity_x.reinit(mesh->triangulation.n_active_cells());
+    velocity_y.reinit(mesh->triangulation.n_active_cells());
+    velocity_z.reinit(mesh->triangulation.n_active_cells());
+    /*
+     * The cell averages of the Darcy velocities and of the total
+     * moisture content (the porosity), and the nutrients in the domain,
+     * as in local_assemble_system_transport() but a batch of cells at a
+     * time. The gradient of the elevation is the unit vector of the
+     * last direction. The cells are visited in the same order in every
+     * run, so the sums do not depend on the number of threads.
+     */
+    typedef typename Transport_Operator<dim>::Evaluation Evaluation;
+    const MatrixFree<dim,double> &data=transport_operator.get_matrix_free();
+    Evaluation phi(data);
+    Vector<double> nodal_nutrients(new_nodal.free_moisture_content);
+    nodal_nutrients.scale(solution_transport);
+    VectorizedArray<double>                hydraulic_conductivity[Evaluation::n_q_points];
+    Tensor<1,dim,VectorizedArray<double> > darcy_velocity[Evaluation::n_q_points];
+    for (unsigned int cell=0; cell<data.n_macro_cells(); ++cell)
+      {
+	phi.reinit(cell);
+	VectorizedArray<double> volume        =make_vectorized_array(0.);
+	VectorizedArray<double> nutrients     =make_vectorized_array(0.);
+	VectorizedArray<double> total_moisture=make_vectorized_array(0.);
+	Tensor<1,dim,VectorizedArray<double> > new_velocity;
+	Tensor<1,dim,VectorizedArray<double> > old_velocity;
+	if (test_transport==false)
+	  {
+	    for (unsigned int level=0; level<2; ++level)
+	      {
+		phi.read_dof_values_plain(level==0 ?
+					  new_nodal.hydraulic_conductivity :
+					  old_nodal.hydraulic_conductivity);
+		phi.evaluate(true,false);
+		for (unsigned int q=0; q<phi.n_q_points; ++q)
+		  hydraulic_conductivity[q]=phi.get_value(q);
+		phi.read_dof_values_plain(level==0 ?
+					  solution_flow_old_iteration :
+					  old_solution_flow);
+		phi.evaluate(false,true);
+		for (unsigned int q=0; q<phi.n_q_points; ++q)
+		  {
+		    Tensor<1,dim,VectorizedArray<double> > total_head_gradient=
+		      phi.get_gradient(q);
+		    total_head_gradient[dim-1]+=make_vectorized_array(1.);
+		    darcy_velocity[q]=//cm/s
+		      -1.*hydraulic_conductivity[q]*total_head_gradient;
+		  }
+		for (unsigned int d=0; d<dim; ++d)
+		  {
+		    for (unsigned int q=0; q<phi.n_q_points; ++q)
+		      phi.submit_value(darcy_velocity[q][d],q);
+		    if (level==0)
+		      new_velocity[d]=cell_integral(phi);
+		    else
+		      old_velocity[d]=cell_integral(phi);
+		  }
+	      }
+	    phi.read_dof_values_plain(nodal_nutrients);
+	    phi.evaluate(true,false);
+	    for (unsigned int q=0; q<phi.n_q_points; ++q)
+	      phi.submit_value(phi.get_value(q),q);
+	    nutrients=cell_integral(phi);//mg_nutrients
+
+	    phi.read_dof_values_plain(new_nodal.total_moisture_content);
+	    phi.evaluate(true,false);
+	    for (unsigned int q=0; q<phi.n_q_points; ++q)
+	      phi.submit_value(phi.get_value(q),q);
+	    total_moisture=cell_integral(phi);
+
+	    for (unsigned int q=0; q<phi.n_q_points; ++q)
+	      phi.submit_value(make_vectorized_array(1.),q);
+	    volume=cell_integral(phi);
+	  }
+	for (unsigned int v=0; v<data.n_components_filled(cell); ++v)
+	  {
+	    const typename DoFHandler<dim>::cell_iterator dof_cell=
+	      data.get_cell_iterator(cell,v);
+	    Tensor<1,dim> cell_new_velocity;
+	    Tensor<1,dim> cell_old_velocity;
+	    double porosity=0.;
+	    if (test_transport==false)
+	      {
+		for (unsigned int d=0; d<dim; ++d)
+		  {
+		    cell_new_velocity[d]=new_velocity[d][v]/volume[v];
+		    cell_old_velocity[d]=old_velocity[d][v]/volume[v];
+		  }
+		porosity=total_moisture[v]/volume[v];
+		nutrients_in_domain_current+=nutrients[v];
+	      }
+	    const unsigned int cell_index=dof_cell->active_cell_index();
+	    set_transport_cell_coefficients(cell_index,
+					    transport_cell_coefficients(cell_index,dof_cell->diameter(),
+									porosity,cell_new_velocity,
+									cell_old_velocity));
+	  }
+      }
+    /*
+     * The nodal sink factors without the porosity of the cells, see
+     * Assembly::Transport_Cell_Coefficients
+     */
+    Vector<double> new_sink_factor(mesh->dof_handler.n_dofs());
+    Vector<double> old_sink_factor(mesh->dof_handler.n_dofs());
+    if (parameters.homogeneous_decay_rate==true)
+      {
+	new_sink_factor.add(parameters.first_order_decay_factor);//1/s
+	old_sink_factor.add(parameters.first_order_decay_factor);
+      }
+    else if (test_transport==false)
+      {
+	for (unsigned int i=0; i<mesh->dof_handler.n_dofs(); ++i)
+	  {
+	    if (solution_transport(i)>1.E-1)
+	      new_sink_factor(i)=
+		new_nodal.biomass_concentration(i)*
+		parameters.maximum_substrate_use_rate*new_nodal.free_saturation(i)/
+		(new_nodal.free_saturation(i)*solution_transport(i)
+		 +parameters.half_velocity_constant/1000.);
+	    if (old_solution_transport(i)>1.E-4)
+	      old_sink_factor(i)=
+		old_nodal.biomass_concentration(i)*
+		parameters.maximum_substrate_use_rate*old_nodal.free_saturation(i)/
+		(old_nodal.free_saturation(i)*old_solution_transport(i)
+		 +parameters.half_velocity_constant/1000.);
+	  }
+      }
+    transport_operator.set_coefficients(transport_coefficients,
+					new_nodal.free_moisture_content,
+					old_nodal.free_moisture_content,
+					new_sink_factor,old_sink_factor,
+					theta_transport*time_step,
+					-1.*(1.-theta_transport)*time_step);
+    /*
+     * rhs=(M_old-(1-theta)*dt*L_old)*c_old plus the mass entering
+     * through the inflow faces, already condensed
+     */
+    transport_operator.apply_old(system_rhs_transport,old_solution_transport);
+    const double concentration_at_boundary=//mg_substrate/cm3_total_water
+      parameters.transport_top_fixed_value/1000.;
+    transport_operator.add_inflow(system_rhs_transport,
+				  time_step*theta_transport*concentration_at_boundary,
+				  time_step*(1.-theta_transport)*concentration_at_boundary);
+  }
+
+
+  template <int dim>
+  Quadrature<dim> Heat_Pipe<dim>::flow_quadrature() const
   {
-    system_rhs_flow.reinit         (dof_handler.n_dofs());
-    system_matrix_flow.reinit      (sparsity_pattern);
-    mass_matrix_richards.reinit        (sparsity_pattern);
-    laplace_matrix_new_richards.reinit (sparsity_pattern);
-    laplace_matrix_old_richards.reinit (sparsity_pattern);
-
     std::string quadrature_option;
     unsigned int order=0;
     if (parameters.lumped_matrix==false)
       {
-    	quadrature_option="gauss";
-    	order=2;
+	quadrature_option="gauss";
+	order=2;
       }
     if (parameters.lumped_matrix==true)
       quadrature_option="trapez";
 
-    QuadratureSelector<dim> quadrature_formula(quadrature_option,order);
-    QGauss<dim-1>     face_quadrature_formula(1);
-    FEValues<dim>fe_values(fe, quadrature_formula,
-  			   update_values|update_gradients|
-  			   update_quadrature_points|
-  			   update_JxW_values);
-    FEFaceValues<dim> fe_face_values(fe, face_quadrature_formula,
-  				     update_values|update_gradients|
-  				     update_normal_vectors|
-  				     update_quadrature_points|update_JxW_values);
-    const unsigned int dofs_per_cell  =fe.dofs_per_cell;
-    const unsigned int n_face_q_points=face_quadrature_formula.size();
-    const unsigned int n_q_points     =quadrature_formula.size();
-    
-    FullMatrix<double> cell_mass_matrix       (dofs_per_cell,dofs_per_cell);
-    FullMatrix<double> cell_laplace_matrix_new(dofs_per_cell,dofs_per_cell);
-    FullMatrix<double> cell_laplace_matrix_old(dofs_per_cell,dofs_per_cell);
-    Vector<double>     cell_rhs               (dofs_per_cell);
+    return (QuadratureSelector<dim>(quadrature_option,order));
+  }
 
-    std::vector<unsigned int> local_dof_indices(fe.dofs_per_cell);
-    Vector<double> old_pressure_values;
-    Vector<double> new_pressure_values;
-    Vector<double> old_hydraulic_conductivity_values;
-    Vector<double> new_hydraulic_conductivity_values;
-    Vector<double> old_total_moisture_content_values;
-    Vector<double> new_total_moisture_content_values;
-    Vector<double> old_moisture_capacity_values;
-    Vector<double> new_moisture_capacity_values;
-    
-    double face_boundary_indicator;
-    flow_at_top=0.;
-    flow_at_bottom=0.;
-    flow_column_1=0.;
-    flow_column_2=0.;
-    flow_column_3=0.;
-    unsigned int cell_integer_index=0;
-    typename DoFHandler<dim>::active_cell_iterator
-      cell = dof_handler.begin_active(),
-      endc = dof_handler.end();
-    for (; cell!=endc; ++cell)
+  template <int dim>
+  void Heat_Pipe<dim>::assemble_system_flow()
+  {
+    if (matrix_free_flow)
       {
-  	fe_values.reinit (cell);
-  	cell_mass_matrix       =0;
-  	cell_laplace_matrix_new=0;
-  	cell_laplace_matrix_old=0;
-  	cell_rhs               =0;
-
-  	old_pressure_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_pressure_values.reinit(cell->get_fe().dofs_per_cell);
-  	old_hydraulic_conductivity_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_hydraulic_conductivity_values.reinit(cell->get_fe().dofs_per_cell);
-  	old_total_moisture_content_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_total_moisture_content_values.reinit(cell->get_fe().dofs_per_cell);
-  	old_moisture_capacity_values.reinit(cell->get_fe().dofs_per_cell);
-  	new_moisture_capacity_values.reinit(cell->get_fe().dofs_per_cell);
-	
-  	cell->get_dof_values(old_solution_flow,old_pressure_values);
-  	cell->get_dof_values(solution_flow_old_iteration,new_pressure_values);
-  	cell->get_dof_values(old_nodal_hydraulic_conductivity,old_hydraulic_conductivity_values);
-  	cell->get_dof_values(new_nodal_hydraulic_conductivity,new_hydraulic_conductivity_values);
-  	cell->get_dof_values(old_nodal_total_moisture_content,old_total_moisture_content_values);
-  	cell->get_dof_values(new_nodal_total_moisture_content,new_total_moisture_content_values);
-  	cell->get_dof_values(old_nodal_specific_moisture_capacity,old_moisture_capacity_values);
-  	cell->get_dof_values(new_nodal_specific_moisture_capacity,new_moisture_capacity_values);
-	
-  	for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
-  	  {
-  	    for (unsigned int k=0; k<dofs_per_cell; k++)
-  	      {
-  		for (unsigned int i=0; i<dofs_per_cell; ++i)
-  		  {
-  		    for (unsigned int j=0; j<dofs_per_cell; ++j)
-  		      {
-  			if (parameters.moisture_transport_equation.compare("head")==0)
-  			  {
-  			    cell_mass_matrix(i,j)+=
-  			      (theta_richards)*
-  			      new_moisture_capacity_values[k]*
-  			      fe_values.shape_value(k,q_point)*
-  			      fe_values.shape_value(i,q_point)*
-  			      fe_values.shape_value(j,q_point)*
-  			      fe_values.JxW(q_point)
-  			      +
-  			      (1-theta_richards)*
-  			      old_moisture_capacity_values[k]*
-  			      fe_values.shape_value(k,q_point)*
-  			      fe_values.shape_value(i,q_point)*
-  			      fe_values.shape_value(j,q_point)*
-  			      fe_values.JxW(q_point);
-  			  }
-  			else if (parameters.moisture_transport_equation.compare("mixed")==0)
-  			  {
-  			    cell_mass_matrix(i,j)+=
-  			      new_moisture_capacity_values[k]*
-  			      fe_values.shape_value(k,q_point)*
-  			      fe_values.shape_value(j,q_point)*
-  			      fe_values.shape_value(i,q_point)*
-  			      fe_values.JxW(q_point);
-  			  }
-  			else
-  			  {
-  			    std::cout << "Moisture transport equation \""
-  				      << parameters.moisture_transport_equation
-  				      << "\" is not implemented. Error.\n";
-  			    throw -1;
-  			  }
-  			cell_laplace_matrix_new(i,j)+=(new_hydraulic_conductivity_values[k]*
-  						       fe_values.shape_value(k,q_point)*
-  						       fe_values.shape_grad(j,q_point)*
-  						       fe_values.shape_grad(i,q_point)*
-  						       fe_values.JxW(q_point));
-
-  			cell_laplace_matrix_old(i,j)+=(old_hydraulic_conductivity_values[k]*
-  						       fe_values.shape_value(k,q_point)*
-  						       fe_values.shape_grad(j,q_point)*
-  						       fe_values.shape_grad(i,q_point)*
-  						       fe_values.JxW(q_point));
-  		      }
-  		    cell_rhs(i)-=
-  		      time_step*
-  		      (theta_richards)*
-  		      new_hydraulic_conductivity_values[k]*
-  		      fe_values.shape_value(k,q_point)*
-  		      fe_values.shape_grad(i,q_point)[dim-1]*
-  		      fe_values.JxW(q_point)
-  		      +
-  		      time_step*
-  		      (1.-theta_richards)*
-  		      old_hydraulic_conductivity_values[k]*
-  		      fe_values.shape_value(k,q_point)*
-  		      fe_values.shape_grad(i,q_point)[dim-1]*
-  		      fe_values.JxW(q_point);
-		    
-  		    if (parameters.moisture_transport_equation.compare("mixed")==0)
-  		      {
-  			cell_rhs(i)-=(new_total_moisture_content_values[k]-
-  				      old_total_moisture_content_values[k])*
-  			  fe_values.shape_value(k,q_point)*
-  			  fe_values.shape_value(i,q_point)*
-  			  fe_values.JxW(q_point);
-  		      }
-  		  }
-  	      }
-  	  }
-	
-  	for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
-  	  {
-  	    if (cell->face(face)->at_boundary())
-  	      {
-  		fe_face_values.reinit (cell,face);
-  		face_boundary_indicator=cell->face(face)->boundary_id();
-		
-  		if ((face_boundary_indicator==11)&&//top
-  		    (parameters.richards_fixed_at_top==false))//second kind b.c.
-  		  {
-  		    double flow=0.0;
-  		    if (transient_drying==false)
-  		      flow=parameters.richards_top_flow_value;
-		    
-  		    for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
-  		      for (unsigned int k=0; k<dofs_per_cell; ++k)
-  			for (unsigned int i=0; i<dofs_per_cell; ++i)
-  			  cell_rhs(i)-=
-  			    time_step*
-  			    (theta_richards)*flow*
-  			    fe_face_values.shape_value(k,q_face_point)*
-  			    fe_face_values.shape_value(i,q_face_point)*
-  			    fe_face_values.JxW(q_face_point)
-  			    +
-  			    time_step*
-  			    (1.-theta_richards)*flow*
-  			    fe_face_values.shape_value(k,q_face_point)*
-  			    fe_face_values.shape_value(i,q_face_point)*
-  			    fe_face_values.JxW(q_face_point);
-  		  }
-		
-		if ((face_boundary_indicator==2)&&//bottom
-  		    (parameters.richards_fixed_at_bottom==false))//second kind b.c.
-  		  {
-  		    double flow=0.0;
-  		    if (transient_drying==false)
-  		      flow=parameters.richards_bottom_flow_value;
-		    
-  		    for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
-  		      for (unsigned int k=0; k<dofs_per_cell; ++k)
-  			for (unsigned int i=0; i<dofs_per_cell; ++i)
-  			  cell_rhs(i)-=
-  			    time_step*
-  			    (theta_richards)*flow*
-  			    fe_face_values.shape_value(k,q_face_point)*
-  			    fe_face_values.shape_value(i,q_face_point)*
-  			    fe_face_values.JxW(q_face_point)
-  			    +
-  			    time_step*
-  			    (1.-theta_richards)*flow*
-  			    fe_face_values.shape_value(k,q_face_point)*
-  			    fe_face_values.shape_value(i,q_face_point)*
-  			    fe_face_values.JxW(q_face_point);
-  		  }
-  		/*
-  		 * Estimate the flow passing throw the top and bottom boundaries
-  		 */
-  		if (face_boundary_indicator==11 ||// top right
-		    face_boundary_indicator==12 ||// top centre
-		    face_boundary_indicator==13 ||// top left
-  		    face_boundary_indicator==2)// bottom
-  		  {
-  		    double flow=0.;
-  		    for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
-  		      for (unsigned int k=0; k<dofs_per_cell; ++k)
-  			{
-  			  for (unsigned int i=0; i<dofs_per_cell; ++i)
-  			    {
-  			      for (unsigned int j=0; j<dofs_per_cell; ++j)
-  				{
-  				  flow-=
-  				    (theta_richards)*
-  				    new_hydraulic_conductivity_values[k]*
-  				    fe_face_values.shape_value(k,q_face_point)*
-  				    fe_face_values.normal_vector(q_face_point)*
-  				    fe_face_values.shape_grad(j,q_face_point)*
-  				    (
-  				     new_pressure_values(j)
-  				     +
-  				     cell->vertex(j)[dim-1]
-  				     )*
-  				    fe_face_values.shape_value(i,q_face_point)*
-  				    fe_face_values.JxW(q_face_point)
-  				    +
-  				    (1.-theta_richards)*
-  				    old_hydraulic_conductivity_values[k]*
-  				    fe_face_values.shape_value(k,q_face_point)*
-  				    fe_face_values.normal_vector(q_face_point)*
-  				    fe_face_values.shape_grad(j,q_face_point)*
-  				    (
-  				     old_pressure_values(j)
-  				     +
-  				     cell->vertex(j)[dim-1]
-  				     )*
-  				    fe_face_values.shape_value(i,q_face_point)*
-  				    fe_face_values.JxW(q_face_point);
-  				}
-  			    }
-  			}
-  		    if (face_boundary_indicator==11 ||
-			face_boundary_indicator==12 ||
-			face_boundary_indicator==13)//top
-		      {
-			flow_at_top+=flow;
-			if (face_boundary_indicator==11)// top right
-			  flow_column_1+=flow;
-			if (face_boundary_indicator==12)// top centre
-			  flow_column_2+=flow;
-			if (face_boundary_indicator==13)// top left
-			  flow_column_3+=flow;
-		      }
-  		    if (face_boundary_indicator==2)//bottom
-  		      flow_at_bottom+=flow;
-  		  }
-  	      }
-  	  }
-	
-  	cell_integer_index++;
-  	cell->get_dof_indices (local_dof_indices);
-  	for (unsigned int i=0; i<dofs_per_cell; ++i)
-  	  {
-  	    for (unsigned int j=0; j<dofs_per_cell; ++j)
-  	      {
-  		laplace_matrix_new_richards
-  		  .add(local_dof_indices[i],local_dof_indices[j],cell_laplace_matrix_new(i,j));
-  		laplace_matrix_old_richards
-  		  .add(local_dof_indices[i],local_dof_indices[j],cell_laplace_matrix_old(i,j));
-  		mass_matrix_richards
-  		  .add(local_dof_indices[i],local_dof_indices[j],cell_mass_matrix(i,j));
-  	      }
-  	    system_rhs_flow(local_dof_indices[i])+=cell_rhs(i);
-  	  }
+	assemble_system_flow_matrix_free();
+	return;
       }
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("assemble flow"));
+    /*
+     * The matrices are sized in setup_system(), here they are only
+     * set to zero
+     */
+    system_rhs_flow            =0;
+    system_matrix_flow         =0;
+    mass_matrix_richards       =0;
+    laplace_matrix_new_richards=0;
+    laplace_matrix_old_richards=0;
+
+    QGauss<dim-1> face_quadrature_formula(1);
+
+    if (mesh->flow_geometry.empty())
+      own_mesh->flow_geometry.reinit(mesh->dof_handler,flow_quadrature());
+
+    /*
+     * The cell loop runs in parallel. Each thread works on its own
+     * FEValues objects and local matrices (Scratch::Flow) and the
+     * results are added to the global matrices in
+     * copy_local_to_global_flow(). WorkStream calls the copier
+     * sequentially and in the order of the cells, so the results are
+     * the same as in a serial loop. The flows through the boundaries
+     * are computed once per time step in calculate_boundary_flows().
+     */
+    WorkStream::run(mesh->dof_handler.begin_active(),
+		    mesh->dof_handler.end(),
+		    *this,
+		    &Heat_Pipe<dim>::local_assemble_system_flow,
+		    &Heat_Pipe<dim>::copy_local_to_global_flow,
+		    Assembly::Scratch::Flow<dim>(fe,face_quadrature_formula),
+		    Assembly::CopyData::Flow<dim>(fe));
 
     // std::cout << std::scientific << std::setprecision(2)
     // 	      << "\tflow at top: " << flow_at_top << " cm3/s"
     // 	      << "\tflow at bottom: " << flow_at_bottom << " cm3/s\n";
     
     Vector<double> tmp(solution_flow_new_iteration.size ());
-    if (parameters.moisture_transport_equation.compare("head")==0)
+    if (head_equation)
       mass_matrix_richards.vmult(tmp,old_solution_flow);
-    else if (parameters.moisture_transport_equation.compare("mixed")==0)
-      mass_matrix_richards.vmult(tmp,solution_flow_old_iteration);
     else
-      {
-  	std::cout << "Moisture transport equation \""
-  		  << parameters.moisture_transport_equation
-  		  << "\" is not implemented. Error.\n";
-  	throw -1;
-      }
+      mass_matrix_richards.vmult(tmp,solution_flow_old_iteration);
 
     system_rhs_flow.add          ( 1.0,tmp);
     laplace_matrix_old_richards.vmult( tmp,old_solution_flow);
@@ -2368,8 +5424,8 @@ namespace TRL
     system_matrix_flow.copy_from(mass_matrix_richards);
     system_matrix_flow.add      (theta_richards*time_step, laplace_matrix_new_richards);
 
-    hanging_node_constraints.condense(system_matrix_flow);
-    hanging_node_constraints.condense(system_rhs_flow);
+    mesh->hanging_node_constraints.condense(system_matrix_flow);
+    mesh->hanging_node_constraints.condense(system_rhs_flow);
 
     std::map<unsigned int,double> boundary_values;
     if (parameters.richards_fixed_at_bottom==true)
@@ -2394,7 +5450,7 @@ namespace TRL
   	  boundary_condition_bottom_fixed_pressure=
 	    parameters.richards_bottom_fixed_value;
 	
-  	VectorTools::interpolate_boundary_values(dof_handler,
+  	VectorTools::interpolate_boundary_values(mesh->dof_handler,
   						 2,
   						 ConstantFunction<dim>
 						 (boundary_condition_bottom_fixed_pressure),
@@ -2410,17 +5466,17 @@ namespace TRL
   	  parameters.richards_top_fixed_value;
 	
   	boundary_values.clear();
-  	VectorTools::interpolate_boundary_values(dof_handler,
+  	VectorTools::interpolate_boundary_values(mesh->dof_handler,
   						 11,
   						 ConstantFunction<dim>
 						 (boundary_condition_top_fixed_pressure),
   						 boundary_values);
-	VectorTools::interpolate_boundary_values(dof_handler,
+	VectorTools::interpolate_boundary_values(mesh->dof_handler,
   						 12,
   						 ConstantFunction<dim>
 						 (boundary_condition_top_fixed_pressure),
   						 boundary_values);
-	VectorTools::interpolate_boundary_values(dof_handler,
+	VectorTools::interpolate_boundary_values(mesh->dof_handler,
   						 13,
   						 ConstantFunction<dim>
 						 (boundary_condition_top_fixed_pressure),
@@ -2432,64 +5488,745 @@ namespace TRL
       }
   }
 
+  template <int dim>
+  void Heat_Pipe<dim>::local_assemble_system_flow(const typename DoFHandler<dim>::active_cell_iterator &cell,
+						  Assembly::Scratch::Flow<dim> &scratch,
+						  Assembly::CopyData::Flow<dim> &data)
+  {
+    const Assembly::Geometry<dim> &geometry=mesh->flow_geometry;
+    FEFaceValues<dim> &fe_face_values=scratch.fe_face_values;
+
+    const unsigned int dofs_per_cell  =fe.dofs_per_cell;
+    const unsigned int n_face_q_points=fe_face_values.get_quadrature().size();
+    const unsigned int n_q_points     =geometry.n_q_points;
+
+    Cell_Values old_pressure_values;
+    Cell_Values new_pressure_values;
+    Cell_Values old_hydraulic_conductivity_values;
+    Cell_Values new_hydraulic_conductivity_values;
+    Cell_Values old_total_moisture_content_values;
+    Cell_Values new_total_moisture_content_values;
+    Cell_Values old_moisture_capacity_values;
+    Cell_Values new_moisture_capacity_values;
+
+    FullMatrix<double> &cell_mass_matrix       =data.cell_mass_matrix;
+    FullMatrix<double> &cell_laplace_matrix_new=data.cell_laplace_matrix_new;
+    FullMatrix<double> &cell_laplace_matrix_old=data.cell_laplace_matrix_old;
+    Vector<double>     &cell_rhs               =data.cell_rhs;
+
+    double face_boundary_indicator;
+
+    cell_mass_matrix       =0;
+    cell_laplace_matrix_new=0;
+    cell_laplace_matrix_old=0;
+    cell_rhs               =0;
+
+    cell->get_dof_indices(data.local_dof_indices);
+    for (unsigned int i=0; i<dofs_per_cell; ++i)
+      {
+	const unsigned int dof=data.local_dof_indices[i];
+	old_pressure_values[i]              =old_solution_flow(dof);
+	new_pressure_values[i]              =solution_flow_old_iteration(dof);
+	old_hydraulic_conductivity_values[i]=old_nodal.hydraulic_conductivity(dof);
+	new_hydraulic_conductivity_values[i]=new_nodal.hydraulic_conductivity(dof);
+	old_total_moisture_content_values[i]=old_nodal.total_moisture_content(dof);
+	new_total_moisture_content_values[i]=new_nodal.total_moisture_content(dof);
+	old_moisture_capacity_values[i]     =old_nodal.specific_moisture_capacity(dof);
+	new_moisture_capacity_values[i]     =new_nodal.specific_moisture_capacity(dof);
+      }
+
+    /*
+     * The coefficients are interpolated at each quadrature point once,
+     * and the geometry (JxW and shape function gradients) comes from
+     * the cache built in assemble_system_flow().
+     */
+    const unsigned int cell_index=cell->active_cell_index();
+    for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+      {
+	double new_moisture_capacity=0.;
+	double old_moisture_capacity=0.;
+	double new_hydraulic_conductivity=0.;
+	double old_hydraulic_conductivity=0.;
+	double moisture_content_change=0.;
+	for (unsigned int k=0; k<dofs_per_cell; k++)
+	  {
+	    const double shape_value_k=geometry.shape_value(k,q_point);
+	    new_moisture_capacity     +=new_moisture_capacity_values[k]*shape_value_k;
+	    old_moisture_capacity     +=old_moisture_capacity_values[k]*shape_value_k;
+	    new_hydraulic_conductivity+=new_hydraulic_conductivity_values[k]*shape_value_k;
+	    old_hydraulic_conductivity+=old_hydraulic_conductivity_values[k]*shape_value_k;
+	    moisture_content_change   +=(new_total_moisture_content_values[k]-
+					 old_total_moisture_content_values[k])*shape_value_k;
+	  }
+	const double JxW=geometry.JxW(cell_index,q_point);
+
+	double mass_factor=0.;
+	if (head_equation)
+	  mass_factor=
+	    ((theta_richards)*new_moisture_capacity+
+	     (1-theta_richards)*old_moisture_capacity)*JxW;
+	else
+	  mass_factor=
+	    new_moisture_capacity*JxW;
+
+	for (unsigned int i=0; i<dofs_per_cell; ++i)
+	  {
+	    const double         shape_value_i=geometry.shape_value(i,q_point);
+	    const Tensor<1,dim> &shape_grad_i =geometry.shape_grad(cell_index,i,q_point);
+	    for (unsigned int j=0; j<dofs_per_cell; ++j)
+	      {
+		const double grad_i_grad_j=
+		  geometry.shape_grad(cell_index,j,q_point)*shape_grad_i*JxW;
+
+		cell_mass_matrix(i,j)+=
+		  mass_factor*
+		  geometry.shape_value(j,q_point)*
+		  shape_value_i;
+		cell_laplace_matrix_new(i,j)+=new_hydraulic_conductivity*grad_i_grad_j;
+		cell_laplace_matrix_old(i,j)+=old_hydraulic_conductivity*grad_i_grad_j;
+	      }
+	    cell_rhs(i)-=
+	      time_step*
+	      ((theta_richards)*new_hydraulic_conductivity+
+	       (1.-theta_richards)*old_hydraulic_conductivity)*
+	      shape_grad_i[dim-1]*
+	      JxW;
+
+	    if (head_equation==false)
+	      cell_rhs(i)-=
+		moisture_content_change*
+		shape_value_i*
+		JxW;
+	  }
+      }
+
+    for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
+      {
+	if (cell->face(face)->at_boundary())
+	  {
+	    fe_face_values.reinit (cell,face);
+	    face_boundary_indicator=cell->face(face)->boundary_id();
+
+	    if ((face_boundary_indicator==11)&&//top
+		(parameters.richards_fixed_at_top==false))//second kind b.c.
+	      {
+		double flow=0.0;
+		if (transient_drying==false)
+		  flow=parameters.richards_top_flow_value;
+
+		for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
+		  for (unsigned int k=0; k<dofs_per_cell; ++k)
+		    for (unsigned int i=0; i<dofs_per_cell; ++i)
+		      cell_rhs(i)-=
+			time_step*
+			(theta_richards)*flow*
+			fe_face_values.shape_value(k,q_face_point)*
+			fe_face_values.shape_value(i,q_face_point)*
+			fe_face_values.JxW(q_face_point)
+			+
+			time_step*
+			(1.-theta_richards)*flow*
+			fe_face_values.shape_value(k,q_face_point)*
+			fe_face_values.shape_value(i,q_face_point)*
+			fe_face_values.JxW(q_face_point);
+	      }
+
+	    if ((face_boundary_indicator==2)&&//bottom
+		(parameters.richards_fixed_at_bottom==false))//second kind b.c.
+	      {
+		double flow=0.0;
+		if (transient_drying==false)
+		  flow=parameters.richards_bottom_flow_value;
+
+		for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
+		  for (unsigned int k=0; k<dofs_per_cell; ++k)
+		    for (unsigned int i=0; i<dofs_per_cell; ++i)
+		      cell_rhs(i)-=
+			time_step*
+			(theta_richards)*flow*
+			fe_face_values.shape_value(k,q_face_point)*
+			fe_face_values.shape_value(i,q_face_point)*
+			fe_face_values.JxW(q_face_point)
+			+
+			time_step*
+			(1.-theta_richards)*flow*
+			fe_face_values.shape_value(k,q_face_point)*
+			fe_face_values.shape_value(i,q_face_point)*
+			fe_face_values.JxW(q_face_point);
+	      }
+	  }
+      }
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::copy_local_to_global_flow(const Assembly::CopyData::Flow<dim> &data)
+  {
+    const unsigned int dofs_per_cell=fe.dofs_per_cell;
+    for (unsigned int i=0; i<dofs_per_cell; ++i)
+      {
+	for (unsigned int j=0; j<dofs_per_cell; ++j)
+	  {
+	    laplace_matrix_new_richards
+	      .add(data.local_dof_indices[i],data.local_dof_indices[j],data.cell_laplace_matrix_new(i,j));
+	    laplace_matrix_old_richards
+	      .add(data.local_dof_indices[i],data.local_dof_indices[j],data.cell_laplace_matrix_old(i,j));
+	    mass_matrix_richards
+	      .add(data.local_dof_indices[i],data.local_dof_indices[j],data.cell_mass_matrix(i,j));
+	  }
+	system_rhs_flow(data.local_dof_indices[i])+=data.cell_rhs(i);
+      }
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::assemble_system_flow_matrix_free()
+  {
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("assemble flow"));
+    /*
+     * Same system as assemble_system_flow(), but only its right hand
+     * side is assembled. The system is solved for the correction of
+     * the last iterate, with its first kind boundary values set:
+     * system_residual_flow=rhs-A*iterate (see solve_system_flow_matrix_free())
+     */
+    const bool top_fixed=
+      (parameters.richards_fixed_at_top==true && transient_drying==false);
+    if (rebuild_richards_operator || top_fixed!=richards_operator_top_fixed)
+      {
+	/*
+	 * The hanging nodes are copied, not computed again: in 3D
+	 * make_hanging_node_constraints() uses the user flags of the
+	 * triangulation, which other ensemble members may be reading
+	 */
+	flow_constraints.clear();
+	flow_constraints.merge(mesh->hanging_node_constraints);
+	if (parameters.richards_fixed_at_bottom==true)
+	  VectorTools::interpolate_boundary_values(mesh->dof_handler,
+						   2,
+						   ConstantFunction<dim>(0.),
+						   flow_constraints);
+	if (top_fixed)
+	  for (unsigned int boundary_id=11; boundary_id<=13; ++boundary_id)
+	    VectorTools::interpolate_boundary_values(mesh->dof_handler,
+						     boundary_id,
+						     ConstantFunction<dim>(0.),
+						     flow_constraints);
+	flow_constraints.close();
+	richards_operator.reinit(mesh->dof_handler,flow_constraints,
+				 parameters.lumped_matrix);
+	rebuild_richards_operator=false;
+	richards_operator_top_fixed=top_fixed;
+      }
+    if (head_equation)
+      richards_operator.set_coefficients(new_nodal.specific_moisture_capacity,
+					 old_nodal.specific_moisture_capacity,
+					 theta_richards,
+					 new_nodal.hydraulic_conductivity,
+					 theta_richards*time_step);
+    else
+      richards_operator.set_coefficients(new_nodal.specific_moisture_capacity,
+					 old_nodal.specific_moisture_capacity,
+					 1.,
+					 new_nodal.hydraulic_conductivity,
+					 theta_richards*time_step);
+
+    std::map<unsigned int,double> boundary_values;
+    if (parameters.richards_fixed_at_bottom==true)
+      {
+	double boundary_condition_bottom_fixed_pressure=
+	  parameters.domain_size+parameters.richards_top_fixed_value;
+	if (stop_flow==false)
+	  boundary_condition_bottom_fixed_pressure=
+	    parameters.richards_bottom_fixed_value;
+	VectorTools::interpolate_boundary_values(mesh->dof_handler,
+						 2,
+						 ConstantFunction<dim>
+						 (boundary_condition_bottom_fixed_pressure),
+						 boundary_values);
+      }
+    if (top_fixed)
+      for (unsigned int boundary_id=11; boundary_id<=13; ++boundary_id)
+	VectorTools::interpolate_boundary_values(mesh->dof_handler,
+						 boundary_id,
+						 ConstantFunction<dim>
+						 (parameters.richards_top_fixed_value),
+						 boundary_values);
+    solution_flow_new_iteration=solution_flow_old_iteration;
+    for (std::map<unsigned int,double>::const_iterator
+	   boundary_value=boundary_values.begin();
+	 boundary_value!=boundary_values.end(); ++boundary_value)
+      solution_flow_new_iteration(boundary_value->first)=boundary_value->second;
+    mesh->hanging_node_constraints.distribute(solution_flow_new_iteration);
+
+    system_rhs_flow=0;
+    richards_operator.get_matrix_free().
+      cell_loop(&Heat_Pipe<dim>::local_assemble_rhs_flow_matrix_free,
+		this,system_rhs_flow,
+		head_equation ? old_solution_flow : solution_flow_old_iteration);
+    /*
+     * Second kind boundaries, as in local_assemble_system_flow()
+     */
+    if (parameters.richards_fixed_at_top==false ||
+	parameters.richards_fixed_at_bottom==false)
+      {
+	QGauss<dim-1>     face_quadrature_formula(1);
+	FEFaceValues<dim> fe_face_values(fe,face_quadrature_formula,
+					 update_values|update_JxW_values);
+	const unsigned int dofs_per_cell  =fe.dofs_per_cell;
+	const unsigned int n_face_q_points=face_quadrature_formula.size();
+	Vector<double>            cell_rhs(dofs_per_cell);
+	std::vector<unsigned int> local_dof_indices(dofs_per_cell);
+	double flow_at_top_boundary=0.;
+	double flow_at_bottom_boundary=0.;
+	if (transient_drying==false)
+	  {
+	    flow_at_top_boundary   =parameters.richards_top_flow_value;
+	    flow_at_bottom_boundary=parameters.richards_bottom_flow_value;
+	  }
+	for (typename DoFHandler<dim>::active_cell_iterator cell=mesh->dof_handler.begin_active();
+	     cell!=mesh->dof_handler.end(); ++cell)
+	  if (cell->at_boundary())
+	    {
+	      cell_rhs=0;
+	      bool flux_face=false;
+	      for (unsigned int face=0; face<GeometryInfo<dim>::faces_per_cell; ++face)
+		if (cell->face(face)->at_boundary())
+		  {
+		    const unsigned int face_boundary_indicator=cell->face(face)->boundary_id();
+		    double flow=0.;
+		    if (face_boundary_indicator==11 &&//top
+			parameters.richards_fixed_at_top==false)//second kind b.c.
+		      flow=flow_at_top_boundary;
+		    else if (face_boundary_indicator==2 &&//bottom
+			     parameters.richards_fixed_at_bottom==false)//second kind b.c.
+		      flow=flow_at_bottom_boundary;
+		    else
+		      continue;
+		    flux_face=true;
+		    fe_face_values.reinit(cell,face);
+		    for (unsigned int q_face_point=0; q_face_point<n_face_q_points; ++q_face_point)
+		      for (unsigned int i=0; i<dofs_per_cell; ++i)
+			cell_rhs(i)-=
+			  time_step*flow*
+			  fe_face_values.shape_value(i,q_face_point)*
+			  fe_face_values.JxW(q_face_point);
+		  }
+	      if (flux_face)
+		{
+		  cell->get_dof_indices(local_dof_indices);
+		  flow_constraints.distribute_local_to_global(cell_rhs,
+							      local_dof_indices,
+							      system_rhs_flow);
+		}
+	    }
+      }
+
+    richards_operator.apply_plain(system_residual_flow,
+				  solution_flow_new_iteration);
+    system_residual_flow.sadd(-1.,1.,system_rhs_flow);
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::local_assemble_rhs_flow_matrix_free(const MatrixFree<dim,double>               &data,
+							   Vector<double>                             &dst,
+							   const Vector<double>                       &src,
+							   const std::pair<unsigned int,unsigned int> &cell_range) const
+  {
+    /*
+     * Cell terms of the right hand side of assemble_system_flow():
+     * the mass matrix applied to src (the old solution for the head
+     * form, the last iterate for the mixed form), the explicit part of
+     * the Laplace term, gravity and, for the mixed form, the change of
+     * the moisture content
+     */
+    typedef typename Richards_Operator<dim>::Evaluation Evaluation;
+    Evaluation phi(data);
+    Evaluation old_pressure(data);
+    Evaluation new_conductivity(data);
+    Evaluation old_conductivity(data);
+    Evaluation new_moisture_content(data);
+    Evaluation old_moisture_content(data);
+
+    const VectorizedArray<double> theta=make_vectorized_array(theta_richards);
+    const VectorizedArray<double> dt   =make_vectorized_array(time_step);
+    for (unsigned int cell=cell_range.first; cell<cell_range.second; ++cell)
+      {
+	phi.reinit(cell);
+	phi.read_dof_values_plain(src);
+	phi.evaluate(true,false);
+	old_pressure.reinit(cell);
+	old_pressure.read_dof_values_plain(old_solution_flow);
+	old_pressure.evaluate(false,true);
+	new_conductivity.reinit(cell);
+	new_conductivity.read_dof_values_plain(new_nodal.hydraulic_conductivity);
+	new_conductivity.evaluate(true,false);
+	old_conductivity.reinit(cell);
+	old_conductivity.read_dof_values_plain(old_nodal.hydraulic_conductivity);
+	old_conductivity.evaluate(true,false);
+	if (head_equation==false)
+	  {
+	    new_moisture_content.reinit(cell);
+	    new_moisture_content.read_dof_values_plain(new_nodal.total_moisture_content);
+	    new_moisture_content.evaluate(true,false);
+	    old_moisture_content.reinit(cell);
+	    old_moisture_content.read_dof_values_plain(old_nodal.total_moisture_content);
+	    old_moisture_content.evaluate(true,false);
+	  }
+	for (unsigned int q=0; q<phi.n_q_points; ++q)
+	  {
+	    VectorizedArray<double> value=
+	      richards_operator.mass_coefficient(cell,q)*phi.get_value(q);
+	    if (head_equation==false)
+	      value-=
+		new_moisture_content.get_value(q)-
+		old_moisture_content.get_value(q);
+
+	    const VectorizedArray<double> old_conductivity_value=
+	      old_conductivity.get_value(q);
+	    Tensor<1,dim,VectorizedArray<double> > gradient=
+	      (-(1.-theta)*dt*old_conductivity_value)*old_pressure.get_gradient(q);
+	    gradient[dim-1]-=
+	      dt*(theta*new_conductivity.get_value(q)+
+		  (1.-theta)*old_conductivity_value);
+
+	    phi.submit_value(value,q);
+	    phi.submit_gradient(gradient,q);
+	  }
+	phi.integrate(true,true);
+	phi.distribute_local_to_global(dst);
+      }
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::solve_system_flow_matrix_free()
+  {
+    /*
+     * CG for the correction of the iterate set in
+     * assemble_system_flow_matrix_free(), which is zero on the
+     * constrained dofs. The Chebyshev preconditioner only needs the
+     * operator and its diagonal.
+     */
+    SolverControl solver_control(1000*solution_flow_new_iteration.size(),
+				 1e-8*system_rhs_flow.l2_norm ());
+    SolverCG<> cg(solver_control);
+
+    typedef PreconditionChebyshev<Richards_Operator<dim>,Vector<double> > Preconditioner;
+    typename Preconditioner::AdditionalData chebyshev_data;
+    chebyshev_data.degree                 =parameters.flow_chebyshev_degree;
+    chebyshev_data.smoothing_range        =parameters.flow_chebyshev_smoothing_range;
+    chebyshev_data.matrix_diagonal_inverse=richards_operator.get_inverse_diagonal();
+    Preconditioner preconditioner;
+    preconditioner.initialize(richards_operator,chebyshev_data);
+
+    Vector<double> correction(solution_flow_new_iteration.size());
+    cg.solve(richards_operator,correction,system_residual_flow,preconditioner);
+    flow_constraints.distribute(correction);
+    solution_flow_new_iteration+=correction;
+
+    flow_solver_iterations=solver_control.last_step();
+    timing_monitor.add_count(timing_section("flow solver iterations"),
+			     flow_solver_iterations);
+  }
+
   template <int dim>
   void Heat_Pipe<dim>::solve_system_flow()
   {
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("solve flow"));
+    if (matrix_free_flow)
+      {
+	solve_system_flow_matrix_free();
+	return;
+      }
+#ifdef DEAL_II_WITH_UMFPACK
+    if (parameters.flow_solver.compare("direct")==0)
+      {
+	flow_direct_solver.factorize(system_matrix_flow);
+	flow_direct_solver.solve(system_rhs_flow,solution_flow_new_iteration);
+	mesh->hanging_node_constraints.distribute(solution_flow_new_iteration);
+	flow_solver_iterations=0;
+	return;
+      }
+#endif
     SolverControl solver_control(1000*solution_flow_new_iteration.size(),
   				 1e-8*system_rhs_flow.l2_norm ());
     SolverCG<> cg(solver_control);
-    PreconditionSSOR<> preconditioner;
-    preconditioner.initialize (system_matrix_flow, 1.2);
-    cg.solve(system_matrix_flow,solution_flow_new_iteration,
-  	     system_rhs_flow,preconditioner);
-    hanging_node_constraints.distribute(solution_flow_new_iteration);
+    if (parameters.flow_preconditioner.compare("amg")==0)
+      {
+#ifdef DEAL_II_WITH_TRILINOS
+	/*
+	 * The values of system_matrix_flow are copied row by row into the
+	 * Trilinos matrix. Its sparsity pattern was set in setup_system()
+	 * and is not touched here, so the (possibly old) AMG hierarchy
+	 * still refers to a valid matrix.
+	 */
+	std::vector<TrilinosWrappers::SparseMatrix::size_type> column_indices;
+	std::vector<TrilinosScalar>                            values;
+	for (unsigned int row=0; row<system_matrix_flow.m(); ++row)
+	  {
+	    column_indices.clear();
+	    values.clear();
+	    for (SparseMatrix<double>::const_iterator entry=system_matrix_flow.begin(row);
+		 entry!=system_matrix_flow.end(row); ++entry)
+	      {
+		column_indices.push_back(entry->column());
+		values.push_back(entry->value());
+	      }
+	    system_matrix_flow_trilinos.set(row,column_indices.size(),
+					    &column_indices[0],&values[0]);
+	  }
+	system_matrix_flow_trilinos.compress(VectorOperation::insert);
+
+	if (rebuild_flow_preconditioner)
+	  {
+	    TrilinosWrappers::PreconditionAMG::AdditionalData amg_data;
+	    amg_data.elliptic=true;
+	    amg_data.higher_order_elements=false;
+	    amg_data.smoother_sweeps=2;
+	    amg_data.aggregation_threshold=0.02;
+	    flow_amg_preconditioner.initialize(system_matrix_flow_trilinos,amg_data);
+	  }
+	cg.solve(system_matrix_flow,solution_flow_new_iteration,
+		 system_rhs_flow,flow_amg_preconditioner);
+#endif
+      }
+    else
+      {
+	PreconditionSSOR<> preconditioner;
+	preconditioner.initialize (system_matrix_flow, 1.2);
+	cg.solve(system_matrix_flow,solution_flow_new_iteration,
+		 system_rhs_flow,preconditioner);
+      }
+    mesh->hanging_node_constraints.distribute(solution_flow_new_iteration);
+    /*
+     * The AMG hierarchy is reused while it keeps the number of
+     * iterations close to the one obtained right after it was built.
+     */
+    flow_solver_iterations=solver_control.last_step();
+    timing_monitor.add_count(timing_section("flow solver iterations"),
+			     flow_solver_iterations);
+    if (rebuild_flow_preconditioner)
+      {
+	flow_preconditioner_reference_iterations=
+	  std::max(flow_solver_iterations,(unsigned int)1);
+	rebuild_flow_preconditioner=false;
+      }
+    else if (flow_solver_iterations>
+	     parameters.flow_amg_rebuild_ratio*flow_preconditioner_reference_iterations)
+      rebuild_flow_preconditioner=true;
+  }
+
+  template <int dim>
+  double Heat_Pipe<dim>::assemble_and_solve_system_flow()
+  {
+    /*
+     * One Picard step of the Richards equation. It only reads the
+     * previous iterate and the nodal properties computed in
+     * calculate_mass_balance_ratio(), and writes only to the flow
+     * system and solution_flow_new_iteration. That is why run() can
+     * call it in a separate task while the transport is assembled.
+     * Returns the relative residual of the previous iterate.
+     */
+    assemble_system_flow();
+    const double relative_residual=
+      compute_flow_residual();
+    solve_system_flow();
+    return (relative_residual);
+  }
+
+  template <int dim>
+  double Heat_Pipe<dim>::compute_flow_residual()
+  {
+    /*
+     * Residual of the Richards equation linearized around the last
+     * iterate (solution_flow_old_iteration) and evaluated there, i.e.
+     * the residual of the nonlinear problem at this iterate. It must be
+     * called right after assemble_system_flow(). Constrained (hanging)
+     * rows are not part of the system and are left out.
+     */
+    Vector<double> residual(solution_flow_old_iteration.size());
+    if (matrix_free_flow)
+      {
+	/*
+	 * Computed in assemble_system_flow_matrix_free(), with the first
+	 * kind boundary values set on the iterate. Those rows are left
+	 * out too.
+	 */
+	residual=system_residual_flow;
+      }
+    else
+      {
+	system_matrix_flow.vmult(residual,solution_flow_old_iteration);
+	residual-=system_rhs_flow;
+	mesh->hanging_node_constraints.set_zero(residual);
+      }
+
+    const double rhs_norm=system_rhs_flow.l2_norm();
+    if (rhs_norm>0.)
+      return (residual.l2_norm()/rhs_norm);
+    else
+      return (residual.l2_norm());
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::solve_system_transport()
+  {
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("solve transport"));
+#ifdef DEAL_II_WITH_UMFPACK
+    if (parameters.transport_solver.compare("direct")==0)
+      {
+	transport_direct_solver.factorize(system_matrix_transport);
+	transport_direct_solver.solve(system_rhs_transport,solution_transport);
+	mesh->hanging_node_constraints.distribute(solution_transport);
+	transport_solver_iterations=0;
+	transport_solver_residual  =0.;
+	return;
+      }
+#endif
+    SolverControl solver_control_transport(100*solution_transport.size(),
+					   1e-8*system_rhs_transport.l2_norm());
+    /*
+     * The ilu and mic preconditioners are either built in every Picard
+     * iteration or kept for the whole time step. In the latter case
+     * rebuild_transport_preconditioner is set at the beginning of each
+     * time step (see run()), when the time step changes and when the
+     * mesh changes (see setup_system()).
+     */
+    if (parameters.transport_preconditioner_update.compare("iteration")==0)
+      rebuild_transport_preconditioner=true;
+
+    if (matrix_free_transport)
+      {
+	PreconditionJacobi<Transport_Operator<dim> > preconditioner_transport;
+	preconditioner_transport
+	  .initialize(transport_operator,1.0);
+	solve_system_transport(solver_control_transport,transport_operator,
+			       preconditioner_transport);
+      }
+    else if (parameters.transport_preconditioner.compare("ilu")==0)
+      {
+	if (rebuild_transport_preconditioner)
+	  transport_ilu_preconditioner
+	    .initialize(system_matrix_transport,
+			SparseILU<double>::AdditionalData());
+	solve_system_transport(solver_control_transport,system_matrix_transport,
+			       transport_ilu_preconditioner);
+      }
+    else if (parameters.transport_preconditioner.compare("mic")==0)
+      {
+	if (rebuild_transport_preconditioner)
+	  transport_mic_preconditioner
+	    .initialize(system_matrix_transport,
+			SparseMIC<double>::AdditionalData());
+	solve_system_transport(solver_control_transport,system_matrix_transport,
+			       transport_mic_preconditioner);
+      }
+    else
+      {
+	PreconditionJacobi<> preconditioner_transport;
+	preconditioner_transport
+	  .initialize(system_matrix_transport,1.0);
+	solve_system_transport(solver_control_transport,system_matrix_transport,
+			       preconditioner_transport);
+      }
+    rebuild_transport_preconditioner=false;
+    mesh->hanging_node_constraints.distribute(solution_transport);
+
+    transport_solver_iterations=solver_control_transport.last_step();
+    timing_monitor.add_count(timing_section("transport solver iterations"),
+			     transport_solver_iterations);
+    transport_solver_residual  =solver_control_transport.last_value();
   }
 
   template <int dim>
-  void Heat_Pipe<dim>::solve_system_transport()
+  template <class MatrixType, class PreconditionerType>
+  void Heat_Pipe<dim>::solve_system_transport(SolverControl            &solver_control,
+					      const MatrixType         &system_matrix,
+					      const PreconditionerType &preconditioner)
   {
-    SolverControl solver_control_transport(100*solution_transport.size(),
-					   1e-8*system_rhs_transport.l2_norm());
-    
-    SolverBicgstab<> bicgstab_transport(solver_control_transport);
-    PreconditionJacobi<> preconditioner_transport;
-    preconditioner_transport
-      .initialize(system_matrix_transport,1.0);
-    bicgstab_transport
-      .solve(system_matrix_transport,solution_transport,
-    	     system_rhs_transport,preconditioner_transport);
-    hanging_node_constraints.distribute(solution_transport);
+    if (parameters.transport_solver.compare("gmres")==0)
+      {
+	SolverGMRES<> gmres_transport(solver_control,
+				      SolverGMRES<>::AdditionalData(parameters.transport_gmres_restart));
+	gmres_transport
+	  .solve(system_matrix,solution_transport,
+		 system_rhs_transport,preconditioner);
+      }
+    else
+      {
+	SolverBicgstab<> bicgstab_transport(solver_control);
+	bicgstab_transport
+	  .solve(system_matrix,solution_transport,
+		 system_rhs_transport,preconditioner);
+      }
   }
 
   template <int dim>
   void Heat_Pipe<dim>::output_results()
   {
-    DataOut<dim> data_out;
+    Timing_Monitor::Scope timing_scope(timing_monitor,
+				       timing_section("output results"));
+    /*
+     * The vectors are copied here and written by write_output(), in
+     * the background if asynchronous output is set. The previous
+     * output must be finished before its copies are overwritten.
+     */
+    wait_for_output();
 
-    Vector<double> test;
-    test.reinit(dof_handler.n_dofs());
-    unsigned int i=0;
-    for (std::map<unsigned int,double>::iterator it=repeated_points.begin();
-    	 it!=repeated_points.end(); it++)
+    const Vector<double> *dof_vectors[]=
+      {
+	&solution_flow_new_iteration,
+	&solution_transport,
+	&new_nodal.biomass_fraction,
+	&new_nodal.free_moisture_content,
+	&new_nodal.total_moisture_content,
+	&new_nodal.hydraulic_conductivity,
+	&new_nodal.specific_moisture_capacity,
+	//&new_nodal.free_saturation,
+	&mesh->dof_valence
+      };
+    const char *dof_names[]=
+      {
+	"pressure(cm_total_water)",
+	"substrate(mg_substrate_per_cm3_total_water)",
+	"biomass(cm3_biomass_per_cm3_void)",
+	"free_water(cm3_free_water_per_cm3_soi)",
+	"total_water(cm3_total_water_per_cm3_soil)",
+	"hydraulic_conductivity(cm_per_s)",
+	"specific_moisture_capacity(cm3_total_water_per_(cm3_soil)(cm_total_water))",
+	//"effective_free_saturation",
+	"test"
+      };
+    const Vector<double> *cell_vectors[]=
       {
-    	test[i]=it->second;
-    	i++;
+	&mesh->boundary_ids,
+	&velocity_x,
+	&velocity_y,
+	&velocity_z
+      };
+    const char *cell_names[]=
+      {
+	"boundary_ids",
+	"velocity_x",
+	"velocity_y",
+	"velocity_z"
+      };
+    const unsigned int n_dof_vectors =sizeof(dof_vectors)/sizeof(dof_vectors[0]);
+    const unsigned int n_cell_vectors=(dim==3 ? 4 : 3);
+
+    output_vectors.resize(n_dof_vectors+n_cell_vectors);
+    output_names.resize  (n_dof_vectors+n_cell_vectors);
+    for (unsigned int i=0; i<n_dof_vectors; ++i)
+      {
+	output_vectors[i]=*dof_vectors[i];
+	output_names[i]  =dof_names[i];
       }
-    
-    data_out.attach_dof_handler(dof_handler);
-    data_out.add_data_vector(solution_flow_new_iteration,"pressure(cm_total_water)");
-    data_out.add_data_vector(solution_transport,"substrate(mg_substrate_per_cm3_total_water)");
-    data_out.add_data_vector(new_nodal_biomass_fraction,"biomass(cm3_biomass_per_cm3_void)");
-    data_out.add_data_vector(new_nodal_free_moisture_content,"free_water(cm3_free_water_per_cm3_soi)");
-    data_out.add_data_vector(new_nodal_total_moisture_content,"total_water(cm3_total_water_per_cm3_soil)");
-    data_out.add_data_vector(new_nodal_hydraulic_conductivity,"hydraulic_conductivity(cm_per_s)");
-    data_out.add_data_vector(new_nodal_specific_moisture_capacity,"specific_moisture_capacity(cm3_total_water_per_(cm3_soil)(cm_total_water))");
-    //data_out.add_data_vector(new_nodal_free_saturation,"effective_free_saturation");
-    data_out.add_data_vector(boundary_ids,"boundary_ids");
-    data_out.add_data_vector(test,"test");
-    data_out.add_data_vector(velocity_x,"velocity_x");
-    data_out.add_data_vector(velocity_y,"velocity_y");
-    data_out.build_patches();
+    for (unsigned int i=0; i<n_cell_vectors; ++i)
+      {
+	output_vectors[n_dof_vectors+i]=*cell_vectors[i];
+	output_names[n_dof_vectors+i]  =cell_names[i];
+      }
+    n_output_dof_vectors=n_dof_vectors;
     
     std::stringstream tsn;
     tsn << timestep_number;
@@ -2506,8 +6243,6 @@ namespace TRL
 
     std::stringstream d;
     d << dim;
-    std::stringstream c;
-    c << triangulation.n_active_cells();
 
     std::string output_file_format=parameters.output_file_format;
 
@@ -2526,35 +6261,102 @@ namespace TRL
     if (transient_transport==true && parameters.homogeneous_decay_rate==true)
       time_period+="_decaying";
 
-    std::string filename;
+    std::string run_name;
+    std::string output_name;
     if (test_transport==false)
       {
-  	filename = parameters.output_directory + "/solution_"
-  	  + parameters.moisture_transport_equation + "_" + lm
-  	  + d.str() + "d_"
-	  + parameters.sand_fraction + "_"
+	run_name = parameters.diagnostics_prefix + "solution_"
+	  + parameters.moisture_transport_equation + "_" + lm
+	  + d.str() + "d_"
+	  + parameters.sand_fraction;
+	output_name = run_name + "_"
   	  + time_period + "_t_" + t.str()
   	  + output_file_format;
       }
     else
       {
-  	filename = parameters.output_directory + "/solution_"
-  	  + d.str() + "d_"
+	run_name = parameters.diagnostics_prefix + "solution_"
+  	  + d.str() + "d";
+	output_name = run_name + "_"
   	  + "tsn_" + tsn.str()
   	  + output_file_format;
       }
+    /*
+     * The .pvd file indexes all .vtu files of the run by time, paths
+     * are relative to the output directory
+     */
+    output_records.push_back(std::make_pair(time,output_name));
+
+    const std::string filename=
+      parameters.output_directory + "/" + output_name;
+    const std::string pvd_filename=
+      parameters.output_directory + "/" + run_name + ".pvd";
+    if (parameters.asynchronous_output==true)
+      {
+	output_task=
+	  Threads::new_task(&Heat_Pipe<dim>::write_output,
+			    *this,filename,pvd_filename,time);
+	output_in_task=true;
+      }
+    else
+      write_output(filename,pvd_filename,time);
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::write_output(const std::string filename,
+				    const std::string pvd_filename,
+				    const double      output_time)
+  {
+    /*
+     * Not named after the period, which may change while the output
+     * is written in the background
+     */
+    Timing_Monitor::Scope timing_scope(timing_monitor,"write output");
+    DataOut<dim> data_out;
+
+    data_out.attach_dof_handler(mesh->dof_handler);
+    for (unsigned int i=0; i<output_vectors.size(); ++i)
+      data_out.add_data_vector(output_vectors[i],output_names[i],
+			       (i<n_output_dof_vectors ?
+				DataOut<dim>::type_dof_data :
+				DataOut<dim>::type_cell_data));
+    data_out.build_patches();
+
+    std::string output_file_format=parameters.output_file_format;
     std::ofstream output (filename.c_str());
     if (output_file_format.compare(".gp")==0)
       data_out.write_gnuplot (output);
     else if (output_file_format.compare(".vtu")==0)
-      data_out.write_vtu (output);
+      {
+	DataOutBase::VtkFlags vtk_flags;
+	vtk_flags.time=output_time;
+	if (parameters.compress_output==true)
+	  vtk_flags.compression_level=DataOutBase::VtkFlags::best_speed;
+	else
+	  vtk_flags.compression_level=DataOutBase::VtkFlags::no_compression;
+	data_out.set_flags(vtk_flags);
+	data_out.write_vtu (output);
+
+	std::ofstream pvd_output (pvd_filename.c_str());
+	DataOutBase::write_pvd_record (pvd_output,output_records);
+      }
     else
       {
-  	std::cout << "Error in output function. Output file format "
-  		  << "not implemented.\n Current output file format is: "
-  		  << output_file_format << "\n" << "Options are: "
-  		  << ".gp, .vtu"
-  		  << std::endl;
+  	terminal << "Error in output function. Output file format "
+		 << "not implemented.\n Current output file format is: "
+		 << output_file_format << "\n" << "Options are: "
+		 << ".gp, .vtu"
+		 << std::endl;
+      }
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::wait_for_output()
+  {
+    if (output_in_task)
+      {
+	output_task.join();
+	output_in_task=false;
       }
   }
 
@@ -2567,8 +6369,8 @@ namespace TRL
     if (parameters.initial_state.compare("default")==0 ||
   	parameters.initial_state.compare("no_drying")==0)
       {
-  	VectorTools::project(dof_handler,
-  			     hanging_node_constraints,
+  	VectorTools::project(mesh->dof_handler,
+  			     mesh->hanging_node_constraints,
   			     QGauss<dim>(3),
   			     ConstantFunction<dim>(parameters.initial_condition_homogeneous_flow),
   			     old_solution_flow);
@@ -2577,8 +6379,8 @@ namespace TRL
   	solution_flow_old_iteration=
   	  old_solution_flow;
 	
-  	VectorTools::project(dof_handler,
-			     hanging_node_constraints,
+  	VectorTools::project(mesh->dof_handler,
+			     mesh->hanging_node_constraints,
 			     QGauss<dim>(3),
 			     ConstantFunction<dim>(parameters//mg_substrate/cm3_water
 						   .initial_condition_homogeneous_transport/1000.),
@@ -2586,16 +6388,16 @@ namespace TRL
   	solution_transport=old_solution_transport;
 	
 	initial_condition_biomass();
-	old_nodal_biomass_concentration=
-	  new_nodal_biomass_concentration;// mg_biomass/cm3_soil
+	old_nodal.biomass_concentration=
+	  new_nodal.biomass_concentration;// mg_biomass/cm3_soil
   	// define the rest of the nodal vectors
 	calculate_mass_balance_ratio();
-	old_nodal_biomass_fraction=new_nodal_biomass_fraction;
-  	old_nodal_total_moisture_content=new_nodal_total_moisture_content;
-  	old_nodal_free_moisture_content=new_nodal_free_moisture_content;
-  	old_nodal_hydraulic_conductivity=new_nodal_hydraulic_conductivity;
-  	old_nodal_specific_moisture_capacity=new_nodal_specific_moisture_capacity;
-	old_nodal_free_saturation=new_nodal_free_saturation;
+	old_nodal.biomass_fraction=new_nodal.biomass_fraction;
+  	old_nodal.total_moisture_content=new_nodal.total_moisture_content;
+  	old_nodal.free_moisture_content=new_nodal.free_moisture_content;
+  	old_nodal.hydraulic_conductivity=new_nodal.hydraulic_conductivity;
+  	old_nodal.specific_moisture_capacity=new_nodal.specific_moisture_capacity;
+	old_nodal.free_saturation=new_nodal.free_saturation;
       }
     // else if (parameters.initial_state.compare("dry")==0)
     //   {
@@ -2632,8 +6434,8 @@ namespace TRL
     // 	  if (!file.is_open())
     // 	    throw 2;
 
-    // 	  old_nodal_biomass_concentration.block_read(file);
-    // 	  new_nodal_biomass_concentration=old_nodal_biomass_concentration;
+    // 	  old_nodal.biomass_concentration.block_read(file);
+    // 	  new_nodal.biomass_concentration=old_nodal.biomass_concentration;
 	  
     // 	  file.close();
     // 	  if (file.is_open())
@@ -2675,8 +6477,8 @@ namespace TRL
     // 	  if (!file.is_open())
     // 	    throw 2;
 
-    // 	  old_nodal_biomass_concentration.block_read(file);
-    // 	  new_nodal_biomass_concentration=old_nodal_biomass_concentration;
+    // 	  old_nodal.biomass_concentration.block_read(file);
+    // 	  new_nodal.biomass_concentration=old_nodal.biomass_concentration;
 	  
     // 	  file.close();
     // 	  if (file.is_open())
@@ -2712,182 +6514,755 @@ namespace TRL
     // 	  if (file.is_open())
     // 	    throw 3;
 
-    // 	}
-    // 	{
-    // 	  std::ifstream file("state_final_bacteria.ph");
-    // 	  if (!file.is_open())
-    // 	    throw 2;
+    // 	}
+    // 	{
+    // 	  std::ifstream file("state_final_bacteria.ph");
+    // 	  if (!file.is_open())
+    // 	    throw 2;
+
+    // 	  old_nodal.biomass_concentration.block_read(file);
+    // 	  new_nodal.biomass_concentration=old_nodal.biomass_concentration;
+	  
+    // 	  file.close();
+    // 	  if (file.is_open())
+    // 	    throw 3;
+    // 	}
+    //   }
+    else
+      {
+  	terminal << "Wrong initial state specified in input file."
+		 << "\"" << parameters.initial_state << "\" is not a valid "
+		 << "parameter.";
+  	throw 1;
+      }
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::initial_condition_biomass()
+  {
+    /*
+     * The initial condition for biomass defined in the input file is given in
+     * mg_biomass/L_total_water. It needs to be transformed to mg_biomass/cm3_total_water.
+     * This is done in this way:
+     *
+     * B[mg_biomass/L_total_water]=
+     * B[mg_biomass/L_total_water]*
+     * water_volume_ratio[L_total_water/1000 cm3_total_water]
+     * =[mg_biomass/L_total_water]*[L_total_water/1000 cm3_total_water]
+     * =(1/1000)*[mg_biomass/cm3_total_water]
+     */
+    
+    // for (unsigned int i=0; i<dof_handler.n_dofs(); i++)
+    //   {
+    // 	new_nodal.biomass_concentration[i]=//mg_biomass/cm3_total_water(void_space)
+    // 	  (1./1000.)*parameters.initial_condition_homogeneous_bacteria;
+    // 	new_nodal.biomass_fraction[i]=
+    // 	  new_nodal.biomass_concentration[i]/
+    // 	  parameters.biomass_dry_density;
+    //   }
+    //----------------------------------------------------------------------
+    QGauss<dim>quadrature_formula(2);
+    FEValues<dim>fe_values(fe, quadrature_formula,
+			   update_values|update_gradients|
+			   update_quadrature_points|
+			   update_JxW_values);
+    //const unsigned int dofs_per_cell=fe.dofs_per_cell;
+    Vector<double> initial_biomass_values;
+    Vector<double> initial_biomass_fraction;
+    typename DoFHandler<dim>::active_cell_iterator
+      cell = mesh->dof_handler.begin_active(),
+      endc = mesh->dof_handler.end();
+    for (; cell!=endc; ++cell)
+      {
+	initial_biomass_values
+	  .reinit(cell->get_fe().dofs_per_cell);
+	initial_biomass_fraction
+	  .reinit(cell->get_fe().dofs_per_cell);
+	
+	for (unsigned int i=0; i<GeometryInfo<dim>::vertices_per_cell; i++)
+	  {
+	    if (dim==1)
+	      {
+		if (cell->material_id()==50)
+		  {
+		    initial_biomass_values[i]=
+		      (1./1000.)*parameters
+		      .initial_condition_homogeneous_bacteria_column_1;
+		    initial_biomass_fraction[i]=
+		      (1./1000.)*parameters
+		      .initial_condition_homogeneous_bacteria_column_1
+		      /parameters.biomass_dry_density;
+		  }
+	      }
+	    else if (dim==2 || dim==3)
+	      {
+		double biomass=0.;
+		if (cell->material_id()==50)
+		  biomass=parameters
+		    .initial_condition_homogeneous_bacteria_column_1;
+		else if (cell->material_id()==51)
+		  biomass=parameters
+		    .initial_condition_homogeneous_bacteria_column_2;
+		else if (cell->material_id()==52)
+		  biomass=parameters
+		    .initial_condition_homogeneous_bacteria_column_3;
+		else
+		  biomass=0.;
+		
+		initial_biomass_values[i]=
+		  (1./1000.)*biomass;
+		initial_biomass_fraction[i]=
+		  (1./1000.)*biomass
+		  /parameters.biomass_dry_density;
+	      }
+	    else
+	      {
+		terminal << "Error, initial biomass function not implemented"
+			 << " for dim " << dim << std::endl;
+		throw -1;
+	      }
+	  }
+	
+	cell->set_dof_values(initial_biomass_values,
+			     new_nodal.biomass_concentration);
+	cell->set_dof_values(initial_biomass_fraction,
+			     new_nodal.biomass_fraction);
+      }
+  }
+  
+  template <int dim>
+  double Heat_Pipe<dim>::estimate_time_step_error() const
+  {
+    /*
+     * Local error of the current time step, estimated as the difference
+     * between the solution and its linear extrapolation from the two
+     * previous time steps. Each component is weighted with
+     * atol+rtol*|u| and the weighted RMS norms of pressure and
+     * substrate are combined with max(), so that values below one mean
+     * the step is within tolerance.
+     */
+    const double ratio=time_step/old_time_step;
+    double error_flow=0.;
+    double error_transport=0.;
+    const unsigned int n_dofs=solution_flow_new_iteration.size();
+    for (unsigned int i=0; i<n_dofs; ++i)
+      {
+	const double predicted_flow=
+	  old_solution_flow[i]+ratio*(old_solution_flow[i]-older_solution_flow[i]);
+	const double weight_flow=
+	  parameters.time_step_absolute_tolerance_flow+
+	  parameters.time_step_relative_tolerance*fabs(solution_flow_new_iteration[i]);
+	error_flow+=
+	  std::pow((solution_flow_new_iteration[i]-predicted_flow)/weight_flow,2);
+
+	if (transient_transport==true && coupled_transport==true)
+	  {
+	    const double predicted_transport=
+	      old_solution_transport[i]+ratio*(old_solution_transport[i]-older_solution_transport[i]);
+	    const double weight_transport=
+	      parameters.time_step_absolute_tolerance_transport+
+	      parameters.time_step_relative_tolerance*fabs(solution_transport[i]);
+	    error_transport+=
+	      std::pow((solution_transport[i]-predicted_transport)/weight_transport,2);
+	  }
+      }
+    return (std::max(std::sqrt(error_flow/n_dofs),
+		     std::sqrt(error_transport/n_dofs)));
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::time_step_bounds(double &minimum_time_step,
+					double &maximum_time_step) const
+  {
+    if (transient_drying==true)
+      {
+	minimum_time_step=parameters.minimum_time_step_drying;
+	maximum_time_step=parameters.maximum_time_step_drying;
+      }
+    else if (transient_saturation==true)
+      {
+	minimum_time_step=parameters.minimum_time_step_saturation;
+	maximum_time_step=parameters.maximum_time_step_saturation;
+      }
+    else
+      {
+	minimum_time_step=parameters.minimum_time_step_transport;
+	maximum_time_step=parameters.maximum_time_step_transport;
+      }
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::print_info(unsigned int it,
+				  double rel_err_flow,
+				  double rel_err_tran) const
+  {
+    terminal.setf(std::ios::scientific,std::ios::floatfield);
+    terminal << "\ttimestep number: " << std::fixed << timestep_number
+	     << "\tit: "      << std::fixed << it
+	     << "\tcell #s: " << mesh->triangulation.n_active_cells() << "\n"
+	     << std::setprecision(5)
+	     << "\ttime step: " << time_step << " s\n"
+	     << "\tflow of nutrients at bottom: " << nutrient_flow_at_bottom << " mg/s\n"
+	     << "\tflow of nutrients at top   : " << nutrient_flow_at_top << " mg/s\n"
+	     << "\tnutrients in domain        : "
+	     << fabs(nutrients_in_domain_current-nutrients_in_domain_previous) << " mg\n"
+	     << "\tcumulative flow of nutrients at bottom: " << cumulative_flow_at_bottom << " mg\n"
+	     << "\tcumulative flow of nutrients at top   : " << cumulative_flow_at_top << " mg\n"
+	     << "\tcumulative nutrients in domain        : " << nutrients_in_domain_previous << " mg\n"
+	     << "\trelative error transport: "
+	     << std::scientific << rel_err_tran << "%\n"
+	     << "\trelative error flow: "
+	     << rel_err_flow << "%\n" 
+	     << "\tflow solver iterations: " << flow_solver_iterations
+	     << " (" << parameters.flow_solver << ", "
+	     << parameters.flow_preconditioner << ")\n"
+	     << "\ttransport solver iterations: " << transport_solver_iterations
+	     << " (" << parameters.transport_solver << ", "
+	     << parameters.transport_preconditioner << ")"
+	     << "\tresidual: " << transport_solver_residual << "\n"
+	     << "\tbiomass in domain: "
+	     << fabs(biomass_in_domain_current-biomass_in_domain_previous) << " mg\n"
+	     << "\tX: " << solution_transport.norm_sqr() << "\n\n";
+  }
+  
+  template <int dim>
+  unsigned long long Heat_Pipe<dim>::mesh_cache_key() const
+  {
+    /*
+     * Everything the initial mesh depends on: the grid options and,
+     * if it is read, the contents of the mesh file
+     */
+    std::stringstream key;
+    key << "version " << Checkpoint::version
+	<< " dim " << dim
+	<< " use mesh file " << (use_mesh_file && dim>1)
+	<< " domain size " << parameters.domain_size
+	<< " refinement level " << refinement_level << "\n";
+    if (use_mesh_file && dim>1)
+      {
+	std::ifstream mesh_file(mesh_filename.c_str());
+	key << mesh_file.rdbuf();
+      }
+    return (Checkpoint::hash_string(key.str()));
+  }
+
+  template <int dim>
+  std::string Heat_Pipe<dim>::mesh_cache_filename() const
+  {
+    std::stringstream filename;
+    filename << parameters.mesh_cache_directory << "/mesh_" << dim << "d_"
+	     << std::hex << std::setw(16) << std::setfill('0')
+	     << mesh_cache_key() << ".cache";
+    return (filename.str());
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::write_mesh(std::ostream &file) const
+  {
+    /*
+     * The coarse cells (vertices, material and boundary ids) and the
+     * refinement tree of the current mesh. The mesh is rebuilt from
+     * them in read_mesh(), also if it was coarsened below the initial
+     * refinement
+     */
+    std::vector<unsigned int> coarse_vertex_index(mesh->triangulation.n_vertices(),
+						  numbers::invalid_unsigned_int);
+    std::vector<Point<dim> > coarse_vertices;
+    std::vector<char> refinement_tree;
+    std::vector<typename Triangulation<dim>::cell_iterator> active_cells;
+    for (typename Triangulation<dim>::cell_iterator cell=mesh->triangulation.begin(0);
+	 cell!=mesh->triangulation.end(0); ++cell)
+      {
+	for (unsigned int v=0; v<GeometryInfo<dim>::vertices_per_cell; ++v)
+	  if (coarse_vertex_index[cell->vertex_index(v)]==numbers::invalid_unsigned_int)
+	    {
+	      coarse_vertex_index[cell->vertex_index(v)]=coarse_vertices.size();
+	      coarse_vertices.push_back(cell->vertex(v));
+	    }
+	Checkpoint::add_to_refinement_tree(cell,refinement_tree,active_cells);
+      }
+
+    Checkpoint::write_value(file,(unsigned int)coarse_vertices.size());
+    for (unsigned int i=0; i<coarse_vertices.size(); ++i)
+      for (unsigned int d=0; d<dim; ++d)
+	Checkpoint::write_value(file,coarse_vertices[i][d]);
+    Checkpoint::write_value(file,mesh->triangulation.n_cells(0));
+    for (typename Triangulation<dim>::cell_iterator cell=mesh->triangulation.begin(0);
+	 cell!=mesh->triangulation.end(0); ++cell)
+      {
+	for (unsigned int v=0; v<GeometryInfo<dim>::vertices_per_cell; ++v)
+	  Checkpoint::write_value(file,coarse_vertex_index[cell->vertex_index(v)]);
+	Checkpoint::write_value(file,(unsigned int)cell->material_id());
+	for (unsigned int f=0; f<GeometryInfo<dim>::faces_per_cell; ++f)
+	  Checkpoint::write_value(file,(unsigned int)cell->face(f)->boundary_id());
+      }
+    Checkpoint::write_value(file,(unsigned int)refinement_tree.size());
+    if (refinement_tree.size()>0)
+      file.write(&refinement_tree[0],refinement_tree.size());
+  }
+
+  template <int dim>
+  bool Heat_Pipe<dim>::read_mesh(std::istream &file)
+  {
+    /*
+     * Builds the triangulation, which has to be empty, from the data
+     * of write_mesh(). Returns false, and leaves the triangulation
+     * empty, if the data is truncated or the mesh can not be rebuilt
+     */
+    unsigned int n_vertices=0;
+    Checkpoint::read_value(file,n_vertices);
+    std::vector<Point<dim> > vertices(n_vertices);
+    for (unsigned int i=0; i<n_vertices; ++i)
+      for (unsigned int d=0; d<dim; ++d)
+	Checkpoint::read_value(file,vertices[i][d]);
+
+    unsigned int n_coarse_cells=0;
+    Checkpoint::read_value(file,n_coarse_cells);
+    std::vector<CellData<dim> > cells(n_coarse_cells);
+    std::vector<unsigned int> face_boundary_ids(n_coarse_cells*
+						GeometryInfo<dim>::faces_per_cell);
+    for (unsigned int c=0; c<n_coarse_cells; ++c)
+      {
+	for (unsigned int v=0; v<GeometryInfo<dim>::vertices_per_cell; ++v)
+	  Checkpoint::read_value(file,cells[c].vertices[v]);
+	unsigned int material_id=0;
+	Checkpoint::read_value(file,material_id);
+	cells[c].material_id=material_id;
+	for (unsigned int f=0; f<GeometryInfo<dim>::faces_per_cell; ++f)
+	  Checkpoint::read_value(file,
+				 face_boundary_ids[c*GeometryInfo<dim>::faces_per_cell+f]);
+      }
+    unsigned int tree_size=0;
+    Checkpoint::read_value(file,tree_size);
+    std::vector<char> refinement_tree(tree_size);
+    if (tree_size>0)
+      file.read(&refinement_tree[0],tree_size);
+    if (!file || n_coarse_cells==0)
+      return false;
+
+    own_mesh->triangulation.create_triangulation(vertices,cells,SubCellData());
+    /*
+     * The boundary ids are set before the refinement, the children
+     * of the faces inherit them
+     */
+    unsigned int c=0;
+    for (typename Triangulation<dim>::cell_iterator cell=own_mesh->triangulation.begin(0);
+	 cell!=own_mesh->triangulation.end(0); ++cell, ++c)
+      for (unsigned int f=0; f<GeometryInfo<dim>::faces_per_cell; ++f)
+	if (cell->face(f)->at_boundary())
+	  cell->face(f)->set_boundary_id(face_boundary_ids[c*GeometryInfo<dim>::faces_per_cell+f]);
+    Checkpoint::apply_refinement_tree(own_mesh->triangulation,refinement_tree);
+
+    std::vector<char> mesh_refinement_tree;
+    std::vector<typename Triangulation<dim>::cell_iterator> active_cells;
+    for (typename Triangulation<dim>::cell_iterator cell=own_mesh->triangulation.begin(0);
+	 cell!=own_mesh->triangulation.end(0); ++cell)
+      Checkpoint::add_to_refinement_tree(cell,mesh_refinement_tree,active_cells);
+    if (mesh_refinement_tree!=refinement_tree)
+      {
+	own_mesh->triangulation.clear();
+	return false;
+      }
+    return true;
+  }
+
+  template <int dim>
+  bool Heat_Pipe<dim>::share_mesh() const
+  {
+    /*
+     * Only a mesh that does not change can be shared, and a restart
+     * rebuilds the mesh of its checkpoint
+     */
+    return (shared_meshes!=0 &&
+	    parameters.adaptive_refinement==false &&
+	    parameters.restart_from_checkpoint==false);
+  }
+
+  template <int dim>
+  unsigned long long Heat_Pipe<dim>::shared_mesh_key() const
+  {
+    /*
+     * Everything a shared mesh depends on: the initial mesh and the
+     * quadrature of the cached flow geometry
+     */
+    std::stringstream key;
+    key << mesh_cache_key()
+	<< " lumped matrix " << parameters.lumped_matrix;
+    return (Checkpoint::hash_string(key.str()));
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::create_initial_mesh()
+  {
+    /*
+     * The initial mesh is read from the mesh cache if there is one for
+     * the grid options and the mesh file, and written to it otherwise
+     */
+    const bool use_mesh_cache=
+      parameters.mesh_cache_directory.empty()==false;
+    bool mesh_from_cache=false;
+    if (use_mesh_cache)
+      mesh_from_cache=read_mesh_cache();
+    if (mesh_from_cache==false)
+      read_grid();
+    setup_system();
+    if (mesh_from_cache==false)
+      {
+	if (dim>1)
+	  {
+	    refine_grid(1);
+	    refine_grid(4);
+	    refine_grid(4);
+	  }
+	if (use_mesh_cache)
+	  write_mesh_cache();
+      }
+    repeated_vertices();
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::write_mesh_cache() const
+  {
+    /*
+     * The initial mesh, i.e. the one of read_grid() and the refinement
+     * at selected regions in run(). Ensemble members, and other runs,
+     * may write the same cache at the same time: the file is written
+     * under a name unique to this process and object and then renamed,
+     * so readers only see complete files
+     */
+    const std::string filename=mesh_cache_filename();
+    std::stringstream temporary_filename;
+    temporary_filename << filename << "." << getpid() << "_" << this << ".tmp";
+    std::ofstream file(temporary_filename.str().c_str(),std::ios::binary);
+    if (!file.is_open())
+      {
+	terminal << "Warning. The mesh cache " << filename
+		 << " could not be written.\n";
+	return;
+      }
+    Checkpoint::write_value(file,mesh_cache_key());
+    write_mesh(file);
+    file.close();
+    if (!file ||
+	std::rename(temporary_filename.str().c_str(),filename.c_str())!=0)
+      {
+	std::remove(temporary_filename.str().c_str());
+	terminal << "Warning. The mesh cache " << filename
+		 << " could not be written.\n";
+	return;
+      }
+    terminal << "\tMesh cache written: " << filename << "\n";
+  }
+
+  template <int dim>
+  bool Heat_Pipe<dim>::read_mesh_cache()
+  {
+    /*
+     * Returns false, and leaves the triangulation empty, if there is
+     * no cache for the current grid options and mesh file
+     */
+    const std::string filename=mesh_cache_filename();
+    std::ifstream file(filename.c_str(),std::ios::binary);
+    if (!file.is_open())
+      return false;
+
+    unsigned long long key=0;
+    Checkpoint::read_value(file,key);
+    if (key!=mesh_cache_key())
+      return false;
 
-    // 	  old_nodal_biomass_concentration.block_read(file);
-    // 	  new_nodal_biomass_concentration=old_nodal_biomass_concentration;
-	  
-    // 	  file.close();
-    // 	  if (file.is_open())
-    // 	    throw 3;
-    // 	}
-    //   }
-    else
+    if (read_mesh(file)==false)
       {
-  	std::cout << "Wrong initial state specified in input file."
-  		  << "\"" << parameters.initial_state << "\" is not a valid "
-  		  << "parameter.";
-  	throw 1;
+	terminal << "Warning. The mesh cache " << filename
+		 << " is truncated, it is not used.\n";
+	return false;
       }
+    terminal << "\tMesh read from cache: " << filename << "\n";
+    return true;
   }
 
   template <int dim>
-  void Heat_Pipe<dim>::initial_condition_biomass()
+  void Heat_Pipe<dim>::write_checkpoint(const std::string &filename) const
   {
+    std::vector<char> refinement_tree;
+    std::vector<typename DoFHandler<dim>::cell_iterator> active_cells;
+    for (typename DoFHandler<dim>::cell_iterator cell=mesh->dof_handler.begin(0);
+	 cell!=mesh->dof_handler.end(0); ++cell)
+      Checkpoint::add_to_refinement_tree(cell,refinement_tree,active_cells);
+
+    std::ofstream file(filename.c_str(),std::ios::binary);
+    if (!file.is_open())
+      {
+	terminal << "Error. The checkpoint file " << filename
+		 << " could not be opened.\n";
+	throw -1;
+      }
+    Checkpoint::write_value(file,Checkpoint::version);
+    Checkpoint::write_value(file,(unsigned int)dim);
+    write_mesh(file);
+
+    Checkpoint::write_value(file,timestep_number);
+    Checkpoint::write_value(file,last_adaptation_timestep);
+    Checkpoint::write_value(file,time);
+    Checkpoint::write_value(file,time_step);
+    Checkpoint::write_value(file,old_time_step);
+    Checkpoint::write_value(file,milestone_time);
+    Checkpoint::write_value(file,time_for_dry_conditions);
+    Checkpoint::write_value(file,time_for_saturated_conditions);
+    Checkpoint::write_value(file,last_adaptation_time);
+    Checkpoint::write_value(file,cumulative_flow_at_top);
+    Checkpoint::write_value(file,cumulative_flow_at_bottom);
+    Checkpoint::write_value(file,nutrients_in_domain_previous);
+    Checkpoint::write_value(file,biomass_in_domain_previous);
+    Checkpoint::write_value(file,figure_count);
+    Checkpoint::write_value(file,transient_drying);
+    Checkpoint::write_value(file,transient_saturation);
+    Checkpoint::write_value(file,transient_transport);
+    Checkpoint::write_value(file,stop_flow);
+    Checkpoint::write_value(file,redefine_time_step);
     /*
-     * The initial condition for biomass defined in the input file is given in
-     * mg_biomass/L_total_water. It needs to be transformed to mg_biomass/cm3_total_water.
-     * This is done in this way:
-     *
-     * B[mg_biomass/L_total_water]=
-     * B[mg_biomass/L_total_water]*
-     * water_volume_ratio[L_total_water/1000 cm3_total_water]
-     * =[mg_biomass/L_total_water]*[L_total_water/1000 cm3_total_water]
-     * =(1/1000)*[mg_biomass/cm3_total_water]
+     * Only the state at the end of the time step is stored, the rest of
+     * the vectors is recomputed from it
      */
-    
-    // for (unsigned int i=0; i<dof_handler.n_dofs(); i++)
-    //   {
-    // 	new_nodal_biomass_concentration[i]=//mg_biomass/cm3_total_water(void_space)
-    // 	  (1./1000.)*parameters.initial_condition_homogeneous_bacteria;
-    // 	new_nodal_biomass_fraction[i]=
-    // 	  new_nodal_biomass_concentration[i]/
-    // 	  parameters.biomass_dry_density;
-    //   }
-    //----------------------------------------------------------------------
-    QGauss<dim>quadrature_formula(2);
-    FEValues<dim>fe_values(fe, quadrature_formula,
-			   update_values|update_gradients|
-			   update_quadrature_points|
-			   update_JxW_values);
-    //const unsigned int dofs_per_cell=fe.dofs_per_cell;
-    Vector<double> initial_biomass_values;
-    Vector<double> initial_biomass_fraction;
-    typename DoFHandler<dim>::active_cell_iterator
-      cell = dof_handler.begin_active(),
-      endc = dof_handler.end();
-    for (; cell!=endc; ++cell)
+    const Vector<double> *fields[]=
       {
-	initial_biomass_values
-	  .reinit(cell->get_fe().dofs_per_cell);
-	initial_biomass_fraction
-	  .reinit(cell->get_fe().dofs_per_cell);
-	
-	for (unsigned int i=0; i<GeometryInfo<dim>::vertices_per_cell; i++)
-	  {
-	    if (dim==1)
-	      {
-		if (cell->material_id()==50)
-		  {
-		    initial_biomass_values[i]=
-		      (1./1000.)*parameters
-		      .initial_condition_homogeneous_bacteria_column_1;
-		    initial_biomass_fraction[i]=
-		      (1./1000.)*parameters
-		      .initial_condition_homogeneous_bacteria_column_1
-		      /parameters.biomass_dry_density;
-		  }
-	      }
-	    else if (dim==2)
-	      {
-		double biomass=0.;
-		if (cell->material_id()==50)
-		  biomass=parameters
-		    .initial_condition_homogeneous_bacteria_column_1;
-		else if (cell->material_id()==51)
-		  biomass=parameters
-		    .initial_condition_homogeneous_bacteria_column_2;
-		else if (cell->material_id()==52)
-		  biomass=parameters
-		    .initial_condition_homogeneous_bacteria_column_3;
-		else
-		  biomass=0.;
-		
-		initial_biomass_values[i]=
-		  (1./1000.)*biomass;
-		initial_biomass_fraction[i]=
-		  (1./1000.)*biomass
-		  /parameters.biomass_dry_density;
-	      }
-	    else
-	      {
-		std::cout << "Error, initial biomass function not implemented"
-			  << " for dim " << dim << std::endl;
-		throw -1;
-	      }
-	  }
-	
-	cell->set_dof_values(initial_biomass_values,
-			     new_nodal_biomass_concentration);
-	cell->set_dof_values(initial_biomass_fraction,
-			     new_nodal_biomass_fraction);
+	&old_solution_flow,
+	&old_solution_transport,
+	&old_nodal.biomass_concentration,
+	&old_nodal.biomass_fraction,
+	&old_nodal.total_moisture_content,
+	&old_nodal.free_moisture_content,
+	&old_nodal.hydraulic_conductivity,
+	&old_nodal.specific_moisture_capacity,
+	&old_nodal.free_saturation
+      };
+    Vector<double> cell_values(fe.dofs_per_cell);
+    for (unsigned int f=0; f<sizeof(fields)/sizeof(fields[0]); ++f)
+      for (unsigned int c=0; c<active_cells.size(); ++c)
+	{
+	  active_cells[c]->get_dof_values(*fields[f],cell_values);
+	  file.write(reinterpret_cast<const char *>(cell_values.begin()),
+		     cell_values.size()*sizeof(double));
+	}
+    file.close();
+    terminal << "\tCheckpoint written: " << filename << "\n";
+  }
+
+  template <int dim>
+  void Heat_Pipe<dim>::read_checkpoint(const std::string &filename)
+  {
+    std::ifstream file(filename.c_str(),std::ios::binary);
+    if (!file.is_open())
+      {
+	terminal << "Error. The checkpoint file " << filename
+		 << " could not be opened.\n";
+	throw -1;
+      }
+    unsigned int checkpoint_version=0;
+    unsigned int checkpoint_dim=0;
+    Checkpoint::read_value(file,checkpoint_version);
+    Checkpoint::read_value(file,checkpoint_dim);
+    if (checkpoint_version!=Checkpoint::version ||
+	checkpoint_dim!=dim)
+      {
+	terminal << "Error. The checkpoint file " << filename
+		 << " was written with a different version or dimension.\n";
+	throw -1;
+      }
+    /*
+     * The mesh is rebuilt from the coarse cells stored in the checkpoint
+     * and not from read_grid(), the adaptive refinement may have
+     * coarsened it below the initial refinement level
+     */
+    if (read_mesh(file)==false)
+      {
+	terminal << "Error. The mesh could not be rebuilt from the "
+		 << "checkpoint file " << filename << ".\n";
+	throw -1;
+      }
+
+    Checkpoint::read_value(file,timestep_number);
+    Checkpoint::read_value(file,last_adaptation_timestep);
+    Checkpoint::read_value(file,time);
+    Checkpoint::read_value(file,time_step);
+    Checkpoint::read_value(file,old_time_step);
+    Checkpoint::read_value(file,milestone_time);
+    Checkpoint::read_value(file,time_for_dry_conditions);
+    Checkpoint::read_value(file,time_for_saturated_conditions);
+    Checkpoint::read_value(file,last_adaptation_time);
+    Checkpoint::read_value(file,cumulative_flow_at_top);
+    Checkpoint::read_value(file,cumulative_flow_at_bottom);
+    Checkpoint::read_value(file,nutrients_in_domain_previous);
+    Checkpoint::read_value(file,biomass_in_domain_previous);
+    Checkpoint::read_value(file,figure_count);
+    Checkpoint::read_value(file,transient_drying);
+    Checkpoint::read_value(file,transient_saturation);
+    Checkpoint::read_value(file,transient_transport);
+    Checkpoint::read_value(file,stop_flow);
+    Checkpoint::read_value(file,redefine_time_step);
+    setup_system();
+
+    std::vector<char> refinement_tree;
+    std::vector<typename DoFHandler<dim>::cell_iterator> active_cells;
+    for (typename DoFHandler<dim>::cell_iterator cell=mesh->dof_handler.begin(0);
+	 cell!=mesh->dof_handler.end(0); ++cell)
+      Checkpoint::add_to_refinement_tree(cell,refinement_tree,active_cells);
+
+    Vector<double> *fields[]=
+      {
+	&old_solution_flow,
+	&old_solution_transport,
+	&old_nodal.biomass_concentration,
+	&old_nodal.biomass_fraction,
+	&old_nodal.total_moisture_content,
+	&old_nodal.free_moisture_content,
+	&old_nodal.hydraulic_conductivity,
+	&old_nodal.specific_moisture_capacity,
+	&old_nodal.free_saturation
+      };
+    Vector<double> cell_values(fe.dofs_per_cell);
+    for (unsigned int f=0; f<sizeof(fields)/sizeof(fields[0]); ++f)
+      for (unsigned int c=0; c<active_cells.size(); ++c)
+	{
+	  file.read(reinterpret_cast<char *>(cell_values.begin()),
+		    cell_values.size()*sizeof(double));
+	  active_cells[c]->set_dof_values(cell_values,*fields[f]);
+	}
+    if (!file)
+      {
+	terminal << "Error. The checkpoint file " << filename
+		 << " is truncated.\n";
+	throw -1;
       }
+    file.close();
+
+    solution_flow_new_iteration=old_solution_flow;
+    solution_flow_old_iteration=old_solution_flow;
+    solution_transport         =old_solution_transport;
+    new_nodal=old_nodal;
+
+    terminal << "\tRestarted from: " << filename << "\n"
+	     << "\ttimestep_number: " << timestep_number << "\n"
+	     << "\ttime: " << time/3600 << " h\n"
+	     << "\ttime_step: " << time_step << " s\n"
+	     << "\tcells: " << mesh->triangulation.n_active_cells() << "\n";
   }
-  
+
   template <int dim>
-  void Heat_Pipe<dim>::print_info(unsigned int it,
-				  double rel_err_flow,
-				  double rel_err_tran) const
+  std::string Heat_Pipe<dim>::timing_section(const std::string &name) const
   {
-    std::cout.setf(std::ios::scientific,std::ios::floatfield);
-    std::cout << "\ttimestep number: " << std::fixed << timestep_number
-	      << "\tit: "      << std::fixed << it
-	      << "\tcell #s: " << triangulation.n_active_cells() << "\n"
-	      << std::setprecision(5)
-	      << "\ttime step: " << time_step << " s\n"
-	      << "\tflow of nutrients at bottom: " << nutrient_flow_at_bottom << " mg/s\n"
-	      << "\tflow of nutrients at top   : " << nutrient_flow_at_top << " mg/s\n"
-	      << "\tnutrients in domain        : "
-	      << fabs(nutrients_in_domain_current-nutrients_in_domain_previous) << " mg\n"
-	      << "\tcumulative flow of nutrients at bottom: " << cumulative_flow_at_bottom << " mg\n"
-	      << "\tcumulative flow of nutrients at top   : " << cumulative_flow_at_top << " mg\n"
-	      << "\tcumulative nutrients in domain        : " << nutrients_in_domain_previous << " mg\n"
-	      << "\trelative error transport: "
-	      << std::scientific << rel_err_tran << "%\n"
-      	      << "\trelative error flow: "
-	      << rel_err_flow << "%\n" 
-	      << "\tbiomass in domain: "
-	      << fabs(biomass_in_domain_current-biomass_in_domain_previous) << " mg\n"
-	      << "\tX: " << solution_transport.norm_sqr() << "\n\n";
+    if (transient_drying==true)
+      return ("drying/"+name);
+    else if (transient_saturation==true)
+      return ("saturating/"+name);
+    else
+      return ("transporting/"+name);
   }
-  
+
   template <int dim>
   void Heat_Pipe<dim>::run()
   {
-    read_grid();
-    setup_system();
-    if (dim==2)
+    /*
+     * A restart takes the mesh, the state and the step count from the
+     * checkpoint. Otherwise the initial mesh is created (see
+     * create_initial_mesh()), or, in an ensemble, read from the first
+     * member with the same mesh. That member also builds the cached
+     * geometry, which a shared mesh can not build when it is needed
+     */
+    unsigned int first_timestep_number=1;
+    if (parameters.restart_from_checkpoint==true)
       {
-	refine_grid(1);
-	refine_grid(4);
-	refine_grid(4);
+	read_checkpoint(parameters.restart_file);
+	first_timestep_number=timestep_number+1;
+	repeated_vertices();
       }
-    repeated_vertices();
-    initial_condition();
+    else if (share_mesh())
+      {
+	typename Shared_Meshes<dim>::Entry &entry=
+	  shared_meshes->entry(shared_mesh_key());
+	Threads::Mutex::ScopedLock lock(entry.mutex);
+	if (entry.mesh_data)
+	  {
+	    own_mesh.reset();
+	    mesh=entry.mesh_data;
+	    setup_system();
+	    terminal << "\tMesh shared with another ensemble member\n";
+	  }
+	else
+	  {
+	    create_initial_mesh();
+	    own_mesh->flow_geometry.reinit(own_mesh->dof_handler,
+					   flow_quadrature());
+	    own_mesh->transport_geometry.reinit(own_mesh->dof_handler,
+						QGauss<dim>(2));
+	    entry.mesh_data=own_mesh;
+	  }
+      }
+    else
+      create_initial_mesh();
+    setup_hydraulic_properties();
+    if (parameters.restart_from_checkpoint==false)
+      initial_condition();
     
-    std::cout << "Solving problem with : "
-	      << "\n\ttheta pressure     : " << theta_richards
-	      << "\n\ttheta transport    : " << theta_transport
-	      << "\n\ttimestep_number_max: " << timestep_number_max
-	      << "\n\ttime_step          : " << time_step
-	      << "\n\ttime_max           : " << time_max
-	      << "\n\trefinement_level   : " << refinement_level
-	      << "\n\tuse_mesh_file      : " << use_mesh_file
-	      << "\n\tmesh_filename      : " << mesh_filename
-	      << "\n\tcells              : " << triangulation.n_active_cells()
-	      << "\n\tInitial State      : " << parameters.initial_state
-	      << "\n\tTransport output frequency: " << parameters.output_frequency_transport
-	      << "\n\n";
+    terminal << "Solving problem with : "
+	     << "\n\ttheta pressure     : " << theta_richards
+	     << "\n\ttheta transport    : " << theta_transport
+	     << "\n\ttimestep_number_max: " << timestep_number_max
+	     << "\n\ttime_step          : " << time_step
+	     << "\n\ttime_max           : " << time_max
+	     << "\n\trefinement_level   : " << refinement_level
+	     << "\n\tuse_mesh_file      : " << use_mesh_file
+	     << "\n\tmesh_filename      : " << mesh_filename
+	     << "\n\tcells              : " << mesh->triangulation.n_active_cells()
+	     << "\n\tInitial State      : " << parameters.initial_state
+	     << "\n\tTransport output frequency: " << parameters.output_frequency_transport
+	     << "\n\n";
+    {
+      std::vector<std::string> column_names;
+      column_names.push_back("n");
+      column_names.push_back("time (h)");
+      column_names.push_back("k_e (cm/s)");
+      column_names.push_back("flow_1 (cm3/s)");
+      if (dim>1)
+	{
+	  column_names.push_back("flow_2 (cm3/s)");
+	  column_names.push_back("flow_3 (cm3/s)");
+	}
+      column_names.push_back("flow_bottom (cm3/s)");
+      column_names.push_back("flow_top (cm3/s)");
+      column_names.push_back("nutrients_bottom (mg/s)");
+      column_names.push_back("nutrients_top (mg/s)");
+      column_names.push_back("cumulative flow nutrients at bottom (mg/s)");
+      column_names.push_back("cumulative flow nutrients at top (mg/s)");
+      column_names.push_back("cumulative nutrients in domain (mg)");
+      column_names.push_back("cumulative biomass in domain (mg)");
+      column_names.push_back("biomass_1 (mg)");
+      if (dim>1)
+	{
+	  column_names.push_back("biomass_2 (mg)");
+	  column_names.push_back("biomass_3 (mg)");
+	}
+      const bool binary=(parameters.output_data_format.compare("binary")==0);
+      std::stringstream filename;
+      filename << parameters.diagnostics_prefix
+	       << "output_data_" << dim << "d_"
+	       << parameters.relative_permeability_model << "_"
+	       << parameters.sand_fraction << "_"
+	       << parameters.yield_coefficient << "_"
+	       << parameters.maximum_substrate_use_rate << "_"
+	       << parameters.half_velocity_constant
+	       << (binary ? ".bin" : ".txt");
+      output_data.open(filename.str(),column_names,binary,
+		       parameters.output_data_flush_interval);
+    }
     
-    for (timestep_number=1;
+    for (timestep_number=first_timestep_number;
     	 timestep_number<parameters.timestep_number_max;
     	 ++timestep_number)
       {
     	double relative_error_flow=1000;
+    	double relative_residual_flow=1000;
+    	double initial_residual_flow=1000;
     	double relative_error_transport=0;
     	double old_norm_flow=0.;
     	double new_norm_flow=0.;
@@ -2896,33 +7271,91 @@ namespace TRL
     	unsigned int iteration=0;
     	unsigned int step=0;
     	bool remain_in_loop=true;
+	bool reject_time_step=false;
+	bool phase_changed=false;
+	/* *
+	 * Multirate stepping: a frozen flow is solved again when the
+	 * pump is switched, when the transport period ends or after a
+	 * fixed number of time steps
+	 * */
+	if (parameters.freeze_steady_flow==true &&
+	    solve_flow==false &&
+	    (stop_flow!=frozen_stop_flow ||
+	     transient_transport==false ||
+	     timestep_number-flow_frozen_timestep>=parameters.flow_freeze_interval))
+	  solve_flow=true;
+	time_step_error=0.;
+	rebuild_transport_preconditioner=true;
+	flow_anderson_acceleration.clear();
 	do
     	  {
-    	    if (transient_transport==true && iteration==10)
+    	    if ((transient_transport==true && iteration==10) ||
+		reject_time_step==true)
     	      {
-    	    	time_step=time_step/2.;
+		if (reject_time_step==false)
+		  {
+		    time_step=time_step/2.;
+		    timing_monitor.add_count(timing_section("halved time steps"));
+		  }
+		reject_time_step=false;
+		rebuild_transport_preconditioner=true;
+		flow_anderson_acceleration.clear();
     	    	relative_error_flow=1000;
+		relative_residual_flow=1000;
     	    	relative_error_transport=0;
     	    	iteration=0;
     	      }
-    	    /* *
+    	    timing_monitor.add_count(timing_section("picard iterations"));
+	    /* *
     	     * ASSEMBLE systems
     	     * */
     	    calculate_mass_balance_ratio();
-    	    if (solve_flow && test_transport==false)
+	    const bool flow_step=
+	      solve_flow && test_transport==false;
+	    const bool transport_step=
+	      (transient_transport==true || test_transport==true) && coupled_transport==true;
+	    /* *
+	     * The flow (assembly and solution) and the transport assembly
+	     * depend only on the previous iterate, so the flow may run as
+	     * a separate task while the transport is assembled. The task
+	     * is joined before solution_flow_old_iteration is updated
+	     * */
+	    Threads::Task<double> flow_task;
+	    bool flow_in_task=false;
+    	    if (flow_step)
 	      {
-		assemble_system_flow();
+		if (transport_step && parameters.concurrent_flow_and_transport)
+		  {
+		    flow_task=
+		      Threads::new_task(&Heat_Pipe<dim>::assemble_and_solve_system_flow,
+					*this);
+		    flow_in_task=true;
+		  }
+		else
+		  relative_residual_flow=
+		    assemble_and_solve_system_flow();
 	      }
-    	    if ((transient_transport==true || test_transport==true) && coupled_transport==true)
+    	    if (transport_step)
 	      {
 		assemble_system_transport();
 	      }
+	    if (flow_in_task)
+	      relative_residual_flow=
+		flow_task.return_value();
+	    if (flow_step && iteration==0)
+	      initial_residual_flow=
+		relative_residual_flow;
     	    /* *
     	     * SOLVE systems
     	     * */
-    	    if(solve_flow && test_transport==false)
+    	    if (flow_step)
     	      {
-    		solve_system_flow();
+		if (parameters.nonlinear_solver=="anderson")
+		  {
+		    flow_anderson_acceleration.apply(solution_flow_old_iteration,
+						     solution_flow_new_iteration);
+		    mesh->hanging_node_constraints.distribute(solution_flow_new_iteration);
+		  }
     		old_norm_flow=
     		  solution_flow_old_iteration.norm_sqr();
     		new_norm_flow=
@@ -2954,7 +7387,15 @@ namespace TRL
     	     * */
     	    if (test_transport==false)
     	      {
-    		if (relative_error_flow<1.E-3 &&
+		bool flow_converged=false;
+		if (!solve_flow)
+		  flow_converged=true;
+		else if (parameters.convergence_criterion=="residual")
+		  flow_converged=relative_residual_flow<parameters.flow_residual_tolerance;
+		else
+		  flow_converged=relative_error_flow<1.E-3;
+
+    		if (flow_converged &&
     		    relative_error_transport<=5.E-3 && //[%]
     		    iteration!=0)
     		  remain_in_loop=false;
@@ -2964,6 +7405,35 @@ namespace TRL
     		if (relative_error_transport<1E-5)
     		  remain_in_loop=false;
     	      }
+	    /* *
+	     * With error control, a converged time step whose local
+	     * error is above the tolerance is repeated with a smaller
+	     * time step
+	     * */
+	    if (remain_in_loop==false &&
+		test_transport==false &&
+		parameters.time_step_control=="error" &&
+		time_step_history==true)
+	      {
+		time_step_error=
+		  estimate_time_step_error();
+		double minimum_time_step=0.;
+		double maximum_time_step=0.;
+		time_step_bounds(minimum_time_step,
+				 maximum_time_step);
+		if (time_step_error>1. && time_step>minimum_time_step)
+		  {
+		    time_step=
+		      time_step*std::max(parameters.time_step_minimum_factor,
+					 parameters.time_step_safety_factor*
+					 std::pow(time_step_error,-0.5));
+		    if (time_step<minimum_time_step)
+		      time_step=minimum_time_step;
+		    reject_time_step=true;
+		    remain_in_loop=true;
+		    timing_monitor.add_count(timing_section("rejected time steps"));
+		  }
+	      }
 	    
     	    if (step>10)
 	      {
@@ -2975,16 +7445,48 @@ namespace TRL
     	    step++;
 	  }
     	while (remain_in_loop);
-
+	timing_monitor.add_count(timing_section("time steps"));
+	/* *
+	 * Diagnostics of the accepted time step. The boundary flows are
+	 * needed at every step (cumulative nutrient flows, criterion of
+	 * saturated conditions), the biomass in the domain only on the
+	 * steps that are logged, see below
+	 * */
+	const bool flow_solved=
+	  solve_flow && test_transport==false;
+	const bool transport_solved=
+	  (transient_transport==true || test_transport==true) && coupled_transport==true;
+	calculate_boundary_flows(flow_solved,transport_solved);
+
+	/* *
+	 * The solution of the previous time step already satisfied the
+	 * Richards equation of this one, i.e. the flow is steady. Freeze
+	 * it (pressure and velocity field) and advance only the transport
+	 * */
+	if (parameters.freeze_steady_flow==true &&
+	    solve_flow==true &&
+	    test_transport==false &&
+	    transient_transport==true &&
+	    initial_residual_flow<parameters.flow_freeze_tolerance)
+	  {
+	    solve_flow=false;
+	    frozen_stop_flow=stop_flow;
+	    flow_frozen_timestep=timestep_number;
+	  }
     	time=time+time_step;
+	older_solution_flow=
+	  old_solution_flow;
+	older_solution_transport=
+	  old_solution_transport;
+	old_time_step=
+	  time_step;
+	time_step_history=true;
     	cumulative_flow_at_top+=//mg
     	  nutrient_flow_at_top*time_step;
     	cumulative_flow_at_bottom+=//mg
     	  nutrient_flow_at_bottom*time_step;
     	nutrients_in_domain_previous=
     	  nutrients_in_domain_current;
-	biomass_in_domain_previous=
-    	  biomass_in_domain_current;
     	/* *
     	 * Choose in which time period are we and note the time
     	 * */
@@ -2996,13 +7498,17 @@ namespace TRL
     		double relative_tolerance_drying=3.1E-4;
     		double pressure_at_top=0.;
     		if (dim==1)
-    		  pressure_at_top=VectorTools::point_value(dof_handler,
+    		  pressure_at_top=VectorTools::point_value(mesh->dof_handler,
     							   solution_flow_new_iteration,
     							   Point<dim>(0.));
     		else if (dim==2)
-    		  pressure_at_top=VectorTools::point_value(dof_handler,
+    		  pressure_at_top=VectorTools::point_value(mesh->dof_handler,
     							   solution_flow_new_iteration,
     							   Point<dim>(0.,-10.0));
+		else if (dim==3)
+		  pressure_at_top=VectorTools::point_value(mesh->dof_handler,
+							   solution_flow_new_iteration,
+							   Point<dim>(0.,0.,-10.0));
     		relative_error_drying=
     		  pressure_at_top/
     		  (parameters.richards_bottom_fixed_value-parameters.domain_size);
@@ -3018,20 +7524,21 @@ namespace TRL
 		    
     		    time_for_dry_conditions=time;
     		    milestone_time=time;
-    		    std::cout << "\tDry conditions reached at: "
-    			      << time_for_dry_conditions/3600 << " h\n"
-    			      << "\ttimestep_number: " << timestep_number << "\n"
-    			      << "\ttime_step: " << time_step << " s\n"
-    			      << "\tnumerical pressure at top: " << pressure_at_top << " m\n"
-    			      << "\texpected pressure at top: "
-    			      << parameters.richards_bottom_fixed_value-parameters.domain_size << " m\n";
+		    phase_changed=true;
+    		    terminal << "\tDry conditions reached at: "
+			     << time_for_dry_conditions/3600 << " h\n"
+			     << "\ttimestep_number: " << timestep_number << "\n"
+			     << "\ttime_step: " << time_step << " s\n"
+			     << "\tnumerical pressure at top: " << pressure_at_top << " m\n"
+			     << "\texpected pressure at top: "
+			     << parameters.richards_bottom_fixed_value-parameters.domain_size << " m\n";
 		    
     		    if (parameters.richards_fixed_at_top==true)
-    		      std::cout << "\tFixing top pressure at: "
-    				<< parameters.richards_top_fixed_value << " cm\n";
+    		      terminal << "\tFixing top pressure at: "
+			       << parameters.richards_top_fixed_value << " cm\n";
     		    else
-    		      std::cout << "\tActivating moisture flow: "
-    				<< parameters.richards_top_flow_value << " cm/s\n";
+    		      terminal << "\tActivating moisture flow: "
+			       << parameters.richards_top_flow_value << " cm/s\n";
     		  }
     	      }
     	    double relative_error_saturation=0.;
@@ -3061,9 +7568,9 @@ namespace TRL
     		if (relative_error_saturation<relative_tolerance_saturation||
     		    absolute_error_saturation<absolute_tolerance_saturation)
     		  {
-    		    std::cout << "\t\t: " << transient_saturation
-    			      << "\t" << relative_error_saturation
-    			      << "\t" << absolute_error_saturation << "\n";
+    		    terminal << "\t\t: " << transient_saturation
+			     << "\t" << relative_error_saturation
+			     << "\t" << absolute_error_saturation << "\n";
 		    
     		    transient_saturation=false;
     		    transient_transport=true;
@@ -3074,42 +7581,54 @@ namespace TRL
     		    figure_count=0;
     		    time_for_saturated_conditions=time-milestone_time;
     		    milestone_time=time;
-
-    		    std::cout << "\tSaturated conditions reached at: "
-    			      << time_for_saturated_conditions/3600 << " h\n"
-    			      << "\ttimestep_number: " << timestep_number << "\n"
-    			      << "\ttime_step: "       << time_step       << " s\n";
-    		    std::cout << "\tActivating nutrient flow: "
-    			      << std::scientific << parameters.transport_top_fixed_value
-    			      << " mg_substrate/m3_soil\n";
+		    phase_changed=true;
+
+    		    terminal << "\tSaturated conditions reached at: "
+			     << time_for_saturated_conditions/3600 << " h\n"
+			     << "\ttimestep_number: " << timestep_number << "\n"
+			     << "\ttime_step: "       << time_step       << " s\n";
+    		    terminal << "\tActivating nutrient flow: "
+			     << std::scientific << parameters.transport_top_fixed_value
+			     << " mg_substrate/m3_soil\n";
     		    if (parameters.homogeneous_decay_rate==true)
-    		      std::cout << "Activating decay rate: "
-    				<< std::scientific << parameters.first_order_decay_factor << " 1/s\n";
+    		      terminal << "Activating decay rate: "
+			       << std::scientific << parameters.first_order_decay_factor << " 1/s\n";
     		  }
     	      }
     	    /* *
     	     * Output info in the terminal
     	     * */
-    	    if ((timestep_number%1==0 && transient_drying==true) ||
-		(timestep_number%1==0 && transient_saturation==true) ||
-		(timestep_number%parameters.output_frequency_terminal==0
-		 && transient_transport==true) ||
-		(timestep_number==parameters.timestep_number_max-1))
+	    const bool print_time_step=
+	      (timestep_number%1==0 && transient_drying==true) ||
+	      (timestep_number%1==0 && transient_saturation==true) ||
+	      (timestep_number%parameters.output_frequency_terminal==0
+	       && transient_transport==true) ||
+	      (timestep_number==parameters.timestep_number_max-1);
+    	    if (print_time_step==true ||
+		parameters.output_data_every_time_step==true)
     	      {
+		if (transport_solved==true)
+		  {
+		    calculate_biomass_in_domain();
+		    biomass_in_domain_previous=
+		      biomass_in_domain_current;
+		  }
     		double effective_hydraulic_conductivity=0.;
     		{
+		  Timing_Monitor::Scope timing_scope(timing_monitor,
+						     timing_section("data logging"));
 		  std::vector<double> average_hydraulic_conductivity_vector_row;
-    		  for (unsigned int i=0; i<new_nodal_hydraulic_conductivity.size(); i++)
+    		  for (unsigned int i=0; i<new_nodal.hydraulic_conductivity.size(); i++)
     		    {
 		      double result=
 			1./
-			(new_nodal_hydraulic_conductivity[i]*new_nodal_hydraulic_conductivity.size());
+			(new_nodal.hydraulic_conductivity[i]*new_nodal.hydraulic_conductivity.size());
 		      
 		      if (!numbers::is_finite(result))
 			{
-			  std::cout << "Error in calculation of effective hydraulic conductivity.\n"
-				    << "i: " << i << "\tk_eff_i" << result
-				    << "\tki: " << new_nodal_hydraulic_conductivity[i] << "\n";
+			  terminal << "Error in calculation of effective hydraulic conductivity.\n"
+				   << "i: " << i << "\tk_eff_i" << result
+				   << "\tki: " << new_nodal.hydraulic_conductivity[i] << "\n";
 			}
 		      effective_hydraulic_conductivity+=result;
 		      
@@ -3122,7 +7641,7 @@ namespace TRL
 		    .push_back(1./effective_hydraulic_conductivity);
 		  average_hydraulic_conductivity_vector_row
 		    .push_back(flow_column_1);
-		  if (dim==2)
+		  if (dim>1)
 		    {
 		      average_hydraulic_conductivity_vector_row
 			.push_back(flow_column_2);
@@ -3147,125 +7666,80 @@ namespace TRL
 		    .push_back(biomass_in_domain_previous);
 		  average_hydraulic_conductivity_vector_row
 		    .push_back(biomass_column_1);
-		  if (dim==2)
+		  if (dim>1)
 		    {
 		      average_hydraulic_conductivity_vector_row
 			.push_back(biomass_column_2);
 		      average_hydraulic_conductivity_vector_row
 			.push_back(biomass_column_3);
 		    }
-		  average_hydraulic_conductivity_vector.clear();
-    		  average_hydraulic_conductivity_vector
-		    .push_back(average_hydraulic_conductivity_vector_row);
-		  
-		  std::stringstream filename;
-		  filename << "output_data_" << dim << "d_"
-			   << parameters.relative_permeability_model << "_"
-			   << parameters.sand_fraction << "_"
-			   << parameters.yield_coefficient << "_"
-			   << parameters.maximum_substrate_use_rate << "_"
-			   << parameters.half_velocity_constant << ".txt";
-		  
-		  std::ofstream output_file;
-		  if (timestep_number==parameters.output_frequency_terminal)
-		    {
-		      output_file.open(filename.str(),std::ios_base::out);
-		      output_file << "n\t"
-				  << "time (h)\t"
-				  << "k_e (cm/s)\t"
-				  << "flow_1 (cm3/s)\t";
-		      if (dim==2)
-			{ 
-			  output_file << "flow_2 (cm3/s)\t"
-				      << "flow_3 (cm3/s)\t";
-			}
-		      output_file << "flow_bottom (cm3/s)\t"
-				  << "flow_top (cm3/s)\t"
-				  << "nutrients_bottom (mg/s)\t"
-				  << "nutrients_top (mg/s)\t"
-				  << "cumulative flow nutrients at bottom (mg/s)\t"
-				  << "cumulative flow nutrients at top (mg/s)\t"
-				  << "cumulative nutrients in domain (mg)\t"
-				  << "cumulative biomass in domain (mg)\t"
-				  << "biomass_1 (mg)";
-		      if (dim==2)
-			{ 
-			  output_file << "\tbiomass_2 (mg)"
-				      << "\tbiomass_3 (mg)";
-			}
-		      output_file << "\n";
-		    }
-		  else
-		    output_file.open(filename.str(),std::ios_base::app);
-		  DataTools data_tools;
-		  
-		  data_tools.print_data(output_file,
-					average_hydraulic_conductivity_vector);
+		  output_data.add_row(average_hydraulic_conductivity_vector_row);
     		}
-    		if (parameters.output_data_in_terminal==true)
+    		if (parameters.output_data_in_terminal==true &&
+		    print_time_step==true)
     		  {
-    		    std::cout.setf(std::ios::fixed,std::ios::floatfield);
+    		    terminal.setf(std::ios::fixed,std::ios::floatfield);
     		    std::setprecision(10);
-    		    std::cout << std::fixed
-    			      << "tsn: "    << std::setw(6)  << timestep_number
-    			      << "  time: " << std::setw(9) << std::setprecision(5)
-    			      << (time-milestone_time)/3600 << " h";
+    		    terminal << std::fixed
+			     << "tsn: "    << std::setw(6)  << timestep_number
+			     << "  time: " << std::setw(9) << std::setprecision(5)
+			     << (time-milestone_time)/3600 << " h";
 		    
     		    if (transient_drying==true)
-    		      std::cout << "\tdrying";
+    		      terminal << "\tdrying";
     		    else if (transient_saturation)
-    		      std::cout << "\tsaturation";
+    		      terminal << "\tsaturation";
     		    else
-    		      std::cout << "\ttransport";
+    		      terminal << "\ttransport";
 		    
     		    if (transient_drying==true)
-    		      std::cout << "\tRelError: " << std::scientific << std::setprecision(2)
-    				<< relative_error_drying;
+    		      terminal << "\tRelError: " << std::scientific << std::setprecision(2)
+			       << relative_error_drying;
     		    else if (transient_saturation==true)
-    		      std::cout << "\tRelError: " << std::scientific << std::setprecision(2)
-    				<< relative_error_saturation
-    				<< "\tAbsError: " << std::scientific << std::setprecision(2)
-    				<< absolute_error_saturation;
-
-    		    std::cout <<  std::fixed
-    			      << "  ts: "    << std::fixed << std::setprecision(2) << std::setw(5)
-    			      << time_step
-    			      << "  k_eff: " << std::scientific << std::setprecision(10)
-    			      << 1./effective_hydraulic_conductivity
-    			      << "\tcell #s: " << std::fixed << std::setprecision(2)
-    			      << triangulation.n_active_cells() << "\n"
-    			      << "\tflow of water at bottom    : " << std::setw(7) << std::scientific
-    			      << std::setprecision(4)
-    			      << flow_at_bottom << " cm3/s"
-    			      << "\tflow of water at top    : " << std::setw(7) << std::scientific
-    			      << std::setprecision(4)
-    			      << flow_at_top << " cm3/s\n"
-    			      << "\tflow of nutrients at bottom: " << std::setw(7) << std::fixed
-    			      << std::setprecision(4)
-    			      << nutrient_flow_at_bottom << "  mg/s"
-    			      << "\tflow of nutrients at top: "    << std::setw(7) << std::fixed
-    			      << std::setprecision(4)
-    			      << nutrient_flow_at_top << "  mg/s" << "\n"
-    			      << "\tcumulative flow of nutrients at bottom: "
-			      << std::fixed << std::setprecision(3)
-    			      << cumulative_flow_at_bottom << " mg\n"
-    			      << "\tcumulative flow of nutrients at top: "
-			      << std::fixed << std::setprecision(3)
-    			      << cumulative_flow_at_top << " mg\n"
-    			      << "\tcumulative nutrients in domain: "
-			      << std::fixed << std::setprecision(3)
-    			      << nutrients_in_domain_previous << " mg\n"
-			      << "\tcumulative biomass in domain: "
-			      << std::fixed << std::setprecision(3)
-    			      << biomass_in_domain_previous << " mg\n"
-    			      << std::endl;
+    		      terminal << "\tRelError: " << std::scientific << std::setprecision(2)
+			       << relative_error_saturation
+			       << "\tAbsError: " << std::scientific << std::setprecision(2)
+			       << absolute_error_saturation;
+
+    		    terminal <<  std::fixed
+			     << "  ts: "    << std::fixed << std::setprecision(2) << std::setw(5)
+			     << time_step
+			     << "  k_eff: " << std::scientific << std::setprecision(10)
+			     << 1./effective_hydraulic_conductivity
+			     << "\tcell #s: " << std::fixed << std::setprecision(2)
+			     << mesh->triangulation.n_active_cells() << "\n"
+			     << "\tflow of water at bottom    : " << std::setw(7) << std::scientific
+			     << std::setprecision(4)
+			     << flow_at_bottom << " cm3/s"
+			     << "\tflow of water at top    : " << std::setw(7) << std::scientific
+			     << std::setprecision(4)
+			     << flow_at_top << " cm3/s\n"
+			     << "\tflow of nutrients at bottom: " << std::setw(7) << std::fixed
+			     << std::setprecision(4)
+			     << nutrient_flow_at_bottom << "  mg/s"
+			     << "\tflow of nutrients at top: "    << std::setw(7) << std::fixed
+			     << std::setprecision(4)
+			     << nutrient_flow_at_top << "  mg/s" << "\n"
+			     << "\tcumulative flow of nutrients at bottom: "
+			     << std::fixed << std::setprecision(3)
+			     << cumulative_flow_at_bottom << " mg\n"
+			     << "\tcumulative flow of nutrients at top: "
+			     << std::fixed << std::setprecision(3)
+			     << cumulative_flow_at_top << " mg\n"
+			     << "\tcumulative nutrients in domain: "
+			     << std::fixed << std::setprecision(3)
+			     << nutrients_in_domain_previous << " mg\n"
+			     << "\tcumulative biomass in domain: "
+			     << std::fixed << std::setprecision(3)
+			     << biomass_in_domain_previous << " mg\n"
+			     << std::endl;
     		  }
     	      }
     	  }
     	else
     	  {
 	    if (timestep_number%parameters.output_frequency_terminal==0)
-	      std::cout << "Time step " << timestep_number << "\tts: " << time_step << "\n";
+	      terminal << "Time step " << timestep_number << "\tts: " << time_step << "\n";
     	  }
     	/* *
     	 * OUTPUT solution files
@@ -3300,7 +7774,29 @@ namespace TRL
     	      {
     		time_step=parameters.time_step;
     		redefine_time_step=false;
+		time_step_history=false;
+		old_time_step_error=0.;
     	      }
+	    else if (parameters.time_step_control=="error")
+	      {
+		/* *
+		 * PI controller (Gustafsson, 1991) for an error estimate
+		 * of order two. Without an estimate (first step of a
+		 * period), the time step grows at the largest rate
+		 * */
+		double factor=parameters.time_step_maximum_factor;
+		if (time_step_history==true && time_step_error>0.)
+		  {
+		    factor=parameters.time_step_safety_factor*
+		      std::pow(time_step_error,-0.7/2.);
+		    if (old_time_step_error>0.)
+		      factor*=std::pow(old_time_step_error,0.4/2.);
+		    old_time_step_error=time_step_error;
+		  }
+		factor=std::min(parameters.time_step_maximum_factor,
+				std::max(parameters.time_step_minimum_factor,factor));
+		time_step=time_step*factor;
+	      }
     	    else if (step<5)
     	      {
     		if (transient_drying==true || transient_transport==true)
@@ -3309,17 +7805,14 @@ namespace TRL
     		  time_step=time_step*2;
     	      }
 	    
-    	    if (time_step<1)
-    	      time_step=1;
-	    
-    	    if (time_step>1 && transient_drying==true)
-    	      time_step=1;
-    	    else if (time_step>1 && transient_saturation==true)
-    	      time_step=1;
-    	    else if (time_step>30 && transient_transport==true)
-	      {
-		time_step=30;
-	      }
+	    double minimum_time_step=0.;
+	    double maximum_time_step=0.;
+	    time_step_bounds(minimum_time_step,
+			     maximum_time_step);
+    	    if (time_step<minimum_time_step)
+    	      time_step=minimum_time_step;
+    	    else if (time_step>maximum_time_step)
+	      time_step=maximum_time_step;
     	  }
     	/* *
     	 * Update solutions
@@ -3328,20 +7821,12 @@ namespace TRL
     	  solution_flow_new_iteration;
     	old_solution_transport=
     	  solution_transport;
-    	old_nodal_total_moisture_content=
-    	  new_nodal_total_moisture_content;
-    	old_nodal_free_moisture_content=
-    	  new_nodal_free_moisture_content;
-    	old_nodal_biomass_concentration=//mg_biomass/m3
-    	  new_nodal_biomass_concentration;
-    	old_nodal_biomass_fraction=
-    	  new_nodal_biomass_fraction;
-    	old_nodal_hydraulic_conductivity=
-    	  new_nodal_hydraulic_conductivity;
-    	old_nodal_specific_moisture_capacity=
-    	  new_nodal_specific_moisture_capacity;
-    	old_nodal_free_saturation=
-    	  new_nodal_free_saturation;
+	/* *
+	 * new_nodal is computed again from scratch at the beginning of
+	 * the next nonlinear iteration, so the nodal properties are
+	 * swapped rather than copied
+	 * */
+	old_nodal.swap(new_nodal);
     	{
     	  /*
     	   * Based on Paris thesis, p80.
@@ -3355,7 +7840,7 @@ namespace TRL
     	   * using a timer. This flow rate was selected to provide a total
     	   * flow of 40ml for each sand fraction.
     	   */
-	  if (dim==2)
+	  if (dim>1)
 	    stop_flow=false;
 	  else if (dim==1)
 	    {
@@ -3364,18 +7849,228 @@ namespace TRL
 	      double fractpart=std::modf((time-milestone_time)/(24.*3600.),&intpart);
 	      if (transient_transport==true &&
 		  ((dim==1 && fractpart>=0. && fractpart<16*60./(24.*3600.)) ||
-		   (dim==2)))
+		   (dim>1)))
 		{
 		  stop_flow=false;
 		}
 	    }
 	  
 	}
+	/* *
+	 * Adapt the mesh to the substrate and biomass fronts. The
+	 * interval follows the front speed, estimated from the largest
+	 * seepage velocity: the mesh is adapted again when the front may
+	 * have crossed front_cells_per_adaptation of the smallest cells.
+	 * Not after the last time step: the new_nodal properties are
+	 * only recomputed in the next nonlinear iteration (see
+	 * refine_grid()) and the final output needs them
+	 * */
+	if (parameters.adaptive_refinement==true &&
+	    transient_transport==true &&
+	    timestep_number<parameters.timestep_number_max-1)
+	  {
+	    double front_speed=0.;//cm/s
+	    for (unsigned int i=0; i<velocity_x.size(); ++i)
+	      front_speed=
+		std::max(front_speed,
+			 std::sqrt(velocity_x[i]*velocity_x[i]+
+				   velocity_y[i]*velocity_y[i]+
+				   velocity_z[i]*velocity_z[i]));
+	    front_speed/=parameters.moisture_content_saturation;
+
+	    bool adapt_mesh=
+	      (timestep_number-last_adaptation_timestep>=
+	       parameters.maximum_adaptation_interval);
+	    if (front_speed>0. &&
+		time-last_adaptation_time>=
+		parameters.front_cells_per_adaptation*
+		GridTools::minimal_cell_diameter(mesh->triangulation)/front_speed)
+	      adapt_mesh=true;
+
+	    if (adapt_mesh)
+	      {
+		refine_grid(3);
+		last_adaptation_time=time;
+		last_adaptation_timestep=timestep_number;
+	      }
+	  }
+	/* *
+	 * The state at the beginning of the saturation and transport
+	 * periods can be used to restart from (see read_checkpoint())
+	 * */
+	if (parameters.write_checkpoints==true && phase_changed==true)
+	  {
+	    if (transient_saturation==true)
+	      write_checkpoint(parameters.diagnostics_prefix+
+			       parameters.checkpoint_prefix+"_dry.chk");
+	    else if (transient_transport==true)
+	      write_checkpoint(parameters.diagnostics_prefix+
+			       parameters.checkpoint_prefix+"_saturated.chk");
+	  }
       }
-    
+    /*
+     * The values of the last time step were swapped into old_nodal
+     */
+    new_nodal=old_nodal;
+    if (parameters.write_checkpoints==true)
+      write_checkpoint(parameters.diagnostics_prefix+
+		       parameters.checkpoint_prefix+"_final.chk");
     output_results();
-    std::cout << "\t Job Done!!"
-	      << std::endl;
+    wait_for_output();
+    output_data.close();
+    if (parameters.timing_file.empty()==false)
+      {
+	/*
+	 * Size of the problem and of the run, for the benchmarks
+	 */
+	Utilities::System::MemoryStats memory_stats;
+	Utilities::System::get_memory_stats(memory_stats);
+	timing_monitor.add_count("run/threads",MultithreadInfo::n_threads());
+	timing_monitor.add_count("run/active cells",mesh->triangulation.n_active_cells());
+	timing_monitor.add_count("run/dofs",mesh->dof_handler.n_dofs());
+	timing_monitor.add_count("run/peak memory (kB)",memory_stats.VmHWM);
+	timing_monitor.write_json(parameters.diagnostics_prefix+
+				  parameters.timing_file);
+      }
+    terminal << "\t Job Done!!"
+	     << std::endl;
+  }
+}
+
+namespace TRL
+{
+  /*
+   * Members of an ensemble, one list of parameter overrides (see
+   * Parameters::AllParameters::set_parameter()) per member. Each line of
+   * the ensemble file is either a member, with its overrides separated
+   * by ';', or a sweep
+   *   sweep subsection/entry = value_1 value_2 ...
+   * The members are the lines combined with every value of every sweep
+   * (the Cartesian product). Empty lines and lines starting with '#' are
+   * ignored.
+   */
+  std::vector<std::vector<std::string> >
+  read_ensemble (const std::string &filename)
+  {
+    std::ifstream file(filename.c_str());
+    if (!file.is_open())
+      {
+	std::cout << "Error. The ensemble file " << filename
+		  << " could not be opened.\n";
+	throw -1;
+      }
+    std::vector<std::vector<std::string> > members;
+    std::vector<std::vector<std::string> > sweeps;
+    std::string line;
+    while (std::getline(file,line))
+      {
+	line=Utilities::trim(line);
+	if (line.empty() || line[0]=='#')
+	  continue;
+	if (line.compare(0,6,"sweep ")==0)
+	  {
+	    const std::string::size_type equal_sign=line.find('=');
+	    if (equal_sign==std::string::npos)
+	      {
+		std::cout << "Error. Sweep \"" << line << "\" has no values.\n";
+		throw -1;
+	      }
+	    const std::string entry=
+	      Utilities::trim(line.substr(6,equal_sign-6));
+	    const std::vector<std::string> values=
+	      Utilities::split_string_list(line.substr(equal_sign+1),' ');
+	    std::vector<std::string> sweep;
+	    for (unsigned int i=0; i<values.size(); ++i)
+	      if (values[i].empty()==false)
+		sweep.push_back(entry+"="+values[i]);
+	    sweeps.push_back(sweep);
+	  }
+	else
+	  {
+	    const std::vector<std::string> overrides=
+	      Utilities::split_string_list(line,';');
+	    members.push_back(std::vector<std::string>());
+	    for (unsigned int i=0; i<overrides.size(); ++i)
+	      if (overrides[i].empty()==false)
+		members.back().push_back(overrides[i]);
+	  }
+      }
+    if (members.empty())
+      members.push_back(std::vector<std::string>());
+
+    for (unsigned int s=0; s<sweeps.size(); ++s)
+      {
+	std::vector<std::vector<std::string> > swept_members;
+	for (unsigned int m=0; m<members.size(); ++m)
+	  for (unsigned int v=0; v<sweeps[s].size(); ++v)
+	    {
+	      swept_members.push_back(members[m]);
+	      swept_members.back().push_back(sweeps[s][v]);
+	    }
+	members.swap(swept_members);
+      }
+    return (members);
+  }
+
+  template <int dim>
+  void run_ensemble_member (int argc, char *argv[],
+			    const std::vector<std::string> parameter_overrides,
+			    const unsigned int             member,
+			    Shared_Meshes<dim>            *shared_meshes)
+  {
+    /*
+     * A failed member must not stop the others
+     */
+    try
+      {
+	Heat_Pipe<dim> laplace_problem(argc,argv,parameter_overrides,
+				       shared_meshes);
+	laplace_problem.run();
+      }
+    catch (std::exception &exc)
+      {
+	std::cerr << "Ensemble member " << member << " failed: "
+		  << exc.what() << std::endl;
+      }
+    catch (...)
+      {
+	std::cerr << "Ensemble member " << member << " failed." << std::endl;
+      }
+  }
+  /*
+   * Runs the members of the ensemble, members_in_parallel at a time.
+   * The members without adaptive refinement share the mesh, the dofs
+   * and the cached geometry (see Mesh_Data) with the other members that
+   * have the same grid options. A member with adaptive refinement has
+   * its own: it is refined differently in each member as the fronts
+   * move. Member i writes its files, and its terminal output (log.txt),
+   * with the diagnostics prefix member_i_, unless its overrides set
+   * another one.
+   */
+  template <int dim>
+  void run_ensemble (int argc, char *argv[],
+		     const std::vector<std::vector<std::string> > &members,
+		     const unsigned int members_in_parallel)
+  {
+    Shared_Meshes<dim> shared_meshes;
+    for (unsigned int first=0; first<members.size(); first+=members_in_parallel)
+      {
+	Threads::ThreadGroup<> threads;
+	for (unsigned int m=first;
+	     m<std::min(first+members_in_parallel,(unsigned int)members.size()); ++m)
+	  {
+	    std::vector<std::string> parameter_overrides;
+	    parameter_overrides.push_back("general things/diagnostics prefix=member_"
+					  +Utilities::int_to_string(m)+"_");
+	    parameter_overrides.push_back("general things/log to file=true");
+	    parameter_overrides.insert(parameter_overrides.end(),
+				       members[m].begin(),members[m].end());
+	    threads+=Threads::new_thread(&run_ensemble_member<dim>,
+					 argc,argv,parameter_overrides,m,
+					 &shared_meshes);
+	  }
+	threads.join_all();
+      }
   }
 }
 
@@ -3385,14 +8080,73 @@ int main (int argc, char *argv[])
     {
       using namespace TRL;
       using namespace dealii;
+      /*
+       * MPI (if deal.II was configured with it) must be initialized
+       * before Trilinos is used, e.g. by the amg flow preconditioner.
+       * The number of threads is left to TBB.
+       */
+      Utilities::MPI::MPI_InitFinalize mpi_initialization(argc,argv,
+							  numbers::invalid_unsigned_int);
       {
 	clock_t t1,t2;
+	Timer wall_timer;
 	
 	t1=clock();
 	deallog.depth_console (0);
-	const unsigned int dim=2;
-	Heat_Pipe<dim> laplace_problem(argc,argv);
-	laplace_problem.run();
+	/*
+	 * The dimension is the second argument of the program, 2 if
+	 * it is not given
+	 */
+	int dim=2;
+	if (argc>=3)
+	  dim=Utilities::string_to_int(argv[2]);
+	/*
+	 * Ensemble mode: the third argument is the ensemble file (see
+	 * read_ensemble()), the fourth the number of members run at a
+	 * time (by default, the number of threads)
+	 */
+	if (argc>=4)
+	  {
+	    const std::vector<std::vector<std::string> > members=
+	      read_ensemble(argv[3]);
+	    unsigned int members_in_parallel=MultithreadInfo::n_threads();
+	    if (argc==5)
+	      members_in_parallel=Utilities::string_to_int(argv[4]);
+	    members_in_parallel=std::max(members_in_parallel,1U);
+	    std::cout << "Running " << members.size() << " ensemble members, "
+		      << members_in_parallel << " at a time\n";
+	    if (dim==1)
+	      run_ensemble<1>(argc,argv,members,members_in_parallel);
+	    else if (dim==2)
+	      run_ensemble<2>(argc,argv,members,members_in_parallel);
+	    else if (dim==3)
+	      run_ensemble<3>(argc,argv,members,members_in_parallel);
+	    else
+	      {
+		std::cout << "Error. Dimension " << dim << " is not implemented.\n";
+		throw -1;
+	      }
+	  }
+	else if (dim==1)
+	  {
+	    Heat_Pipe<1> laplace_problem(argc,argv);
+	    laplace_problem.run();
+	  }
+	else if (dim==2)
+	  {
+	    Heat_Pipe<2> laplace_problem(argc,argv);
+	    laplace_problem.run();
+	  }
+	else if (dim==3)
+	  {
+	    Heat_Pipe<3> laplace_problem(argc,argv);
+	    laplace_problem.run();
+	  }
+	else
+	  {
+	    std::cout << "Error. Dimension " << dim << " is not implemented.\n";
+	    throw -1;
+	  }
 	t2=clock();
 
 	float time_diff
@@ -3400,6 +8154,7 @@ int main (int argc, char *argv[])
 
 	std::cout << time_diff << std::endl;
 	std::cout << time_diff/CLOCKS_PER_SEC << " seconds"<< std::endl;
+	std::cout << wall_timer.wall_time() << " seconds (wall time)" << std::endl;
       }
     }
   catch (std::exception &exc)